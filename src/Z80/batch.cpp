@@ -0,0 +1,101 @@
+#include "../include/batch.hpp"
+#include <algorithm>
+#include <thread>
+
+BatchRunner::BatchRunner(unsigned threads, bool jit) {
+    if (threads == 0) threads = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned i = 0; i < threads; i++) {
+        workers.push_back(std::make_unique<Worker>());
+        workers.back()->cpu = std::make_unique<Z80>();
+        if (jit) workers.back()->cpu->enableJit(true);
+    }
+}
+
+BatchRunner::~BatchRunner() = default;
+
+/**
+ * Jobs are dealt out as equal contiguous ranges,
+ * the calling thread works as worker 0
+ */
+void BatchRunner::run(const std::vector<BatchJob>& jobs, const ResultHandler& onResult) {
+    size_t count = workers.size();
+    for (size_t i = 0; i < count; i++) {
+        workers[i]->begin = jobs.size() * i / count;
+        workers[i]->end = jobs.size() * (i + 1) / count;
+    }
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < count; i++) {
+        threads.emplace_back(&BatchRunner::work, this, i, std::cref(jobs), std::cref(onResult));
+    }
+    work(0, jobs, onResult);
+    for (std::thread& thread : threads) thread.join();
+}
+
+void BatchRunner::work(size_t index, const std::vector<BatchJob>& jobs, const ResultHandler& onResult) {
+    Worker& worker = *workers[index];
+    size_t job;
+    while (true) {
+        if (!take(worker, job)) {
+            if (!steal(index)) return;
+            continue;
+        }
+        BatchResult result = execute(*worker.cpu, jobs[job], job);
+        std::lock_guard<std::mutex> guard(resultLock);
+        onResult(result);
+    }
+}
+
+bool BatchRunner::take(Worker& worker, size_t& job) {
+    std::lock_guard<std::mutex> guard(worker.lock);
+    if (worker.begin == worker.end) return false;
+    job = worker.begin++;
+    return true;
+}
+
+/**
+ * Only one lock is held at a time. The stolen jobs are in no range
+ * until the thief stores them, other thieves cannot take them meanwhile
+ * and the thief is about to run them anyway
+ */
+bool BatchRunner::steal(size_t thief) {
+    while (true) {
+        size_t victim = thief;
+        size_t largest = 0;
+        for (size_t i = 0; i < workers.size(); i++) {
+            if (i == thief) continue;
+            std::lock_guard<std::mutex> guard(workers[i]->lock);
+            if (workers[i]->end - workers[i]->begin > largest) {
+                largest = workers[i]->end - workers[i]->begin;
+                victim = i;
+            }
+        }
+        if (largest == 0) return false;
+
+        size_t begin, end;
+        {
+            Worker& source = *workers[victim];
+            std::lock_guard<std::mutex> guard(source.lock);
+            size_t left = source.end - source.begin;
+            if (left == 0) continue;    // emptied since the scan, look again
+            end = source.end;
+            begin = end - (left + 1) / 2;
+            source.end = begin;
+        }
+        Worker& own = *workers[thief];
+        std::lock_guard<std::mutex> guard(own.lock);
+        own.begin = begin;
+        own.end = end;
+        return true;
+    }
+}
+
+BatchResult BatchRunner::execute(Z80& cpu, const BatchJob& job, size_t index) {
+    if (job.snapshot) job.snapshot->restore(cpu);
+    else {
+        cpu.reset();
+        if (job.image) cpu.loadImage(job.origin, *job.image);
+        cpu.setRegisters(job.registers);
+    }
+    RunResult run = cpu.runCycles(job.cycleBudget);
+    return BatchResult{ index, run, cpu.getRegisters() };
+}
@@ -0,0 +1,111 @@
+#include "../include/blockcache.hpp"
+#include "../include/jit.hpp"
+
+BlockCache::BlockCache() = default;
+BlockCache::~BlockCache() = default;
+
+BlockCache::BlockCache(const BlockCache& other) {
+    setEnabled(other.enabled());
+    if (other.translator) setJitEnabled(true, other.translator->hotThreshold());
+}
+
+BlockCache& BlockCache::operator=(const BlockCache& other) {
+    if (this != &other) {
+        setEnabled(false);
+        setEnabled(other.enabled());
+        if (other.translator) setJitEnabled(true, other.translator->hotThreshold());
+    }
+    return *this;
+}
+
+/**
+ * Enabling allocates one slot per address and the page tables,
+ * disabling frees all blocks and resets the counters
+ */
+void BlockCache::setEnabled(bool enable) {
+    if (enable == enabled()) return;
+    if (enable) {
+        blocks.resize(0x10000);
+        pageGen.assign(PAGE_COUNT, 0);
+        codePages.assign(PAGE_COUNT, 0);
+    }
+    else {
+        translator.reset();
+        blocks.clear();
+        blocks.shrink_to_fit();
+        pageGen.clear();
+        codePages.clear();
+    }
+    counters = BlockCacheStats();
+    exitBlock = false;
+}
+
+bool BlockCache::setJitEnabled(bool enable, uint32_t hotThreshold) {
+    translator.reset();
+    if (enable && Jit::supported()) {
+        setEnabled(true);
+        translator = std::make_unique<Jit>(counters, hotThreshold);
+        if (!translator->ready()) translator.reset();
+    }
+    return translator != nullptr;
+}
+
+/**
+ * A block is valid while the pages of its first and last byte
+ * keep the generations it was decoded with
+ */
+Block* BlockCache::lookup(uint16_t pc) {
+    Block* block = blocks[pc].get();
+    if (block && block->startGen == pageGen[block->start >> PAGE_SHIFT]
+        && block->endGen == pageGen[uint16_t(block->end - 1) >> PAGE_SHIFT]) {
+        counters.hits++;
+        return block;
+    }
+    counters.misses++;
+    return nullptr;
+}
+
+Block* BlockCache::insert(Block&& block) {
+    int startPage = block.start >> PAGE_SHIFT;
+    int endPage = uint16_t(block.end - 1) >> PAGE_SHIFT;
+    block.startGen = pageGen[startPage];
+    block.endGen = pageGen[endPage];
+    codePages[startPage] = 1;
+    codePages[endPage] = 1;
+
+    std::unique_ptr<Block>& slot = blocks[block.start];
+    if (slot) {
+        *slot = std::move(block);
+    }
+    else {
+        slot = std::make_unique<Block>(std::move(block));
+    }
+    return slot.get();
+}
+
+/**
+ * Bumping the generation invalidates all blocks decoded from the page,
+ * they get replaced when their address is looked up again
+ */
+void BlockCache::invalidatePage(int page) {
+    if (translator) translator->invalidatePage(page);
+    pageGen[page]++;
+    codePages[page] = 0;
+    counters.invalidations++;
+    exitBlock = true;
+}
+
+void BlockCache::onRemap(uint16_t start, uint32_t size) {
+    if (codePages.empty()) return;
+    int first = start >> PAGE_SHIFT;
+    int last = (start + size - 1) >> PAGE_SHIFT;
+    for (int page = first; page <= last && page < PAGE_COUNT; page++) {
+        if (codePages[page]) invalidatePage(page);
+    }
+}
+
+void BlockCache::invalidateAll() {
+    for (int page = 0; page < (int)codePages.size(); page++) {
+        if (codePages[page]) invalidatePage(page);
+    }
+}
@@ -0,0 +1,42 @@
+#include "../include/iobus.hpp"
+#include <algorithm>
+
+void IoDevice::inBlock(uint16_t port, uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) data[i] = in(port);
+}
+
+void IoDevice::outBlock(uint16_t port, const uint8_t* data, size_t size) {
+    for (size_t i = 0; i < size; i++) out(port, data[i]);
+}
+
+void IoBus::attach(uint16_t port, IoDevice* device, bool fullDecode) {
+    if (!fullDecode) {
+        devices[port & 0xFF] = device;
+        return;
+    }
+    auto match = std::find_if(full.begin(), full.end(),
+        [port](const std::pair<uint16_t, IoDevice*>& entry) { return entry.first == port; });
+    if (match != full.end()) match->second = device;
+    else full.emplace_back(port, device);
+    fullDecoded[port & 0xFF] = true;
+}
+
+void IoBus::detach(IoDevice* device) {
+    for (IoDevice*& entry : devices) {
+        if (entry == device) entry = nullptr;
+    }
+    full.erase(std::remove_if(full.begin(), full.end(),
+        [device](const std::pair<uint16_t, IoDevice*>& entry) { return entry.second == device; }), full.end());
+    fullDecoded.reset();
+    for (const auto& entry : full) fullDecoded[entry.first & 0xFF] = true;
+}
+
+/**
+ * Fully decoded ports first, the 8-bit device answers the rest
+ */
+IoDevice* IoBus::fullDevice(uint16_t port) const {
+    for (const auto& [address, device] : full) {
+        if (address == port) return device;
+    }
+    return devices[port & 0xFF];
+}
@@ -0,0 +1,541 @@
+#include "../include/jit.hpp"
+#include "../include/cpu.hpp"
+#include "../include/flagtables.hpp"
+#include "../include/timing.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <initializer_list>
+#include <mutex>
+#include <string>
+
+#ifdef Z80_JIT_SUPPORTED
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+namespace {
+
+    // Host registers, rbx holds the CPU pointer, rbp the flag tables
+    // and r13 the remaining instruction budget
+    enum HostReg : uint8_t { RAX = 0, RCX = 1, RDX = 2, RBX = 3, RBP = 5, RSI = 6, RDI = 7 };
+
+    // Condition codes of Jcc
+    enum HostCond : uint8_t { BELOW = 0x2, ZERO = 0x4, NOT_ZERO = 0x5 };
+
+    // 8/32-bit ALU instructions "op r/m, r"
+    enum HostAlu : uint8_t { H_ADD = 0x00, H_OR = 0x08, H_AND = 0x20, H_SUB = 0x28, H_XOR = 0x30 };
+
+    /**
+    * @brief Minimal x86-64 encoder writing into the code buffer
+    */
+    class Emitter {
+    public:
+        explicit Emitter(uint8_t* at) : cursor(at) {}
+
+        uint8_t* here() const { return cursor; }
+
+        void byte(uint8_t value) { *cursor++ = value; }
+        void bytes(std::initializer_list<uint8_t> values) {
+            for (uint8_t value : values) byte(value);
+        }
+        void imm16(uint16_t value) { std::memcpy(cursor, &value, 2); cursor += 2; }
+        void imm32(uint32_t value) { std::memcpy(cursor, &value, 4); cursor += 4; }
+        void imm64(uint64_t value) { std::memcpy(cursor, &value, 8); cursor += 8; }
+
+        // ModRM addressing [rbx + disp]
+        void cpuField(uint8_t reg, int32_t disp) {
+            if (disp >= -128 && disp <= 127) {
+                byte(0x40 | (reg << 3) | RBX);
+                byte(uint8_t(disp));
+            }
+            else {
+                byte(0x80 | (reg << 3) | RBX);
+                imm32(disp);
+            }
+        }
+
+        // movzx reg32, byte [rbx + disp]
+        void loadByte(uint8_t reg, int32_t disp) { bytes({ 0x0F, 0xB6 }); cpuField(reg, disp); }
+        // mov byte [rbx + disp], reg8 (al/cl/dl)
+        void storeByte(uint8_t reg, int32_t disp) { byte(0x88); cpuField(reg, disp); }
+        // mov byte [rbx + disp], imm8
+        void storeByteImm(int32_t disp, uint8_t value) { byte(0xC6); cpuField(0, disp); byte(value); }
+        // mov word [rbx + disp], imm16
+        void storeWordImm(int32_t disp, uint16_t value) { bytes({ 0x66, 0xC7 }); cpuField(0, disp); imm16(value); }
+        // cmp word [rbx + disp], imm16
+        void cmpWordImm(int32_t disp, uint16_t value) { bytes({ 0x66, 0x81 }); cpuField(7, disp); imm16(value); }
+        // cmp byte [rbx + disp], imm8
+        void cmpByteImm(int32_t disp, uint8_t value) { byte(0x80); cpuField(7, disp); byte(value); }
+        // test byte [rbx + disp], imm8
+        void testByteImm(int32_t disp, uint8_t value) { byte(0xF6); cpuField(0, disp); byte(value); }
+
+        // movzx reg32, byte [rbp + index + disp32]
+        void loadTable(uint8_t reg, uint8_t index, int32_t disp) {
+            bytes({ 0x0F, 0xB6, uint8_t(0x84 | (reg << 3)), uint8_t((index << 3) | RBP) });
+            imm32(disp);
+        }
+
+        // op r/m8, r8 and op r/m32, r32
+        void alu8(uint8_t op, uint8_t dst, uint8_t src) { byte(op); byte(0xC0 | (src << 3) | dst); }
+        void alu32(uint8_t op, uint8_t dst, uint8_t src) { byte(op + 1); byte(0xC0 | (src << 3) | dst); }
+        // mov reg32, reg32
+        void mov32(uint8_t dst, uint8_t src) { byte(0x89); byte(0xC0 | (src << 3) | dst); }
+        // mov reg32, imm32
+        void movImm32(uint8_t reg, uint32_t value) { byte(0xB8 + reg); imm32(value); }
+        // shl reg32, imm8
+        void shl32(uint8_t reg, uint8_t count) { bytes({ 0xC1, uint8_t(0xE0 | reg), count }); }
+        // and reg32, imm32
+        void andImm32(uint8_t reg, uint32_t value) { bytes({ 0x81, uint8_t(0xE0 | reg) }); imm32(value); }
+        // or reg8, imm8
+        void orImm8(uint8_t reg, uint8_t value) { bytes({ 0x80, uint8_t(0xC8 | reg), value }); }
+        // inc/dec reg8
+        void inc8(uint8_t reg) { bytes({ 0xFE, uint8_t(0xC0 | reg) }); }
+        void dec8(uint8_t reg) { bytes({ 0xFE, uint8_t(0xC8 | reg) }); }
+
+        // add qword [rbx + disp], imm32
+        void addQwordImm(int32_t disp, uint32_t value) { bytes({ 0x48, 0x81 }); cpuField(0, disp); imm32(value); }
+
+        // add byte [rbx + disp], imm8
+        void addByteImm(int32_t disp, uint8_t value) { byte(0x80); cpuField(0, disp); byte(value); }
+
+        // cmp/sub/add r13, imm32
+        void cmpBudget(uint32_t value) { bytes({ 0x49, 0x81, 0xFD }); imm32(value); }
+        void subBudget(uint32_t value) { bytes({ 0x49, 0x81, 0xED }); imm32(value); }
+        void addBudget(uint32_t value) { bytes({ 0x49, 0x81, 0xC5 }); imm32(value); }
+
+        // handler(cpu, op)
+        void callHandler(const void* handler, const void* op) {
+            bytes({ 0x48, 0x89, 0xDF });                // mov rdi, rbx
+            bytes({ 0x48, 0xBE }); imm64(uint64_t(op)); // mov rsi, op
+            bytes({ 0x48, 0xB8 }); imm64(uint64_t(handler)); // mov rax, handler
+            bytes({ 0xFF, 0xD0 });                      // call rax
+        }
+
+        // jmp/jcc rel32, returns the rel32 field to patch
+        uint8_t* jmp() { byte(0xE9); uint8_t* field = cursor; imm32(0); return field; }
+        uint8_t* jcc(uint8_t cond) { bytes({ 0x0F, uint8_t(0x80 | cond) }); uint8_t* field = cursor; imm32(0); return field; }
+        void jmp(const uint8_t* target) { patch(jmp(), target); }
+        void jcc(uint8_t cond, const uint8_t* target) { patch(jcc(cond), target); }
+
+        static void patch(uint8_t* field, const uint8_t* target) {
+            int32_t rel = int32_t(target - (field + 4));
+            std::memcpy(field, &rel, 4);
+        }
+
+    private:
+        uint8_t* cursor;
+    };
+
+    /**
+    * @brief Offsets of the guest registers inside the CPU state
+    */
+    struct Fields {
+        int32_t reg8[8];    // indexed by register code, 6 unused
+        int32_t f, a, bc, de, hl, sp, pc, cycles, rFetches, exitBlock;
+    };
+}
+
+bool Jit::supported() {
+    return true;
+}
+
+/**
+ * The buffer starts with the routine entering and leaving translated code:
+ * enter(cpu, code, budget) saves the callee-saved registers it uses,
+ * leaving returns the remaining budget.
+ * It is never writable and executable at once, hosts enforcing W^X
+ * refuse such mappings
+ */
+Jit::Jit(BlockCacheStats& counters, uint32_t hotThreshold)
+    : counters(counters), threshold(std::max<uint32_t>(hotThreshold, 1)),
+      translations(0x10000), pageTranslations(BlockCache::PAGE_COUNT) {
+    void* mapped = mmap(nullptr, CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapped == MAP_FAILED) return;
+    buffer = static_cast<uint8_t*>(mapped);
+
+    Emitter e(buffer);
+    e.bytes({ 0x55, 0x53, 0x41, 0x55 });            // push rbp; push rbx; push r13
+    e.bytes({ 0x48, 0x89, 0xFB });                  // mov rbx, rdi
+    e.bytes({ 0x49, 0x89, 0xD5 });                  // mov r13, rdx
+    e.bytes({ 0x48, 0xBD }); e.imm64(uint64_t(&FlagTables::tables)); // mov rbp, tables
+    e.bytes({ 0xFF, 0xE6 });                        // jmp rsi
+    exitRoutine = e.here();
+    e.bytes({ 0x4C, 0x89, 0xE8 });                  // mov rax, r13
+    e.bytes({ 0x41, 0x5D, 0x5B, 0x5D, 0xC3 });      // pop r13; pop rbx; pop rbp; ret
+    routineSize = used = (e.here() - buffer + 15) & ~size_t(15);
+    if (!setWritable(false)) {
+        munmap(buffer, CODE_SIZE);
+        buffer = nullptr;
+        return;
+    }
+}
+
+Jit::~Jit() {
+    if (buffer) munmap(buffer, CODE_SIZE);
+}
+
+bool Jit::setWritable(bool writable) {
+    return mprotect(buffer, CODE_SIZE, writable ? PROT_READ | PROT_WRITE : PROT_READ | PROT_EXEC) == 0;
+}
+
+uint64_t Jit::run(Z80State& cpu, const uint8_t* code, uint64_t budget) {
+    auto enter = reinterpret_cast<uint64_t (*)(Z80State*, const uint8_t*, uint64_t)>(buffer);
+    return budget - enter(&cpu, code, budget);
+}
+
+/**
+ * Translated block layout:
+ *   entry:  leave if the budget cannot cover the whole block, else charge it
+ *   body:   inline host code or handler calls, each call followed by a
+ *           check for writes into code
+ *   exits:  patchable jumps to the successors, initially to stubs
+ *           storing the successor address in PC and leaving
+ */
+const uint8_t* Jit::translate(const Z80State& cpu, const Block& block) {
+    if (!setWritable(true)) return nullptr;
+    if (CODE_SIZE - used < MAX_TRANSLATION) flush();
+
+    auto offset = [&cpu](const void* field) {
+        return int32_t(static_cast<const uint8_t*>(field) - reinterpret_cast<const uint8_t*>(&cpu));
+    };
+    Fields fields{};
+    for (uint8_t code : { Regs::B, Regs::C, Regs::D, Regs::E, Regs::H, Regs::L, Regs::A }) {
+        fields.reg8[code] = offset(&cpu.regs[Z80State::regIndex(code)]);
+    }
+    fields.f = offset(&cpu.f);
+    fields.a = offset(&cpu.a);
+    fields.bc = offset(&cpu.bc);
+    fields.de = offset(&cpu.de);
+    fields.hl = offset(&cpu.hl);
+    fields.sp = offset(&cpu.sp);
+    fields.pc = offset(&cpu.pc);
+    fields.cycles = offset(&cpu.cycles);
+    fields.rFetches = offset(&cpu.rFetches);
+    fields.exitBlock = offset(&cpu.blockCache.exitBlock);
+
+    const int32_t addTable = int32_t(offsetof(FlagTables::Tables, add));
+    const int32_t subTable = int32_t(offsetof(FlagTables::Tables, sub));
+    const int32_t szpTable = int32_t(offsetof(FlagTables::Tables, szp));
+    const int32_t incTable = int32_t(offsetof(FlagTables::Tables, inc));
+    const int32_t decTable = int32_t(offsetof(FlagTables::Tables, dec));
+    constexpr uint8_t INC_DEC_KEPT = uint8_t(~(Z80State::N_FLAG | Z80State::Z_FLAG | Z80State::S_FLAG | Z80State::H_FLAG | Z80State::PV_FLAG));
+
+    // Handler operands live in the code buffer, they stay valid
+    // while code using them may still be running
+    DecodedOp* ops = reinterpret_cast<DecodedOp*>(buffer + used);
+    std::copy(block.ops.begin(), block.ops.end(), ops);
+    uint8_t* code = buffer + ((used + block.ops.size() * sizeof(DecodedOp) + 15) & ~size_t(15));
+
+    auto translation = std::make_unique<Translation>();
+    translation->start = block.start;
+    translation->firstPage = block.start >> BlockCache::PAGE_SHIFT;
+    translation->lastPage = uint16_t(block.end - 1) >> BlockCache::PAGE_SHIFT;
+    translation->code = code;
+
+    struct SideExit { uint8_t* jump; uint32_t remaining; };
+    std::vector<SideExit> sideExits;
+    std::vector<std::pair<uint8_t*, uint16_t>> exitJumps;
+
+    Emitter e(code);
+    const uint32_t length = uint32_t(block.ops.size());
+    e.cmpBudget(length);
+    uint8_t* budgetExit = e.jcc(BELOW);
+    e.subBudget(length);
+
+    // ALU A,value with the operand in ecx (AluOps encoding)
+    auto emitAlu = [&](uint8_t op) {
+        e.loadByte(RAX, fields.a);
+        if (op == AluOps::AND || op == AluOps::XOR || op == AluOps::OR) {
+            e.alu8(op == AluOps::AND ? H_AND : op == AluOps::XOR ? H_XOR : H_OR, RAX, RCX);
+            e.storeByte(RAX, fields.a);
+            e.loadTable(RDX, RAX, szpTable);
+            if (op == AluOps::AND) e.orImm8(RDX, Z80State::H_FLAG);
+            e.storeByte(RDX, fields.f);
+            return;
+        }
+        // index = carry << 16 | A << 8 | value
+        e.mov32(RDX, RAX);
+        e.shl32(RDX, 8);
+        e.alu32(H_OR, RDX, RCX);
+        bool withCarry = op == AluOps::ADC || op == AluOps::SBC;
+        if (withCarry) {
+            e.loadByte(RSI, fields.f);
+            e.andImm32(RSI, Z80State::C_FLAG);
+            e.mov32(RDI, RSI);
+            e.shl32(RDI, 16);
+            e.alu32(H_OR, RDX, RDI);
+            e.alu32(H_ADD, RCX, RSI);
+        }
+        bool adds = op == AluOps::ADD || op == AluOps::ADC;
+        e.loadTable(RDX, RDX, adds ? addTable : subTable);
+        e.storeByte(RDX, fields.f);
+        if (op != AluOps::CP) {
+            e.alu8(adds ? H_ADD : H_SUB, RAX, RCX);
+            e.storeByte(RAX, fields.a);
+        }
+    };
+
+    // T-states and opcode fetches of inline instructions are summed up
+    // and added before the next handler call or exit
+    uint32_t pendingCycles = 0;
+    uint8_t pendingFetches = 0;
+    auto flushCycles = [&]() {
+        if (pendingCycles) e.addQwordImm(fields.cycles, pendingCycles);
+        if (pendingFetches) e.addByteImm(fields.rFetches, pendingFetches);
+        pendingCycles = 0;
+        pendingFetches = 0;
+    };
+
+    for (uint32_t i = 0; i < length; i++) {
+        const DecodedOp& op = ops[i];
+        const uint8_t opcode = op.opcode;
+        const uint8_t dest = (opcode >> 3) & 0x07;
+        const uint8_t src = opcode & 0x07;
+        const bool last = i + 1 == length;
+        const bool unprefixed = op.prefix == 0;
+        const uint8_t opCycles = Timing::unprefixed[opcode];
+
+        // LD r,r'
+        if (unprefixed && (opcode & 0xC0) == 0x40 && dest != 6 && src != 6) {
+            pendingCycles += opCycles;
+            pendingFetches++;
+            e.loadByte(RAX, fields.reg8[src]);
+            e.storeByte(RAX, fields.reg8[dest]);
+        }
+        // LD r,n
+        else if (unprefixed && (opcode & 0xC7) == LD_B_N && dest != 6) {
+            pendingCycles += opCycles;
+            pendingFetches++;
+            e.storeByteImm(fields.reg8[dest], uint8_t(op.operand));
+        }
+        // LD dd,nn
+        else if (unprefixed && (opcode & 0xCF) == LD_BC_NN) {
+            pendingCycles += opCycles;
+            pendingFetches++;
+            const int32_t pairs[4] = { fields.bc, fields.de, fields.hl, fields.sp };
+            e.storeWordImm(pairs[opcode >> 4], op.operand);
+        }
+        // ALU A,r and ALU A,n
+        else if (!Z80State::lazyFlags && unprefixed && (opcode & 0xC0) == 0x80 && src != 6) {
+            pendingCycles += opCycles;
+            pendingFetches++;
+            e.loadByte(RCX, fields.reg8[src]);
+            emitAlu(dest);
+        }
+        else if (!Z80State::lazyFlags && unprefixed && (opcode & 0xC7) == ADD_A_N) {
+            pendingCycles += opCycles;
+            pendingFetches++;
+            e.movImm32(RCX, uint8_t(op.operand));
+            emitAlu(dest);
+        }
+        // INC r, DEC r
+        else if (!Z80State::lazyFlags && unprefixed && ((opcode & 0xC7) == INC_B || (opcode & 0xC7) == DEC_B) && dest != 6) {
+            bool increment = (opcode & 0xC7) == INC_B;
+            pendingCycles += opCycles;
+            pendingFetches++;
+            e.loadByte(RAX, fields.reg8[dest]);
+            e.loadTable(RDX, RAX, increment ? incTable : decTable);
+            e.loadByte(RCX, fields.f);
+            e.andImm32(RCX, INC_DEC_KEPT);
+            e.alu32(H_OR, RDX, RCX);
+            e.storeByte(RDX, fields.f);
+            if (increment) e.inc8(RAX);
+            else e.dec8(RAX);
+            e.storeByte(RAX, fields.reg8[dest]);
+        }
+        // JP nn, JR e
+        else if (unprefixed && last && (opcode == JP_NN || opcode == JR)) {
+            pendingCycles += opCycles;
+            pendingFetches++;
+            flushCycles();
+            exitJumps.push_back({ e.jmp(), op.operand });
+            break;
+        }
+        // JP cc,nn, JR cc,e: test the flag and take one of two exits
+        else if (!Z80State::lazyFlags && unprefixed && last
+            && ((opcode & 0xC7) == JP_NZ || opcode == JR_NZ || opcode == JR_Z || opcode == JR_NC || opcode == JR_C)) {
+            uint8_t condition = (opcode & 0xC7) == JP_NZ ? dest : dest & 0x03;
+            const uint8_t masks[4] = { Z80State::Z_FLAG, Z80State::C_FLAG, Z80State::PV_FLAG, Z80State::S_FLAG };
+            pendingCycles += opCycles;
+            pendingFetches++;
+            flushCycles();
+            e.testByteImm(fields.f, masks[condition >> 1]);
+            uint8_t* notTaken = e.jcc(condition & 1 ? ZERO : NOT_ZERO);
+            if ((opcode & 0xC7) != JP_NZ) e.addQwordImm(fields.cycles, Timing::JR_TAKEN);
+            exitJumps.push_back({ e.jmp(), op.operand });
+            Emitter::patch(notTaken, e.here());
+            exitJumps.push_back({ e.jmp(), op.next });
+            break;
+        }
+        // Everything else runs its block handler
+        else {
+            flushCycles();
+            e.storeWordImm(fields.pc, op.next);
+            e.callHandler(reinterpret_cast<const void*>(op.handler), &op);
+            e.cmpByteImm(fields.exitBlock, 0);
+            sideExits.push_back({ e.jcc(NOT_ZERO), length - i - 1 });
+
+            if (last) {
+                // Static targets of JP/JR/CALL are linked, anything else leaves
+                bool staticTarget = unprefixed && (opcode == JP_NN || (opcode & 0xC7) == JP_NZ
+                    || opcode == JR || opcode == JR_NZ || opcode == JR_Z || opcode == JR_NC || opcode == JR_C
+                    || opcode == CALL_NN || (opcode & 0xC7) == CALL_NZ);
+                if (staticTarget) {
+                    e.cmpWordImm(fields.pc, op.operand);
+                    uint8_t* other = e.jcc(NOT_ZERO);
+                    exitJumps.push_back({ e.jmp(), op.operand });
+                    Emitter::patch(other, e.here());
+                }
+                e.cmpWordImm(fields.pc, op.next);
+                e.jcc(NOT_ZERO, exitRoutine);
+                exitJumps.push_back({ e.jmp(), op.next });
+            }
+            continue;
+        }
+
+        // Block cut by the size limit after an inline instruction
+        if (last) {
+            flushCycles();
+            exitJumps.push_back({ e.jmp(), op.next });
+        }
+    }
+
+    // Out of line exits
+    Emitter::patch(budgetExit, e.here());
+    e.storeWordImm(fields.pc, block.start);
+    e.jmp(exitRoutine);
+
+    for (const SideExit& side : sideExits) {
+        Emitter::patch(side.jump, e.here());
+        if (side.remaining) e.addBudget(side.remaining);
+        e.jmp(exitRoutine);
+    }
+
+    for (const auto& [jump, target] : exitJumps) {
+        Emitter::patch(jump, e.here());
+        translation->exits.push_back({ jump, e.here(), target });
+        e.storeWordImm(fields.pc, target);
+        e.jmp(exitRoutine);
+    }
+
+    used = (e.here() - buffer + 15) & ~size_t(15);
+    writePerfMap(code, e.here() - code, block.start);
+    counters.translations++;
+
+    // Link the exits to translated successors and the exits
+    // of other translations to this block
+    Translation* added = translation.get();
+    translations[block.start] = std::move(translation);
+    pageTranslations[added->firstPage].push_back(block.start);
+    if (added->lastPage != added->firstPage) pageTranslations[added->lastPage].push_back(block.start);
+
+    for (uint32_t index = 0; index < added->exits.size(); index++) {
+        Exit& exit = added->exits[index];
+        exitsTo[exit.target].push_back({ block.start, index });
+        if (const uint8_t* successor = lookup(exit.target)) link(exit, successor);
+    }
+    auto incoming = exitsTo.find(block.start);
+    if (incoming != exitsTo.end()) {
+        for (const ExitRef& ref : incoming->second) {
+            link(translations[ref.from]->exits[ref.index], code);
+        }
+    }
+    if (!setWritable(false)) {
+        // nothing in the buffer may run, the interpreter takes over
+        flush();
+        return nullptr;
+    }
+    return code;
+}
+
+void Jit::link(Exit& exit, const uint8_t* code) {
+    Emitter::patch(exit.jump, code);
+}
+
+void Jit::unlink(Exit& exit) {
+    Emitter::patch(exit.jump, exit.stub);
+}
+
+/**
+ * Removing a translation unlinks the exits jumping into it and forgets
+ * its own exits, its code stays in the buffer until the next flush
+ * because it may be the code that is running right now
+ */
+void Jit::drop(uint16_t start) {
+    std::unique_ptr<Translation> translation = std::move(translations[start]);
+    if (!translation) return;
+
+    for (const Exit& exit : translation->exits) {
+        std::vector<ExitRef>& refs = exitsTo[exit.target];
+        refs.erase(std::remove_if(refs.begin(), refs.end(),
+            [start](const ExitRef& ref) { return ref.from == start; }), refs.end());
+    }
+    auto incoming = exitsTo.find(start);
+    if (incoming != exitsTo.end()) {
+        for (const ExitRef& ref : incoming->second) {
+            unlink(translations[ref.from]->exits[ref.index]);
+        }
+    }
+
+    for (int page : { translation->firstPage, translation->lastPage }) {
+        std::vector<uint16_t>& starts = pageTranslations[page];
+        starts.erase(std::remove(starts.begin(), starts.end(), start), starts.end());
+    }
+}
+
+/**
+ * Handlers called from translated code land here, the buffer is
+ * executable again before they return into it
+ */
+void Jit::invalidatePage(int page) {
+    std::vector<uint16_t> starts = pageTranslations[page];
+    if (starts.empty() || !setWritable(true)) return;
+    for (uint16_t start : starts) drop(start);
+    if (!setWritable(false)) flush();
+}
+
+void Jit::flush() {
+    for (std::unique_ptr<Translation>& translation : translations) translation.reset();
+    for (std::vector<uint16_t>& starts : pageTranslations) starts.clear();
+    exitsTo.clear();
+    used = routineSize;
+}
+
+/**
+ * Every Jit of the process appends to one stream, opened on the first
+ * translation when Z80_PERF_MAP is set. After a flush the buffer is
+ * reused and later lines describe the same addresses again
+ */
+void Jit::writePerfMap(const uint8_t* code, size_t size, uint16_t start) {
+    static std::mutex lock;
+    static std::unique_ptr<std::ofstream> perfMap = []() -> std::unique_ptr<std::ofstream> {
+        if (!std::getenv("Z80_PERF_MAP")) return nullptr;
+        return std::make_unique<std::ofstream>("/tmp/perf-" + std::to_string(getpid()) + ".map", std::ios::app);
+    }();
+    if (!perfMap) return;
+    std::lock_guard<std::mutex> guard(lock);
+    *perfMap << std::hex << uintptr_t(code) << " " << size << " z80_block_" << start << std::dec << '\n';
+}
+
+#else
+
+bool Jit::supported() {
+    return false;
+}
+
+Jit::Jit(BlockCacheStats& counters, uint32_t hotThreshold)
+    : counters(counters), threshold(hotThreshold) {}
+
+Jit::~Jit() = default;
+
+bool Jit::setWritable(bool) { return false; }
+
+const uint8_t* Jit::translate(const Z80State&, const Block&) { return nullptr; }
+uint64_t Jit::run(Z80State&, const uint8_t*, uint64_t) { return 0; }
+void Jit::invalidatePage(int) {}
+void Jit::flush() {}
+
+#endif
@@ -0,0 +1,466 @@
+#include "../include/lockstep.hpp"
+#include "../include/cpucore.hpp"
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+// Slot of F in the register arrays, the register code 6 names (HL)
+static constexpr int F_SLOT = 6;
+
+LockstepGroup::LockstepGroup(int lanes)
+    : pc(0), cycles(0), fetches(0), halted(false), count(std::clamp(lanes, 1, LANES)), runningCount(0), leader(0),
+      totalInstructions(0), memory(new uint8_t[size_t(0x10000) * LANES]()) {
+    for (int lane = 0; lane < LANES; lane++) {
+        setRegisters(lane, Z80Registers{});
+        running[lane] = lane < count;
+        peeledAt[lane] = 0;
+        results[lane] = RunResult{ RunStatus::Limit, 0, 0 };
+    }
+    runningCount = count;
+}
+
+LockstepGroup::~LockstepGroup() = default;
+
+void LockstepGroup::writeByte(int lane, uint16_t addr, uint8_t value) {
+    if (scalar[lane]) scalar[lane]->writeByte(addr, value);
+    else at(lane, addr) = value;
+}
+
+uint8_t LockstepGroup::readByte(int lane, uint16_t addr) const {
+    if (scalar[lane]) return scalar[lane]->readByte(addr);
+    return column(addr)[lane];
+}
+
+void LockstepGroup::load(uint16_t addr, const uint8_t* data, size_t size) {
+    size = std::min<size_t>(size, 0x10000);
+    for (size_t offset = 0; offset < size; offset++) {
+        for (int lane = 0; lane < count; lane++) writeByte(lane, uint16_t(addr + offset), data[offset]);
+    }
+}
+
+void LockstepGroup::setRegisters(int lane, const Z80Registers& registers) {
+    if (scalar[lane]) {
+        scalar[lane]->setRegisters(registers);
+        return;
+    }
+    const uint16_t main[4] = { registers.bc, registers.de, registers.hl, registers.af };
+    const uint16_t primed[4] = { registers.bc_prime, registers.de_prime, registers.hl_prime, registers.af_prime };
+    // BC, DE, HL fill slots 0-5 high byte first, AF fills 7 (A) and 6 (F)
+    for (int index = 0; index < 3; index++) {
+        regs[2 * index][lane] = uint8_t(main[index] >> 8);
+        regs[2 * index + 1][lane] = uint8_t(main[index]);
+        alternate[2 * index][lane] = uint8_t(primed[index] >> 8);
+        alternate[2 * index + 1][lane] = uint8_t(primed[index]);
+    }
+    regs[Regs::A][lane] = uint8_t(main[3] >> 8);
+    regs[F_SLOT][lane] = uint8_t(main[3]);
+    alternate[Regs::A][lane] = uint8_t(primed[3] >> 8);
+    alternate[F_SLOT][lane] = uint8_t(primed[3]);
+    ix[lane] = registers.ix;
+    iy[lane] = registers.iy;
+    sp[lane] = registers.sp;
+    lanePc[lane] = registers.pc;
+    laneHalted[lane] = registers.halted;
+    i[lane] = registers.i;
+    r[lane] = registers.r;
+    rFetches[lane] = fetches;
+    iff1[lane] = registers.iff1;
+    iff2[lane] = registers.iff2;
+    im[lane] = registers.im;
+}
+
+Z80Registers LockstepGroup::getRegisters(int lane) const {
+    if (scalar[lane]) return scalar[lane]->getRegisters();
+    auto join = [lane](const uint8_t (&bank)[8][LANES], int high, int low) {
+        return uint16_t((bank[high][lane] << 8) | bank[low][lane]);
+    };
+    uint8_t refresh = uint8_t((r[lane] & 0x80) | ((r[lane] + (fetches - rFetches[lane])) & 0x7F));
+    return Z80Registers{ join(regs, Regs::A, F_SLOT), join(regs, Regs::B, Regs::C), join(regs, Regs::D, Regs::E), join(regs, Regs::H, Regs::L),
+        join(alternate, Regs::A, F_SLOT), join(alternate, Regs::B, Regs::C), join(alternate, Regs::D, Regs::E), join(alternate, Regs::H, Regs::L),
+        ix[lane], iy[lane], sp[lane], lanePc[lane], i[lane], refresh, iff1[lane], iff2[lane], im[lane], laneHalted[lane] };
+}
+
+uint64_t LockstepGroup::getCycles(int lane) const {
+    return scalar[lane] ? scalar[lane]->getCycles() : cycles;
+}
+
+bool LockstepGroup::isHalted(int lane) const {
+    return scalar[lane] ? scalar[lane]->isHalted() : laneHalted[lane];
+}
+
+/**
+ * Lanes not at the first lane's PC are peeled before the run starts,
+ * lanes peeled before this run only run their scalar CPU. A lane peeled
+ * during the run finishes the budget on its scalar CPU, its result
+ * counts the instructions it executed in lock-step before
+ */
+void LockstepGroup::runCycles(uint64_t maxCycles) {
+    uint64_t start = cycles;
+    uint64_t end = maxCycles > UINT64_MAX - start ? UINT64_MAX : start + maxCycles;
+    uint64_t startInstructions = totalInstructions;
+    bool peeledBefore[LANES];
+    for (int lane = 0; lane < count; lane++) peeledBefore[lane] = scalar[lane] != nullptr;
+
+    if (runningCount > 0) {
+        pc = lanePc[leader];
+        halted = laneHalted[leader];
+        for (int lane = 0; lane < count; lane++) {
+            if (running[lane] && (lanePc[lane] != pc || laneHalted[lane] != halted)) peel(lane);
+        }
+        while (cycles < end && !halted && step()) totalInstructions++;
+    }
+
+    RunStatus status = halted ? RunStatus::Halted : RunStatus::Limit;
+    for (int lane = 0; lane < count; lane++) {
+        if (running[lane]) {
+            lanePc[lane] = pc;
+            laneHalted[lane] = halted;
+            results[lane] = RunResult{ status, totalInstructions - startInstructions, cycles - start };
+        }
+        else if (peeledBefore[lane]) {
+            results[lane] = scalar[lane]->runCycles(maxCycles);
+        }
+        else {
+            Z80& cpu = *scalar[lane];
+            RunResult run = cpu.runCycles(end == UINT64_MAX ? UINT64_MAX : end - cpu.getCycles());
+            results[lane] = RunResult{ run.status, peeledAt[lane] - startInstructions + run.instructions, cpu.getCycles() - start };
+        }
+    }
+}
+
+/**
+ * The scalar CPU gets the lane's memory and registers
+ */
+void LockstepGroup::peel(int lane) {
+    std::vector<uint8_t> image(0x10000);
+    for (uint32_t addr = 0; addr < 0x10000; addr++) image[addr] = column(uint16_t(addr))[lane];
+    auto cpu = std::make_unique<Z80>();
+    cpu->loadImage(0, image);
+    Z80State& state = *cpu;
+    state.cycles = cycles;
+    state.setRegisters(getRegisters(lane));
+
+    scalar[lane] = std::move(cpu);
+    peeledAt[lane] = totalInstructions;
+    running[lane] = 0;
+    runningCount--;
+    if (lane == leader) {
+        while (leader < count - 1 && !running[leader]) leader++;
+    }
+}
+
+void LockstepGroup::keepLanes(const uint8_t* keep) {
+    for (int lane = 0; lane < count; lane++) {
+        if (running[lane] && !keep[lane]) {
+            lanePc[lane] = pc;
+            laneHalted[lane] = halted;
+            peel(lane);
+        }
+    }
+}
+
+void LockstepGroup::keepEqual(const uint8_t* values) {
+    alignas(32) uint8_t keep[LANES];
+    uint8_t expected = values[leader];
+    for (int lane = 0; lane < LANES; lane++) keep[lane] = values[lane] == expected;
+    keepLanes(keep);
+}
+
+void LockstepGroup::keepEqual(const uint16_t* values) {
+    alignas(32) uint8_t keep[LANES];
+    uint16_t expected = values[leader];
+    for (int lane = 0; lane < LANES; lane++) keep[lane] = values[lane] == expected;
+    keepLanes(keep);
+}
+
+/**
+ * A tie goes to the leader's side
+ */
+bool LockstepGroup::keepMajority(const uint8_t* condition) {
+    int taken = 0;
+    for (int lane = 0; lane < count; lane++) taken += running[lane] && condition[lane];
+    bool branch = taken * 2 > runningCount || (taken * 2 == runningCount && condition[leader]);
+    alignas(32) uint8_t keep[LANES];
+    for (int lane = 0; lane < LANES; lane++) keep[lane] = (condition[lane] != 0) == branch;
+    keepLanes(keep);
+    return branch;
+}
+
+uint16_t LockstepGroup::pair(int code, int lane) const {
+    if (code == Pairs::SP) return sp[lane];
+    return uint16_t((regs[2 * code][lane] << 8) | regs[2 * code + 1][lane]);
+}
+
+void LockstepGroup::setPair(int code, int lane, uint16_t value) {
+    if (code == Pairs::SP) {
+        sp[lane] = value;
+        return;
+    }
+    regs[2 * code][lane] = uint8_t(value >> 8);
+    regs[2 * code + 1][lane] = uint8_t(value);
+}
+
+void LockstepGroup::condition(uint8_t code, uint8_t* out) const {
+    static constexpr uint8_t masks[4] = { Z80State::Z_FLAG, Z80State::C_FLAG, Z80State::PV_FLAG, Z80State::S_FLAG };
+    uint8_t mask = masks[code >> 1];
+    uint8_t set = code & 1;
+    for (int lane = 0; lane < LANES; lane++) out[lane] = ((regs[F_SLOT][lane] & mask) != 0) == set;
+}
+
+/**
+ * 16-bit operand following the opcode, lanes may hold different ones
+ */
+void LockstepGroup::immediate(uint16_t* out) const {
+    const uint8_t* low = column(uint16_t(pc + 1));
+    const uint8_t* high = column(uint16_t(pc + 2));
+    for (int lane = 0; lane < LANES; lane++) out[lane] = uint16_t(low[lane] | (high[lane] << 8));
+}
+
+void LockstepGroup::push(const uint16_t* values) {
+    for (int lane = 0; lane < LANES; lane++) {
+        at(lane, --sp[lane]) = uint8_t(values[lane] >> 8);
+        at(lane, --sp[lane]) = uint8_t(values[lane]);
+    }
+}
+
+/**
+ * Same instruction set and timings as the unprefixed opcodes of Z80Core,
+ * anything else (prefixes, I/O, RST, ...) peels every lane.
+ * Lanes differing from the leader are peeled before anything is changed,
+ * lanes that are not running execute along but their state is not read again
+ */
+bool LockstepGroup::step() {
+    keepEqual(column(pc));
+    uint8_t op = column(pc)[leader];
+    uint8_t dest = (op >> 3) & 0x07;
+    uint8_t src = op & 0x07;
+    uint8_t rr = (op >> 4) & 0x03;
+    uint8_t* a = regs[Regs::A];
+    uint8_t* f = regs[F_SLOT];
+    const uint8_t* n = column(uint16_t(pc + 1));
+    alignas(32) uint8_t value[LANES];
+    alignas(32) uint16_t word16[LANES];
+    uint16_t next = uint16_t(pc + 1);
+    uint32_t extra = 0;
+
+    if (op == HALT) {
+        halted = true;
+        next = pc;
+    }
+    // LD r,r', LD r,(HL), LD (HL),r
+    else if ((op & 0xC0) == 0x40) {
+        if (src == 6) {
+            for (int lane = 0; lane < LANES; lane++) value[lane] = at(lane, pair(Pairs::HL, lane));
+            std::copy(value, value + LANES, regs[dest]);
+        }
+        else if (dest == 6) {
+            for (int lane = 0; lane < LANES; lane++) at(lane, pair(Pairs::HL, lane)) = regs[src][lane];
+        }
+        else std::copy(regs[src], regs[src] + LANES, regs[dest]);
+    }
+    // ALU A,r, ALU A,(HL), ALU A,n
+    else if ((op & 0xC0) == 0x80 || (op & 0xC7) == ADD_A_N) {
+        if ((op & 0xC0) == 0xC0) {
+            std::copy(n, n + LANES, value);
+            next = uint16_t(pc + 2);
+        }
+        else if (src == 6) {
+            for (int lane = 0; lane < LANES; lane++) value[lane] = at(lane, pair(Pairs::HL, lane));
+        }
+        else std::copy(regs[src], regs[src] + LANES, value);
+
+        alignas(32) uint8_t carry[LANES];
+        bool withCarry = dest == AluOps::ADC || dest == AluOps::SBC;
+        for (int lane = 0; lane < LANES; lane++) carry[lane] = withCarry ? f[lane] & Z80State::C_FLAG : 0;
+        switch (dest) {
+        case AluOps::ADD: case AluOps::ADC: LaneAlu::add(a, f, value, carry); break;
+        case AluOps::SUB: case AluOps::SBC: LaneAlu::sub(a, f, value, carry, true); break;
+        case AluOps::AND: LaneAlu::andA(a, f, value); break;
+        case AluOps::XOR: LaneAlu::xorA(a, f, value); break;
+        case AluOps::OR: LaneAlu::orA(a, f, value); break;
+        default: LaneAlu::sub(a, f, value, carry, false); break;
+        }
+    }
+    // INC (HL), DEC (HL), INC r, DEC r
+    else if (op == INC_HL || op == DEC_HL) {
+        for (int lane = 0; lane < LANES; lane++) value[lane] = at(lane, pair(Pairs::HL, lane));
+        if (op == INC_HL) LaneAlu::inc(value, f);
+        else LaneAlu::dec(value, f);
+        for (int lane = 0; lane < LANES; lane++) at(lane, pair(Pairs::HL, lane)) = value[lane];
+    }
+    else if ((op & 0xC7) == INC_B) LaneAlu::inc(regs[dest], f);
+    else if ((op & 0xC7) == DEC_B) LaneAlu::dec(regs[dest], f);
+    // LD (HL),n, LD r,n
+    else if (op == LD_HL_N) {
+        for (int lane = 0; lane < LANES; lane++) at(lane, pair(Pairs::HL, lane)) = n[lane];
+        next = uint16_t(pc + 2);
+    }
+    else if ((op & 0xC7) == LD_B_N) {
+        std::copy(n, n + LANES, regs[dest]);
+        next = uint16_t(pc + 2);
+    }
+
+    // LD rr,nn, ADD HL,rr, INC rr, DEC rr
+    else if ((op & 0xCF) == LD_BC_NN) {
+        immediate(word16);
+        for (int lane = 0; lane < LANES; lane++) setPair(rr, lane, word16[lane]);
+        next = uint16_t(pc + 3);
+    }
+    else if ((op & 0xCF) == ADD_HL_BC) {
+        for (int lane = 0; lane < LANES; lane++) {
+            uint16_t target = pair(Pairs::HL, lane);
+            uint16_t operand = pair(rr, lane);
+            uint32_t result = target + operand;
+            f[lane] = (f[lane] & (Z80State::S_FLAG | Z80State::Z_FLAG | Z80State::PV_FLAG))
+                | (((target & 0x0FFF) + (operand & 0x0FFF)) > 0x0FFF ? Z80State::H_FLAG : 0)
+                | (result > 0xFFFF ? Z80State::C_FLAG : 0);
+            setPair(Pairs::HL, lane, uint16_t(result));
+        }
+    }
+    else if ((op & 0xCF) == INC_BC) {
+        for (int lane = 0; lane < LANES; lane++) setPair(rr, lane, uint16_t(pair(rr, lane) + 1));
+    }
+    else if ((op & 0xCF) == DEC_BC) {
+        for (int lane = 0; lane < LANES; lane++) setPair(rr, lane, uint16_t(pair(rr, lane) - 1));
+    }
+
+    // LD (BC),A, LD (DE),A, LD A,(BC), LD A,(DE)
+    else if (op == LD_BC_A || op == LD_DE_A) {
+        for (int lane = 0; lane < LANES; lane++) at(lane, pair(rr, lane)) = a[lane];
+    }
+    else if (op == LD_A_BC || op == LD_A_DE) {
+        for (int lane = 0; lane < LANES; lane++) a[lane] = at(lane, pair(rr, lane));
+    }
+    // LD (nn),HL, LD HL,(nn), LD (nn),A, LD A,(nn), LD SP,HL
+    else if (op == LD_NN_HL || op == LD_HL_INN || op == LD_NN_A || op == LD_A_INN) {
+        immediate(word16);
+        for (int lane = 0; lane < LANES; lane++) {
+            uint16_t addr = word16[lane];
+            if (op == LD_NN_HL) {
+                at(lane, addr) = regs[Regs::L][lane];
+                at(lane, uint16_t(addr + 1)) = regs[Regs::H][lane];
+            }
+            else if (op == LD_HL_INN) setPair(Pairs::HL, lane, word(lane, addr));
+            else if (op == LD_NN_A) at(lane, addr) = a[lane];
+            else a[lane] = at(lane, addr);
+        }
+        next = uint16_t(pc + 3);
+    }
+    else if (op == LD_SP_HL) {
+        for (int lane = 0; lane < LANES; lane++) sp[lane] = pair(Pairs::HL, lane);
+    }
+
+    // EX AF,AF', EXX, EX DE,HL
+    else if (op == EX_AF_AF) {
+        for (int slot : { F_SLOT, int(Regs::A) }) std::swap_ranges(regs[slot], regs[slot] + LANES, alternate[slot]);
+    }
+    else if (op == EXX) {
+        for (int slot = Regs::B; slot <= Regs::L; slot++) std::swap_ranges(regs[slot], regs[slot] + LANES, alternate[slot]);
+    }
+    else if (op == EX_DE_HL) {
+        std::swap_ranges(regs[Regs::D], regs[Regs::D] + LANES, regs[Regs::H]);
+        std::swap_ranges(regs[Regs::E], regs[Regs::E] + LANES, regs[Regs::L]);
+    }
+
+    // JR e, JR cc,e - lanes with another offset or the other outcome leave
+    else if (op == JR || op == JR_NZ || op == JR_Z || op == JR_NC || op == JR_C) {
+        bool taken = true;
+        if (op != JR) {
+            condition(dest & 0x03, value);
+            taken = keepMajority(value);
+        }
+        next = uint16_t(pc + 2);
+        if (taken) {
+            keepEqual(n);
+            next = uint16_t(next + int8_t(n[leader]));
+            if (op != JR) extra = Timing::JR_TAKEN;
+        }
+    }
+    // JP nn, JP cc,nn, CALL nn, CALL cc,nn
+    else if (op == JP_NN || (op & 0xC7) == JP_NZ || op == CALL_NN || (op & 0xC7) == CALL_NZ) {
+        bool call = op == CALL_NN || (op & 0xC7) == CALL_NZ;
+        bool taken = true;
+        if (op != JP_NN && op != CALL_NN) {
+            condition(dest, value);
+            taken = keepMajority(value);
+        }
+        next = uint16_t(pc + 3);
+        if (taken) {
+            immediate(word16);
+            keepEqual(word16);
+            uint16_t target = word16[leader];
+            if (call) {
+                std::fill(word16, word16 + LANES, next);
+                push(word16);
+                if (op != CALL_NN) extra = Timing::CALL_TAKEN;
+            }
+            next = target;
+        }
+    }
+    else if (op == JP_HL) {
+        for (int lane = 0; lane < LANES; lane++) word16[lane] = pair(Pairs::HL, lane);
+        keepEqual(word16);
+        next = word16[leader];
+    }
+    // RET, RET cc
+    else if (op == RET || (op & 0xC7) == RET_NZ) {
+        bool taken = true;
+        if (op != RET) {
+            condition(dest, value);
+            taken = keepMajority(value);
+        }
+        if (taken) {
+            for (int lane = 0; lane < LANES; lane++) word16[lane] = word(lane, sp[lane]);
+            keepEqual(word16);
+            for (int lane = 0; lane < LANES; lane++) sp[lane] += 2;
+            next = word16[leader];
+            if (op != RET) extra = Timing::RET_TAKEN;
+        }
+    }
+    // PUSH qq, POP qq - AF takes the place of SP
+    else if ((op & 0xCF) == PUSH_BC) {
+        for (int lane = 0; lane < LANES; lane++) {
+            word16[lane] = rr == 3 ? uint16_t((a[lane] << 8) | f[lane]) : pair(rr, lane);
+        }
+        push(word16);
+    }
+    else if ((op & 0xCF) == POP_BC) {
+        for (int lane = 0; lane < LANES; lane++) {
+            uint16_t popped = word(lane, sp[lane]);
+            sp[lane] += 2;
+            if (rr == 3) {
+                a[lane] = uint8_t(popped >> 8);
+                f[lane] = uint8_t(popped);
+            }
+            else setPair(rr, lane, popped);
+        }
+    }
+
+    // SCF, DAA, DI, EI
+    else if (op == SCF) {
+        for (int lane = 0; lane < LANES; lane++) {
+            f[lane] = (f[lane] | Z80State::C_FLAG) & ~(Z80State::N_FLAG | Z80State::H_FLAG);
+        }
+    }
+    else if (op == DAA) {
+        for (int lane = 0; lane < LANES; lane++) {
+            uint16_t result = FlagTables::tables.daa[FlagTables::daaIndex(a[lane], f[lane])];
+            a[lane] = uint8_t(result >> 8);
+            f[lane] = uint8_t(result);
+        }
+    }
+    else if (op == DI || op == EI) {
+        std::fill(iff1, iff1 + LANES, op == EI);
+        std::fill(iff2, iff2 + LANES, op == EI);
+    }
+    else if (op != 0x00) {  // NOP
+        std::fill(value, value + LANES, 0);
+        keepLanes(value);
+        return false;
+    }
+
+    pc = next;
+    cycles += Timing::unprefixed[op] + extra;
+    fetches++;
+    return true;
+}
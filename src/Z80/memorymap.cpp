@@ -0,0 +1,188 @@
+#include "../include/memorymap.hpp"
+#include <algorithm>
+#include <atomic>
+
+/**
+ * Page of zeroes every fresh map starts with. It always has this reference
+ * besides the maps' own, so it counts as shared and is never written
+ */
+static const std::shared_ptr<std::array<uint8_t, MemoryMap::PAGE_SIZE>>& zeroPage() {
+    static const auto page = std::make_shared<std::array<uint8_t, MemoryMap::PAGE_SIZE>>();
+    return page;
+}
+
+MemoryMap::MemoryMap() {
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        ram[page] = zeroPage();
+        unmap(page);
+    }
+}
+
+MemoryMap::MemoryMap(const MemoryMap& other) {
+    assign(other, false);
+}
+
+MemoryMap::MemoryMap(MemoryMap& parent, Shared) {
+    assign(parent, true);
+    for (int page = 0; page < PAGE_COUNT; page++) parent.updatePage(page);
+}
+
+MemoryMap& MemoryMap::operator=(const MemoryMap& other) {
+    if (this != &other) assign(other, false);
+    return *this;
+}
+
+MemoryMap MemoryMap::fork() {
+    return MemoryMap(*this, Shared{});
+}
+
+/**
+ * A page other owns alone is copied unless share is set: other keeps its
+ * write fast pointer to it, so sharing it would need other to change.
+ * Pointers into other's RAM or sink are moved to this map's own,
+ * pointers to host memory and devices are kept
+ */
+void MemoryMap::assign(const MemoryMap& other, bool share) {
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        if (share || other.ram[page].use_count() > 1) ram[page] = other.ram[page];
+        else if (ram[page] && ram[page].use_count() == 1) *ram[page] = *other.ram[page];
+        else ram[page] = std::make_shared<RamPage>(*other.ram[page]);
+    }
+    if (other.sink && !sink) sink.reset(new uint8_t[PAGE_SIZE]);
+    dirty = other.dirty;
+    devices = other.devices;
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        mappedRead[page] = rebase(other.mappedRead[page], other);
+        mappedWrite[page] = rebase(other.mappedWrite[page], other);
+        updatePage(page);
+    }
+}
+
+template<typename T>
+T* MemoryMap::rebase(T* pointer, const MemoryMap& other) {
+    if (other.sink && pointer == other.sink.get()) return sink.get();
+    uintptr_t address = reinterpret_cast<uintptr_t>(pointer);
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        uintptr_t otherPage = reinterpret_cast<uintptr_t>(other.ram[page]->data());
+        if (address >= otherPage && address < otherPage + PAGE_SIZE) return ram[page]->data() + (address - otherPage);
+    }
+    return pointer;
+}
+
+void MemoryMap::map(int page, const uint8_t* read, uint8_t* write) {
+    if (!write && !sink) sink.reset(new uint8_t[PAGE_SIZE]);
+    mappedRead[page] = read;
+    mappedWrite[page] = write ? write : sink.get();
+    updatePage(page);
+}
+
+void MemoryMap::unmap(int page) {
+    map(page, ram[page]->data(), ram[page]->data());
+}
+
+bool MemoryMap::sharedAndMapped(int page) const {
+    return mappedWrite[page] == ram[page]->data() && ram[page].use_count() > 1;
+}
+
+int MemoryMap::sharedPages() const {
+    int count = 0;
+    for (int page = 0; page < PAGE_COUNT; page++) count += ram[page].use_count() > 1;
+    return count;
+}
+
+/**
+ * A page seen shared may have lost its other owners since, then it is
+ * taken over as it is. The fence pairs with the release of the last
+ * other owner, which may have been reading the page on another thread
+ */
+uint8_t* MemoryMap::ownPage(int page) {
+    if (ram[page].use_count() > 1) setRamPage(page, std::make_shared<RamPage>(*ram[page]));
+    else {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        updatePage(page);
+    }
+    return writePages[page];
+}
+
+void MemoryMap::setRamPage(int page, std::shared_ptr<RamPage> data) {
+    const uint8_t* old = ram[page]->data();
+    ram[page] = std::move(data);
+    if (mappedRead[page] == old) mappedRead[page] = ram[page]->data();
+    if (mappedWrite[page] == old) mappedWrite[page] = ram[page]->data();
+    updatePage(page);
+}
+
+/**
+ * Every page aliases owner, so all of them count as shared while the
+ * owner or another page of it is held anywhere else
+ */
+void MemoryMap::shareRam(const std::shared_ptr<void>& owner, uint8_t* const* pages, const DirtyBlocks& written) {
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        setRamPage(page, pages[page] ? std::shared_ptr<RamPage>(owner, reinterpret_cast<RamPage*>(pages[page])) : zeroPage());
+    }
+    dirty = written;
+}
+
+/**
+ * Built-in RAM is only written through its own addresses, so the blocks
+ * marked by address cover it. Marks from pages mapped elsewhere just
+ * clear blocks that are zero already. A shared page with dirty blocks is
+ * swapped for the page of zeroes instead of being copied and cleared
+ */
+void MemoryMap::clearRam() {
+    for (int page = 0; page < PAGE_COUNT; page++) {
+        uint32_t start = uint32_t(page) << PAGE_SHIFT;
+        if (!dirty.any(start, PAGE_SIZE)) continue;
+        if (ram[page].use_count() > 1) {
+            setRamPage(page, zeroPage());
+            dirty.forget(start, PAGE_SIZE);
+        }
+        else dirty.clear(ram[page]->data(), start, PAGE_SIZE);
+    }
+}
+
+void MemoryMap::addDevice(uint16_t start, uint32_t size, MmioDevice* device) {
+    uint32_t end = std::min<uint32_t>(start + size, 0x10000);
+    if (start >= end) return;
+    devices.push_back({ start, end, device });
+    for (uint32_t page = start >> PAGE_SHIFT; page <= (end - 1) >> PAGE_SHIFT; page++) updatePage(page);
+}
+
+void MemoryMap::removeDevice(MmioDevice* device) {
+    devices.erase(std::remove_if(devices.begin(), devices.end(),
+        [device](const DeviceRange& range) { return range.device == device; }), devices.end());
+    for (int page = 0; page < PAGE_COUNT; page++) updatePage(page);
+}
+
+/**
+ * A page keeps its fast pointers unless a device range overlaps it,
+ * a page of shared built-in RAM loses the write pointer
+ */
+void MemoryMap::updatePage(int page) {
+    uint32_t first = uint32_t(page) << PAGE_SHIFT;
+    uint32_t last = first + PAGE_SIZE;
+    bool hasDevice = std::any_of(devices.begin(), devices.end(),
+        [first, last](const DeviceRange& range) { return range.start < last && range.end > first; });
+    readPages[page] = hasDevice ? nullptr : mappedRead[page];
+    writePages[page] = hasDevice || sharedAndMapped(page) ? nullptr : mappedWrite[page];
+}
+
+uint8_t MemoryMap::readDevice(uint16_t addr) const {
+    for (const DeviceRange& range : devices) {
+        if (addr >= range.start && addr < range.end) return range.device->read(addr);
+    }
+    return mappedRead[addr >> PAGE_SHIFT][addr & (PAGE_SIZE - 1)];
+}
+
+void MemoryMap::writeDevice(uint16_t addr, uint8_t value) {
+    for (const DeviceRange& range : devices) {
+        if (addr >= range.start && addr < range.end) {
+            range.device->write(addr, value);
+            return;
+        }
+    }
+    int page = addr >> PAGE_SHIFT;
+    if (sharedAndMapped(page) || (!writePages[page] && readPages[page])) ownPage(page);
+    mappedWrite[page][addr & (PAGE_SIZE - 1)] = value;
+    dirty.mark(addr);
+}
@@ -0,0 +1,108 @@
+#include "../include/scheduler.hpp"
+#include <utility>
+
+Scheduler::Scheduler() {
+    for (Slot& slot : slots) slot = Slot{ 0, nullptr, 0, 0, false };
+    clear();
+}
+
+void Scheduler::clear() {
+    size = 0;
+    freeCount = 0;
+    for (int slot = CAPACITY - 1; slot >= 0; slot--) {
+        if (slots[slot].used) slots[slot].generation = (slots[slot].generation + 1) & 0xFFFFFF;
+        slots[slot].used = false;
+        freeSlots[freeCount++] = uint8_t(slot);
+    }
+}
+
+EventId Scheduler::schedule(uint64_t cycle, EventHandler* handler) {
+    if (freeCount == 0) return NO_EVENT;
+    uint8_t slot = freeSlots[--freeCount];
+    slots[slot].cycle = cycle;
+    slots[slot].handler = handler;
+    slots[slot].used = true;
+    slots[slot].heapIndex = size;
+    heap[size] = slot;
+    siftUp(size++);
+    return idOf(slot);
+}
+
+bool Scheduler::pending(EventId id) const {
+    uint32_t slot = id & 0xFF;
+    return slot < CAPACITY && slots[slot].used && idOf(uint8_t(slot)) == id;
+}
+
+bool Scheduler::cancel(EventId id) {
+    if (!pending(id)) return false;
+    release(uint8_t(id & 0xFF));
+    return true;
+}
+
+/**
+ * The slot keeps its handle, the event only moves within the heap
+ */
+bool Scheduler::reschedule(EventId id, uint64_t cycle) {
+    if (!pending(id)) return false;
+    Slot& slot = slots[id & 0xFF];
+    uint64_t old = slot.cycle;
+    slot.cycle = cycle;
+    if (cycle < old) siftUp(slot.heapIndex);
+    else siftDown(slot.heapIndex);
+    return true;
+}
+
+/**
+ * The slot is released before its handler runs,
+ * so the handler can schedule its next event right away
+ */
+void Scheduler::runDue(uint64_t now) {
+    while (size && slots[heap[0]].cycle <= now) {
+        uint8_t slot = heap[0];
+        uint64_t cycle = slots[slot].cycle;
+        EventHandler* handler = slots[slot].handler;
+        release(slot);
+        handler->onEvent(cycle);
+    }
+}
+
+void Scheduler::release(uint8_t slot) {
+    uint8_t index = slots[slot].heapIndex;
+    uint8_t last = --size;
+    if (index != last) {
+        swap(index, last);
+        siftUp(index);
+        siftDown(slots[heap[index]].heapIndex);
+    }
+    slots[slot].used = false;
+    slots[slot].generation = (slots[slot].generation + 1) & 0xFFFFFF;
+    freeSlots[freeCount++] = slot;
+}
+
+void Scheduler::swap(uint8_t a, uint8_t b) {
+    std::swap(heap[a], heap[b]);
+    slots[heap[a]].heapIndex = a;
+    slots[heap[b]].heapIndex = b;
+}
+
+void Scheduler::siftUp(uint8_t index) {
+    while (index > 0) {
+        uint8_t parent = (index - 1) / 2;
+        if (!less(index, parent)) break;
+        swap(index, parent);
+        index = parent;
+    }
+}
+
+void Scheduler::siftDown(uint8_t index) {
+    while (true) {
+        uint8_t smallest = index;
+        uint8_t left = 2 * index + 1;
+        uint8_t right = left + 1;
+        if (left < size && less(left, smallest)) smallest = left;
+        if (right < size && less(right, smallest)) smallest = right;
+        if (smallest == index) break;
+        swap(index, smallest);
+        index = smallest;
+    }
+}
@@ -0,0 +1,231 @@
+#include "../include/snapshot.hpp"
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <new>
+#include <vector>
+
+// Files are mapped with mmap where the host has it, read into memory elsewhere
+#if defined(__unix__) || defined(__APPLE__)
+#define Z80_SNAPSHOT_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static constexpr char MAGIC[8] = { 'Z', '8', '0', 'S', 'N', 'A', 'P', 0 };
+
+static_assert(sizeof(Snapshot::Header) == 32 && sizeof(Snapshot::Section) == 24, "image layout");
+static_assert(sizeof(Snapshot::Cpu) == 48 && sizeof(Snapshot::RamTable) == 160, "image layout");
+
+/**
+ * Heap buffers are allocated with room to align the image to a page,
+ * so images in memory have the same layout guarantees as mapped ones
+ */
+static std::shared_ptr<void> allocatePages(size_t size, uint8_t*& bytes) {
+    std::shared_ptr<uint8_t> buffer(new uint8_t[size + Snapshot::PAGE_SIZE](), std::default_delete<uint8_t[]>());
+    uintptr_t address = reinterpret_cast<uintptr_t>(buffer.get());
+    bytes = buffer.get() + ((Snapshot::PAGE_SIZE - address % Snapshot::PAGE_SIZE) % Snapshot::PAGE_SIZE);
+    return buffer;
+}
+
+/**
+ * Page 0 holds the header, the section table and both sections,
+ * the RAM pages with a written block follow in address order
+ */
+Snapshot::Snapshot(const Z80& source) {
+    const MemoryMap& memory = source.bus();
+    const DirtyBlocks& written = memory.writtenBlocks();
+    int pages = 0;
+    for (int page = 0; page < MemoryMap::PAGE_COUNT; page++) pages += written.any(uint32_t(page) << MemoryMap::PAGE_SHIFT, PAGE_SIZE);
+
+    size_t size = size_t(1 + pages) * PAGE_SIZE;
+    uint8_t* bytes = nullptr;
+    std::shared_ptr<void> buffer = allocatePages(size, bytes);
+
+    constexpr uint64_t cpuOffset = sizeof(Header) + 2 * sizeof(Section);
+    constexpr uint64_t ramOffset = cpuOffset + sizeof(Cpu);
+    static_assert(ramOffset + sizeof(RamTable) <= PAGE_SIZE, "the sections have to fit the first page");
+
+    Header header{};
+    std::memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.byteOrder = ORDER_MARK;
+    header.pageSize = PAGE_SIZE;
+    header.sectionCount = 2;
+    header.size = size;
+    const Section sections[2] = { { CPU, 0, cpuOffset, sizeof(Cpu) }, { RAM_TABLE, 0, ramOffset, sizeof(RamTable) } };
+    std::memcpy(bytes, &header, sizeof(header));
+    std::memcpy(bytes + sizeof(header), sections, sizeof(sections));
+
+    const Z80State& state = source;
+    Z80Registers registers = state.getRegisters();
+    Cpu saved{};
+    saved.af = registers.af;
+    saved.bc = registers.bc;
+    saved.de = registers.de;
+    saved.hl = registers.hl;
+    saved.af_prime = registers.af_prime;
+    saved.bc_prime = registers.bc_prime;
+    saved.de_prime = registers.de_prime;
+    saved.hl_prime = registers.hl_prime;
+    saved.ix = registers.ix;
+    saved.iy = registers.iy;
+    saved.sp = registers.sp;
+    saved.pc = registers.pc;
+    saved.i = registers.i;
+    saved.r = registers.r;
+    saved.im = registers.im;
+    saved.iff1 = registers.iff1;
+    saved.iff2 = registers.iff2;
+    saved.halted = registers.halted;
+    saved.eiShadow = state.eiShadow;
+    saved.nmiPending = state.nmiPending;
+    saved.intLine = state.intLine;
+    saved.intData = state.intData;
+    saved.cycles = state.cycles;
+    std::memcpy(bytes + cpuOffset, &saved, sizeof(saved));
+
+    RamTable table{};
+    uint64_t offset = PAGE_SIZE;
+    for (int page = 0; page < MemoryMap::PAGE_COUNT; page++) {
+        if (!written.any(uint32_t(page) << MemoryMap::PAGE_SHIFT, PAGE_SIZE)) continue;
+        std::memcpy(bytes + offset, memory.ramPage(page), PAGE_SIZE);
+        table.pageOffset[page] = offset;
+        offset += PAGE_SIZE;
+    }
+    for (int index = 0; index < DirtyBlocks::WORD_COUNT; index++) table.writtenBlocks[index] = written.word(index);
+    std::memcpy(bytes + ramOffset, &table, sizeof(table));
+
+    adopt(std::move(buffer), bytes, size);
+}
+
+#ifdef Z80_SNAPSHOT_MMAP
+
+/**
+ * A private writable mapping: pages stay shared with the page cache until
+ * written, and a CPU left as the only holder may write to them in place
+ */
+bool Snapshot::load(const std::string& path) {
+    int file = open(path.c_str(), O_RDONLY);
+    if (file < 0) return false;
+    struct stat info;
+    if (fstat(file, &info) != 0 || info.st_size < off_t(sizeof(Header))) {
+        close(file);
+        return false;
+    }
+    size_t size = size_t(info.st_size);
+    void* mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, file, 0);
+    close(file);
+    if (mapped == MAP_FAILED) return false;
+    std::shared_ptr<void> mapping(mapped, [size](void* address) { munmap(address, size); });
+    return adopt(std::move(mapping), static_cast<uint8_t*>(mapped), size);
+}
+
+#else
+
+bool Snapshot::load(const std::string& path) {
+    std::ifstream file(path, std::ios::binary);
+    if (!file) return false;
+    std::vector<uint8_t> bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    return read(bytes.data(), bytes.size());
+}
+
+#endif
+
+bool Snapshot::read(const uint8_t* bytes, size_t size) {
+    uint8_t* copy = nullptr;
+    std::shared_ptr<void> buffer = allocatePages(size, copy);
+    if (size > 0) std::memcpy(copy, bytes, size);
+    return adopt(std::move(buffer), copy, size);
+}
+
+bool Snapshot::save(const std::string& path) const {
+    if (!valid()) return false;
+    std::ofstream file(path, std::ios::binary | std::ios::trunc);
+    file.write(reinterpret_cast<const char*>(image), std::streamsize(length));
+    return bool(file);
+}
+
+const uint8_t* Snapshot::section(uint32_t type, uint64_t& size) const {
+    if (!valid()) return nullptr;
+    const Header* header = reinterpret_cast<const Header*>(image);
+    const Section* sections = reinterpret_cast<const Section*>(image + sizeof(Header));
+    for (uint32_t index = 0; index < header->sectionCount; index++) {
+        if (sections[index].type == type) {
+            size = sections[index].size;
+            return image + sections[index].offset;
+        }
+    }
+    return nullptr;
+}
+
+/**
+ * Everything restore relies on is checked once here: the header, that
+ * every section lies inside the image, the sizes of the known sections,
+ * and that RAM pages are whole aligned pages of the image
+ */
+bool Snapshot::adopt(std::shared_ptr<void> buffer, uint8_t* bytes, size_t size) {
+    storage.reset();
+    image = nullptr;
+    length = 0;
+    if (size < sizeof(Header) || reinterpret_cast<uintptr_t>(bytes) % alignof(uint64_t) != 0) return false;
+    const Header* header = reinterpret_cast<const Header*>(bytes);
+    if (std::memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0 || header->version > VERSION
+        || header->byteOrder != ORDER_MARK || header->pageSize != PAGE_SIZE || header->size != size
+        || header->sectionCount > (size - sizeof(Header)) / sizeof(Section)) {
+        return false;
+    }
+
+    const Section* sections = reinterpret_cast<const Section*>(bytes + sizeof(Header));
+    const Cpu* savedCpu = nullptr;
+    const RamTable* table = nullptr;
+    for (uint32_t index = 0; index < header->sectionCount; index++) {
+        const Section& entry = sections[index];
+        if (entry.offset > size || entry.size > size - entry.offset || entry.offset % alignof(uint64_t) != 0) return false;
+        if (entry.type == CPU && entry.size >= sizeof(Cpu)) savedCpu = reinterpret_cast<const Cpu*>(bytes + entry.offset);
+        if (entry.type == RAM_TABLE && entry.size >= sizeof(RamTable)) table = reinterpret_cast<const RamTable*>(bytes + entry.offset);
+    }
+    if (!savedCpu || !table) return false;
+    for (uint64_t offset : table->pageOffset) {
+        if (offset % PAGE_SIZE != 0 || offset > size || size - offset < (offset ? PAGE_SIZE : 0)) return false;
+    }
+
+    storage = std::move(buffer);
+    image = bytes;
+    length = size;
+    cpu = savedCpu;
+    ram = table;
+    return true;
+}
+
+/**
+ * setRegisters clears the EI shadow, so the hidden interrupt state is
+ * restored after it. Pages at offset 0 are zero, the header is never shared
+ */
+void Snapshot::restore(Z80& target) const {
+    if (!valid()) return;
+    Z80State& state = target;
+    state.cycles = cpu->cycles;
+    state.setRegisters(Z80Registers{ cpu->af, cpu->bc, cpu->de, cpu->hl,
+        cpu->af_prime, cpu->bc_prime, cpu->de_prime, cpu->hl_prime,
+        cpu->ix, cpu->iy, cpu->sp, cpu->pc, cpu->i, cpu->r,
+        cpu->iff1 != 0, cpu->iff2 != 0, cpu->im, cpu->halted != 0 });
+    state.eiShadow = cpu->eiShadow != 0;
+    state.nmiPending = cpu->nmiPending != 0;
+    state.intLine = cpu->intLine != 0;
+    state.intData = cpu->intData;
+    state.scheduler.clear();
+    state.raiseEvent();
+
+    uint8_t* pages[MemoryMap::PAGE_COUNT];
+    for (int page = 0; page < MemoryMap::PAGE_COUNT; page++) {
+        pages[page] = ram->pageOffset[page] ? image + ram->pageOffset[page] : nullptr;
+    }
+    DirtyBlocks written;
+    for (int index = 0; index < DirtyBlocks::WORD_COUNT; index++) written.setWord(index, ram->writtenBlocks[index]);
+    target.bus().shareRam(storage, pages, written);
+    state.blockCache.invalidateAll();
+}
@@ -0,0 +1,189 @@
+#include "../include/batch.hpp"
+#include <cctype>
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <sstream>
+#include <string>
+
+/**
+* Batch runner command line:
+*
+*   z80_batch [-j threads] [--jit] jobs.txt
+*
+* Every line of the job file is one job, '#' starts a comment:
+*
+*   image.bin  origin  cycles  [register=value ...]
+*
+* The image is loaded at the hex origin and the job runs until HALT or
+* until the decimal cycle budget is used up. Registers (af bc de hl af'
+* bc' de' hl' ix iy sp pc i r im iff) take hex values and default to 0.
+* An image saved by Snapshot::save resumes the saved machine instead,
+* its origin and registers are ignored.
+* As soon as a job finishes, stdout gets the line
+*
+*   job  status  instructions  cycles  af=.. bc=.. de=.. hl=.. ix=.. iy=.. sp=.. pc=..
+*
+* with the job's line number among the jobs, a summary goes to stderr.
+* Images named by several jobs are read once.
+*/
+
+static const char* statusName(RunStatus status) {
+    switch (status) {
+    case RunStatus::Limit: return "limit";
+    case RunStatus::Halted: return "halted";
+    case RunStatus::Breakpoint: return "breakpoint";
+    case RunStatus::Stopped: return "stopped";
+    }
+    return "?";
+}
+
+/**
+* @brief Parse an unsigned number taking up the whole text
+* @return false if the text is empty, has other characters or exceeds max
+*/
+static bool parseNumber(const std::string& text, int base, unsigned long max, unsigned long& value) {
+    if (text.empty() || text[0] == '-' || text[0] == '+' || std::isspace((unsigned char)text[0])) return false;
+    char* end = nullptr;
+    errno = 0;
+    value = std::strtoul(text.c_str(), &end, base);
+    return errno == 0 && *end == '\0' && value <= max;
+}
+
+/**
+* @brief Set a register named in a job line
+* @return false if there is no such register
+*/
+static bool setRegister(Z80Registers& registers, const std::string& name, uint16_t value) {
+    static const std::map<std::string, uint16_t Z80Registers::*> pairs = {
+        { "af", &Z80Registers::af }, { "bc", &Z80Registers::bc }, { "de", &Z80Registers::de }, { "hl", &Z80Registers::hl },
+        { "af'", &Z80Registers::af_prime }, { "bc'", &Z80Registers::bc_prime },
+        { "de'", &Z80Registers::de_prime }, { "hl'", &Z80Registers::hl_prime },
+        { "ix", &Z80Registers::ix }, { "iy", &Z80Registers::iy }, { "sp", &Z80Registers::sp }, { "pc", &Z80Registers::pc }
+    };
+    auto pair = pairs.find(name);
+    if (pair != pairs.end()) registers.*(pair->second) = value;
+    else if (name == "i") registers.i = uint8_t(value);
+    else if (name == "r") registers.r = uint8_t(value);
+    else if (name == "im") registers.im = uint8_t(value);
+    else if (name == "iff") registers.iff1 = registers.iff2 = value != 0;
+    else return false;
+    return true;
+}
+
+/**
+* @brief Parse the job file
+* @return false after printing the first malformed line
+*/
+static bool readJobs(std::istream& input, std::vector<BatchJob>& jobs) {
+    std::map<std::string, std::shared_ptr<const std::vector<uint8_t>>> images;
+    std::map<std::string, std::shared_ptr<const Snapshot>> snapshots;
+    std::string line;
+    for (int number = 1; std::getline(input, line); number++) {
+        line = line.substr(0, line.find('#'));
+        std::istringstream fields(line);
+        std::string path, origin;
+        BatchJob job;
+        if (!(fields >> path)) continue;
+        if (!(fields >> origin >> job.cycleBudget)) {
+            std::cerr << "line " << number << ": expected image, origin and cycle budget\n";
+            return false;
+        }
+        unsigned long address;
+        if (!parseNumber(origin, 16, 0xFFFF, address)) {
+            std::cerr << "line " << number << ": bad origin " << origin << "\n";
+            return false;
+        }
+        job.origin = uint16_t(address);
+
+        auto saved = snapshots.find(path);
+        if (saved == snapshots.end() && !images.count(path)) {
+            auto snapshot = std::make_shared<Snapshot>();
+            if (snapshot->load(path)) saved = snapshots.emplace(path, snapshot).first;
+        }
+        if (saved != snapshots.end()) job.snapshot = saved->second;
+        else {
+            auto& image = images[path];
+            if (!image) {
+                std::ifstream file(path, std::ios::binary);
+                if (!file) {
+                    std::cerr << "line " << number << ": cannot read " << path << "\n";
+                    return false;
+                }
+                image = std::make_shared<const std::vector<uint8_t>>(
+                    std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+            }
+            job.image = image;
+        }
+
+        std::string assignment;
+        while (fields >> assignment) {
+            size_t equals = assignment.find('=');
+            unsigned long value;
+            if (equals == std::string::npos || !parseNumber(assignment.substr(equals + 1), 16, 0xFFFF, value)
+                || !setRegister(job.registers, assignment.substr(0, equals), uint16_t(value))) {
+                std::cerr << "line " << number << ": bad register assignment " << assignment << "\n";
+                return false;
+            }
+        }
+        jobs.push_back(std::move(job));
+    }
+    return true;
+}
+
+int main(int argc, char** argv) {
+    unsigned threads = 0;
+    bool jit = false;
+    std::string path;
+    for (int arg = 1; arg < argc; arg++) {
+        std::string option = argv[arg];
+        if (option == "-j" && arg + 1 < argc) {
+            unsigned long count;
+            if (!parseNumber(argv[++arg], 10, 0xFFFF, count)) {
+                std::cerr << "bad thread count " << argv[arg] << "\n";
+                return 2;
+            }
+            threads = unsigned(count);
+        }
+        else if (option == "--jit") jit = true;
+        else path = option;
+    }
+    if (path.empty()) {
+        std::cerr << "usage: z80_batch [-j threads] [--jit] jobs.txt\n";
+        return 2;
+    }
+
+    std::vector<BatchJob> jobs;
+    std::ifstream file(path);
+    if (!file) {
+        std::cerr << "cannot read " << path << "\n";
+        return 1;
+    }
+    if (!readJobs(file, jobs)) return 1;
+
+    BatchRunner runner(threads, jit);
+    uint64_t instructions = 0;
+    auto start = std::chrono::steady_clock::now();
+    runner.run(jobs, [&instructions](const BatchResult& result) {
+        const Z80Registers& regs = result.registers;
+        char line[160];
+        std::snprintf(line, sizeof(line),
+            "%zu %s %llu %llu af=%04X bc=%04X de=%04X hl=%04X ix=%04X iy=%04X sp=%04X pc=%04X\n",
+            result.job, statusName(result.run.status),
+            (unsigned long long)result.run.instructions, (unsigned long long)result.run.cycles,
+            regs.af, regs.bc, regs.de, regs.hl, regs.ix, regs.iy, regs.sp, regs.pc);
+        std::cout << line;
+        instructions += result.run.instructions;
+    });
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    std::cout.flush();
+
+    std::cerr << jobs.size() << " jobs on " << runner.threadCount() << " threads in " << elapsed.count() << " s, "
+        << instructions / elapsed.count() / 1e6 << " MIPS\n";
+    return 0;
+}
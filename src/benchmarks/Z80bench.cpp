@@ -0,0 +1,511 @@
+#include "../include/batch.hpp"
+#include "../include/cpucore.hpp"
+#include "../include/lockstep.hpp"
+#include "../include/snapshot.hpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <iomanip>
+#include <memory>
+#include <new>
+#include <string>
+#include <thread>
+
+/**
+* @brief Bytes requested from the global operator new, for the instance density table
+*/
+static std::atomic<uint64_t> allocatedBytes{ 0 };
+
+void* operator new(size_t size) {
+    allocatedBytes += size;
+    if (void* memory = std::malloc(size ? size : 1)) return memory;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept { std::free(memory); }
+void operator delete(void* memory, size_t) noexcept { std::free(memory); }
+
+/**
+* @brief Guest workload used by the benchmark
+* @details Every program is an endless loop, so the benchmark
+* decides how many instructions get executed
+*/
+struct Workload {
+    std::string name;
+    std::vector<uint8_t> program;
+};
+
+static const std::vector<Workload> workloads = {
+    // Register-to-register loads and 8-bit ALU operations
+    { "ld/alu", {
+        LD_B_N, 0x00,               // LD B, 0x00
+        LD_C_N, 0x01,               // LD C, 0x01
+        LD_A_B,                     // loop: LD A, B
+        ADD_A_C,                    // ADD A, C
+        LD_C_A,                     // LD C, A
+        XOR_D,                      // XOR D
+        LD_D_A,                     // LD D, A
+        AND_E,                      // AND E
+        OR_H,                       // OR H
+        LD_E_A,                     // LD E, A
+        SUB_L,                      // SUB L
+        LD_L_A,                     // LD L, A
+        ADC_A_B,                    // ADC A, B
+        SBC_A_C,                    // SBC A, C
+        INC_H,                      // INC H
+        DEC_B,                      // DEC B
+        CP_N, 0x10,                 // CP 0x10
+        JP_NN, 0x04, 0x00           // JP loop
+    } },
+    // (HL) and (IX/IY+d) memory operands
+    { "memory", {
+        LD_HL_NN, 0x00, 0x80,                       // LD HL, 0x8000
+        PREFIX_DD, LD_IXY, 0x00, 0x90,              // LD IX, 0x9000
+        PREFIX_FD, LD_IXY, 0x00, 0xA0,              // LD IY, 0xA000
+        LD_A_HL,                                    // loop: LD A, (HL)
+        PREFIX_DD, ADD, 0x01,                       // ADD A, (IX+1)
+        PREFIX_DD, 0x77, 0x02,                      // LD (IX+2), A
+        INC_HL,                                     // INC (HL)
+        PREFIX_FD, 0x46, 0x03,                      // LD B, (IY+3)
+        PREFIX_FD, XOR, 0x02,                       // XOR (IY+2)
+        PREFIX_DD, INC, 0x04,                       // INC (IX+4)
+        LD_HL_B,                                    // LD (HL), B
+        ADD_A_HL,                                   // ADD A, (HL)
+        JR, 0xEB                                    // JR loop
+    } },
+    // Rotates, shifts and bit operations of the 0xCB page
+    { "bits", {
+        LD_HL_NN, 0x00, 0x80,                       // LD HL, 0x8000
+        PREFIX_DD, LD_IXY, 0x00, 0x90,              // LD IX, 0x9000
+        PREFIX_CB, 0x00,                            // loop: RLC B
+        PREFIX_CB, 0x19,                            // RR C
+        PREFIX_CB, 0x22,                            // SLA D
+        PREFIX_CB, 0x3B,                            // SRL E
+        PREFIX_CB, 0x06,                            // RLC (HL)
+        PREFIX_CB, 0x47,                            // BIT 0, A
+        PREFIX_CB, 0xC8,                            // SET 1, B
+        PREFIX_CB, 0x91,                            // RES 2, C
+        PREFIX_DD, PREFIX_CB, 0x01, 0x16,           // RL (IX+1)
+        PREFIX_DD, PREFIX_CB, 0x02, 0x5E,           // BIT 3, (IX+2)
+        JR, 0xE6                                    // JR loop
+    } },
+    // Conditional branches, calls and the stack
+    { "branch", {
+        LD_SP_NN, 0x00, 0xF0,       // LD SP, 0xF000
+        LD_B_N, 0x08,               // loop: LD B, 0x08
+        CALL_NN, 0x0E, 0x00,        // inner: CALL sub
+        DEC_B,                      // DEC B
+        JR_NZ, 0xFA,                // JR NZ, inner
+        JP_NN, 0x03, 0x00,          // JP loop
+        PUSH_BC,                    // sub: PUSH BC
+        INC_A,                      // INC A
+        CP_N, 0x80,                 // CP 0x80
+        POP_BC,                     // POP BC
+        RET                         // RET
+    } },
+};
+
+/**
+* @brief How the benchmark drives the CPU
+*/
+enum class Mode {
+    Single,     // step() per instruction
+    Batched,    // step(count)
+    Blocks,     // step(count) with the block cache enabled
+    Jit         // step(count) with hot blocks translated to host code
+};
+
+/**
+* @brief Device register the workloads never touch
+*/
+struct IdleDevice : MmioDevice {
+    uint8_t value = 0;
+    uint8_t read(uint16_t) override { return value; }
+    void write(uint16_t, uint8_t data) override { value = data; }
+};
+
+/**
+* @brief Run a workload for a fixed number of instructions
+* @param device attach a memory-mapped device to a page the workload does not use
+* @return Executed instructions per second
+*/
+static double measureOnce(const Workload& workload, uint64_t instructions, Mode mode, bool device) {
+    auto cpu = std::make_unique<Z80>();
+    IdleDevice idle;
+    if (device) cpu->addMmioDevice(0xD000, 1, &idle);
+    cpu->enableBlockCache(mode == Mode::Blocks);
+    cpu->enableJit(mode == Mode::Jit);
+    for (uint16_t i = 0; i < (uint16_t)workload.program.size(); i++) {
+        cpu->writeByte(i, workload.program[i]);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    if (mode != Mode::Single) {
+        cpu->step(instructions);
+    }
+    else {
+        for (uint64_t i = 0; i < instructions; i++) {
+            cpu->step();
+        }
+    }
+    auto end = std::chrono::steady_clock::now();
+
+    std::chrono::duration<double> elapsed = end - start;
+    return instructions / elapsed.count();
+}
+
+/**
+* @brief Best of several runs, filters out scheduling noise
+*/
+static double measure(const Workload& workload, uint64_t instructions, Mode mode, bool device = false) {
+    double best = 0;
+    for (int run = 0; run < 3; run++) {
+        best = std::max(best, measureOnce(workload, instructions, mode, device));
+    }
+    return best;
+}
+
+/**
+* @brief Run a workload with step(count) on a CPU of the given bus policy
+* @return Executed instructions per second, best of several runs
+*/
+template<typename Cpu>
+static double measureBus(const Workload& workload, uint64_t instructions) {
+    double best = 0;
+    for (int run = 0; run < 3; run++) {
+        auto cpu = std::make_unique<Cpu>();
+        for (uint16_t i = 0; i < (uint16_t)workload.program.size(); i++) {
+            cpu->writeByte(i, workload.program[i]);
+        }
+        auto start = std::chrono::steady_clock::now();
+        cpu->step(instructions);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::max(best, instructions / elapsed.count());
+    }
+    return best;
+}
+
+/**
+* @brief Memory one CPU takes, the object itself and what it allocates
+* @details Every RAM page is written once, untouched pages share one page of zeroes
+* and would leave the RAM of a guest out of the count
+*/
+static uint64_t instanceBytes() {
+    uint64_t before = allocatedBytes;
+    auto cpu = std::make_unique<Z80>();
+    for (uint32_t addr = 0; addr < 0x10000; addr += MemoryMap::PAGE_SIZE) cpu->writeByte(uint16_t(addr), 0xFF);
+    return sizeof(Z80) + (allocatedBytes - before);
+}
+
+/**
+* @brief Run a workload on many CPUs in turn, a short slice each
+* @param count number of CPUs, 1 measures the slices without switching
+* @param slice instructions per turn
+* @return Executed instructions per second
+*/
+static double measureSwitching(const Workload& workload, uint64_t instructions, size_t count, uint64_t slice) {
+    std::vector<std::unique_ptr<Z80>> cpus;
+    for (size_t i = 0; i < count; i++) {
+        cpus.push_back(std::make_unique<Z80>());
+        for (uint16_t j = 0; j < (uint16_t)workload.program.size(); j++) cpus.back()->writeByte(j, workload.program[j]);
+    }
+    double best = 0;
+    for (int run = 0; run < 3; run++) {
+        uint64_t turns = instructions / slice;
+        auto start = std::chrono::steady_clock::now();
+        for (uint64_t turn = 0; turn < turns; turn++) cpus[turn % count]->step(slice);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::max(best, turns * slice / elapsed.count());
+    }
+    return best;
+}
+
+/**
+* @brief Run a batch of equal jobs, each a workload cut off after a cycle budget
+* @return Jobs per second
+*/
+static double measureBatch(const Workload& workload, unsigned threads, size_t count, uint64_t budget) {
+    auto image = std::make_shared<const std::vector<uint8_t>>(workload.program);
+    std::vector<BatchJob> jobs(count);
+    for (BatchJob& job : jobs) {
+        job.image = image;
+        job.cycleBudget = budget;
+    }
+    BatchRunner runner(threads);
+    double best = 0;
+    for (int run = 0; run < 3; run++) {
+        auto start = std::chrono::steady_clock::now();
+        runner.run(jobs, [](const BatchResult&) {});
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::max(best, count / elapsed.count());
+    }
+    return best;
+}
+
+/**
+* @brief Run a workload on every lane of a lock-step group, or on as many scalar CPUs one after the other
+* @details Lanes start with different A and C, so only the data differs
+* @return Executed instructions per second, all lanes together
+*/
+static double measureLockstep(const Workload& workload, uint64_t instructions, bool lockstep) {
+    constexpr int LANES = LockstepGroup::LANES;
+    uint64_t budget = std::max<uint64_t>(instructions / LANES * 4, 1000);
+    double best = 0;
+    for (int run = 0; run < 3; run++) {
+        LockstepGroup group(LANES);
+        std::vector<std::unique_ptr<Z80>> cpus;
+        group.load(0, workload.program.data(), workload.program.size());
+        for (int lane = 0; lane < LANES; lane++) {
+            Z80Registers registers{};
+            registers.af = uint16_t(lane << 8);
+            registers.bc = uint16_t(lane * 3);
+            group.setRegisters(lane, registers);
+            cpus.push_back(std::make_unique<Z80>());
+            for (uint16_t i = 0; i < (uint16_t)workload.program.size(); i++) cpus.back()->writeByte(i, workload.program[i]);
+            cpus.back()->setRegisters(registers);
+        }
+        uint64_t executed = 0;
+        auto start = std::chrono::steady_clock::now();
+        if (lockstep) {
+            group.runCycles(budget);
+            for (int lane = 0; lane < LANES; lane++) executed += group.result(lane).instructions;
+        }
+        else {
+            for (auto& cpu : cpus) executed += cpu->runCycles(budget).instructions;
+        }
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::max(best, executed / elapsed.count());
+    }
+    return best;
+}
+
+/**
+* @brief Time reset() of a CPU whose RAM was written before each call
+* @param blocks 256-byte blocks written between resets
+* @return Nanoseconds per reset
+*/
+static double measureReset(int blocks, uint64_t resets) {
+    auto cpu = std::make_unique<Z80>();
+    std::vector<uint8_t> data(DirtyBlocks::BLOCK_SIZE, 0x5A);
+    std::chrono::duration<double> elapsed{ 0 };
+    for (uint64_t i = 0; i < resets; i++) {
+        for (int block = 0; block < blocks; block++) {
+            cpu->loadImage(uint16_t(block * 0x10000 / blocks), data);
+        }
+        auto start = std::chrono::steady_clock::now();
+        cpu->reset();
+        elapsed += std::chrono::steady_clock::now() - start;
+    }
+    return elapsed.count() / resets * 1e9;
+}
+
+/**
+* @brief Branch a machine with all 64KB written, by fork() or by copying it
+* @param pages 4KB pages each branch writes to before it is dropped
+* @param kilobytes set to the memory held by one branch after its writes
+* @return Nanoseconds per branch, creation and writes included
+*/
+static double measureBranch(bool useFork, int pages, uint64_t branches, double& kilobytes) {
+    auto parent = std::make_unique<Z80>();
+    parent->loadImage(0, std::vector<uint8_t>(0x10000, 0x5A));
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < branches; i++) {
+        auto branch = std::make_unique<Z80>(useFork ? parent->fork() : Z80(*parent));
+        for (int page = 0; page < pages; page++) branch->writeByte(uint16_t(page * MemoryMap::PAGE_SIZE), uint8_t(i));
+        int owned = MemoryMap::PAGE_COUNT - branch->bus().sharedPages();
+        kilobytes = (sizeof(Z80) + owned * MemoryMap::PAGE_SIZE) / 1024.0;
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / branches * 1e9;
+}
+
+/**
+* @brief Save and restore a machine with every page of RAM written
+* @param restoreTime set to nanoseconds per restore into a recycled CPU
+* @return Nanoseconds per capture
+*/
+static double measureSnapshot(uint64_t rounds, double& restoreTime) {
+    auto cpu = std::make_unique<Z80>();
+    cpu->loadImage(0, std::vector<uint8_t>(0x10000, 0x5A));
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < rounds; i++) Snapshot capture(*cpu);
+    std::chrono::duration<double> captureElapsed = std::chrono::steady_clock::now() - start;
+
+    Snapshot snapshot(*cpu);
+    auto target = std::make_unique<Z80>();
+    start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < rounds; i++) snapshot.restore(*target);
+    std::chrono::duration<double> restoreElapsed = std::chrono::steady_clock::now() - start;
+    restoreTime = restoreElapsed.count() / rounds * 1e9;
+    return captureElapsed.count() / rounds * 1e9;
+}
+
+/**
+* @brief Copy 16KB with LDIR over and over
+* @return Guest bytes copied per second
+*/
+static double measureCopy(uint64_t copies) {
+    const std::vector<uint8_t> program = {
+        LD_HL_NN, 0x00, 0x40,       // loop: LD HL, 0x4000
+        LD_DE_NN, 0x00, 0x80,       // LD DE, 0x8000
+        LD_BC_NN, 0x00, 0x40,       // LD BC, 0x4000
+        PREFIX_ED, LDIR,            // LDIR
+        JR, 0xF3                    // JR loop
+    };
+    double best = 0;
+    for (int run = 0; run < 3; run++) {
+        auto cpu = std::make_unique<Z80>();
+        for (uint16_t i = 0; i < (uint16_t)program.size(); i++) cpu->writeByte(i, program[i]);
+        auto start = std::chrono::steady_clock::now();
+        cpu->step(copies * 5);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        best = std::max(best, copies * 0x4000 / elapsed.count());
+    }
+    return best;
+}
+
+int main(int argc, char** argv) {
+    uint64_t instructions = argc > 1 ? std::stoull(argv[1]) : 100000000;
+
+#ifdef Z80_THREADED_CORE
+    std::cout << "Engine: threaded\n";
+#else
+    std::cout << "Engine: table\n";
+#endif
+    std::cout << "Instructions per workload: " << instructions << "\n\n";
+    std::cout << std::left << std::setw(10) << "workload"
+        << std::right << std::setw(16) << "step()" << std::setw(16) << "step(count)" << std::setw(16) << "block cache"
+        << std::setw(16) << (Jit::supported() ? "jit" : "jit (n/a)") << "\n";
+    for (const Workload& workload : workloads) {
+        double single = measure(workload, instructions, Mode::Single);
+        double batched = measure(workload, instructions, Mode::Batched);
+        double blocks = measure(workload, instructions, Mode::Blocks);
+        double jit = measure(workload, instructions, Mode::Jit);
+        std::cout << std::left << std::setw(10) << workload.name
+            << std::right << std::fixed << std::setprecision(1)
+            << std::setw(11) << single / 1e6 << " MIPS"
+            << std::setw(11) << batched / 1e6 << " MIPS"
+            << std::setw(11) << blocks / 1e6 << " MIPS"
+            << std::setw(11) << jit / 1e6 << " MIPS\n";
+    }
+
+    // Memory accesses to RAM pages must not slow down once a device is mapped elsewhere
+    std::cout << "\nMMIO device on an unused page, step(count)\n";
+    std::cout << std::left << std::setw(10) << "workload"
+        << std::right << std::setw(16) << "no device" << std::setw(16) << "device" << std::setw(16) << "overhead" << "\n";
+    for (const Workload& workload : workloads) {
+        double plain = measure(workload, instructions, Mode::Batched);
+        double mapped = measure(workload, instructions, Mode::Batched, true);
+        std::cout << std::left << std::setw(10) << workload.name
+            << std::right << std::fixed << std::setprecision(1)
+            << std::setw(11) << plain / 1e6 << " MIPS"
+            << std::setw(11) << mapped / 1e6 << " MIPS"
+            << std::setw(14) << (plain / mapped - 1) * 100 << " %\n";
+    }
+
+    // The bus is a template parameter, the flat bus drops the page lookup from every access
+    std::cout << "\nBus policy, step(count)\n";
+    std::cout << std::left << std::setw(10) << "workload"
+        << std::right << std::setw(16) << "paged" << std::setw(16) << "flat" << std::setw(16) << "speedup" << "\n";
+    for (const Workload& workload : workloads) {
+        double paged = measureBus<Z80>(workload, instructions);
+        double flat = measureBus<Z80Flat>(workload, instructions);
+        std::cout << std::left << std::setw(10) << workload.name
+            << std::right << std::fixed << std::setprecision(1)
+            << std::setw(11) << paged / 1e6 << " MIPS"
+            << std::setw(11) << flat / 1e6 << " MIPS"
+            << std::setw(14) << (flat / paged - 1) * 100 << " %\n";
+    }
+
+    // Registers share one cache line, memory lives on the heap
+    uint64_t bytes = instanceBytes();
+    std::cout << "\nInstances, " << sizeof(Z80) << " bytes per object + "
+        << bytes - sizeof(Z80) << " bytes allocated\n";
+    std::cout << std::fixed << std::setprecision(0) << std::setw(11) << double(1ull << 30) / bytes << " per GB\n";
+
+    // Round robin over many CPUs against one CPU stepped in the same slices
+    const size_t instances = 1024;
+    const uint64_t slice = 64;
+    std::cout << "\nSwitching between " << instances << " CPUs every " << slice << " instructions, step(count)\n";
+    std::cout << std::left << std::setw(10) << "workload"
+        << std::right << std::setw(16) << "one CPU" << std::setw(16) << "switching" << std::setw(16) << "per switch" << "\n";
+    for (const Workload& workload : workloads) {
+        double one = measureSwitching(workload, instructions, 1, slice);
+        double many = measureSwitching(workload, instructions, instances, slice);
+        std::cout << std::left << std::setw(10) << workload.name
+            << std::right << std::fixed << std::setprecision(1)
+            << std::setw(11) << one / 1e6 << " MIPS"
+            << std::setw(11) << many / 1e6 << " MIPS"
+            << std::setw(13) << (slice / many - slice / one) * 1e9 << " ns\n";
+    }
+
+    // Independent jobs spread over the cores by the work-stealing batch runner
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    const size_t jobCount = 512;
+    const uint64_t budget = std::max<uint64_t>(instructions * 4 / jobCount, 1000);
+    std::cout << "\nBatch runner, " << jobCount << " ld/alu jobs of " << budget << " T-states, "
+        << cores << " hardware threads\n";
+    std::cout << std::left << std::setw(10) << "threads"
+        << std::right << std::setw(16) << "jobs/s" << std::setw(16) << "speedup" << "\n";
+    std::vector<unsigned> threadCounts;
+    for (unsigned threads = 1; threads < cores; threads *= 2) threadCounts.push_back(threads);
+    threadCounts.push_back(cores);
+    double single = 0;
+    for (unsigned threads : threadCounts) {
+        double rate = measureBatch(workloads[0], threads, jobCount, budget);
+        if (threads == 1) single = rate;
+        std::cout << std::left << std::setw(10) << threads
+            << std::right << std::fixed << std::setprecision(1)
+            << std::setw(16) << rate << std::setw(15) << rate / single << "x\n";
+    }
+
+    // Same program on 32 CPUs, lanes of one group against scalar runs.
+    // Prefixed opcodes peel every lane, memory and bits fall back to scalar
+    std::cout << "\nLock-step, " << LockstepGroup::LANES << " CPUs, runCycles\n";
+    std::cout << std::left << std::setw(10) << "workload"
+        << std::right << std::setw(16) << "scalar" << std::setw(16) << "lock-step" << std::setw(16) << "speedup" << "\n";
+    for (const Workload& workload : workloads) {
+        double scalar = measureLockstep(workload, instructions, false);
+        double lanes = measureLockstep(workload, instructions, true);
+        std::cout << std::left << std::setw(10) << workload.name
+            << std::right << std::fixed << std::setprecision(1)
+            << std::setw(11) << scalar / 1e6 << " MIPS"
+            << std::setw(11) << lanes / 1e6 << " MIPS"
+            << std::setw(14) << (lanes / scalar - 1) * 100 << " %\n";
+    }
+
+    // reset() zeroes only the blocks written since the last one
+    std::cout << "\nreset() after writing\n";
+    for (int blocks : { 0, 4, 32, DirtyBlocks::BLOCK_COUNT }) {
+        std::cout << std::left << std::setw(10) << (std::to_string(blocks * DirtyBlocks::BLOCK_SIZE / 1024.0).substr(0, 4) + " KB")
+            << std::right << std::fixed << std::setprecision(1)
+            << std::setw(13) << measureReset(blocks, 20000) << " ns\n";
+    }
+
+    // A fork shares the RAM until a branch writes to it, a copy duplicates it
+    std::cout << "\nBranches of a machine with 64KB written\n";
+    std::cout << std::left << std::setw(14) << "pages written" << std::right
+        << std::setw(14) << "fork" << std::setw(14) << "copy" << std::setw(14) << "fork memory" << std::setw(14) << "copy memory" << "\n";
+    for (int pages : { 0, 1, 4, MemoryMap::PAGE_COUNT }) {
+        double forkMemory = 0, copyMemory = 0;
+        double forkTime = measureBranch(true, pages, 20000, forkMemory);
+        double copyTime = measureBranch(false, pages, 20000, copyMemory);
+        std::cout << std::left << std::setw(14) << pages << std::right << std::fixed << std::setprecision(1)
+            << std::setw(11) << forkTime << " ns" << std::setw(11) << copyTime << " ns"
+            << std::setw(11) << forkMemory << " KB" << std::setw(11) << copyMemory << " KB\n";
+    }
+
+    // Restoring shares the image's pages instead of copying them
+    double restoreTime = 0;
+    double captureTime = measureSnapshot(20000, restoreTime);
+    std::cout << "\nSnapshot of a machine with 64KB written\n" << std::fixed << std::setprecision(1)
+        << std::left << std::setw(10) << "capture" << std::right << std::setw(13) << captureTime << " ns\n"
+        << std::left << std::setw(10) << "restore" << std::right << std::setw(13) << restoreTime << " ns\n";
+
+    // Repeating block copies run as host memory moves
+    std::cout << "\nLDIR, 16KB per copy\n";
+    std::cout << std::fixed << std::setprecision(1)
+        << std::setw(11) << measureCopy(std::max<uint64_t>(instructions / 1000, 1)) / 1e6 << " MB/s\n";
+    return 0;
+}
@@ -0,0 +1,95 @@
+#ifndef BATCH_HPP
+#define BATCH_HPP
+
+#include "cpu.hpp"
+#include "snapshot.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+/**
+* @brief Guest program run by the batch runner
+*/
+struct BatchJob {
+    std::shared_ptr<const std::vector<uint8_t>> image; // loaded at origin, jobs of the same program share it
+    uint16_t origin = 0;
+    Z80Registers registers{};   // state the job starts from, all zero is the reset state
+    uint64_t cycleBudget = UINT64_MAX;  // T-states after which the job is cut off, by default it runs until HALT
+    std::shared_ptr<const Snapshot> snapshot;   // if set, the job resumes from it instead of image and registers
+};
+
+/**
+* @brief Outcome of one job
+*/
+struct BatchResult {
+    size_t job;                 // index of the job in the batch
+    RunResult run;              // why the job ended, executed instructions and T-states
+    Z80Registers registers;     // state the job ended in
+};
+
+/**
+* @class BatchRunner
+* @brief Runs many independent jobs across all cores
+*
+* Every worker owns a range of job indices and takes jobs from its front,
+* a worker running out of jobs steals the back half of the largest range
+* left. Each worker keeps one CPU for all its jobs and batches, between
+* jobs it is only reset, never constructed again.
+*/
+class BatchRunner {
+public:
+    using ResultHandler = std::function<void(const BatchResult&)>;
+
+    /**
+    * @param threads number of workers, 0 uses every hardware thread
+    * @param jit translate hot blocks, pays off for long jobs
+    */
+    explicit BatchRunner(unsigned threads = 0, bool jit = false);
+    ~BatchRunner();
+
+    /**
+    * @brief Run every job and report each result as soon as it is known
+    * @param onResult called from the workers, one call at a time, in completion order
+    */
+    void run(const std::vector<BatchJob>& jobs, const ResultHandler& onResult);
+
+    unsigned threadCount() const { return unsigned(workers.size()); }
+
+private:
+    struct Worker {
+        std::mutex lock;        // guards begin and end
+        size_t begin = 0;       // jobs [begin, end) not taken yet
+        size_t end = 0;
+        std::unique_ptr<Z80> cpu;
+    };
+
+    /**
+    * @brief Job loop of one worker, returns when no job is left anywhere
+    */
+    void work(size_t index, const std::vector<BatchJob>& jobs, const ResultHandler& onResult);
+
+    /**
+    * @brief Take the next job of a worker's own range
+    * @return false if the range is empty
+    */
+    bool take(Worker& worker, size_t& job);
+
+    /**
+    * @brief Move the back half of the largest other range to a worker
+    * @return false if every range is empty
+    */
+    bool steal(size_t thief);
+
+    /**
+    * @brief Run a job on a worker's CPU
+    */
+    BatchResult execute(Z80& cpu, const BatchJob& job, size_t index);
+
+    std::vector<std::unique_ptr<Worker>> workers;
+    std::mutex resultLock;      // serializes onResult
+};
+
+#endif
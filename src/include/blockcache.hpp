@@ -0,0 +1,140 @@
+#ifndef BLOCKCACHE_HPP
+#define BLOCKCACHE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+class Z80State;
+class Jit;
+
+/**
+* @brief Instruction decoded once, with its operands extracted from memory
+*/
+struct DecodedOp {
+    void (*handler)(Z80State&, const DecodedOp&);
+    uint16_t next;          // PC after the instruction
+    uint16_t operand;       // immediate byte/word or branch target
+    int8_t displacement;    // IX/IY displacement
+    uint8_t prefix;         // 0xDD/0xFD or 0 for unprefixed instructions
+    uint8_t opcode;         // opcode following the prefix
+};
+
+/**
+* @brief Straight-line run of instructions ending with a branch
+*/
+struct Block {
+    uint16_t start;         // address of the first instruction
+    uint16_t end;           // address after the last instruction
+    uint32_t startGen;      // generation of the page holding start
+    uint32_t endGen;        // generation of the page holding end - 1
+    uint32_t execCount = 0; // executions, decides when the JIT translates it
+    std::vector<DecodedOp> ops;
+};
+
+/**
+* @brief Block cache counters
+*/
+struct BlockCacheStats {
+    uint64_t hits = 0;          // lookups served by a valid block
+    uint64_t misses = 0;        // lookups that had to decode a block
+    uint64_t invalidations = 0; // writes that invalidated a page holding code
+    uint64_t translations = 0;  // blocks translated to host code
+};
+
+/**
+* @class BlockCache
+* @brief Decoded basic blocks keyed by their start address
+*
+* Memory is split into 256-byte pages with a generation counter each.
+* A block remembers the generations of the pages it was decoded from,
+* a write to a page holding code bumps its generation and so invalidates
+* every block decoded from it.
+*/
+class BlockCache {
+public:
+    static constexpr int PAGE_SHIFT = 8;
+    static constexpr int PAGE_COUNT = 0x10000 >> PAGE_SHIFT;
+    static constexpr size_t MAX_BLOCK_OPS = 32;
+
+    BlockCache();
+    ~BlockCache();
+
+    /**
+    * @brief Copies start with an empty cache, blocks belong to the memory they were decoded from
+    */
+    BlockCache(const BlockCache& other);
+    BlockCache& operator=(const BlockCache& other);
+
+    /**
+    * @brief Allocate or release the cache storage
+    */
+    void setEnabled(bool enable);
+    bool enabled() const { return !blocks.empty(); }
+
+    /**
+    * @brief Create or drop the JIT translating hot blocks
+    * @details Enabling the JIT enables the cache as well
+    * @return whether the JIT is active
+    */
+    bool setJitEnabled(bool enable, uint32_t hotThreshold);
+    Jit* jit() const { return translator.get(); }
+
+    /**
+    * @brief Find a valid block starting at pc
+    * @return block or nullptr if it needs to be decoded
+    */
+    Block* lookup(uint16_t pc);
+
+    /**
+    * @brief Store a freshly decoded block
+    * @details Stamps the block with the current page generations
+    */
+    Block* insert(Block&& block);
+
+    /**
+    * @brief Memory write notification
+    * @param addr written address
+    */
+    void onWrite(uint16_t addr) {
+        if (!codePages.empty() && codePages[addr >> PAGE_SHIFT]) {
+            invalidatePage(addr >> PAGE_SHIFT);
+        }
+    }
+
+    /**
+    * @brief Notification of a bulk write to [start, start + size)
+    */
+    void onWrite(uint16_t start, uint32_t size) { onRemap(start, size); }
+
+    /**
+    * @brief Memory mapping change notification
+    * @details Invalidates the pages holding code in [start, start + size)
+    */
+    void onRemap(uint16_t start, uint32_t size);
+
+    /**
+    * @brief Invalidate every cached block
+    */
+    void invalidateAll();
+
+    /**
+    * @brief Whether the running block has to be left after the current instruction
+    * @details Set when a write invalidated code, so the executor abandons
+    * a block that modified itself, and when the CPU raises an interrupt event
+    */
+    bool exitBlock = false;
+
+    const BlockCacheStats& stats() const { return counters; }
+
+private:
+    void invalidatePage(int page);
+
+    std::vector<std::unique_ptr<Block>> blocks;     // indexed by start address
+    std::vector<uint32_t> pageGen;                  // generation per page
+    std::vector<uint8_t> codePages;                 // page holds a valid block
+    BlockCacheStats counters;
+    std::unique_ptr<Jit> translator;                // JIT of hot blocks, optional
+};
+
+#endif
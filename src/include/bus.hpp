@@ -0,0 +1,194 @@
+#ifndef BUS_HPP
+#define BUS_HPP
+
+#include <cstdint>
+#include <cstring>
+#include <memory>
+
+/**
+* Bus policies of Z80Core
+*
+* The CPU holds its bus as a plain member and calls it without virtual
+* dispatch, so every fetch and store inlines into the handlers. A bus provides:
+*
+*   uint8_t read(uint16_t addr) const
+*   void write(uint16_t addr, uint8_t value)
+*   const uint8_t* readPointer(uint16_t addr) const
+*   uint8_t* writePointer(uint16_t addr, uint32_t size)
+*       host memory behind addr, valid to the end of its 4KB page,
+*       nullptr makes block transfers go through read/write byte by byte.
+*       The caller writes at most size bytes through a write pointer
+*   bool devicePage(int page) const
+*       whether reading the 4KB page may have side effects,
+*       polling loops reading such pages are never skipped
+*   void clearRam()
+*       zero the RAM, only the blocks written since the last clear
+*
+* MemoryMap (memorymap.hpp) is the paged bus with memory-mapped devices.
+*/
+
+/**
+* @class DirtyBlocks
+* @brief Bitmap of the 256-byte blocks of RAM written since the last clear
+* @details A CPU recycled for short jobs touches a few blocks per job,
+* clearing only those makes reset() cost about as much as the job wrote
+*/
+class DirtyBlocks {
+public:
+    static constexpr int BLOCK_SHIFT = 8;
+    static constexpr uint32_t BLOCK_SIZE = 1 << BLOCK_SHIFT;
+    static constexpr int BLOCK_COUNT = 0x10000 >> BLOCK_SHIFT;
+    static constexpr int WORD_COUNT = BLOCK_COUNT / 64;
+
+    void mark(uint16_t addr) { bits[addr >> 14] |= uint64_t(1) << ((addr >> BLOCK_SHIFT) & 63); }
+
+    /**
+    * @brief Mark [addr, addr + size), size > 0, without wrapping past 0xFFFF
+    */
+    void mark(uint16_t addr, uint32_t size) {
+        for (uint32_t block = addr >> BLOCK_SHIFT; block <= (addr + size - 1) >> BLOCK_SHIFT; block++) {
+            bits[block >> 6] |= uint64_t(1) << (block & 63);
+        }
+    }
+
+    bool dirty(int block) const { return (bits[block >> 6] >> (block & 63)) & 1; }
+
+    /**
+    * @brief Whether a block of [start, start + size) is dirty, both multiples of BLOCK_SIZE
+    */
+    bool any(uint32_t start, uint32_t size) const {
+        for (uint32_t block = start >> BLOCK_SHIFT; block < (start + size) >> BLOCK_SHIFT; block++) {
+            if (bits[block >> 6] == 0) block |= 63;
+            else if (dirty(int(block))) return true;
+        }
+        return false;
+    }
+
+    /**
+    * @brief Zero the dirty blocks of 64KB of RAM, runs of blocks with one memset each
+    */
+    void clear(uint8_t* ram) { clear(ram, 0, 0x10000); }
+
+    /**
+    * @brief Zero the dirty blocks of [start, start + size), both multiples of BLOCK_SIZE
+    * @param memory the bytes of the range, memory[0] holds address start
+    */
+    void clear(uint8_t* memory, uint32_t start, uint32_t size) {
+        int first = int(start >> BLOCK_SHIFT);
+        int last = int((start + size) >> BLOCK_SHIFT);
+        for (int block = first; block < last; block++) {
+            if (bits[block >> 6] == 0) {
+                block |= 63;
+                continue;
+            }
+            if (!dirty(block)) continue;
+            int end = block + 1;
+            while (end < last && dirty(end)) end++;
+            std::memset(memory + ((block - first) << BLOCK_SHIFT), 0, size_t(end - block) << BLOCK_SHIFT);
+            block = end;
+        }
+        forget(start, size);
+    }
+
+    /**
+    * @brief Unmark [start, start + size) without touching memory, for RAM replaced by zeroes
+    */
+    void forget(uint32_t start, uint32_t size) {
+        uint32_t last = (start + size) >> BLOCK_SHIFT;
+        for (uint32_t block = start >> BLOCK_SHIFT; block < last; ) {
+            if ((block & 63) == 0 && block + 64 <= last) {
+                bits[block >> 6] = 0;
+                block += 64;
+            }
+            else {
+                bits[block >> 6] &= ~(uint64_t(1) << (block & 63));
+                block++;
+            }
+        }
+    }
+
+    /**
+    * @brief The bitmap as 64-bit words, block b is bit b % 64 of word b / 64
+    */
+    uint64_t word(int index) const { return bits[index]; }
+    void setWord(int index, uint64_t value) { bits[index] = value; }
+
+    int count() const {
+        int dirtyCount = 0;
+        for (uint64_t word : bits) {
+            for (; word != 0; word &= word - 1) dirtyCount++;
+        }
+        return dirtyCount;
+    }
+
+private:
+    uint64_t bits[WORD_COUNT] = {};
+};
+
+/**
+* @class FlatBus
+* @brief 64KB of RAM and nothing else
+* @details The RAM is allocated apart from the bus, copies get their own
+*/
+class FlatBus {
+public:
+    FlatBus() : ram(new uint8_t[SIZE]()) {}
+    FlatBus(const FlatBus& other) : ram(new uint8_t[SIZE]), dirty(other.dirty) { std::memcpy(ram.get(), other.ram.get(), SIZE); }
+    FlatBus& operator=(const FlatBus& other) {
+        std::memcpy(ram.get(), other.ram.get(), SIZE);
+        dirty = other.dirty;
+        return *this;
+    }
+
+    uint8_t read(uint16_t addr) const { return ram[addr]; }
+    void write(uint16_t addr, uint8_t value) {
+        ram[addr] = value;
+        dirty.mark(addr);
+    }
+    const uint8_t* readPointer(uint16_t addr) const { return ram.get() + addr; }
+    uint8_t* writePointer(uint16_t addr, uint32_t size) {
+        dirty.mark(addr, size);
+        return ram.get() + addr;
+    }
+    bool devicePage(int) const { return false; }
+    void clearRam() { dirty.clear(ram.get()); }
+    int dirtyBlocks() const { return dirty.count(); }
+
+private:
+    static constexpr uint32_t SIZE = 0x10000;
+
+    std::unique_ptr<uint8_t[]> ram;
+    DirtyBlocks dirty;
+};
+
+/**
+* @class TracingBus
+* @brief Bus reporting every access to a tracer before passing it on
+* @tparam Inner bus the accesses go to
+* @tparam Tracer type with onRead(addr, value) and onWrite(addr, value)
+* @details No host pointers are handed out and every page counts as a
+* device page, so block transfers and skipped polling loops still show
+* up access by access
+*/
+template<typename Inner, typename Tracer>
+class TracingBus : public Inner {
+public:
+    uint8_t read(uint16_t addr) const {
+        uint8_t value = Inner::read(addr);
+        tracer.onRead(addr, value);
+        return value;
+    }
+
+    void write(uint16_t addr, uint8_t value) {
+        tracer.onWrite(addr, value);
+        Inner::write(addr, value);
+    }
+
+    const uint8_t* readPointer(uint16_t) const { return nullptr; }
+    uint8_t* writePointer(uint16_t, uint32_t) { return nullptr; }
+    bool devicePage(int) const { return true; }
+
+    mutable Tracer tracer;
+};
+
+#endif
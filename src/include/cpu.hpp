@@ -1,67 +1,170 @@
 #ifndef CPU_HPP
 #define CPU_HPP
 
+#include "blockcache.hpp"
+#include "bus.hpp"
+#include "iobus.hpp"
+#include "jit.hpp"
+#include "memorymap.hpp"
 #include "opcodes.hpp"
+#include "scheduler.hpp"
 #include <cstdint>
 #include <cstring>
 #include <array>
+#include <atomic>
 #include <iostream>
+#include <utility>
 #include <vector>
 
 /**
-* @class Z80
-* @brief Zilog Z80 CPU emulator.
-* 
-* Emulates the functionality of core instructions of a Z80
-* processor, including data transfer, branching, arithmetics, logic and stack operations.
+* Host byte order, decides how the bytes of a register pair are laid out.
+* Detected from the compiler, can be set to 0/1 when building for an unknown host
 */
-class Z80 {
-private:
+#ifndef Z80_BIG_ENDIAN
+#if defined(__BYTE_ORDER__)
+#define Z80_BIG_ENDIAN (__BYTE_ORDER__ == __ORDER_BIG_ENDIAN__)
+#elif defined(_MSC_VER)
+#define Z80_BIG_ENDIAN 0
+#else
+#error "Unknown host byte order, define Z80_BIG_ENDIAN to 0 or 1"
+#endif
+#endif
 
-    // Registers
-    union {
-        struct { uint8_t f, a; };
-        uint16_t af;
-    };
-    union {
-        struct { uint8_t c, b; };
-        uint16_t bc;
-    };
-    union {
-        struct { uint8_t e, d; };
-        uint16_t de;
-    };
-    union {
-        struct { uint8_t l, h; };
-        uint16_t hl;
-    };
-    union {
-        struct { uint8_t f_prime, a_prime; };
-        uint16_t af_prime;
-    };
-    union {
-        struct { uint8_t c_prime, b_prime; };
-        uint16_t bc_prime;
-    };
-    union {
-        struct { uint8_t e_prime, d_prime; };
-        uint16_t de_prime;
+/**
+* @brief 16-bit register pair whose high and low bytes are registers of their own
+*/
+#if Z80_BIG_ENDIAN
+#define Z80_REGISTER_PAIR(hi, lo, pair) union { struct { uint8_t hi, lo; }; uint16_t pair; }
+#else
+#define Z80_REGISTER_PAIR(hi, lo, pair) union { struct { uint8_t lo, hi; }; uint16_t pair; }
+#endif
+
+/**
+* @brief Reason a call to Z80::run returned
+*/
+enum class RunStatus {
+    Limit,          // the instruction or cycle limit was reached
+    Halted,         // the CPU executed HALT
+    Breakpoint,     // PC reached a breakpoint, its instruction was not executed
+    Stopped         // requestStop() was called
+};
+
+/**
+* @brief Outcome of Z80::run
+*/
+struct RunResult {
+    RunStatus status;
+    uint64_t instructions;  // executed instructions
+    uint64_t cycles;        // T-states of the executed instructions
+};
+
+/**
+* @brief Programmer-visible registers, to set up a run and read its outcome
+*/
+struct Z80Registers {
+    uint16_t af, bc, de, hl;
+    uint16_t af_prime, bc_prime, de_prime, hl_prime;
+    uint16_t ix, iy, sp, pc;
+    uint8_t i, r;
+    bool iff1, iff2;
+    uint8_t im;
+    bool halted;
+};
+
+/**
+* @brief Registers and the fields the engines touch on every instruction
+* @details Fills exactly one cache line at the start of every CPU, everything
+* larger comes after it or lives on the heap. Switching between many CPUs
+* then pulls in one line of state per CPU.
+*/
+struct alignas(64) Z80HotState {
+    /**
+    * @brief ALU operation whose flags have not been written to F yet
+    * @details Only used in lazy flags mode (Z80_LAZY_FLAGS)
+    */
+    enum class FlagOp : uint8_t {
+        None,   // F is up to date
+        Add,    // ADD/ADC: flagX = A before, flagY = operand
+        Sub,    // SUB/SBC/CP: flagX = A before, flagY = operand
+        And,    // AND: flagX = result
+        Or,     // OR/XOR: flagX = result
+        Inc,    // INC: flagX = old value, F holds the preserved flags
+        Dec     // DEC: flagX = old value, F holds the preserved flags
     };
+
+    // Registers
+    // B, C, D, E, H, L, A and F are the bytes of the pairs BC, DE, HL, AF,
+    // regs[regIndex(code)] addresses them by the 3-bit code of an opcode
     union {
-        struct { uint8_t l_prime, h_prime; };
-        uint16_t hl_prime;
+        uint8_t regs[8];
+        struct {
+            Z80_REGISTER_PAIR(b, c, bc);
+            Z80_REGISTER_PAIR(d, e, de);
+            Z80_REGISTER_PAIR(h, l, hl);
+            Z80_REGISTER_PAIR(a, f, af);
+        };
     };
-    bool halted;
-    uint16_t pc; // Program Counter
+    Z80_REGISTER_PAIR(ixh, ixl, ix); // Index Register X
+    Z80_REGISTER_PAIR(iyh, iyl, iy); // Index Register Y
     uint16_t sp; // Stack Pointer
-    uint16_t ix; // Index Register X
-    uint16_t iy; // Index Register Y
-    uint8_t memory[65536]; // 64KB Memory
+    uint16_t pc; // Program Counter
+    uint64_t cycles; // T-states executed since reset
+
+    /**
+    * Interrupt lines are looked at only after an event was raised.
+    * Raising one also drops runLimit to 0, the limit every engine loop
+    * already compares against, so the engines return at the next
+    * instruction boundary without a per-instruction interrupt check
+    */
+    uint64_t runLimit;
+
+    Z80_REGISTER_PAIR(a_prime, f_prime, af_prime);
+    Z80_REGISTER_PAIR(b_prime, c_prime, bc_prime);
+    Z80_REGISTER_PAIR(d_prime, e_prime, de_prime);
+    Z80_REGISTER_PAIR(h_prime, l_prime, hl_prime);
+
+    // Interrupts
+    uint8_t i; // Interrupt vector base
+    uint8_t r; // Memory refresh, as last written by LD R,A
+    bool iff1; // maskable interrupts enabled
+    bool iff2; // IFF1 saved while an NMI is serviced
+    uint8_t im; // interrupt mode 0-2
+    bool halted;
+    bool eventPending;
+    bool eiShadow; // EI was the last instruction, INT waits for one more
+    bool intLine; // INT asserted, level triggered
+    uint8_t intData; // byte on the data bus during an INT acknowledge
+    bool nmiPending; // NMI edge not yet serviced
+
+    // Pending flag computation (lazy flags mode)
+    FlagOp flagOp;
+    uint8_t flagX;
+    uint8_t flagY;
+    uint8_t flagCarry; // carry in of ADC/SBC
+
+    uint8_t rFetches; // opcode fetches since R was written, they advance its low 7 bits
+};
+
+/**
+* @class Z80State
+* @brief Registers, interrupt lines and everything else of the CPU that does not touch memory
+*
+* The block cache and the JIT work on this part only, so they serve
+* every Z80Core whatever its bus.
+*/
+class Z80State : protected Z80HotState {
+    friend class Jit;
+    friend class LockstepGroup;
+    friend class Snapshot;
 
 public:
 
-    Z80();
-    
+#ifdef Z80_LAZY_FLAGS
+    static constexpr bool lazyFlags = true;
+#else
+    static constexpr bool lazyFlags = false;
+#endif
+
     /**
     * @brief CPU flag bitmasks
     */
@@ -75,30 +178,111 @@ public:
     };
 
     /**
-    * @brief Reset CPU to initial state
+    * @brief Attach a device to an I/O port
+    * @details Devices answer every port with the same low byte unless
+    * attached with fullDecode. Unattached ports read 0xFF and ignore writes.
+    * The device has to stay alive until it is detached
+    * @param fullDecode match all 16 bits of the port address
     */
-    void reset();
+    void attachIoDevice(uint16_t port, IoDevice* device, bool fullDecode = false);
 
     /**
-    * @brief Read a byte from memory
-    * @param addr - 16-bit memory address
-    * @return 8 bit value at specified address
+    * @brief Detach a device from every port it was attached to
     */
-    uint8_t readByte(uint16_t addr) const;
+    void detachIoDevice(IoDevice* device);
 
+    /**
+    * @brief Assert or release the maskable interrupt line
+    * @details Level triggered: while asserted, an interrupt is accepted
+    * whenever IFF1 is set. Can be called between runs or from a device
+    * callback, the running engine returns at the next instruction boundary
+    * @param data byte on the data bus during the acknowledge,
+    * the RST opcode in IM 0 and the low byte of the vector address in IM 2.
+    * IM 0 supports only RST opcodes (data & 0xC7 == 0xC7): with any other
+    * byte the interrupt is not accepted and the line stays pending
+    */
+    void setIntLine(bool asserted, uint8_t data = 0xFF);
 
     /**
-    * @brief Write a byte to memory
-    * @param addr - 16-bit memory address
-    * @param value - 8-bit value to write at the address location 
+    * @brief Trigger a non-maskable interrupt, serviced at 0x0066
+    */
+    void triggerNmi();
+
+    /**
+    * @brief Call a handler once the cycle counter reaches an absolute cycle
+    * @details Handlers run between instructions, at most MAX_INSTRUCTION
+    * T-states late, and may raise interrupts or schedule further events.
+    * The engines run in slices ending at the next deadline, they are not
+    * polled per instruction
+    * @return the event's handle, Scheduler::NO_EVENT when the pool is full
     */
-    void writeByte(uint16_t addr, uint8_t value);
+    EventId scheduleEvent(uint64_t cycle, EventHandler* handler);
 
+    /**
+    * @brief Cancel a scheduled event
+    * @return false if the event already fired or was cancelled
+    */
+    bool cancelEvent(EventId id);
 
     /**
-    * @brief Execute one CPU instruction
+    * @brief Move a scheduled event to another cycle
+    * @return false if the event already fired or was cancelled
+    */
+    bool rescheduleEvent(EventId id, uint64_t cycle);
+
+    /**
+    * @brief Ask a running run() to return with RunStatus::Stopped
+    * @details Safe to call from another thread, a request made while
+    * not running ends the next run() before its first instruction
     */
-    void step();
+    void requestStop();
+
+    /**
+    * @brief Breakpoints stopping run() before the instruction at addr
+    * @details The breakpoint table is allocated by the first breakpoint
+    */
+    void addBreakpoint(uint16_t addr);
+    void removeBreakpoint(uint16_t addr);
+    void clearBreakpoints();
+
+    static constexpr uint64_t RUN_SLICE = 1 << 16;
+    static constexpr uint64_t IDLE_LOOP_LENGTH = 8; // longest polling loop skipIdleLoop recognizes, in instructions
+    static constexpr uint32_t IDLE_PROBE_BACKOFF = 63; // most slices run without probing for a polling loop
+
+    static constexpr bool bigEndian = Z80_BIG_ENDIAN;
+
+    /**
+    * @brief Position of an 8-bit register in the register file
+    * @param code 3-bit register code (see Regs), (HL) has no position
+    * @details Codes 0-5 name the high and low bytes of BC, DE and HL,
+    * A is the high byte of AF. The low byte comes first on little-endian hosts
+    */
+    static constexpr uint8_t regIndex(uint8_t code) {
+        uint8_t pair = code == Regs::A ? 3 : code >> 1;
+        bool low = code != Regs::A && (code & 0x01);
+        return 2 * pair + (low == bigEndian ? 1 : 0);
+    }
+
+    /**
+    * @brief Enable or disable the decoded basic-block cache
+    * @details When enabled, step(count) executes whole predecoded blocks
+    * instead of fetching and decoding every instruction.
+    * Disabling frees the cache and resets its counters
+    */
+    void enableBlockCache(bool enable);
+
+    /**
+    * @brief Enable or disable translation of hot blocks to host code
+    * @details Only available on x86-64 hosts, enables the block cache as well.
+    * step(count) runs blocks executed hotThreshold times as translated code
+    * @return whether the JIT is active
+    */
+    bool enableJit(bool enable, uint32_t hotThreshold = Jit::HOT_THRESHOLD);
+
+    /**
+    * @brief Hit/miss/invalidation counters of the block cache
+    */
+    const BlockCacheStats& blockCacheStats() const;
 
     //Register accessors
     uint8_t getA() const;
@@ -129,30 +313,110 @@ public:
     uint16_t getIY() const;
     uint16_t getSP() const;
     uint16_t getPC() const;
+    uint8_t getI() const;
+    uint8_t getR() const;
+    bool getIFF1() const;
+    bool getIFF2() const;
+    uint8_t getIM() const;
+    bool isHalted() const;
 
+    /**
+    * @brief T-states executed since reset
+    */
+    uint64_t getCycles() const;
 
-private:
+    /**
+    * @brief All programmer-visible registers at once
+    */
+    Z80Registers getRegisters() const;
+
+    /**
+    * @brief Load all programmer-visible registers, e.g. the initial state of a job
+    * @details Memory, the cycle counter and pending events are left alone
+    */
+    void setRegisters(const Z80Registers& registers);
+
+protected:
+
+    Z80State();
+
+    uint64_t cycleLimit; // end of the running slice, repeating block instructions pause there
+    uint32_t idleBackoff; // slices skipped after the last failed polling loop probe, doubles per failure
+    uint32_t idleWait; // slices left before the next probe
+
+    /**
+    * @brief Stop flag that can be set from another thread
+    * @details Copies of the CPU start without a pending request
+    */
+    struct StopRequest {
+        std::atomic<bool> pending{ false };
+        StopRequest() = default;
+        StopRequest(const StopRequest&) {}
+        StopRequest& operator=(const StopRequest&) { return *this; }
+    };
+
+    StopRequest stopRequest;
+    std::vector<bool> breakpoints; // one bit per address, allocated by the first setBreakpoint
+    uint32_t breakpointCount;
+
+    BlockCache blockCache; // Decoded basic blocks used by step(count)
+    IoBus io; // 64K port address space
+    Scheduler scheduler; // Device events keyed on cycles
 
     /**
-    * @brief Handle prefixed opcode for the prefixes 0xDD/0xFD
-    * @param prefix - 8-bit prefix (0xDD/0xFD)
-    * @param opcode - actual instruction to execute
+    * @brief Make the engine loops return at the next instruction boundary
+    * and have the interrupt lines checked
     */
-    void handlePrefixedOpcode(uint8_t prefix, uint8_t opcode);
-    
+    void raiseEvent();
 
     /**
-    * @brief Main opcode execution dispatcher
-    * @param opcode instruction to execute
+    * @brief Whether an event was raised or a scheduled event is due
     */
-    void handleOpcode(uint8_t opcode);
+    bool eventsDue() const { return eventPending || cycles >= scheduler.nextDeadline(); }
+
+    /**
+    * @brief BIT n,value - Z from the tested bit, Carry kept
+    */
+    void bit(uint8_t number, uint8_t value);
 
     /**
     * @brief HALT instruction handler, ends the execution of the program when encountered
-    *    
+    * @details The CPU sleeps until an interrupt is accepted
     */
     void halt();
 
+    /**
+    * @brief LD A,I / LD A,R - S, Z from the value, P/V from IFF2
+    */
+    void ldAIr(uint8_t value);
+
+    // Lazy flags helpers
+
+    /**
+    * @brief Record an ALU operation instead of computing its flags
+    * @param op operation kind
+    * @param x first operand / result, see FlagOp
+    * @param y second operand
+    * @param carry carry in of ADC/SBC
+    */
+    void setFlagOp(FlagOp op, uint8_t x, uint8_t y = 0, uint8_t carry = 0);
+
+    /**
+    * @brief Value of F including a pending ALU operation
+    */
+    uint8_t flagsValue() const;
+
+    /**
+    * @brief Write pending ALU flags to F
+    * @details Called before any instruction reads or partially updates F
+    */
+    void materializeFlags();
+
+    /**
+    * @brief Carry flag as 0/1, without materializing F
+    */
+    uint8_t carryFlag() const;
+
     // Helper functions for arithmetic operations
     /**
     * @brief ADD A,n - Add to accumulator
@@ -200,20 +464,18 @@ private:
     */
     void xorA(uint8_t value);
 
-
     /**
     * @brief CP n - Compare with Accumulator
     * @param value 8-bit operand
     */
     void cp(uint8_t value);
 
-    
     /**
     * @brief INC instruction for 8-bit register
     * @param reg reference to register to increment
     */
     void inc(uint8_t& reg);
-    
+
     /**
     * @brief INC instruction helper for memory values
     * @param 8-bit value to increment
@@ -234,17 +496,23 @@ private:
     */
     uint8_t dec_(uint8_t value);
 
-    // Helper functions for load operations
     /**
-    * @brief LD reg, nn instruction
-    * @param reg reference to 16-bit register pair to which we load nn
+    * @brief Transfers a repeating LDIR/CPIR-style instruction runs before it pauses
+    * @details The instruction pauses at the first transfer ending at or
+    * after cycleLimit or the next scheduled event, at least one runs
+    * @param remaining transfers left until BC is 0
     */
-    void ld(uint16_t& reg);
+    uint32_t repeatCount(uint32_t remaining) const;
 
     /**
-    * @brief LD (HL),n instruction
+    * @brief ADC HL,rr - 16-bit add with carry, all flags from the 16-bit result
     */
-    void ldHL();
+    void adcHL(uint16_t value);
+
+    /**
+    * @brief SBC HL,rr - 16-bit subtract with carry, all flags from the 16-bit result
+    */
+    void sbcHL(uint16_t value);
 
     // Exchange operations
     /**
@@ -253,243 +521,712 @@ private:
     */
     void exx();
 
-    // Jump and Conditional Jump
     /**
-    * @brief JP cc,nn - Conditional absolute jump
-    * @param opcode opcode with condition encoding in bits 5-3
+    * @brief SCF - Set Carry Flag
+    * @details Sets Carry flag and clears N/H flags:
     */
-    void jp();
+    void setCarry();
 
     /**
-    * @brief Conditional JP instruction
-    * @param opcode Opcode containing condition, which gets
-    * evaluated by checkCondition(uint8_t) later on
+    * @brief DAA - Decimal Adjust Accumulator
+    * @details Corrects addition/subtraction results:
+    * For addition (N=0): adjusts if half-carry occurred (H=1)
+    * For subtraction (N=1): adjusts using two's complement method
+    * Updates all flags 
     */
-    void condJP(uint8_t opcode);
+    void daa();
 
     /**
-    * @brief JR e - Jump Relative instruction
-    * @details Performs PC-relative jump using signed 8-bit displacement
-    * PC = PC + offset (e - offset)
+    * @brief Check condition code against current flags
+    * @param condition 3-bit condition code (0-7)
     */
-    void jr();
+    bool checkCondition(uint8_t condition);
+};
+
+/**
+* @class Z80Core
+* @brief Zilog Z80 CPU emulator.
+* 
+* Emulates the functionality of core instructions of a Z80
+* processor, including data transfer, branching, arithmetics, logic and stack operations.
+* Every memory access goes through the Bus policy (see bus.hpp), a plain
+* member whose read and write inline into the handlers.
+* @tparam Bus memory policy, MemoryMap for the paged address space with devices
+*/
+template<typename Bus>
+class Z80Core : public Z80State {
+public:
+
+    Z80Core();
 
     /**
-    * @brief Conditional JR cc,e - Jump Relative if condition
-    * @param opcode Full opcode containing condition in bits 5-3
+    * @brief Reset CPU to initial state
     */
-    void condJR(uint8_t opcode);
+    void reset();
 
-    // Call/return operations
     /**
-    * @brief CALL nn - Absolute Call instruction
-    * @details Performs subroutine call:
-    * 1. Pushes current PC+3 onto stack
-    * 2. Loads PC with 16-bit immediate operand
+    * @brief Read a byte from memory
+    * @param addr - 16-bit memory address
+    * @return 8 bit value at specified address
     */
-    void call();
+    uint8_t readByte(uint16_t addr) const { return memory.read(addr); }
 
     /**
-    * @brief CALL cc,nn - Conditional Call
-    * @param opcode full opcode containing condition in bits 5-3
+    * @brief Write a byte to memory
+    * @param addr - 16-bit memory address
+    * @param value - 8-bit value to write at the address location 
     */
-    void condCall(uint8_t opcode);
+    void writeByte(uint16_t addr, uint8_t value) {
+        memory.write(addr, value);
+        blockCache.onWrite(addr);
+    }
 
     /**
-    * @brief RET cc - Conditional Return from Subroutine
-    * @param opcode full opcode containing condition in bits 5-3
-    * @details pops return address from stack only if condition met
+    * @brief Copy a memory image into the address space
+    * @param addr address of the first byte, the image wraps around after 0xFFFF
+    * @param data image bytes, at most 64KB are used
+    * @details Same result as writeByte for every byte, whole pages at a time
     */
-    void condRet(uint8_t opcode);
+    void loadImage(uint16_t addr, const uint8_t* data, size_t size);
+    void loadImage(uint16_t addr, const std::vector<uint8_t>& image) { loadImage(addr, image.data(), image.size()); }
 
     /**
-    * @brief SCF - Set Carry Flag
-    * @details Sets Carry flag and clears N/H flags:
+    * @brief Copy a range of the address space out, as readByte would read it
     */
-    void setCarry();
+    void dumpImage(uint16_t addr, uint8_t* data, size_t size) const;
+
+    /**
+    * @brief The bus behind readByte and writeByte
+    * @details Writes made directly to it bypass the block cache,
+    * use writeByte for memory that may hold code
+    */
+    Bus& bus() { return memory; }
+    const Bus& bus() const { return memory; }
 
+    // Mapping and devices, for buses with pages (MemoryMap). Members of a class
+    // template are instantiated only when called, other buses need not provide them
 
     /**
-    * @brief DAA - Decimal Adjust Accumulator
-    * @details Corrects addition/subtraction results:
-    * For addition (N=0): adjusts if half-carry occurred (H=1)
-    * For subtraction (N=1): adjusts using two's complement method
-    * Updates all flags 
+    * @brief Map a page of the address space to host memory, without copying it
+    * @details For ROM and bank switching. Blocks decoded from the page are
+    * invalidated, the host memory has to outlive the mapping
+    * @param page page number (address >> MemoryMap::PAGE_SHIFT)
+    * @param read MemoryMap::PAGE_SIZE bytes read through the page
+    * @param write MemoryMap::PAGE_SIZE bytes written through the page, nullptr drops writes
     */
-    void daa();
+    void mapPage(int page, const uint8_t* read, uint8_t* write);
 
+    /**
+    * @brief Map a page to writable host memory
+    */
+    void mapRam(int page, uint8_t* data);
 
     /**
-    * @brief Check condition code against current flags
-    * @param condition 3-bit condition code (0-7)
+    * @brief Map a page to read-only host memory, writes to it are dropped
     */
-    bool checkCondition(uint8_t condition);
+    void mapRom(int page, const uint8_t* data);
 
-    // Stack operations
+    /**
+    * @brief Map a page back to the built-in RAM
+    */
+    void unmapPage(int page);
 
     /**
-    * @brief PUSH qq - Push value onto stack
-    * @param value 16-bit value to push
+    * @brief Route reads and writes of [start, start + size) to a device
+    * @details Can be called at any time, only the pages overlapping the
+    * range leave the inline memory path. The device has to stay alive
+    * until it is removed
     */
-    void push(uint16_t value);
+    void addMmioDevice(uint16_t start, uint32_t size, MmioDevice* device);
 
     /**
-    * @brief POP qq - Pop value from stack
-    * @return uint16_t popped value
+    * @brief Detach a device from every range it was added to
     */
-    uint16_t pop();
+    void removeMmioDevice(MmioDevice* device);
 
-    // Register helpers 
+    /**
+    * @brief Copy of the machine sharing the built-in RAM copy-on-write
+    * @details Registers, ports, devices, events and mapped pages are taken
+    * as by a copy. Parent and child share every page of built-in RAM until
+    * one of them writes to it, so a fork costs about the size of the object
+    * and each branch grows only by the 4KB pages it writes. The parent's
+    * next write to each shared page takes the slow path once
+    */
+    Z80Core fork();
+
+    /**
+    * @brief Execute one CPU instruction
+    * @details Pending interrupts are accepted first, their acknowledge
+    * T-states are part of the result. A halted CPU executes a NOP while
+    * an event is scheduled
+    * @return T-states of the instruction, 0 while halted with nothing scheduled
+    */
+    uint32_t step();
+
+    /**
+    * @brief Execute up to count instructions in one call
+    * @param count maximum number of instructions to execute
+    * @return number of executed instructions, NOPs of a halted CPU
+    * included. Stops early on HALT only while no event is scheduled
+    */
+    uint64_t step(uint64_t count);
+
+    /**
+    * @brief Execute until a limit, HALT, a breakpoint or a stop request
+    * @details Runs the engine loop in slices of RUN_SLICE instructions,
+    * stop requests are noticed between slices. While breakpoints are set,
+    * every instruction is checked against them before it executes, except
+    * the first one so a run can resume from a breakpoint. While an event is
+    * scheduled, a halted CPU executes its NOPs up to it at once and they
+    * count as instructions, so the run ends with Halted only when nothing
+    * can wake the CPU
+    * @param maxInstructions maximum number of instructions to execute
+    * @return why the run ended and how many instructions it executed
+    */
+    RunResult run(uint64_t maxInstructions);
+
+    /**
+    * @brief Execute until HALT, a breakpoint or a stop request
+    * @details A CPU halted when the run starts first waits for an
+    * interrupt from a scheduled event
+    */
+    RunResult runUntilHalt();
+
+    /**
+    * @brief Execute until a T-state budget is used up, HALT, a breakpoint or a stop request
+    * @details Stops at the first instruction boundary at or after maxCycles,
+    * so the budget may be exceeded by at most one instruction. Repeating
+    * block I/O instructions finish their whole transfer as one instruction
+    * @param maxCycles T-state budget
+    */
+    RunResult runCycles(uint64_t maxCycles);
+
+private:
+
+    Bus memory; // 64KB address space
+
+    /**
+    * @brief Machine with the given state and bus, used by fork
+    */
+    Z80Core(const Z80State& state, Bus&& bus);
+
+    /**
+    * @brief Execution engine loop
+    * @details Table-driven by default, threaded with computed goto
+    * when built with Z80_THREADED_CORE (GCC/Clang only)
+    * @param count maximum number of instructions to execute
+    * @return number of executed instructions
+    */
+    uint64_t dispatch(uint64_t count);
+
+    /**
+    * @brief Block cache engine loop
+    * @param count maximum number of instructions to execute
+    * @return number of executed instructions
+    */
+    uint64_t runBlocks(uint64_t count);
+
+    /**
+    * @brief Engine loop selected by enableBlockCache
+    */
+    uint64_t runEngine(uint64_t count);
+
+    /**
+    * @brief Accept a pending NMI or INT, called only after an event
+    * @details The instruction after EI executes first
+    * @return number of instructions executed (the one after EI)
+    */
+    uint64_t serviceEvents();
+
+    /**
+    * @brief Run the engine in slices that end at the next scheduled event
+    * @param count maximum number of instructions to execute
+    * @param endCycle no slice starts at or after this cycle
+    * @return number of executed instructions, stops early on HALT
+    */
+    uint64_t runFor(uint64_t count, uint64_t endCycle);
+
+    /**
+    * @brief Execute the NOPs of a halted CPU up to the next scheduled event at once
+    * @param count maximum number of NOPs, 4 T-states each
+    * @param endCycle the last NOP ends at or after this cycle or the event
+    * @return number of NOPs executed
+    */
+    uint64_t skipHalted(uint64_t count, uint64_t endCycle);
+
+    /**
+    * @brief Whether the instruction at PC only loads registers, computes or branches
+    * @details Reads through device pages do not count, they may have side effects
+    */
+    bool pollingOp() const;
+
+    /**
+    * @brief Skip a polling loop at PC that only an event can end
+    * @details Runs one iteration of the loop. If it ends back at PC with
+    * the registers unchanged, every further iteration would repeat it,
+    * so the cycle counter jumps over the whole iterations before limit.
+    * Every failed probe doubles the number of slices that run before the next
+    * one, so code that is not a polling loop stays in the fast engines
+    * @param count maximum number of instructions to execute
+    * @param limit cycle of the next event
+    * @return number of executed and skipped instructions
+    */
+    uint64_t skipIdleLoop(uint64_t count, uint64_t limit);
+
+    /**
+    * @brief Push PC and jump to the handler of an accepted interrupt
+    * @details The acknowledge cycle advances R like an opcode fetch
+    */
+    void acceptInterrupt(uint16_t handler, uint8_t cost);
+
+    /**
+    * @brief Single-step engine loop used while breakpoints are set
+    * @param count maximum number of instructions to execute
+    * @param resume execute the instruction at PC even if it has a breakpoint
+    * @param endCycle stop at the first instruction boundary at or after this cycle
+    * @return number of executed instructions, less than count on HALT, a breakpoint or endCycle
+    */
+    uint64_t stepChecked(uint64_t count, bool resume, uint64_t endCycle);
+
+    /**
+    * @brief Shared loop of run(), runUntilHalt() and runCycles()
+    * @param untilHalt end on HALT even with an event scheduled, a CPU halted
+    * before the run waits for its interrupt first
+    */
+    RunResult runLoop(uint64_t maxInstructions, uint64_t maxCycles, bool untilHalt);
+
+    /**
+    * @brief Decode the basic block starting at start and store it in the cache
+    */
+    Block* decodeBlock(uint16_t start);
+
+    /**
+    * @brief Pointer to the handler of a single decoded opcode
+    */
+    using OpHandler = void (*)(Z80Core&);
+
+    /**
+    * @brief Handler tables indexed by opcode
+    * @details opTable covers unprefixed opcodes, ddTable and fdTable
+    * cover the opcodes following the 0xDD/0xFD prefixes, edTable and cbTable
+    * the ones following 0xED and 0xCB
+    */
+    static const std::array<OpHandler, 256> opTable;
+    static const std::array<OpHandler, 256> ddTable;
+    static const std::array<OpHandler, 256> fdTable;
+    static const std::array<OpHandler, 256> edTable;
+    static const std::array<OpHandler, 256> cbTable;
+
+    /**
+    * @brief Handler of the opcode in DD CB d op / FD CB d op
+    * @details The index register only forms the address, so one table serves both prefixes
+    */
+    using IndexedCbHandler = void (*)(Z80Core&, uint16_t);
+    static const std::array<IndexedCbHandler, 256> indexedCbTable;
+
+    /**
+    * @brief Table entry for opcode Op, forwards to execute<Op>()
+    * @details Plain function pointers are cheaper to call than member
+    * function pointers and let execute<Op>() inline into the entry.
+    * The entries count the opcode fetches R advances with, the opcode
+    * after DD CB d is read as an operand and not counted
+    */
+    template<uint8_t Op>
+    static void opEntry(Z80Core& cpu);
+
+    /**
+    * @brief Table entry for opcode Op after prefix, forwards to executeIndexed<Prefix, Op>()
+    */
+    template<uint8_t Prefix, uint8_t Op>
+    static void indexedEntry(Z80Core& cpu);
+
+    /**
+    * @brief Table entry for opcode Op after 0xED, forwards to executeExtended<Op>()
+    */
+    template<uint8_t Op>
+    static void extendedEntry(Z80Core& cpu);
+
+    /**
+    * @brief Table entry for opcode Op after 0xCB, forwards to executeCb<Op>()
+    */
+    template<uint8_t Op>
+    static void cbEntry(Z80Core& cpu);
+
+    /**
+    * @brief Table entry for opcode Op after DD CB d / FD CB d, forwards to executeIndexedCb<Op>()
+    */
+    template<uint8_t Op>
+    static void indexedCbEntry(Z80Core& cpu, uint16_t addr);
+
+    /**
+    * @brief Build a handler table from execute<Op>() instantiations
+    */
+    template<size_t... Op>
+    static constexpr std::array<OpHandler, 256> makeOpTable(std::index_sequence<Op...>);
+
+    /**
+    * @brief Build a DD/FD handler table from executeIndexed<Prefix, Op>() instantiations
+    */
+    template<uint8_t Prefix, size_t... Op>
+    static constexpr std::array<OpHandler, 256> makeIndexedTable(std::index_sequence<Op...>);
+
+    template<size_t... Op>
+    static constexpr std::array<OpHandler, 256> makeExtendedTable(std::index_sequence<Op...>);
+
+    template<size_t... Op>
+    static constexpr std::array<OpHandler, 256> makeCbTable(std::index_sequence<Op...>);
+
+    template<size_t... Op>
+    static constexpr std::array<IndexedCbHandler, 256> makeIndexedCbTable(std::index_sequence<Op...>);
+
+    /**
+    * @brief Pointer to the handler of a predecoded instruction
+    */
+    using BlockHandler = void (*)(Z80State&, const DecodedOp&);
+
+    /**
+    * @brief Predecoded instruction handler tables indexed by opcode
+    */
+    static const std::array<BlockHandler, 256> blockTable;
+    static const std::array<BlockHandler, 256> ddBlockTable;
+    static const std::array<BlockHandler, 256> fdBlockTable;
+    static const std::array<BlockHandler, 256> edBlockTable;
+    static const std::array<BlockHandler, 256> cbBlockTable;
+
+    template<size_t... Op>
+    static constexpr std::array<BlockHandler, 256> makeBlockTable(std::index_sequence<Op...>);
+
+    template<uint8_t Prefix, size_t... Op>
+    static constexpr std::array<BlockHandler, 256> makeIndexedBlockTable(std::index_sequence<Op...>);
+
+    template<size_t... Op>
+    static constexpr std::array<BlockHandler, 256> makeExtendedBlockTable(std::index_sequence<Op...>);
+
+    template<size_t... Op>
+    static constexpr std::array<BlockHandler, 256> makeCbBlockTable(std::index_sequence<Op...>);
+
+    /**
+    * @brief Execute predecoded unprefixed opcode Op
+    * @details Immediate operands and branch targets come from op,
+    * instructions without operands forward to execute<Op>()
+    */
+    template<uint8_t Op>
+    static void executeDecoded(Z80State& state, const DecodedOp& op);
+
+    /**
+    * @brief Execute predecoded opcode Op following the prefix 0xDD/0xFD
+    */
+    template<uint8_t Prefix, uint8_t Op>
+    static void executeDecodedIndexed(Z80State& state, const DecodedOp& op);
+
+    /**
+    * @brief Execute predecoded opcode Op following the prefix 0xED
+    * @details LD (nn),rr and LD rr,(nn) take their address from op
+    */
+    template<uint8_t Op>
+    static void executeDecodedExtended(Z80State& state, const DecodedOp& op);
 
     /**
-    * @brief Get register value by ID
-    * @param reg 3-bit register code
+    * @brief Execute predecoded opcode Op following the prefix 0xCB
     */
-    uint8_t getReg(uint8_t reg);
-    
+    template<uint8_t Op>
+    static void executeDecodedCb(Z80State& state, const DecodedOp& op);
+
+    /**
+    * @brief Execute unprefixed opcode Op
+    * @details Every opcode gets its own instantiation, so register
+    * operands and ALU operations are resolved at compile time
+    */
+    template<uint8_t Op>
+    void execute();
+
+    /**
+    * @brief Execute opcode Op following the prefix 0xDD/0xFD
+    */
+    template<uint8_t Prefix, uint8_t Op>
+    void executeIndexed();
+
     /**
-    * @brief Set register value by ID
-    * @param reg 3-bit register code
+    * @brief Execute opcode Op following the prefix 0xED
     */
-    void setReg(uint8_t reg, uint8_t value);
+    template<uint8_t Op>
+    void executeExtended();
 
+    /**
+    * @brief Execute opcode Op following the prefix 0xCB
+    * @details Operation, bit number and register are resolved at compile time
+    */
+    template<uint8_t Op>
+    void executeCb();
 
-    // Flag update helpers
+    /**
+    * @brief Execute opcode Op of DD CB d op / FD CB d op on (IX/IY+d)
+    * @param addr IX/IY+d
+    * @details Rotates, shifts, RES and SET also copy the result to the
+    * register coded in Op unless it is (HL), as the hardware does
+    */
+    template<uint8_t Op>
+    void executeIndexedCb(uint16_t addr);
 
     /**
-    * @brief Update flags after addition operation
-    * @param original_a register A before addition
-    * @param value Value added
-    * @param res 16-bit addition result
+    * @brief Rotate or shift a value, flags from the shift table
+    * @tparam Op operation encoded in opcode bits 5-3 (see CbOps)
     */
-    void updateFlagsAdd(uint8_t original_a, uint8_t value, uint16_t res);
+    template<uint8_t Op>
+    uint8_t shift(uint8_t value);
 
     /**
-    * @brief Update flags after subtraction operation
-    * @param original_a register A before subtraction
-    * @param value Value subtracted
-    * @param res 16-bit subtraction result
+    * @brief Access 8-bit register by its 3-bit code at compile time
+    * @tparam Reg register code (see Regs)
     */
-    void updateFlagsSub(uint8_t original_a, uint8_t value, uint16_t res);
+    template<uint8_t Reg>
+    uint8_t& reg();
 
+    /**
+    * @brief Perform ALU operation on the accumulator
+    * @tparam Op ALU operation encoded in opcode bits 5-3 (see AluOps)
+    * @param value 8-bit operand
+    */
+    template<uint8_t Op>
+    void alu(uint8_t value);
 
     /**
-    * @brief Update Sign and Zero flags
+    * @brief RETN/RETI - Return from interrupt, IFF1 restored from IFF2
     */
-    void updateSZ(uint8_t value);
+    void retn();
 
+    // Helper functions for load operations
     /**
-    * @brief Update flags after INC/DEC operation
-    * @param res Result value
-    * @param old Original value
-    * @param inc true = INC, false = DEC
+    * @brief LD reg, nn instruction
+    * @param reg reference to 16-bit register pair to which we load nn
     */
-    void updateFlagsIncDec(uint8_t res, uint8_t old, bool inc = true);
+    void ld(uint16_t& reg);
 
+    /**
+    * @brief LD (HL),n instruction
+    */
+    void ldHL();
+
+    // Input and output operations
+    /**
+    * @brief IN r,(C) - Input from port BC
+    * @tparam Reg destination register, 6 only sets the flags
+    */
+    template<uint8_t Reg>
+    void inC();
+
+    /**
+    * @brief INI/IND/INIR/INDR - Input from port BC to (HL)
+    * @details The repeating forms transfer all B bytes in one step,
+    * with a single batched call when one device serves the whole transfer
+    * @tparam Step +1 to increment HL, -1 to decrement it
+    * @tparam Repeat repeat until B is 0
+    */
+    template<int Step, bool Repeat>
+    void blockIn();
+
+    /**
+    * @brief OUTI/OUTD/OTIR/OTDR - Output from (HL) to port BC
+    */
+    template<int Step, bool Repeat>
+    void blockOut();
+
+    /**
+    * @brief LDI/LDD/LDIR/LDDR - Copy (HL) to (DE)
+    * @details Runs of plain memory are copied with one memmove per page,
+    * transfers through device pages and overlapping runs byte by byte
+    */
+    template<int Step, bool Repeat>
+    void blockCopy();
+
+    /**
+    * @brief CPI/CPD/CPIR/CPDR - Compare A with (HL)
+    * @details Runs of plain memory are searched with memchr
+    */
+    template<int Step, bool Repeat>
+    void blockCompare();
+
+    /**
+    * @brief Copy count bytes from HL to DE, stepping both by Step
+    */
+    template<int Step>
+    void copyBytes(uint32_t count);
+
+    /**
+    * @brief Compare up to count bytes from HL with A, stepping by Step
+    * @param last receives the last compared byte
+    * @return number of compared bytes, the match included
+    */
+    template<int Step>
+    uint32_t findByte(uint32_t count, uint8_t& last);
+
+    /**
+    * @brief Charge the repeated transfers of LDIR/CPIR-style instructions
+    * @param more the instruction repeats: PC goes back to it and the engine
+    * returns, so it continues after the event that paused it
+    */
+    void repeatBlock(uint32_t count, bool more);
+
+    // Jump and Conditional Jump
+    /**
+    * @brief JP cc,nn - Conditional absolute jump
+    * @param opcode opcode with condition encoding in bits 5-3
+    */
+    void jp();
 
     /**
-    * @brief Calculate parity of a value
-    * @param value 8-bit value to check
-    * @detail Used for PV flag in logical operations
+    * @brief Conditional JP instruction
+    * @param opcode Opcode containing condition, which gets
+    * evaluated by checkCondition(uint8_t) later on
     */
-    bool parityEven(uint8_t value);
+    void condJP(uint8_t opcode);
 
+    /**
+    * @brief JR e - Jump Relative instruction
+    * @details Performs PC-relative jump using signed 8-bit displacement
+    * PC = PC + offset (e - offset)
+    */
+    void jr();
 
-    // Prefixed instruction handlers
+    /**
+    * @brief Conditional JR cc,e - Jump Relative if condition
+    * @param opcode Full opcode containing condition in bits 5-3
+    */
+    void condJR(uint8_t opcode);
 
+    // Call/return operations
     /**
-    * @brief Handle ADD A,(IX/IY+d)
-    * @param prefix Index register
-    */ 
-    void handleAdd(uint8_t prefix);
+    * @brief CALL nn - Absolute Call instruction
+    * @details Performs subroutine call:
+    * 1. Pushes current PC+3 onto stack
+    * 2. Loads PC with 16-bit immediate operand
+    */
+    void call();
 
     /**
-    * @brief Handle ADC A,(IX/IY+d)
-    * @param prefix Index register
-    */ 
-    void handleAdc(uint8_t prefix);
+    * @brief CALL cc,nn - Conditional Call
+    * @param opcode full opcode containing condition in bits 5-3
+    */
+    void condCall(uint8_t opcode);
 
     /**
-    * @brief Handle SUB (IX/IY+d)
-    * @param prefix Index register
-    */ 
-    void handleSub(uint8_t prefix);
+    * @brief RET cc - Conditional Return from Subroutine
+    * @param opcode full opcode containing condition in bits 5-3
+    * @details pops return address from stack only if condition met
+    */
+    void condRet(uint8_t opcode);
+
+    // Stack operations
 
     /**
-    * @brief Handle SBC A, (IX/IY+d)
-    */ 
-    void handleSbc(uint8_t prefix);
+    * @brief PUSH qq - Push value onto stack
+    * @param value 16-bit value to push
+    */
+    void push(uint16_t value);
 
     /**
-    * @brief Handle AND (IX/IY+d)
+    * @brief POP qq - Pop value from stack
+    * @return uint16_t popped value
     */
-    void handleAnd(uint8_t prefix);
+    uint16_t pop();
+
+    // Register helpers 
 
     /**
-    * @brief Handle OR (IX/IY+d)
+    * @brief Read a 16-bit little-endian word from memory
     */
-    void handleOr(uint8_t prefix);
+    uint16_t readWord(uint16_t addr) const;
 
     /**
-    * @brief Handle XOR (IX/IY+d)
+    * @brief Write a 16-bit little-endian word to memory
     */
-    void handleXor(uint8_t prefix);
-    
+    void writeWord(uint16_t addr, uint16_t value);
+
+    // Index register helpers, resolved at compile time
+
     /**
-    * @brief Handle CP (IX/IY+d)
+    * @brief 16-bit register taking the place of HL
+    * @tparam Prefix 0xDD selects IX, 0xFD selects IY, 0 selects HL
     */
-    void handleCp(uint8_t prefix);
+    template<uint8_t Prefix>
+    uint16_t& indexReg();
 
     /**
-    * @brief Handle INC (IX/IY+d)
+    * @brief 8-bit register by its 3-bit code, H and L replaced by the
+    * halves of the index register (IXH/IXL, IYH/IYL)
     */
-    void handleIncMem(uint8_t prefix);
+    template<uint8_t Prefix, uint8_t Reg>
+    uint8_t& indexHalf();
 
     /**
-    * @brief Handle DEC (IX/IY+d)
+    * @brief Register pair by its 2-bit code (see Pairs), HL replaced by the index register
     */
-    void handleDecMem(uint8_t prefix);
+    template<uint8_t Prefix, uint8_t Pair>
+    uint16_t& pair();
 
     /**
-    * @brief Handle 8-bit LD operations
+    * @brief Address IX/IY+d, reads the displacement d at PC
     */
-    void handleLd(uint8_t opcode);
+    template<uint8_t Prefix>
+    uint16_t indexedAddress();
 
     /**
-    * @brief Handle indexed LD operations(LD r,(IX/IY+d) or LD (IX/IY+d),r)
+    * @brief ADD HL/IX/IY,rr
+    * @param value 16-bit operand
     */
-    void handleIndexedLd(uint8_t prefix, uint8_t opcode);
+    template<uint8_t Prefix>
+    void addIndex(uint16_t value);
 
+    /**
+    * @brief EX (SP),HL/IX/IY
+    */
+    template<uint8_t Prefix>
+    void exSp();
 };
 
-inline uint8_t Z80::getA() const { return a; }
-inline uint8_t Z80::getF() const { return f; }
-inline uint8_t Z80::getB() const { return b; }
-inline uint8_t Z80::getC() const { return c; }
-inline uint8_t Z80::getD() const { return d; }
-inline uint8_t Z80::getE() const { return e; }
-inline uint8_t Z80::getL() const { return l; }
-inline uint8_t Z80::getH() const { return h; }
-inline uint8_t Z80::getA_P() const { return a_prime; }
-inline uint8_t Z80::getF_P() const { return f_prime; }
-inline uint8_t Z80::getB_P() const { return b_prime; }
-inline uint8_t Z80::getC_P() const { return c_prime; }
-inline uint8_t Z80::getD_P() const { return d_prime; }
-inline uint8_t Z80::getE_P() const { return e_prime; }
-inline uint8_t Z80::getL_P() const { return l_prime; }
-inline uint8_t Z80::getH_P() const { return h_prime; }
-inline uint16_t Z80::getAF() const { return af; }
-inline uint16_t Z80::getBC() const { return bc; }
-inline uint16_t Z80::getDE() const { return de; }
-inline uint16_t Z80::getHL() const { return hl; }
-inline uint16_t Z80::getAF_P() const { return af_prime; }
-inline uint16_t Z80::getBC_P() const { return bc_prime; }
-inline uint16_t Z80::getDE_P() const { return de_prime; }
-inline uint16_t Z80::getHL_P() const { return hl_prime; }
-inline uint16_t Z80::getIX() const { return ix; }
-inline uint16_t Z80::getIY() const { return iy; }
-inline uint16_t Z80::getPC() const { return pc; }
-inline uint16_t Z80::getSP() const { return sp; }
+
+inline uint8_t Z80State::getA() const { return a; }
+inline uint8_t Z80State::getF() const { return lazyFlags ? flagsValue() : f; }
+inline uint8_t Z80State::getB() const { return b; }
+inline uint8_t Z80State::getC() const { return c; }
+inline uint8_t Z80State::getD() const { return d; }
+inline uint8_t Z80State::getE() const { return e; }
+inline uint8_t Z80State::getL() const { return l; }
+inline uint8_t Z80State::getH() const { return h; }
+inline uint8_t Z80State::getA_P() const { return a_prime; }
+inline uint8_t Z80State::getF_P() const { return f_prime; }
+inline uint8_t Z80State::getB_P() const { return b_prime; }
+inline uint8_t Z80State::getC_P() const { return c_prime; }
+inline uint8_t Z80State::getD_P() const { return d_prime; }
+inline uint8_t Z80State::getE_P() const { return e_prime; }
+inline uint8_t Z80State::getL_P() const { return l_prime; }
+inline uint8_t Z80State::getH_P() const { return h_prime; }
+inline uint16_t Z80State::getAF() const { return lazyFlags ? (a << 8) | flagsValue() : af; }
+inline uint16_t Z80State::getBC() const { return bc; }
+inline uint16_t Z80State::getDE() const { return de; }
+inline uint16_t Z80State::getHL() const { return hl; }
+inline uint16_t Z80State::getAF_P() const { return af_prime; }
+inline uint16_t Z80State::getBC_P() const { return bc_prime; }
+inline uint16_t Z80State::getDE_P() const { return de_prime; }
+inline uint16_t Z80State::getHL_P() const { return hl_prime; }
+inline uint16_t Z80State::getIX() const { return ix; }
+inline uint16_t Z80State::getIY() const { return iy; }
+inline uint16_t Z80State::getPC() const { return pc; }
+inline uint16_t Z80State::getSP() const { return sp; }
+inline uint8_t Z80State::getI() const { return i; }
+inline uint8_t Z80State::getR() const { return (r & 0x80) | ((r + rFetches) & 0x7F); }
+inline bool Z80State::getIFF1() const { return iff1; }
+inline bool Z80State::getIFF2() const { return iff2; }
+inline uint8_t Z80State::getIM() const { return im; }
+inline bool Z80State::isHalted() const { return halted; }
+inline uint64_t Z80State::getCycles() const { return cycles; }
+
+/**
+* @brief The CPU on the paged address space, built in cpu.cpp
+* @details Other buses are instantiated by including cpucore.hpp
+*/
+using Z80 = Z80Core<MemoryMap>;
+extern template class Z80Core<MemoryMap>;
 
 
 #endif
@@ -0,0 +1,1895 @@
+#ifndef CPUCORE_HPP
+#define CPUCORE_HPP
+
+/**
+* Member definitions of Z80Core.
+* cpu.cpp instantiates the CPU on MemoryMap (Z80), a program using
+* another bus includes this header to have it instantiated for its own
+*/
+
+#include "cpu.hpp"
+#include "flagtables.hpp"
+#include "timing.hpp"
+#include <algorithm>
+#include <cstring>
+
+#if defined(Z80_THREADED_CORE) && !defined(__GNUC__)
+#error "Z80_THREADED_CORE requires labels-as-values (GCC or Clang)"
+#endif
+
+/*
+Notation:
+
+r - Identifies any of the registers A, B, C, D, E, H, or L.
+
+(HL) - Identifies the contents of the memory location, 
+whose address is specified by the contents of the register pair HL.
+
+(IX+d) - Identifies the contents of the memory location, whose address is specified by 
+the contents of the Index register pair IX plus the signed displacement d.
+
+(IY+d) - Identifies the contents of the memory location, whose address is specified by 
+the contents of the Index register pair IY plus the signed displacement d.
+
+n -  Identifies a one-byte unsigned integer expression in the range (0 to 255).
+
+nn - Identifies a two-byte unsigned integer expression in the range (0 to 65535).
+
+d -  Identifies a one-byte signed integer expression in the range (-128 to +127).
+
+b -  Identifies a one-bit expression in the range (0 to 7).  The most-significant bit 
+to the left is bit 7 and the least-significant bit to the right is bit 0.
+
+e - Identifies a one-byte signed integer expression in the range (-126 to +129)
+for relative jump offset from current location.
+
+cc - Identifies the status of the Flag Register as any of (NZ, Z, NC, C, PV or H)
+for the conditional jumps, calls, and return instructions.
+
+*/
+
+// Precomputed ALU flag results
+static constexpr const FlagTables::Tables& flags = FlagTables::tables;
+
+// Flags written by INC/DEC, the rest of F is preserved
+static constexpr uint8_t INC_DEC_FLAGS = Z80State::N_FLAG | Z80State::Z_FLAG | Z80State::S_FLAG | Z80State::H_FLAG | Z80State::PV_FLAG;
+
+// Flags kept by ADD HL/IX/IY,rr
+static constexpr uint8_t ADD16_KEPT_FLAGS = Z80State::S_FLAG | Z80State::Z_FLAG | Z80State::PV_FLAG;
+
+/**
+ * Opcodes following 0xDD/0xFD that take a displacement,
+ * their (HL) operand becomes (IX/IY+d)
+ */
+static constexpr bool hasDisplacement(uint8_t opcode) {
+    uint8_t dest = (opcode >> 3) & 0x07;
+    uint8_t src = opcode & 0x07;
+    if (opcode == HALT) return false;
+    // DD CB d op, the opcode follows the displacement
+    if (opcode == PREFIX_CB) return true;
+    if ((opcode & 0xC0) == 0x40) return src == 6 || dest == 6;
+    if ((opcode & 0xC0) == 0x80) return src == 6;
+    return opcode == INC_HL || opcode == DEC_HL || opcode == LD_HL_N;
+}
+
+/**
+ * Opcodes the 0xDD/0xFD prefix changes: HL, H, L or (HL) operands.
+ * Every other opcode executes as if it was unprefixed
+ */
+static constexpr bool usesIndex(uint8_t opcode) {
+    uint8_t dest = (opcode >> 3) & 0x07;
+    uint8_t src = opcode & 0x07;
+    auto hl = [](uint8_t reg) { return reg == Regs::H || reg == Regs::L; };
+    if (hasDisplacement(opcode)) return true;
+    if ((opcode & 0xC0) == 0x40 && opcode != HALT) return hl(dest) || hl(src);
+    if ((opcode & 0xC0) == 0x80) return hl(src);
+    if ((opcode & 0xC7) == INC_B || (opcode & 0xC7) == DEC_B || (opcode & 0xC7) == LD_B_N) return hl(dest);
+    return (opcode & 0xCF) == ADD_HL_BC || opcode == LD_HL_NN || opcode == LD_NN_HL || opcode == LD_HL_INN
+        || opcode == INC_HL16 || opcode == DEC_HL16 || opcode == POP_HL || opcode == PUSH_HL
+        || opcode == EX_SP_HL || opcode == JP_HL || opcode == LD_SP_HL;
+}
+
+template<typename Bus>
+Z80Core<Bus>::Z80Core() { reset(); }
+
+template<typename Bus>
+Z80Core<Bus>::Z80Core(const Z80State& state, Bus&& bus) : Z80State(state), memory(std::move(bus)) {}
+
+/**
+ * @brief Reset CPU to initial state
+ * Resets all registers, program counter and stack pointer
+ * Clears the built-in RAM, only the blocks written since the last reset,
+ * mapped pages stay mapped.
+ * Interrupts are disabled in IM 0, the INT line stays as its device drives it.
+ * Scheduled events are dropped
+ */
+template<typename Bus>
+void Z80Core<Bus>::reset() {
+    af = bc = de = hl = 0;
+    af_prime = bc_prime = de_prime = hl_prime = 0;
+    pc = sp = ix = iy = 0;
+    cycles = 0;
+    halted = false;
+    i = r = 0;
+    rFetches = 0;
+    iff1 = iff2 = false;
+    im = 0;
+    nmiPending = eiShadow = false;
+    eventPending = false;
+    runLimit = 0;
+    cycleLimit = UINT64_MAX;
+    idleBackoff = idleWait = 0;
+    scheduler.clear();
+    flagOp = FlagOp::None;
+    flagX = flagY = flagCarry = 0;
+    memory.clearRam();
+    blockCache.invalidateAll();
+}
+
+/**
+ * Remapping a page changes the code behind its addresses,
+ * so blocks and translations decoded from it are dropped
+ */
+template<typename Bus>
+void Z80Core<Bus>::mapPage(int page, const uint8_t* read, uint8_t* write) {
+    memory.map(page, read, write);
+    blockCache.onRemap(uint16_t(page << MemoryMap::PAGE_SHIFT), MemoryMap::PAGE_SIZE);
+}
+
+template<typename Bus>
+void Z80Core<Bus>::mapRam(int page, uint8_t* data) {
+    mapPage(page, data, data);
+}
+
+template<typename Bus>
+void Z80Core<Bus>::mapRom(int page, const uint8_t* data) {
+    mapPage(page, data, nullptr);
+}
+
+template<typename Bus>
+void Z80Core<Bus>::unmapPage(int page) {
+    memory.unmap(page);
+    blockCache.onRemap(uint16_t(page << MemoryMap::PAGE_SHIFT), MemoryMap::PAGE_SIZE);
+}
+
+template<typename Bus>
+void Z80Core<Bus>::addMmioDevice(uint16_t start, uint32_t size, MmioDevice* device) {
+    memory.addDevice(start, size, device);
+    blockCache.onRemap(start, size);
+}
+
+/**
+ * Devices may be spread over several ranges, every page is rechecked
+ */
+template<typename Bus>
+void Z80Core<Bus>::removeMmioDevice(MmioDevice* device) {
+    memory.removeDevice(device);
+    blockCache.onRemap(0, 0x10000);
+}
+
+/**
+ * The child's block cache starts empty, as a copy's does
+ */
+template<typename Bus>
+Z80Core<Bus> Z80Core<Bus>::fork() {
+    return Z80Core(*this, memory.fork());
+}
+
+template<typename Bus>
+template<uint8_t Op>
+void Z80Core<Bus>::opEntry(Z80Core& cpu) {
+    cpu.rFetches++;
+    cpu.cycles += Timing::unprefixed[Op];
+    cpu.execute<Op>();
+}
+
+template<typename Bus>
+template<uint8_t Prefix, uint8_t Op>
+void Z80Core<Bus>::indexedEntry(Z80Core& cpu) {
+    // A second prefix is fetched again as the next instruction
+    if constexpr (Op != PREFIX_DD && Op != PREFIX_FD && Op != PREFIX_ED) cpu.rFetches++;
+    cpu.cycles += Timing::indexedTable[Op];
+    cpu.executeIndexed<Prefix, Op>();
+}
+
+template<typename Bus>
+template<uint8_t Op>
+void Z80Core<Bus>::extendedEntry(Z80Core& cpu) {
+    cpu.rFetches++;
+    cpu.cycles += Timing::extendedTable[Op];
+    cpu.executeExtended<Op>();
+}
+
+template<typename Bus>
+template<uint8_t Op>
+void Z80Core<Bus>::cbEntry(Z80Core& cpu) {
+    cpu.rFetches++;
+    cpu.cycles += Timing::cbTable[Op];
+    cpu.executeCb<Op>();
+}
+
+template<typename Bus>
+template<uint8_t Op>
+void Z80Core<Bus>::indexedCbEntry(Z80Core& cpu, uint16_t addr) {
+    cpu.cycles += Timing::indexedCbTable[Op];
+    cpu.executeIndexedCb<Op>(addr);
+}
+
+template<typename Bus>
+template<size_t... Op>
+constexpr std::array<typename Z80Core<Bus>::OpHandler, 256> Z80Core<Bus>::makeOpTable(std::index_sequence<Op...>) {
+    return { { &Z80Core::opEntry<Op>... } };
+}
+
+template<typename Bus>
+template<uint8_t Prefix, size_t... Op>
+constexpr std::array<typename Z80Core<Bus>::OpHandler, 256> Z80Core<Bus>::makeIndexedTable(std::index_sequence<Op...>) {
+    return { { &Z80Core::indexedEntry<Prefix, Op>... } };
+}
+
+template<typename Bus>
+template<size_t... Op>
+constexpr std::array<typename Z80Core<Bus>::OpHandler, 256> Z80Core<Bus>::makeExtendedTable(std::index_sequence<Op...>) {
+    return { { &Z80Core::extendedEntry<Op>... } };
+}
+
+template<typename Bus>
+template<size_t... Op>
+constexpr std::array<typename Z80Core<Bus>::OpHandler, 256> Z80Core<Bus>::makeCbTable(std::index_sequence<Op...>) {
+    return { { &Z80Core::cbEntry<Op>... } };
+}
+
+template<typename Bus>
+template<size_t... Op>
+constexpr std::array<typename Z80Core<Bus>::IndexedCbHandler, 256> Z80Core<Bus>::makeIndexedCbTable(std::index_sequence<Op...>) {
+    return { { &Z80Core::indexedCbEntry<Op>... } };
+}
+
+template<typename Bus>
+const std::array<typename Z80Core<Bus>::OpHandler, 256> Z80Core<Bus>::opTable = makeOpTable(std::make_index_sequence<256>{});
+template<typename Bus>
+const std::array<typename Z80Core<Bus>::OpHandler, 256> Z80Core<Bus>::ddTable = makeIndexedTable<PREFIX_DD>(std::make_index_sequence<256>{});
+template<typename Bus>
+const std::array<typename Z80Core<Bus>::OpHandler, 256> Z80Core<Bus>::fdTable = makeIndexedTable<PREFIX_FD>(std::make_index_sequence<256>{});
+template<typename Bus>
+const std::array<typename Z80Core<Bus>::OpHandler, 256> Z80Core<Bus>::edTable = makeExtendedTable(std::make_index_sequence<256>{});
+template<typename Bus>
+const std::array<typename Z80Core<Bus>::OpHandler, 256> Z80Core<Bus>::cbTable = makeCbTable(std::make_index_sequence<256>{});
+template<typename Bus>
+const std::array<typename Z80Core<Bus>::IndexedCbHandler, 256> Z80Core<Bus>::indexedCbTable = makeIndexedCbTable(std::make_index_sequence<256>{});
+
+template<typename Bus>
+template<uint8_t Reg>
+uint8_t& Z80Core<Bus>::reg() {
+    static_assert(Reg != 6, "(HL) is not a register");
+    return regs[regIndex(Reg)];
+}
+
+template<typename Bus>
+template<uint8_t Prefix>
+uint16_t& Z80Core<Bus>::indexReg() {
+    if constexpr (Prefix == PREFIX_DD) return ix;
+    else if constexpr (Prefix == PREFIX_FD) return iy;
+    else return hl;
+}
+
+template<typename Bus>
+template<uint8_t Prefix, uint8_t Reg>
+uint8_t& Z80Core<Bus>::indexHalf() {
+    if constexpr (Prefix == PREFIX_DD && Reg == Regs::H) return ixh;
+    else if constexpr (Prefix == PREFIX_DD && Reg == Regs::L) return ixl;
+    else if constexpr (Prefix == PREFIX_FD && Reg == Regs::H) return iyh;
+    else if constexpr (Prefix == PREFIX_FD && Reg == Regs::L) return iyl;
+    else return reg<Reg>();
+}
+
+template<typename Bus>
+template<uint8_t Prefix, uint8_t Pair>
+uint16_t& Z80Core<Bus>::pair() {
+    if constexpr (Pair == Pairs::BC) return bc;
+    else if constexpr (Pair == Pairs::DE) return de;
+    else if constexpr (Pair == Pairs::HL) return indexReg<Prefix>();
+    else return sp;
+}
+
+template<typename Bus>
+template<uint8_t Prefix>
+uint16_t Z80Core<Bus>::indexedAddress() {
+    int8_t d = readByte(pc++);
+    return indexReg<Prefix>() + d;
+}
+
+/**
+ * 16-bit addition:
+ * Half-carry from bit 11, Carry from bit 15, N reset,
+ * Sign, Zero and Parity/Overflow are kept
+ */
+template<typename Bus>
+template<uint8_t Prefix>
+void Z80Core<Bus>::addIndex(uint16_t value) {
+    uint16_t& target = indexReg<Prefix>();
+    uint32_t result = target + value;
+    materializeFlags();
+    f = (f & ADD16_KEPT_FLAGS)
+        | (((target & 0x0FFF) + (value & 0x0FFF)) > 0x0FFF ? H_FLAG : 0)
+        | (result > 0xFFFF ? C_FLAG : 0);
+    target = uint16_t(result);
+}
+
+/**
+ * Exchange the top of the stack with HL/IX/IY
+ */
+template<typename Bus>
+template<uint8_t Prefix>
+void Z80Core<Bus>::exSp() {
+    uint16_t& target = indexReg<Prefix>();
+    uint16_t value = readWord(sp);
+    writeWord(sp, target);
+    target = value;
+}
+
+template<typename Bus>
+template<uint8_t Op>
+void Z80Core<Bus>::alu(uint8_t value) {
+    if constexpr (Op == AluOps::ADD) addA(value);
+    else if constexpr (Op == AluOps::ADC) adcA(value);
+    else if constexpr (Op == AluOps::SUB) sub(value);
+    else if constexpr (Op == AluOps::SBC) sbcA(value);
+    else if constexpr (Op == AluOps::AND) andA(value);
+    else if constexpr (Op == AluOps::XOR) xorA(value);
+    else if constexpr (Op == AluOps::OR) orA(value);
+    else cp(value);
+}
+
+/**
+ * Unprefixed opcode handler:
+ * Instantiated once per opcode, operands encoded in the opcode
+ * (register codes, ALU operation, condition) are resolved at compile time
+ * Unimplemented opcodes execute as no-ops
+ */
+template<typename Bus>
+template<uint8_t Op>
+void Z80Core<Bus>::execute() {
+    constexpr uint8_t dest = (Op >> 3) & 0x07; // bits 5-3 - destination / ALU operation
+    constexpr uint8_t src = Op & 0x07;         // bits 2-0 - source
+
+    //HALT (encoded as LD (HL),(HL))
+    if constexpr (Op == HALT) {
+        halt();
+    }
+    // LD r,r', LD r,(HL), LD (HL),r
+    // bits 7-6 equal to 01
+    else if constexpr ((Op & 0xC0) == 0x40) {
+        if constexpr (src == 6) reg<dest>() = readByte(hl);
+        else if constexpr (dest == 6) writeByte(hl, reg<src>());
+        else reg<dest>() = reg<src>();
+    }
+    // ALU A,r, ALU A,(HL)
+    // bits 7-6 equal to 10
+    else if constexpr ((Op & 0xC0) == 0x80) {
+        if constexpr (src == 6) alu<dest>(readByte(hl));
+        else alu<dest>(reg<src>());
+    }
+    // ALU A,n
+    else if constexpr ((Op & 0xC7) == ADD_A_N) {
+        alu<dest>(readByte(pc++));
+    }
+
+    // INC (HL)
+    else if constexpr (Op == INC_HL) {
+        uint16_t addr = hl;
+        writeByte(addr, inc_(readByte(addr)));
+    }
+    // INC r
+    else if constexpr ((Op & 0xC7) == INC_B) {
+        inc(reg<dest>());
+    }
+    // DEC (HL)
+    else if constexpr (Op == DEC_HL) {
+        uint16_t addr = hl;
+        writeByte(addr, dec_(readByte(addr)));
+    }
+    // DEC r
+    else if constexpr ((Op & 0xC7) == DEC_B) {
+        dec(reg<dest>());
+    }
+
+    // LD (HL),n
+    else if constexpr (Op == LD_HL_N) ldHL();
+    // LD r,n
+    else if constexpr ((Op & 0xC7) == LD_B_N) {
+        reg<dest>() = readByte(pc++);
+    }
+
+    // 16-bit Loads
+    else if constexpr (Op == LD_BC_NN) ld(bc);
+    else if constexpr (Op == LD_DE_NN) ld(de);
+    else if constexpr (Op == LD_HL_NN) ld(hl);
+    else if constexpr (Op == LD_SP_NN) ld(sp);
+
+    // LD (nn),HL, LD HL,(nn), LD SP,HL
+    else if constexpr (Op == LD_NN_HL) {
+        writeWord(readWord(pc), hl);
+        pc += 2;
+    }
+    else if constexpr (Op == LD_HL_INN) {
+        hl = readWord(readWord(pc));
+        pc += 2;
+    }
+    // LD (nn),A, LD A,(nn)
+    else if constexpr (Op == LD_NN_A) {
+        writeByte(readWord(pc), a);
+        pc += 2;
+    }
+    else if constexpr (Op == LD_A_INN) {
+        a = readByte(readWord(pc));
+        pc += 2;
+    }
+    // LD (BC),A, LD (DE),A, LD A,(BC), LD A,(DE)
+    else if constexpr (Op == LD_BC_A) writeByte(bc, a);
+    else if constexpr (Op == LD_DE_A) writeByte(de, a);
+    else if constexpr (Op == LD_A_BC) a = readByte(bc);
+    else if constexpr (Op == LD_A_DE) a = readByte(de);
+    else if constexpr (Op == LD_SP_HL) sp = hl;
+
+    // ADD HL,rr, INC rr, DEC rr
+    else if constexpr ((Op & 0xCF) == ADD_HL_BC) addIndex<0>(pair<0, (Op >> 4) & 0x03>());
+    else if constexpr ((Op & 0xCF) == INC_BC) pair<0, (Op >> 4) & 0x03>()++;
+    else if constexpr ((Op & 0xCF) == DEC_BC) pair<0, (Op >> 4) & 0x03>()--;
+
+    // Exchange instructions
+    else if constexpr (Op == EX_DE_HL) std::swap(de, hl);
+    else if constexpr (Op == EX_SP_HL) exSp<0>();
+    else if constexpr (Op == EX_AF_AF) {
+        materializeFlags();
+        std::swap(af, af_prime);
+    }
+    else if constexpr (Op == EXX) exx();
+
+    // JP nn, JP cc,nn
+    else if constexpr (Op == JP_NN) jp();
+    else if constexpr ((Op & 0xC7) == JP_NZ) condJP(Op);
+    else if constexpr (Op == JP_HL) pc = hl;
+
+    // JR e, JR cc,e
+    else if constexpr (Op == JR) jr();
+    else if constexpr (Op == JR_NZ || Op == JR_Z || Op == JR_NC || Op == JR_C) condJR(Op);
+
+    // CALL nn, CALL cc,nn
+    else if constexpr (Op == CALL_NN) call();
+    else if constexpr ((Op & 0xC7) == CALL_NZ) condCall(Op);
+
+    // RET, RET cc
+    else if constexpr (Op == RET) pc = pop();
+    else if constexpr ((Op & 0xC7) == RET_NZ) condRet(Op);
+
+    // PUSH qq
+    else if constexpr (Op == PUSH_BC) push(bc);
+    else if constexpr (Op == PUSH_DE) push(de);
+    else if constexpr (Op == PUSH_HL) push(hl);
+    else if constexpr (Op == PUSH_AF) {
+        materializeFlags();
+        push(af);
+    }
+
+    // POP qq
+    else if constexpr (Op == POP_BC) bc = pop();
+    else if constexpr (Op == POP_DE) de = pop();
+    else if constexpr (Op == POP_HL) hl = pop();
+    else if constexpr (Op == POP_AF) {
+        af = pop();
+        flagOp = FlagOp::None;
+    }
+
+    // SCF, DAA
+    else if constexpr (Op == SCF) setCarry();
+    else if constexpr (Op == DAA) daa();
+
+    // DI, EI - an asserted INT is accepted after the instruction following EI
+    else if constexpr (Op == DI) iff1 = iff2 = false;
+    else if constexpr (Op == EI) {
+        iff1 = iff2 = true;
+        if (intLine) {
+            eiShadow = true;
+            raiseEvent();
+        }
+    }
+
+    // IN A,(n), OUT (n),A - A is the high byte of the port
+    else if constexpr (Op == IN_A_N) {
+        a = io.in(uint16_t((a << 8) | readByte(pc++)));
+    }
+    else if constexpr (Op == OUT_N_A) {
+        io.out(uint16_t((a << 8) | readByte(pc++)), a);
+    }
+
+    // Prefixes dispatch the following opcode through the IX/IY and extended tables
+    else if constexpr (Op == PREFIX_DD) {
+        uint8_t opcode = readByte(pc++);
+        ddTable[opcode](*this);
+    }
+    else if constexpr (Op == PREFIX_FD) {
+        uint8_t opcode = readByte(pc++);
+        fdTable[opcode](*this);
+    }
+    else if constexpr (Op == PREFIX_ED) {
+        uint8_t opcode = readByte(pc++);
+        edTable[opcode](*this);
+    }
+    else if constexpr (Op == PREFIX_CB) {
+        uint8_t opcode = readByte(pc++);
+        cbTable[opcode](*this);
+    }
+}
+
+/**
+ * Prefixed opcode handler:
+ * Instantiated once per index register and opcode, so IX/IY is fixed
+ * at compile time. HL becomes IX/IY, H/L become its halves and (HL)
+ * becomes (IX/IY+d), every other opcode executes as if unprefixed
+ * @tparam Prefix 0xDD (for IX) or 0xFD (for IY)
+ * @tparam Op actual instruction after prefix
+ */
+template<typename Bus>
+template<uint8_t Prefix, uint8_t Op>
+void Z80Core<Bus>::executeIndexed() {
+    constexpr uint8_t dest = (Op >> 3) & 0x07;
+    constexpr uint8_t src = Op & 0x07;
+    constexpr uint8_t rr = (Op >> 4) & 0x03;
+
+    // Another prefix: this one was a no-op, the next one starts over
+    if constexpr (Op == PREFIX_DD || Op == PREFIX_FD || Op == PREFIX_ED) {
+        pc--;
+    }
+    else if constexpr (!usesIndex(Op)) {
+        execute<Op>();
+    }
+
+    // DD CB d op, FD CB d op
+    else if constexpr (Op == PREFIX_CB) {
+        uint16_t addr = indexedAddress<Prefix>();
+        uint8_t opcode = readByte(pc++);
+        indexedCbTable[opcode](*this, addr);
+    }
+
+    // LD r,(IX/IY+d), LD (IX/IY+d),r - H and L stay H and L
+    else if constexpr ((Op & 0xC0) == 0x40 && (src == 6 || dest == 6)) {
+        uint16_t addr = indexedAddress<Prefix>();
+        if constexpr (src == 6) reg<dest>() = readByte(addr);
+        else writeByte(addr, reg<src>());
+    }
+    // LD r,r' with IXH/IXL/IYH/IYL
+    else if constexpr ((Op & 0xC0) == 0x40) {
+        indexHalf<Prefix, dest>() = indexHalf<Prefix, src>();
+    }
+    // ALU A,(IX/IY+d), ALU A,IXH/IXL/IYH/IYL
+    else if constexpr ((Op & 0xC0) == 0x80) {
+        if constexpr (src == 6) alu<dest>(readByte(indexedAddress<Prefix>()));
+        else alu<dest>(indexHalf<Prefix, src>());
+    }
+
+    // INC/DEC (IX/IY+d)
+    else if constexpr (Op == INC_HL) {
+        uint16_t addr = indexedAddress<Prefix>();
+        writeByte(addr, inc_(readByte(addr)));
+    }
+    else if constexpr (Op == DEC_HL) {
+        uint16_t addr = indexedAddress<Prefix>();
+        writeByte(addr, dec_(readByte(addr)));
+    }
+    // INC/DEC IXH/IXL/IYH/IYL
+    else if constexpr ((Op & 0xC7) == INC_B) inc(indexHalf<Prefix, dest>());
+    else if constexpr ((Op & 0xC7) == DEC_B) dec(indexHalf<Prefix, dest>());
+
+    // LD (IX/IY+d),n
+    else if constexpr (Op == LD_IXY_d) {
+        uint16_t addr = indexedAddress<Prefix>();
+        writeByte(addr, readByte(pc++));
+    }
+    // LD IXH/IXL/IYH/IYL,n
+    else if constexpr ((Op & 0xC7) == LD_B_N) {
+        indexHalf<Prefix, dest>() = readByte(pc++);
+    }
+
+    // LD IX/IY,nn, LD (nn),IX/IY, LD IX/IY,(nn), LD SP,IX/IY
+    else if constexpr (Op == LD_IXY) ld(indexReg<Prefix>());
+    else if constexpr (Op == LD_NN_HL) {
+        writeWord(readWord(pc), indexReg<Prefix>());
+        pc += 2;
+    }
+    else if constexpr (Op == LD_HL_INN) {
+        indexReg<Prefix>() = readWord(readWord(pc));
+        pc += 2;
+    }
+    else if constexpr (Op == LD_SP_HL) sp = indexReg<Prefix>();
+
+    // ADD IX/IY,rr, INC IX/IY, DEC IX/IY
+    else if constexpr ((Op & 0xCF) == ADD_HL_BC) addIndex<Prefix>(pair<Prefix, rr>());
+    else if constexpr (Op == INC_HL16) indexReg<Prefix>()++;
+    else if constexpr (Op == DEC_HL16) indexReg<Prefix>()--;
+
+    // PUSH IX/IY, POP IX/IY, EX (SP),IX/IY
+    else if constexpr (Op == PUSH_HL) push(indexReg<Prefix>());
+    else if constexpr (Op == POP_HL) indexReg<Prefix>() = pop();
+    else if constexpr (Op == EX_SP_HL) exSp<Prefix>();
+
+    // JP (IX/IY)
+    else {
+        static_assert(Op == JP_HL, "unhandled indexed opcode");
+        pc = indexReg<Prefix>();
+    }
+}
+
+/**
+ * Extended opcode handler:
+ * Opcodes following 0xED, unimplemented ones execute as no-ops
+ */
+template<typename Bus>
+template<uint8_t Op>
+void Z80Core<Bus>::executeExtended() {
+    constexpr uint8_t dest = (Op >> 3) & 0x07;
+    constexpr uint8_t rr = (Op >> 4) & 0x03;
+
+    // IN r,(C), OUT (C),r - (HL) codes read flags only / write 0
+    if constexpr ((Op & 0xC7) == IN_B_C) inC<dest>();
+    else if constexpr ((Op & 0xC7) == OUT_C_B) {
+        if constexpr (dest == 6) io.out(bc, 0);
+        else io.out(bc, reg<dest>());
+    }
+
+    // SBC HL,rr, ADC HL,rr
+    else if constexpr ((Op & 0xCF) == SBC_HL_BC) sbcHL(pair<0, rr>());
+    else if constexpr ((Op & 0xCF) == ADC_HL_BC) adcHL(pair<0, rr>());
+
+    // LD (nn),rr, LD rr,(nn)
+    else if constexpr ((Op & 0xCF) == LD_NN_BC) {
+        writeWord(readWord(pc), pair<0, rr>());
+        pc += 2;
+    }
+    else if constexpr ((Op & 0xCF) == LD_BC_INN) {
+        pair<0, rr>() = readWord(readWord(pc));
+        pc += 2;
+    }
+
+    // NEG and mirrors
+    else if constexpr ((Op & 0xC7) == NEG) {
+        uint8_t value = a;
+        a = 0;
+        sub(value);
+    }
+
+    // IM 0/1/2 and their undocumented mirrors
+    else if constexpr ((Op & 0xC7) == IM_0) {
+        constexpr uint8_t modes[4] = { 0, 0, 1, 2 };
+        im = modes[dest & 0x03];
+    }
+    // RETN, RETI and mirrors
+    else if constexpr ((Op & 0xC7) == RETN) retn();
+
+    // LD I,A, LD R,A, LD A,I, LD A,R
+    else if constexpr (Op == LD_I_A) i = a;
+    else if constexpr (Op == LD_R_A) {
+        r = a;
+        rFetches = 0;
+    }
+    else if constexpr (Op == LD_A_I) ldAIr(i);
+    else if constexpr (Op == LD_A_R) ldAIr(getR());
+
+    // RRD, RLD - rotate the digits of A's low nibble and (HL)
+    else if constexpr (Op == RRD || Op == RLD) {
+        uint8_t value = readByte(hl);
+        if constexpr (Op == RRD) writeByte(hl, uint8_t((a << 4) | (value >> 4)));
+        else writeByte(hl, uint8_t((value << 4) | (a & 0x0F)));
+        a = (a & 0xF0) | (Op == RRD ? value & 0x0F : value >> 4);
+        f = carryFlag() | flags.szp[a];
+        flagOp = FlagOp::None;
+    }
+
+    // LDI, LDD, LDIR, LDDR
+    else if constexpr (Op == LDI) blockCopy<1, false>();
+    else if constexpr (Op == LDD) blockCopy<-1, false>();
+    else if constexpr (Op == LDIR) blockCopy<1, true>();
+    else if constexpr (Op == LDDR) blockCopy<-1, true>();
+
+    // CPI, CPD, CPIR, CPDR
+    else if constexpr (Op == CPI) blockCompare<1, false>();
+    else if constexpr (Op == CPD) blockCompare<-1, false>();
+    else if constexpr (Op == CPIR) blockCompare<1, true>();
+    else if constexpr (Op == CPDR) blockCompare<-1, true>();
+
+    // INI, IND, INIR, INDR
+    else if constexpr (Op == INI) blockIn<1, false>();
+    else if constexpr (Op == IND) blockIn<-1, false>();
+    else if constexpr (Op == INIR) blockIn<1, true>();
+    else if constexpr (Op == INDR) blockIn<-1, true>();
+
+    // OUTI, OUTD, OTIR, OTDR
+    else if constexpr (Op == OUTI) blockOut<1, false>();
+    else if constexpr (Op == OUTD) blockOut<-1, false>();
+    else if constexpr (Op == OTIR) blockOut<1, true>();
+    else if constexpr (Op == OTDR) blockOut<-1, true>();
+}
+
+/**
+ * Bit instruction handler:
+ * Opcodes following 0xCB, all 256 of them are instructions
+ */
+template<typename Bus>
+template<uint8_t Op>
+void Z80Core<Bus>::executeCb() {
+    constexpr uint8_t group = Op & 0xC0;
+    constexpr uint8_t number = (Op >> 3) & 0x07;   // bit number or rotate/shift operation
+    constexpr uint8_t src = Op & 0x07;
+
+    if constexpr (group == CbOps::BIT) {
+        if constexpr (src == 6) bit(number, readByte(hl));
+        else bit(number, reg<src>());
+    }
+    else if constexpr (src == 6) {
+        uint16_t addr = hl;
+        uint8_t value = readByte(addr);
+        if constexpr (group == CbOps::SHIFT) writeByte(addr, shift<number>(value));
+        else if constexpr (group == CbOps::RES) writeByte(addr, value & ~(1 << number));
+        else writeByte(addr, value | (1 << number));
+    }
+    else {
+        uint8_t& target = reg<src>();
+        if constexpr (group == CbOps::SHIFT) target = shift<number>(target);
+        else if constexpr (group == CbOps::RES) target &= ~(1 << number);
+        else target |= 1 << number;
+    }
+}
+
+template<typename Bus>
+template<uint8_t Op>
+void Z80Core<Bus>::executeIndexedCb(uint16_t addr) {
+    constexpr uint8_t group = Op & 0xC0;
+    constexpr uint8_t number = (Op >> 3) & 0x07;
+    constexpr uint8_t src = Op & 0x07;
+
+    uint8_t value = readByte(addr);
+    if constexpr (group == CbOps::BIT) bit(number, value);
+    else {
+        if constexpr (group == CbOps::SHIFT) value = shift<number>(value);
+        else if constexpr (group == CbOps::RES) value &= ~(1 << number);
+        else value |= 1 << number;
+        writeByte(addr, value);
+        if constexpr (src != 6) reg<src>() = value;
+    }
+}
+
+/**
+ * Only RL and RR read the carry, the other rows of the table ignore it
+ */
+template<typename Bus>
+template<uint8_t Op>
+uint8_t Z80Core<Bus>::shift(uint8_t value) {
+    uint16_t result = flags.shift[carryFlag()][Op][value];
+    f = uint8_t(result);
+    flagOp = FlagOp::None;
+    return uint8_t(result >> 8);
+}
+
+/**
+* Single instruction execution:
+* Fetch opcode from memory at PC
+* Call its handler from the opcode table,
+* prefixes (DD/FD for IX/IY, ED, CB) dispatch through their own tables
+*/
+template<typename Bus>
+uint32_t Z80Core<Bus>::step() {
+    uint64_t start = cycles;
+    if (eventsDue() && serviceEvents()) return uint32_t(cycles - start);
+    if (halted) {
+        if (scheduler.nextDeadline() != Scheduler::NEVER) skipHalted(1, UINT64_MAX);
+        return uint32_t(cycles - start);
+    }
+    uint8_t opcode = readByte(pc++);
+    opTable[opcode](*this);
+    return uint32_t(cycles - start);
+}
+
+/**
+* Batched execution:
+* Runs the selected engine loop for up to count instructions,
+* an engine returning early leaves an event to service
+*/
+template<typename Bus>
+uint64_t Z80Core<Bus>::step(uint64_t count) {
+    uint64_t executed = runFor(count, UINT64_MAX);
+    while (executed < count && halted && scheduler.nextDeadline() != Scheduler::NEVER) {
+        executed += skipHalted(count - executed, UINT64_MAX);
+        executed += runFor(count - executed, UINT64_MAX);
+    }
+    return executed;
+}
+
+/**
+* No instruction is longer than MAX_INSTRUCTION T-states, so a slice
+* this long cannot run more than one instruction past the nearer of
+* endCycle and the next scheduled event
+*/
+template<typename Bus>
+uint64_t Z80Core<Bus>::runFor(uint64_t count, uint64_t endCycle) {
+    uint64_t executed = 0;
+    while (executed < count) {
+        if (eventsDue()) executed += serviceEvents();
+        if (halted || executed >= count || cycles >= endCycle) break;
+        uint64_t limit = std::min(endCycle, scheduler.nextDeadline());
+        if (limit != UINT64_MAX && idleWait) idleWait--;
+        else if (limit != UINT64_MAX) {
+            executed += skipIdleLoop(count - executed, limit);
+            if (executed >= count || cycles >= limit) continue;
+        }
+        uint64_t slice = count - executed;
+        if (limit != UINT64_MAX) {
+            slice = std::min(slice, std::max<uint64_t>((limit - cycles) / Timing::MAX_INSTRUCTION, 1));
+        }
+        cycleLimit = limit;
+        executed += runEngine(slice);
+        cycleLimit = UINT64_MAX;
+    }
+    return executed;
+}
+
+/**
+* Only an interrupt ends HALT, and only a scheduled event can raise
+* one during the run, so the NOPs before the event change nothing else
+*/
+template<typename Bus>
+uint64_t Z80Core<Bus>::skipHalted(uint64_t count, uint64_t endCycle) {
+    uint64_t wake = std::min(endCycle, scheduler.nextDeadline());
+    if (wake <= cycles) return 0;
+    uint64_t nops = std::min(count, (wake - cycles + 3) / 4);
+    cycles += nops * 4;
+    rFetches += uint8_t(nops);
+    return nops;
+}
+
+template<typename Bus>
+uint64_t Z80Core<Bus>::runEngine(uint64_t count) {
+    return blockCache.enabled() ? runBlocks(count) : dispatch(count);
+}
+
+/**
+* Run loop:
+* Limits and counters stay in locals, each slice runs inside the
+* engine loop without returning here per instruction
+*/
+template<typename Bus>
+RunResult Z80Core<Bus>::runLoop(uint64_t maxInstructions, uint64_t maxCycles, bool untilHalt) {
+    RunResult result{ RunStatus::Limit, 0, 0 };
+    uint64_t start = cycles;
+    uint64_t end = maxCycles == UINT64_MAX ? UINT64_MAX : start + maxCycles;
+    bool waiting = halted;
+    while (result.instructions < maxInstructions && cycles < end) {
+        // A halted CPU with nothing scheduled costs nothing until the host
+        // wakes it. Otherwise it executes its NOPs up to the next event at
+        // once, unless the run was to end on this HALT
+        if (halted && !eventsDue()) {
+            if (scheduler.nextDeadline() == Scheduler::NEVER || (untilHalt && !waiting)) {
+                result.status = RunStatus::Halted;
+                break;
+            }
+            result.instructions += skipHalted(maxInstructions - result.instructions, end);
+            continue;
+        }
+        if (stopRequest.pending.exchange(false, std::memory_order_relaxed)) {
+            result.status = RunStatus::Stopped;
+            break;
+        }
+
+        uint64_t slice = std::min(maxInstructions - result.instructions, RUN_SLICE);
+        bool checked = breakpointCount != 0;
+        uint64_t executed = checked ? stepChecked(slice, result.instructions == 0, end) : runFor(slice, end);
+        result.instructions += executed;
+        // Both stop on HALT, anything they execute means the CPU was woken up
+        if (executed) waiting = false;
+        if (checked && executed < slice && !halted && cycles < end) {
+            result.status = RunStatus::Breakpoint;
+            break;
+        }
+    }
+    // The limit may be reached exactly on HALT
+    if (result.status == RunStatus::Limit && halted && scheduler.nextDeadline() == Scheduler::NEVER) {
+        result.status = RunStatus::Halted;
+    }
+    result.cycles = cycles - start;
+    return result;
+}
+
+/**
+ * Polling loop detection:
+ * The loop may start anywhere, one iteration is whatever runs until PC
+ * comes back. The instructions allowed in it cannot write memory or
+ * ports, so with the registers back where they were the loop is stuck
+ * until an event changes memory or interrupts it
+ */
+template<typename Bus>
+uint64_t Z80Core<Bus>::skipIdleLoop(uint64_t count, uint64_t limit) {
+    uint16_t start = pc;
+    uint64_t startCycles = cycles;
+    uint8_t startFetches = rFetches;
+    const std::array<uint16_t, 4> state = { getAF(), bc, de, hl };
+    uint64_t executed = 0;
+    auto missed = [this, &executed]() {
+        idleBackoff = std::min(idleBackoff * 2 + 1, IDLE_PROBE_BACKOFF);
+        idleWait = idleBackoff;
+        return executed;
+    };
+    do {
+        if (executed == count || cycles >= limit) return executed;
+        if (executed == IDLE_LOOP_LENGTH || !pollingOp()) return missed();
+        uint8_t opcode = readByte(pc++);
+        opTable[opcode](*this);
+        executed++;
+    } while (pc != start);
+
+    if (cycles >= limit) return executed;
+    if (state != std::array<uint16_t, 4>{ getAF(), bc, de, hl }) return missed();
+    idleBackoff = 0;
+    uint64_t length = cycles - startCycles;
+    uint64_t iterations = std::min((limit - cycles) / length, (count - executed) / executed);
+    cycles += iterations * length;
+    rFetches += uint8_t(iterations * uint8_t(rFetches - startFetches));
+    return executed * (iterations + 1);
+}
+
+template<typename Bus>
+bool Z80Core<Bus>::pollingOp() const {
+    auto plain = [this](uint16_t addr) { return !memory.devicePage(addr >> MemoryMap::PAGE_SHIFT); };
+    if (!plain(pc) || !plain(pc + 2)) return false;
+    uint8_t opcode = readByte(pc);
+    uint8_t dest = (opcode >> 3) & 0x07;
+    uint8_t src = opcode & 0x07;
+
+    // LD r,r', LD r,(HL), ALU A,r, ALU A,(HL)
+    if ((opcode & 0xC0) == 0x40 || (opcode & 0xC0) == 0x80) {
+        if (opcode == HALT || ((opcode & 0xC0) == 0x40 && dest == 6)) return false;
+        return src != 6 || plain(hl);
+    }
+    // BIT b,r, BIT b,(HL)
+    if (opcode == PREFIX_CB) {
+        uint8_t bitOp = readByte(pc + 1);
+        return (bitOp & 0xC0) == CbOps::BIT && ((bitOp & 0x07) != 6 || plain(hl));
+    }
+    // LD A,(nn), LD A,(BC), LD A,(DE)
+    if (opcode == LD_A_INN) return plain(readWord(pc + 1));
+    if (opcode == LD_A_BC) return plain(bc);
+    if (opcode == LD_A_DE) return plain(de);
+    // LD r,n, ALU A,n, JP, JR
+    return ((opcode & 0xC7) == LD_B_N && opcode != LD_HL_N) || (opcode & 0xC7) == ADD_A_N
+        || opcode == JP_NN || (opcode & 0xC7) == JP_NZ
+        || opcode == JR || opcode == JR_NZ || opcode == JR_Z || opcode == JR_NC || opcode == JR_C;
+}
+
+template<typename Bus>
+RunResult Z80Core<Bus>::run(uint64_t maxInstructions) {
+    return runLoop(maxInstructions, UINT64_MAX, false);
+}
+
+template<typename Bus>
+RunResult Z80Core<Bus>::runUntilHalt() {
+    return runLoop(UINT64_MAX, UINT64_MAX, true);
+}
+
+template<typename Bus>
+RunResult Z80Core<Bus>::runCycles(uint64_t maxCycles) {
+    return runLoop(UINT64_MAX, maxCycles, false);
+}
+
+template<typename Bus>
+uint64_t Z80Core<Bus>::stepChecked(uint64_t count, bool resume, uint64_t endCycle) {
+    uint64_t executed = 0;
+    while (executed < count) {
+        if (eventsDue()) executed += serviceEvents();
+        if (halted || executed >= count || cycles >= endCycle) break;
+        if ((executed || !resume) && breakpoints[pc]) break;
+        cycleLimit = endCycle;
+        step();
+        cycleLimit = UINT64_MAX;
+        executed++;
+    }
+    return executed;
+}
+
+#ifndef Z80_THREADED_CORE
+
+/**
+* Table-driven engine:
+* One indirect call per instruction through opTable
+*/
+template<typename Bus>
+uint64_t Z80Core<Bus>::dispatch(uint64_t count) {
+    uint64_t executed = 0;
+    runLimit = count;
+    while (executed < runLimit) {
+        uint8_t opcode = readByte(pc++);
+        opTable[opcode](*this);
+        executed++;
+    }
+    return executed;
+}
+
+#else
+
+// Expand M(P, opcode) for every opcode 0x00-0xFF
+#define Z80_OPCODE_ROW(M, P, hi) \
+    M(P, 0x##hi##0) M(P, 0x##hi##1) M(P, 0x##hi##2) M(P, 0x##hi##3) \
+    M(P, 0x##hi##4) M(P, 0x##hi##5) M(P, 0x##hi##6) M(P, 0x##hi##7) \
+    M(P, 0x##hi##8) M(P, 0x##hi##9) M(P, 0x##hi##A) M(P, 0x##hi##B) \
+    M(P, 0x##hi##C) M(P, 0x##hi##D) M(P, 0x##hi##E) M(P, 0x##hi##F)
+#define Z80_FOR_EACH_OPCODE(M, P) \
+    Z80_OPCODE_ROW(M, P, 0) Z80_OPCODE_ROW(M, P, 1) Z80_OPCODE_ROW(M, P, 2) Z80_OPCODE_ROW(M, P, 3) \
+    Z80_OPCODE_ROW(M, P, 4) Z80_OPCODE_ROW(M, P, 5) Z80_OPCODE_ROW(M, P, 6) Z80_OPCODE_ROW(M, P, 7) \
+    Z80_OPCODE_ROW(M, P, 8) Z80_OPCODE_ROW(M, P, 9) Z80_OPCODE_ROW(M, P, A) Z80_OPCODE_ROW(M, P, B) \
+    Z80_OPCODE_ROW(M, P, C) Z80_OPCODE_ROW(M, P, D) Z80_OPCODE_ROW(M, P, E) Z80_OPCODE_ROW(M, P, F)
+
+#define Z80_LABEL_ADDRESS(P, Op) &&P##Op,
+
+// Count the finished instruction, fetch the next one and jump to its handler
+#define Z80_NEXT() \
+    if (++executed >= runLimit) return executed; \
+    goto *opLabels[readByte(pc++)]
+
+#define Z80_OP_HANDLER(P, Op) \
+    P##Op: \
+    rFetches++; \
+    if constexpr (Op == PREFIX_DD) goto *ddLabels[readByte(pc++)]; \
+    else if constexpr (Op == PREFIX_FD) goto *fdLabels[readByte(pc++)]; \
+    else if constexpr (Op == PREFIX_ED) goto *edLabels[readByte(pc++)]; \
+    else if constexpr (Op == PREFIX_CB) goto *cbLabels[readByte(pc++)]; \
+    else if constexpr (Op == HALT) { cycles += Timing::unprefixed[Op]; execute<Op>(); return ++executed; } \
+    else { cycles += Timing::unprefixed[Op]; execute<Op>(); Z80_NEXT(); }
+
+#define Z80_INDEXED_HANDLER(P, Op, Prefix) \
+    P##Op: \
+    if constexpr (Op != PREFIX_DD && Op != PREFIX_FD && Op != PREFIX_ED) rFetches++; \
+    cycles += Timing::indexedTable[Op]; \
+    executeIndexed<Prefix, Op>(); \
+    if constexpr (Op == HALT) return ++executed; \
+    Z80_NEXT();
+
+#define Z80_DD_HANDLER(P, Op) Z80_INDEXED_HANDLER(P, Op, PREFIX_DD)
+#define Z80_FD_HANDLER(P, Op) Z80_INDEXED_HANDLER(P, Op, PREFIX_FD)
+
+#define Z80_ED_HANDLER(P, Op) \
+    P##Op: \
+    rFetches++; \
+    cycles += Timing::extendedTable[Op]; \
+    executeExtended<Op>(); \
+    Z80_NEXT();
+
+#define Z80_CB_HANDLER(P, Op) \
+    P##Op: \
+    rFetches++; \
+    cycles += Timing::cbTable[Op]; \
+    executeCb<Op>(); \
+    Z80_NEXT();
+
+/**
+* Threaded engine:
+* Every handler is inlined into this function and ends with a jump
+* straight to the handler of the next opcode, no call/return per instruction
+*/
+template<typename Bus>
+uint64_t Z80Core<Bus>::dispatch(uint64_t count) {
+    static void* const opLabels[256] = { Z80_FOR_EACH_OPCODE(Z80_LABEL_ADDRESS, op_) };
+    static void* const ddLabels[256] = { Z80_FOR_EACH_OPCODE(Z80_LABEL_ADDRESS, dd_) };
+    static void* const fdLabels[256] = { Z80_FOR_EACH_OPCODE(Z80_LABEL_ADDRESS, fd_) };
+    static void* const edLabels[256] = { Z80_FOR_EACH_OPCODE(Z80_LABEL_ADDRESS, ed_) };
+    static void* const cbLabels[256] = { Z80_FOR_EACH_OPCODE(Z80_LABEL_ADDRESS, cb_) };
+
+    uint64_t executed = 0;
+    if (halted || count == 0) return executed;
+    runLimit = count;
+    goto *opLabels[readByte(pc++)];
+
+    Z80_FOR_EACH_OPCODE(Z80_OP_HANDLER, op_)
+    Z80_FOR_EACH_OPCODE(Z80_DD_HANDLER, dd_)
+    Z80_FOR_EACH_OPCODE(Z80_FD_HANDLER, fd_)
+    Z80_FOR_EACH_OPCODE(Z80_ED_HANDLER, ed_)
+    Z80_FOR_EACH_OPCODE(Z80_CB_HANDLER, cb_)
+}
+
+#undef Z80_CB_HANDLER
+#undef Z80_ED_HANDLER
+#undef Z80_FD_HANDLER
+#undef Z80_DD_HANDLER
+#undef Z80_INDEXED_HANDLER
+#undef Z80_OP_HANDLER
+#undef Z80_NEXT
+#undef Z80_LABEL_ADDRESS
+#undef Z80_FOR_EACH_OPCODE
+#undef Z80_OPCODE_ROW
+
+#endif
+
+template<typename Bus>
+template<size_t... Op>
+constexpr std::array<typename Z80Core<Bus>::BlockHandler, 256> Z80Core<Bus>::makeBlockTable(std::index_sequence<Op...>) {
+    return { { &Z80Core::executeDecoded<Op>... } };
+}
+
+template<typename Bus>
+template<uint8_t Prefix, size_t... Op>
+constexpr std::array<typename Z80Core<Bus>::BlockHandler, 256> Z80Core<Bus>::makeIndexedBlockTable(std::index_sequence<Op...>) {
+    return { { &Z80Core::executeDecodedIndexed<Prefix, Op>... } };
+}
+
+template<typename Bus>
+template<size_t... Op>
+constexpr std::array<typename Z80Core<Bus>::BlockHandler, 256> Z80Core<Bus>::makeExtendedBlockTable(std::index_sequence<Op...>) {
+    return { { &Z80Core::executeDecodedExtended<Op>... } };
+}
+
+template<typename Bus>
+template<size_t... Op>
+constexpr std::array<typename Z80Core<Bus>::BlockHandler, 256> Z80Core<Bus>::makeCbBlockTable(std::index_sequence<Op...>) {
+    return { { &Z80Core::executeDecodedCb<Op>... } };
+}
+
+template<typename Bus>
+const std::array<typename Z80Core<Bus>::BlockHandler, 256> Z80Core<Bus>::blockTable = makeBlockTable(std::make_index_sequence<256>{});
+template<typename Bus>
+const std::array<typename Z80Core<Bus>::BlockHandler, 256> Z80Core<Bus>::ddBlockTable = makeIndexedBlockTable<PREFIX_DD>(std::make_index_sequence<256>{});
+template<typename Bus>
+const std::array<typename Z80Core<Bus>::BlockHandler, 256> Z80Core<Bus>::fdBlockTable = makeIndexedBlockTable<PREFIX_FD>(std::make_index_sequence<256>{});
+template<typename Bus>
+const std::array<typename Z80Core<Bus>::BlockHandler, 256> Z80Core<Bus>::edBlockTable = makeExtendedBlockTable(std::make_index_sequence<256>{});
+template<typename Bus>
+const std::array<typename Z80Core<Bus>::BlockHandler, 256> Z80Core<Bus>::cbBlockTable = makeCbBlockTable(std::make_index_sequence<256>{});
+
+/**
+ * Length in bytes of an unprefixed instruction
+ */
+static constexpr uint8_t opcodeLength(uint8_t opcode) {
+    // LD r,n, LD (HL),n, ALU A,n, IN A,(n), OUT (n),A
+    if ((opcode & 0xC7) == LD_B_N || (opcode & 0xC7) == ADD_A_N || opcode == IN_A_N || opcode == OUT_N_A) return 2;
+    // JR e, JR cc,e
+    if (opcode == JR || opcode == JR_NZ || opcode == JR_Z || opcode == JR_NC || opcode == JR_C) return 2;
+    // LD dd,nn, LD (nn),HL, LD HL,(nn), LD (nn),A, LD A,(nn)
+    if ((opcode & 0xCF) == LD_BC_NN || opcode == LD_NN_HL || opcode == LD_HL_INN
+        || opcode == LD_NN_A || opcode == LD_A_INN) return 3;
+    // JP nn, JP cc,nn, CALL nn, CALL cc,nn
+    if (opcode == JP_NN || (opcode & 0xC7) == JP_NZ || opcode == CALL_NN || (opcode & 0xC7) == CALL_NZ) return 3;
+    return 1;
+}
+
+/**
+ * Length in bytes of an instruction following the prefix 0xDD/0xFD, prefix included
+ */
+static constexpr uint8_t indexedLength(uint8_t opcode) {
+    // Another prefix follows, executes as a no-op
+    if (opcode == PREFIX_DD || opcode == PREFIX_FD || opcode == PREFIX_ED) return 1;
+    // LD (IX/IY+d),n, DD CB d op
+    if (opcode == LD_IXY_d || opcode == PREFIX_CB) return 4;
+    // ALU A,(IX/IY+d), INC/DEC (IX/IY+d), LD r,(IX/IY+d), LD (IX/IY+d),r
+    if (hasDisplacement(opcode)) return 3;
+    // Everything else has the operands of its unprefixed form
+    return 1 + opcodeLength(opcode);
+}
+
+/**
+ * Instructions after which the next PC is known only at run time
+ */
+static constexpr bool endsBlock(uint8_t opcode) {
+    return opcode == JP_NN || (opcode & 0xC7) == JP_NZ
+        || opcode == JR || opcode == JR_NZ || opcode == JR_Z || opcode == JR_NC || opcode == JR_C
+        || opcode == CALL_NN || (opcode & 0xC7) == CALL_NZ
+        || opcode == RET || (opcode & 0xC7) == RET_NZ
+        || opcode == JP_HL || opcode == HALT;
+}
+
+/**
+ * Decode instructions from start until a branch or the block size limit,
+ * extracting immediates, displacements and relative branch targets
+ */
+template<typename Bus>
+Block* Z80Core<Bus>::decodeBlock(uint16_t start) {
+    Block block;
+    block.start = start;
+    block.ops.reserve(BlockCache::MAX_BLOCK_OPS);
+
+    // Immediate operand of the opcode at addr, relative jumps store their absolute target
+    auto immediate = [this](uint8_t opcode, uint16_t addr, uint16_t next) -> uint16_t {
+        uint8_t length = opcodeLength(opcode);
+        uint16_t value = length == 3 ? readWord(addr + 1) : length == 2 ? readByte(addr + 1) : 0;
+        if (opcode == JR || opcode == JR_NZ || opcode == JR_Z || opcode == JR_NC || opcode == JR_C) {
+            value = next + int8_t(value);
+        }
+        return value;
+    };
+
+    uint16_t addr = start;
+    bool last = false;
+    while (!last && block.ops.size() < BlockCache::MAX_BLOCK_OPS) {
+        DecodedOp op{};
+        uint8_t opcode = readByte(addr);
+
+        if (opcode == PREFIX_DD || opcode == PREFIX_FD) {
+            uint8_t indexed = readByte(addr + 1);
+            op.prefix = opcode;
+            op.opcode = indexed;
+            op.handler = opcode == PREFIX_DD ? ddBlockTable[indexed] : fdBlockTable[indexed];
+            op.next = addr + indexedLength(indexed);
+            if (hasDisplacement(indexed)) {
+                op.displacement = readByte(addr + 2);
+                op.operand = readByte(addr + 3);
+            }
+            else if (indexed != PREFIX_DD && indexed != PREFIX_FD && indexed != PREFIX_ED) {
+                op.operand = immediate(indexed, addr + 1, op.next);
+            }
+            last = endsBlock(indexed);
+        }
+        else if (opcode == PREFIX_ED) {
+            uint8_t extended = readByte(addr + 1);
+            op.prefix = opcode;
+            op.opcode = extended;
+            op.handler = edBlockTable[extended];
+            op.next = addr + ((extended & 0xC7) == LD_NN_BC ? 4 : 2);
+            if ((extended & 0xC7) == LD_NN_BC) op.operand = readWord(addr + 2);
+            last = (extended & 0xC7) == RETN;
+        }
+        else if (opcode == PREFIX_CB) {
+            uint8_t bitOp = readByte(addr + 1);
+            op.prefix = opcode;
+            op.opcode = bitOp;
+            op.handler = cbBlockTable[bitOp];
+            op.next = addr + 2;
+        }
+        else {
+            op.handler = blockTable[opcode];
+            op.opcode = opcode;
+            op.next = addr + opcodeLength(opcode);
+            op.operand = immediate(opcode, addr, op.next);
+            last = endsBlock(opcode);
+        }
+
+        block.ops.push_back(op);
+        addr = op.next;
+    }
+
+    block.end = addr;
+    return blockCache.insert(std::move(block));
+}
+
+/**
+* Block cache engine:
+* Looks the block at PC up (decoding it on a miss) and runs its
+* instructions back to back. A write into a page holding code
+* ends the block early, so self-modifying code sees its own changes.
+* With the JIT enabled, translated blocks run as host code and blocks
+* get translated once they have been executed often enough
+*/
+template<typename Bus>
+uint64_t Z80Core<Bus>::runBlocks(uint64_t count) {
+    uint64_t executed = 0;
+    Jit* jit = blockCache.jit();
+    runLimit = count;
+    while (executed < runLimit) {
+        if (jit) {
+            if (const uint8_t* code = jit->lookup(pc)) {
+                blockCache.exitBlock = false;
+                uint64_t done = jit->run(*this, code, count - executed);
+                executed += done;
+                // nothing runs when the budget is below the block length
+                if (done) continue;
+            }
+        }
+
+        Block* block = blockCache.lookup(pc);
+        if (!block) block = decodeBlock(pc);
+
+        if (jit && ++block->execCount == jit->hotThreshold()) {
+            jit->translate(*this, *block);
+            continue;
+        }
+
+        // Only the last op of the block is the end of the run
+        size_t length = std::min<uint64_t>(block->ops.size(), count - executed);
+        const DecodedOp* op = block->ops.data();
+        const DecodedOp* end = op + length;
+        blockCache.exitBlock = false;
+        do {
+            pc = op->next;
+            op->handler(*this, *op);
+        } while (++op != end && !blockCache.exitBlock);
+        executed += op - block->ops.data();
+    }
+    return executed;
+}
+
+/**
+ * Predecoded unprefixed opcode handler:
+ * PC already points after the instruction
+ */
+template<typename Bus>
+template<uint8_t Op>
+void Z80Core<Bus>::executeDecoded(Z80State& state, const DecodedOp& op) {
+    Z80Core& cpu = static_cast<Z80Core&>(state);
+    constexpr uint8_t dest = (Op >> 3) & 0x07;
+    cpu.rFetches++;
+    cpu.cycles += Timing::unprefixed[Op];
+
+    // LD (HL),n, LD r,n
+    if constexpr (Op == LD_HL_N) cpu.writeByte(cpu.hl, op.operand);
+    else if constexpr ((Op & 0xC7) == LD_B_N) cpu.reg<dest>() = op.operand;
+    // ALU A,n
+    else if constexpr ((Op & 0xC7) == ADD_A_N) cpu.alu<dest>(op.operand);
+
+    // LD dd,nn
+    else if constexpr (Op == LD_BC_NN) cpu.bc = op.operand;
+    else if constexpr (Op == LD_DE_NN) cpu.de = op.operand;
+    else if constexpr (Op == LD_HL_NN) cpu.hl = op.operand;
+    else if constexpr (Op == LD_SP_NN) cpu.sp = op.operand;
+    // LD (nn),HL, LD HL,(nn)
+    else if constexpr (Op == LD_NN_HL) cpu.writeWord(op.operand, cpu.hl);
+    else if constexpr (Op == LD_HL_INN) cpu.hl = cpu.readWord(op.operand);
+    // LD (nn),A, LD A,(nn)
+    else if constexpr (Op == LD_NN_A) cpu.writeByte(op.operand, cpu.a);
+    else if constexpr (Op == LD_A_INN) cpu.a = cpu.readByte(op.operand);
+
+    // IN A,(n), OUT (n),A
+    else if constexpr (Op == IN_A_N) cpu.a = cpu.io.in(uint16_t((cpu.a << 8) | op.operand));
+    else if constexpr (Op == OUT_N_A) cpu.io.out(uint16_t((cpu.a << 8) | op.operand), cpu.a);
+
+    // JP nn, JR e, conditional variants
+    else if constexpr (Op == JP_NN || Op == JR) cpu.pc = op.operand;
+    else if constexpr ((Op & 0xC7) == JP_NZ) {
+        if (cpu.checkCondition(dest)) cpu.pc = op.operand;
+    }
+    else if constexpr (Op == JR_NZ || Op == JR_Z || Op == JR_NC || Op == JR_C) {
+        if (cpu.checkCondition(dest & 0x03)) {
+            cpu.pc = op.operand;
+            cpu.cycles += Timing::JR_TAKEN;
+        }
+    }
+
+    // CALL nn, CALL cc,nn
+    else if constexpr (Op == CALL_NN) {
+        cpu.push(cpu.pc);
+        cpu.pc = op.operand;
+    }
+    else if constexpr ((Op & 0xC7) == CALL_NZ) {
+        if (cpu.checkCondition(dest)) {
+            cpu.push(cpu.pc);
+            cpu.pc = op.operand;
+            cpu.cycles += Timing::CALL_TAKEN;
+        }
+    }
+
+    // Instructions without operands
+    else cpu.execute<Op>();
+}
+
+/**
+ * Predecoded prefixed opcode handler:
+ * The displacement is already extracted, the index register is fixed by Prefix.
+ * Opcodes the prefix does not change run their unprefixed handler
+ */
+template<typename Bus>
+template<uint8_t Prefix, uint8_t Op>
+void Z80Core<Bus>::executeDecodedIndexed(Z80State& state, const DecodedOp& op) {
+    Z80Core& cpu = static_cast<Z80Core&>(state);
+    constexpr uint8_t dest = (Op >> 3) & 0x07;
+    constexpr uint8_t src = Op & 0x07;
+
+    // Another prefix, PC already points at it
+    if constexpr (Op == PREFIX_DD || Op == PREFIX_FD || Op == PREFIX_ED) {
+        cpu.rFetches++;
+        cpu.cycles += Timing::indexedTable[Op];
+    }
+    else if constexpr (!usesIndex(Op)) {
+        cpu.rFetches++;
+        cpu.cycles += Timing::indexedTable[Op] - Timing::unprefixed[Op];
+        executeDecoded<Op>(cpu, op);
+    }
+    else {
+        uint16_t& index = cpu.indexReg<Prefix>();
+        uint16_t addr = index + op.displacement;
+        cpu.rFetches += 2;
+        cpu.cycles += Timing::indexedTable[Op];
+
+        // LD r,(IX/IY+d), LD (IX/IY+d),r
+        if constexpr ((Op & 0xC0) == 0x40 && (src == 6 || dest == 6)) {
+            if constexpr (src == 6) cpu.reg<dest>() = cpu.readByte(addr);
+            else cpu.writeByte(addr, cpu.reg<src>());
+        }
+        // ALU A,(IX/IY+d)
+        else if constexpr ((Op & 0xC0) == 0x80 && src == 6) cpu.alu<dest>(cpu.readByte(addr));
+        // INC/DEC (IX/IY+d)
+        else if constexpr (Op == INC_HL) cpu.writeByte(addr, cpu.inc_(cpu.readByte(addr)));
+        else if constexpr (Op == DEC_HL) cpu.writeByte(addr, cpu.dec_(cpu.readByte(addr)));
+        // LD (IX/IY+d),n, LD IXH/IXL/IYH/IYL,n
+        else if constexpr (Op == LD_IXY_d) cpu.writeByte(addr, op.operand);
+        else if constexpr ((Op & 0xC7) == LD_B_N) cpu.indexHalf<Prefix, dest>() = op.operand;
+        // DD CB d op, the opcode is the operand
+        else if constexpr (Op == PREFIX_CB) indexedCbTable[op.operand](cpu, addr);
+        // LD IX/IY,nn, LD (nn),IX/IY, LD IX/IY,(nn)
+        else if constexpr (Op == LD_IXY) index = op.operand;
+        else if constexpr (Op == LD_NN_HL) cpu.writeWord(op.operand, index);
+        else if constexpr (Op == LD_HL_INN) index = cpu.readWord(op.operand);
+        // Instructions without operands
+        else cpu.executeIndexed<Prefix, Op>();
+    }
+}
+
+/**
+ * Predecoded extended opcode handler:
+ * LD (nn),rr and LD rr,(nn) are the only 0xED opcodes with operands
+ */
+template<typename Bus>
+template<uint8_t Op>
+void Z80Core<Bus>::executeDecodedExtended(Z80State& state, const DecodedOp& op) {
+    Z80Core& cpu = static_cast<Z80Core&>(state);
+    constexpr uint8_t rr = (Op >> 4) & 0x03;
+    cpu.rFetches += 2;
+    cpu.cycles += Timing::extendedTable[Op];
+    if constexpr ((Op & 0xCF) == LD_NN_BC) cpu.writeWord(op.operand, cpu.pair<0, rr>());
+    else if constexpr ((Op & 0xCF) == LD_BC_INN) cpu.pair<0, rr>() = cpu.readWord(op.operand);
+    else cpu.executeExtended<Op>();
+}
+
+template<typename Bus>
+template<uint8_t Op>
+void Z80Core<Bus>::executeDecodedCb(Z80State& state, const DecodedOp&) {
+    Z80Core& cpu = static_cast<Z80Core&>(state);
+    cpu.rFetches += 2;
+    cpu.cycles += Timing::cbTable[Op];
+    cpu.executeCb<Op>();
+}
+
+template<typename Bus>
+void Z80Core<Bus>::retn() {
+    pc = pop();
+    iff1 = iff2;
+    if (iff1 && intLine) raiseEvent();
+}
+
+/**
+ * Due scheduled events fire first, so an interrupt they raise is
+ * accepted right away. NMI wins over INT. An accepted interrupt wakes
+ * a halted CPU, which continues after its HALT once the handler returns.
+ * IM 0 executes only RST opcodes from the bus, INT with any other byte
+ * is not accepted
+ */
+template<typename Bus>
+uint64_t Z80Core<Bus>::serviceEvents() {
+    if (cycles >= scheduler.nextDeadline()) scheduler.runDue(cycles);
+    uint64_t executed = 0;
+    while (eiShadow) {
+        eiShadow = false;
+        if (halted) break;
+        uint8_t opcode = readByte(pc++);
+        opTable[opcode](*this);
+        executed++;
+    }
+    eventPending = false;
+
+    if (nmiPending) {
+        nmiPending = false;
+        iff2 = iff1;
+        iff1 = false;
+        acceptInterrupt(0x0066, Timing::NMI);
+    }
+    else if (intLine && iff1 && (im != 0 || (intData & 0xC7) == RST_00)) {
+        iff1 = iff2 = false;
+        if (im == 2) acceptInterrupt(readWord(uint16_t((i << 8) | intData)), Timing::IM2);
+        else if (im == 1) acceptInterrupt(0x0038, Timing::IM0_IM1);
+        else acceptInterrupt(intData & 0x38, Timing::IM0_IM1);
+    }
+    return executed;
+}
+
+template<typename Bus>
+void Z80Core<Bus>::acceptInterrupt(uint16_t handler, uint8_t cost) {
+    if (halted) {
+        halted = false;
+        pc++;
+    }
+    push(pc);
+    pc = handler;
+    cycles += cost;
+    rFetches++;
+}
+
+/**
+* Load 16-bit value
+*/
+template<typename Bus>
+void Z80Core<Bus>::ld(uint16_t& reg) {
+    reg = readByte(pc) | (readByte(pc + 1) << 8);
+    pc += 2;
+}
+
+/**
+* Input from port BC:
+* S, Z, P/V from the value, H and N cleared, carry kept
+*/
+template<typename Bus>
+template<uint8_t Reg>
+void Z80Core<Bus>::inC() {
+    uint8_t value = io.in(bc);
+    f = carryFlag() | flags.szp[value];
+    flagOp = FlagOp::None;
+    if constexpr (Reg != 6) reg<Reg>() = value;
+}
+
+/**
+* Block input:
+* Every transfer reads port BC into (HL), steps HL and decrements B.
+* The port's high byte is B before its decrement, so only a device
+* decoding the low byte sees a single port for a repeated transfer,
+* which then reaches it as one batched call. A repeating input pauses
+* for the running slice or a scheduled event like a block copy
+* N set, Z set when B reaches 0
+*/
+template<typename Bus>
+template<int Step, bool Repeat>
+void Z80Core<Bus>::blockIn() {
+    uint32_t count = Repeat ? repeatCount(b ? b : 256) : 1;
+    uint8_t buffer[256];
+    if (io.lowByteDecoded(bc)) {
+        if (IoDevice* device = io.device(bc)) device->inBlock(bc, buffer, count);
+        else std::fill(buffer, buffer + count, IoBus::FLOATING);
+    }
+    else {
+        for (uint32_t i = 0; i < count; i++) buffer[i] = io.in(uint16_t(((b - i) << 8) | c));
+    }
+    for (uint32_t i = 0; i < count; i++) {
+        writeByte(hl, buffer[i]);
+        hl += Step;
+    }
+    b -= uint8_t(count);
+    f = carryFlag() | flags.sz[b] | N_FLAG;
+    flagOp = FlagOp::None;
+    if constexpr (Repeat) repeatBlock(count, b != 0);
+}
+
+/**
+* Block output:
+* Every transfer decrements B, then writes (HL) to port BC and steps HL,
+* a repeating output pauses like a repeating input
+* N set, Z set when B reaches 0
+*/
+template<typename Bus>
+template<int Step, bool Repeat>
+void Z80Core<Bus>::blockOut() {
+    uint32_t count = Repeat ? repeatCount(b ? b : 256) : 1;
+    uint8_t buffer[256];
+    for (uint32_t i = 0; i < count; i++) {
+        buffer[i] = readByte(hl);
+        hl += Step;
+    }
+    uint16_t port = uint16_t(((b - 1) << 8) | c);
+    if (io.lowByteDecoded(port)) {
+        if (IoDevice* device = io.device(port)) device->outBlock(port, buffer, count);
+    }
+    else {
+        for (uint32_t i = 0; i < count; i++) io.out(uint16_t(((b - 1 - i) << 8) | c), buffer[i]);
+    }
+    b -= uint8_t(count);
+    f = carryFlag() | flags.sz[b] | N_FLAG;
+    flagOp = FlagOp::None;
+    if constexpr (Repeat) repeatBlock(count, b != 0);
+}
+
+/**
+* Block copy:
+* Every transfer copies (HL) to (DE), steps both and decrements BC.
+* A repeating copy runs all its transfers in one call unless the running
+* slice or a scheduled event ends first, then it pauses with PC on the
+* instruction and picks up where it stopped once the event is serviced
+* H and N cleared, P/V set while BC is not 0
+*/
+template<typename Bus>
+template<int Step, bool Repeat>
+void Z80Core<Bus>::blockCopy() {
+    uint32_t count = Repeat ? repeatCount(bc ? bc : 0x10000) : 1;
+    copyBytes<Step>(count);
+    bc -= uint16_t(count);
+    materializeFlags();
+    f = (f & (S_FLAG | Z_FLAG | C_FLAG)) | (bc ? PV_FLAG : 0);
+    if constexpr (Repeat) repeatBlock(count, bc != 0);
+}
+
+/**
+* Block compare:
+* Every transfer compares A with (HL), steps HL and decrements BC,
+* a repeating compare stops at the first match
+* S, Z, H from A - (HL), N set, P/V set while BC is not 0, carry kept
+*/
+template<typename Bus>
+template<int Step, bool Repeat>
+void Z80Core<Bus>::blockCompare() {
+    uint32_t count = Repeat ? repeatCount(bc ? bc : 0x10000) : 1;
+    uint8_t value = 0;
+    count = findByte<Step>(count, value);
+    bc -= uint16_t(count);
+    f = carryFlag() | (flags.sub[0][a][value] & (S_FLAG | Z_FLAG | H_FLAG)) | N_FLAG | (bc ? PV_FLAG : 0);
+    flagOp = FlagOp::None;
+    if constexpr (Repeat) repeatBlock(count, bc != 0 && value != a);
+}
+
+/**
+* Copies run in chunks that stay within one page of the source and one
+* of the destination, so each chunk is a single host range on either side.
+* A chunk is one memmove unless the destination overlaps source bytes
+* the transfer has yet to read: one byte ahead of the source is the fill
+* idiom and becomes a memset, any other such overlap and chunks through
+* device pages go byte by byte
+*/
+template<typename Bus>
+template<int Step>
+void Z80Core<Bus>::copyBytes(uint32_t count) {
+    constexpr uint32_t mask = MemoryMap::PAGE_SIZE - 1;
+    while (count) {
+        // bytes to the end of the page in the direction of the copy
+        uint32_t chunk = Step > 0 ? MemoryMap::PAGE_SIZE - (hl & mask) : (hl & mask) + 1;
+        chunk = std::min(chunk, Step > 0 ? MemoryMap::PAGE_SIZE - (de & mask) : (de & mask) + 1);
+        chunk = std::min(chunk, count);
+
+        // lowest address of either range
+        uint16_t src = Step > 0 ? hl : uint16_t(hl - chunk + 1);
+        uint16_t dst = Step > 0 ? de : uint16_t(de - chunk + 1);
+        // the write may give a shared page a private copy, look the source up after it
+        uint8_t* to = memory.writePointer(dst, chunk);
+        const uint8_t* from = memory.readPointer(src);
+        bool perByte = !from || !to;
+        if (!perByte) {
+            // distance from the first byte read to the first byte written
+            ptrdiff_t ahead = Step > 0 ? to - from : from - to;
+            if (ahead == 1) std::memset(to, Step > 0 ? from[0] : from[chunk - 1], chunk);
+            else if (ahead > 1 && ahead < ptrdiff_t(chunk)) perByte = true;
+            else std::memmove(to, from, chunk);
+        }
+        if (perByte) {
+            for (uint32_t i = 0; i < chunk; i++) {
+                writeByte(uint16_t(de + Step * int(i)), readByte(uint16_t(hl + Step * int(i))));
+            }
+        }
+        else blockCache.onWrite(dst, chunk);
+        hl += uint16_t(Step * int(chunk));
+        de += uint16_t(Step * int(chunk));
+        count -= chunk;
+    }
+}
+
+/**
+* Forward searches of plain memory use memchr per page,
+* everything else compares byte by byte
+*/
+template<typename Bus>
+template<int Step>
+uint32_t Z80Core<Bus>::findByte(uint32_t count, uint8_t& last) {
+    constexpr uint32_t mask = MemoryMap::PAGE_SIZE - 1;
+    uint32_t compared = 0;
+    while (compared < count) {
+        uint32_t chunk = Step > 0 ? MemoryMap::PAGE_SIZE - (hl & mask) : (hl & mask) + 1;
+        chunk = std::min(chunk, count - compared);
+        const uint8_t* from = memory.readPointer(hl);
+        uint32_t length = chunk;
+        if (Step > 0 && from) {
+            const void* match = std::memchr(from, a, chunk);
+            if (match) length = uint32_t(static_cast<const uint8_t*>(match) - from) + 1;
+            last = from[length - 1];
+        }
+        else {
+            for (length = 1; ; length++) {
+                last = readByte(uint16_t(hl + Step * int(length - 1)));
+                if (last == a || length == chunk) break;
+            }
+        }
+        hl += uint16_t(Step * int(length));
+        compared += length;
+        if (last == a) break;
+    }
+    return compared;
+}
+
+template<typename Bus>
+void Z80Core<Bus>::repeatBlock(uint32_t count, bool more) {
+    cycles += uint64_t(count - 1) * (Timing::extendedTable[LDIR] + Timing::BLOCK_REPEAT);
+    // every repetition fetches ED and the opcode again
+    rFetches += uint8_t(2 * (count - 1));
+    if (more) {
+        cycles += Timing::BLOCK_REPEAT;
+        pc -= 2;
+        raiseEvent();
+    }
+}
+
+/**
+* Load PC into HL
+*/
+template<typename Bus>
+void Z80Core<Bus>::ldHL() {
+    writeByte(hl, readByte(pc++));
+}
+
+/**
+* Absolute jump
+*/
+template<typename Bus>
+void Z80Core<Bus>::jp() {
+    uint16_t addr = readByte(pc) | (readByte(pc + 1) << 8);
+    pc = addr;
+}
+
+/**
+ * Conditional jump:
+ * Checks condition code and jumps if met
+ * @param opcode condition encoded in bits 5-3
+ */
+template<typename Bus>
+void Z80Core<Bus>::condJP(uint8_t opcode) {
+    uint8_t condition = (opcode >> 3) & 0x07;
+    uint16_t addr = readByte(pc) | (readByte(pc + 1) << 8);
+    pc += 2;
+    if (checkCondition(condition)) {
+        pc = addr;
+    }
+    
+}
+
+/**
+* Relative jump:
+* PC += signed 8-bit offset
+*/
+template<typename Bus>
+void Z80Core<Bus>::jr() {
+    int8_t offset = readByte(pc++);
+    pc += offset;
+}
+
+/**
+* Conditional relative jump:
+* Extracts condition code from opcode bits 5-3
+* Reads signed offset from the next byte
+* Jumps if condition is satisfied
+*/
+template<typename Bus>
+void Z80Core<Bus>::condJR(uint8_t opcode) {
+    uint8_t condition = (opcode >> 3) & 0x03;
+    int8_t offset = readByte(pc++);
+    if (checkCondition(condition)) {
+        pc += offset;
+        cycles += Timing::JR_TAKEN;
+    }
+}
+
+/**
+* Subroutine call:
+* Reads 16-bit target address
+* pushes return address onto stack
+* sets PC to target address
+*/
+template<typename Bus>
+void Z80Core<Bus>::call() {
+    uint16_t addr = readByte(pc) | (readByte(pc + 1) << 8);
+    pc += 2;
+    push(pc); 
+    pc = addr;
+}
+
+/**
+* Conditional soubroutine call:
+* Check condition from the opcode
+* Execute if condition met
+*/
+template<typename Bus>
+void Z80Core<Bus>::condCall(uint8_t opcode) {
+    uint8_t condition = (opcode >> 3) & 0x07;
+    uint16_t addr = readByte(pc) | (readByte(pc + 1) << 8);
+    pc += 2;
+    if (checkCondition(condition)) {
+        push(pc);
+        pc = addr;
+        cycles += Timing::CALL_TAKEN;
+    }
+}
+
+/**
+* Conditional return from subroutine:
+* check condition from the opcode
+* Pops return address if condition met
+*/
+template<typename Bus>
+void Z80Core<Bus>::condRet(uint8_t opcode) {
+    uint8_t condition = (opcode >> 3) & 0x07;
+    if (checkCondition(condition)) {
+        pc = pop();
+        cycles += Timing::RET_TAKEN;
+    }
+}
+
+/**
+* Push 16-bit value onto stack:
+* Store high byte at SP-1
+* Low byte at SP-2
+* (Z80 is LE)
+*/
+template<typename Bus>
+void Z80Core<Bus>::push(uint16_t value) {
+    writeByte(--sp, (value >> 8) & 0xFF);
+    writeByte(--sp, value & 0xFF);
+}
+
+/**
+* Pop 16-bit value from the stack:
+* Read low Byte on SP
+* High byte on SP + 1
+*/
+template<typename Bus>
+uint16_t Z80Core<Bus>::pop() {
+    uint16_t lo = readByte(sp++);
+    uint16_t hi = readByte(sp++);
+    return (hi << 8) | lo;
+}
+
+/**
+* Bulk load:
+* Copies page by page, pages holding a device take the bytes one at a time.
+* Code in the loaded range is invalidated as writeByte would
+*/
+template<typename Bus>
+void Z80Core<Bus>::loadImage(uint16_t addr, const uint8_t* data, size_t size) {
+    size = std::min<size_t>(size, 0x10000);
+    constexpr uint32_t mask = MemoryMap::PAGE_SIZE - 1;
+    for (size_t done = 0; done < size; ) {
+        uint16_t start = uint16_t(addr + done);
+        uint32_t chunk = uint32_t(std::min<size_t>(MemoryMap::PAGE_SIZE - (start & mask), size - done));
+        if (uint8_t* to = memory.writePointer(start, chunk)) std::memcpy(to, data + done, chunk);
+        else {
+            for (uint32_t i = 0; i < chunk; i++) memory.write(uint16_t(start + i), data[done + i]);
+        }
+        blockCache.onWrite(start, chunk);
+        done += chunk;
+    }
+}
+
+/**
+* Bulk read:
+* Pages holding a device are read one byte at a time
+*/
+template<typename Bus>
+void Z80Core<Bus>::dumpImage(uint16_t addr, uint8_t* data, size_t size) const {
+    size = std::min<size_t>(size, 0x10000);
+    constexpr uint32_t mask = MemoryMap::PAGE_SIZE - 1;
+    for (size_t done = 0; done < size; ) {
+        uint16_t start = uint16_t(addr + done);
+        uint32_t chunk = uint32_t(std::min<size_t>(MemoryMap::PAGE_SIZE - (start & mask), size - done));
+        if (const uint8_t* from = memory.readPointer(start)) std::memcpy(data + done, from, chunk);
+        else {
+            for (uint32_t i = 0; i < chunk; i++) data[done + i] = memory.read(uint16_t(start + i));
+        }
+        done += chunk;
+    }
+}
+
+/**
+* Read a 16-bit word:
+* Low byte at addr, high byte at addr + 1
+*/
+template<typename Bus>
+uint16_t Z80Core<Bus>::readWord(uint16_t addr) const {
+    return readByte(addr) | (readByte(uint16_t(addr + 1)) << 8);
+}
+
+/**
+* Write a 16-bit word:
+* Low byte at addr, high byte at addr + 1
+*/
+template<typename Bus>
+void Z80Core<Bus>::writeWord(uint16_t addr, uint16_t value) {
+    writeByte(addr, value & 0xFF);
+    writeByte(uint16_t(addr + 1), value >> 8);
+}
+
+/**
+* @brief The CPU on 64KB of flat RAM
+*/
+using Z80Flat = Z80Core<FlatBus>;
+
+#endif
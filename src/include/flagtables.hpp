@@ -0,0 +1,237 @@
+#ifndef FLAGTABLES_HPP
+#define FLAGTABLES_HPP
+
+#include "cpu.hpp"
+#include <cstdint>
+
+/**
+* @brief Flag formulas of the 8-bit ALU and tables precomputed from them
+*
+* The formulas are evaluated at compile time for every possible input,
+* so the ALU helpers in Z80 only perform table lookups.
+*/
+namespace FlagTables {
+
+    /**
+    * @brief Calculate parity of a value
+    * @details Uses XOR folding
+    * @return true for even parity, false for odd
+    */
+    constexpr bool parityEven(uint8_t value) {
+        value ^= value >> 4;
+        value ^= value >> 2;
+        value ^= value >> 1;
+        return (value & 1) == 0;
+    }
+
+    /**
+    * @brief Sign and Zero flags of a result
+    */
+    constexpr uint8_t signZero(uint8_t value) {
+        return (value == 0 ? Z80State::Z_FLAG : 0) | (value & 0x80 ? Z80State::S_FLAG : 0);
+    }
+
+    /**
+    * @brief Flags after addition operation
+    * @param original_a register A before addition
+    * @param value Value added
+    * @param res 16-bit addition result
+    * @details Zero, Sign, Half-carry (carry from bit 3),
+    * Parity/Overflow (signed overflow), Carry (result exceeds 8 bits)
+    */
+    constexpr uint8_t add(uint8_t original_a, uint8_t value, uint16_t res) {
+        uint8_t result = res & 0xFF;
+        uint8_t f = signZero(result);
+        if (((original_a & 0x0F) + (value & 0x0F)) > 0x0F) f |= Z80State::H_FLAG;
+        if (((original_a ^ result) & (value ^ result)) & 0x80) f |= Z80State::PV_FLAG;
+        if (res > 0xFF) f |= Z80State::C_FLAG;
+        return f;
+    }
+
+    /**
+    * @brief Flags after subtraction operation
+    * @param original_a register A before subtraction
+    * @param value Value subtracted
+    * @param res 16-bit subtraction result
+    * @details Subtract, Zero, Sign, Half-carry (borrow from bit 4),
+    * Parity/Overflow (signed underflow), Carry (value > original)
+    */
+    constexpr uint8_t sub(uint8_t original_a, uint8_t value, uint16_t res) {
+        uint8_t result = res & 0xFF;
+        uint8_t f = Z80State::N_FLAG | signZero(result);
+        if ((original_a & 0x0F) < (value & 0x0F)) f |= Z80State::H_FLAG;
+        if (((original_a ^ value) & (original_a ^ result)) & 0x80) f |= Z80State::PV_FLAG;
+        if (res > 0xFF) f |= Z80State::C_FLAG;
+        return f;
+    }
+
+    /**
+    * @brief Flags after INC/DEC operation (Carry excluded)
+    * @param res Result value
+    * @param old Original value
+    * @param inc true = INC, false = DEC
+    * @details Half-carry: overflow in lower nibble,
+    * Parity: overflow from 0x7F (INC) or 0x80 (DEC)
+    */
+    constexpr uint8_t incDec(uint8_t res, uint8_t old, bool inc) {
+        uint8_t f = signZero(res);
+        if (!inc) f |= Z80State::N_FLAG;
+        if (inc ? (old & 0x0F) == 0x0F : (old & 0x0F) == 0x00) f |= Z80State::H_FLAG;
+        if ((inc && old == 0x7F) || (!inc && old == 0x80)) f |= Z80State::PV_FLAG;
+        return f;
+    }
+
+    /**
+    * @brief Decimal Adjust Accumulator
+    * @param a accumulator before adjustment
+    * @param f flags before adjustment (N, H and C are used)
+    * @return adjusted accumulator in the high byte, flags in the low byte
+    */
+    constexpr uint16_t daa(uint8_t a, uint8_t f) {
+        uint8_t original_a = a;
+        uint8_t adjust = 0;
+        bool subtract = (f & Z80State::N_FLAG);
+        bool new_carry = (f & Z80State::C_FLAG);
+
+        if (!subtract) {
+            // Addition
+            if ((f & Z80State::H_FLAG) || (a & 0x0F) > 9) {
+                adjust += 0x06;
+            }
+            if ((f & Z80State::C_FLAG) || (a > 0x99) || ((a + adjust) > 0x99)) {
+                adjust += 0x60;
+                new_carry = true;
+            }
+        }
+        else {
+            // Subtraction
+            if ((f & Z80State::H_FLAG) || (a & 0x0F) > 9) {
+                adjust += 0xFA;
+            }
+            if (f & Z80State::C_FLAG) {
+                adjust += 0xA0;
+                new_carry = true;
+            }
+            else {
+                new_carry = (a < adjust);
+            }
+        }
+
+        a += adjust;
+        new_carry |= (a > 0x99);
+
+        uint8_t res_f = signZero(a);
+        res_f |= parityEven(a) ? Z80State::PV_FLAG : 0;
+        res_f |= new_carry ? Z80State::C_FLAG : 0;
+        if (!subtract) {
+            res_f |= ((original_a & 0x0F) + (adjust & 0x0F) > 0x0F) ? Z80State::H_FLAG : 0;
+        }
+        return (a << 8) | res_f;
+    }
+
+    /**
+    * @brief Index of the N, H and C flags in the DAA table
+    */
+    constexpr uint16_t daaIndex(uint8_t a, uint8_t f) {
+        return (((f & Z80State::C_FLAG) | (f & Z80State::N_FLAG) | ((f & Z80State::H_FLAG) >> 2)) << 8) | a;
+    }
+
+    /**
+    * @brief Rotates and shifts of the 0xCB page
+    * @param op operation (see CbOps)
+    * @param value operand
+    * @param carry carry in, used by RL and RR
+    * @return result in the high byte, flags in the low byte:
+    * S, Z, PV (parity) of the result, Carry the bit shifted out, H and N reset
+    */
+    constexpr uint16_t shift(uint8_t op, uint8_t value, bool carry) {
+        bool left = op == CbOps::RLC || op == CbOps::RL || op == CbOps::SLA || op == CbOps::SLL;
+        bool out = left ? (value & 0x80) : (value & 0x01);
+        uint8_t result = 0;
+        switch (op) {
+        case CbOps::RLC: result = uint8_t((value << 1) | (value >> 7)); break;
+        case CbOps::RRC: result = uint8_t((value >> 1) | (value << 7)); break;
+        case CbOps::RL: result = uint8_t((value << 1) | (carry ? 1 : 0)); break;
+        case CbOps::RR: result = uint8_t((value >> 1) | (carry ? 0x80 : 0)); break;
+        case CbOps::SLA: result = uint8_t(value << 1); break;
+        case CbOps::SRA: result = uint8_t((value >> 1) | (value & 0x80)); break;
+        case CbOps::SLL: result = uint8_t((value << 1) | 1); break;
+        default: result = uint8_t(value >> 1); break;
+        }
+        uint8_t f = signZero(result) | (parityEven(result) ? Z80State::PV_FLAG : 0) | (out ? Z80State::C_FLAG : 0);
+        return uint16_t((result << 8) | f);
+    }
+
+    /**
+    * @brief Flags after BIT (Carry excluded)
+    * @details Z and PV are set when the bit is 0, S when bit 7 is tested and set, H is set
+    */
+    constexpr uint8_t bit(uint8_t number, uint8_t value) {
+        if (!(value & (1 << number))) return Z80State::H_FLAG | Z80State::Z_FLAG | Z80State::PV_FLAG;
+        return Z80State::H_FLAG | (number == 7 ? Z80State::S_FLAG : 0);
+    }
+
+    /**
+    * @brief Flag results for every input of the ALU operations
+    */
+    struct Tables {
+        uint8_t sz[256];            // S, Z of a result
+        uint8_t szp[256];           // S, Z, PV (even parity) of a result
+        uint8_t add[2][256][256];   // ADD/ADC [carry][A][value]
+        uint8_t sub[2][256][256];   // SUB/SBC/CP [carry][A][value]
+        uint8_t inc[256];           // INC [old value], Carry excluded
+        uint8_t dec[256];           // DEC [old value], Carry excluded
+        uint16_t daa[8 * 256];      // DAA [daaIndex(A, F)] -> A << 8 | F
+        uint16_t shift[2][8][256];  // RLC..SRL [carry][operation][value] -> result << 8 | F
+        uint8_t bit[8][256];        // BIT [bit][value], Carry excluded
+    };
+
+    /**
+    * @brief Evaluate the flag formulas for all inputs
+    */
+    constexpr Tables build() {
+        Tables t{};
+        for (int v = 0; v < 256; v++) {
+            t.sz[v] = signZero(v);
+            t.szp[v] = signZero(v) | (parityEven(v) ? Z80State::PV_FLAG : 0);
+            t.inc[v] = incDec(v + 1, v, true);
+            t.dec[v] = incDec(v - 1, v, false);
+        }
+        for (int carry = 0; carry < 2; carry++) {
+            for (int a = 0; a < 256; a++) {
+                for (int v = 0; v < 256; v++) {
+                    // ADC/SBC pass the operand with the carry already added
+                    uint8_t operand = v + carry;
+                    t.add[carry][a][v] = add(a, operand, a + v + carry);
+                    t.sub[carry][a][v] = sub(a, operand, uint16_t(a - (v + carry)));
+                }
+            }
+        }
+        for (int n = 0; n < 8; n++) {
+            for (int v = 0; v < 256; v++) {
+                t.shift[0][n][v] = shift(n, v, false);
+                t.shift[1][n][v] = shift(n, v, true);
+                t.bit[n][v] = bit(n, v);
+            }
+        }
+        for (int nhc = 0; nhc < 8; nhc++) {
+            uint8_t f = (nhc & 0x01 ? Z80State::C_FLAG : 0) | (nhc & 0x02 ? Z80State::N_FLAG : 0) | (nhc & 0x04 ? Z80State::H_FLAG : 0);
+            for (int a = 0; a < 256; a++) {
+                t.daa[daaIndex(a, f)] = daa(a, f);
+            }
+        }
+        return t;
+    }
+
+    inline constexpr Tables tables = build();
+
+    static_assert(tables.szp[0x00] == (Z80State::Z_FLAG | Z80State::PV_FLAG), "szp table");
+    static_assert(tables.add[0][0x7F][0x01] == (Z80State::S_FLAG | Z80State::H_FLAG | Z80State::PV_FLAG), "add table");
+    static_assert(tables.sub[1][0x00][0x00] == (Z80State::S_FLAG | Z80State::H_FLAG | Z80State::N_FLAG | Z80State::C_FLAG), "sub table");
+    static_assert(tables.shift[1][CbOps::RL][0x80] == ((0x01 << 8) | Z80State::C_FLAG), "shift table");
+    static_assert(tables.shift[0][CbOps::SRA][0x81] == ((0xC0 << 8) | Z80State::S_FLAG | Z80State::PV_FLAG | Z80State::C_FLAG), "shift table");
+    static_assert(tables.bit[7][0x80] == (Z80State::S_FLAG | Z80State::H_FLAG), "bit table");
+    static_assert(tables.daa[daaIndex(0x50, Z80State::C_FLAG)] == ((0xB0 << 8) | Z80State::S_FLAG | Z80State::C_FLAG), "daa table");
+}
+
+#endif
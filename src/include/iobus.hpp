@@ -0,0 +1,91 @@
+#ifndef IOBUS_HPP
+#define IOBUS_HPP
+
+#include <array>
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+/**
+* @brief Peripheral reached through IN/OUT
+* @details Receives the full 16-bit port address, the high byte is A
+* for IN A,(n)/OUT (n),A and B for the (C) forms
+*/
+class IoDevice {
+public:
+    virtual ~IoDevice() = default;
+    virtual uint8_t in(uint16_t port) = 0;
+    virtual void out(uint16_t port, uint8_t value) = 0;
+
+    /**
+    * @brief Input of a whole INIR/INDR transfer in one call
+    * @param port port of the first transfer
+    * @details The default reads the bytes one at a time
+    */
+    virtual void inBlock(uint16_t port, uint8_t* data, size_t size);
+
+    /**
+    * @brief Output of a whole OTIR/OTDR transfer in one call
+    */
+    virtual void outBlock(uint16_t port, const uint8_t* data, size_t size);
+};
+
+/**
+* @class IoBus
+* @brief Port address space, a device table indexed by the low port byte
+*
+* Most Z80 machines decode only the low 8 bits of the port address,
+* a lookup is then a single table access. Devices attached with full
+* decoding are kept in one short list and matched against all 16 bits,
+* ahead of an 8-bit device on the same low byte. A bit per low byte tells
+* whether the list has to be searched at all.
+*/
+class IoBus {
+public:
+    static constexpr uint8_t FLOATING = 0xFF;   // read from ports without a device
+
+    /**
+    * @brief Attach a device to a port
+    * @param fullDecode match all 16 bits instead of the low byte only
+    */
+    void attach(uint16_t port, IoDevice* device, bool fullDecode = false);
+
+    /**
+    * @brief Detach a device from every port it was attached to
+    */
+    void detach(IoDevice* device);
+
+    /**
+    * @brief Device answering a port, nullptr if none does
+    */
+    IoDevice* device(uint16_t port) const {
+        if (fullDecoded[port & 0xFF]) return fullDevice(port);
+        return devices[port & 0xFF];
+    }
+
+    /**
+    * @brief Whether every port sharing the low byte reaches the same device
+    * @details Lets block transfers hand the whole buffer to one device
+    */
+    bool lowByteDecoded(uint16_t port) const { return !fullDecoded[port & 0xFF]; }
+
+    uint8_t in(uint16_t port) const {
+        IoDevice* target = device(port);
+        return target ? target->in(port) : FLOATING;
+    }
+
+    void out(uint16_t port, uint8_t value) const {
+        if (IoDevice* target = device(port)) target->out(port, value);
+    }
+
+private:
+    IoDevice* fullDevice(uint16_t port) const;
+
+    std::array<IoDevice*, 256> devices{};                   // low byte decoded
+    std::bitset<256> fullDecoded;                           // low bytes with fully decoded ports
+    std::vector<std::pair<uint16_t, IoDevice*>> full;       // fully decoded ports
+};
+
+#endif
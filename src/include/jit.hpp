@@ -0,0 +1,139 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include "blockcache.hpp"
+#include <cstdint>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+// Host code generation needs an x86-64 System V host with mmap
+#if defined(__x86_64__) && defined(__unix__)
+#define Z80_JIT_SUPPORTED
+#endif
+
+class Z80State;
+
+/**
+* @class Jit
+* @brief Dynamic recompiler of hot basic blocks to x86-64 code
+*
+* Guest registers stay in the CPU state, the translated code addresses
+* them through a host register holding the CPU pointer. Register loads,
+* 8-bit ALU operations and branches are emitted as host instructions,
+* every other instruction calls its predecoded block handler.
+* Translated blocks jump straight to translated successors, the links
+* are removed again when the block cache invalidates a page.
+*/
+class Jit {
+public:
+    static constexpr uint32_t HOT_THRESHOLD = 16;      // block executions before translation
+    static constexpr size_t CODE_SIZE = 16 << 20;       // host code buffer
+    static constexpr size_t MAX_TRANSLATION = 8 << 10;  // upper bound of one translated block
+
+    /**
+    * @brief Whether this build can generate host code
+    */
+    static bool supported();
+
+    /**
+    * @param counters block cache counters receiving the translation count
+    * @param hotThreshold block executions before translation
+    */
+    Jit(BlockCacheStats& counters, uint32_t hotThreshold);
+    ~Jit();
+
+    Jit(const Jit&) = delete;
+    Jit& operator=(const Jit&) = delete;
+
+    uint32_t hotThreshold() const { return threshold; }
+
+    /**
+    * @brief Whether the code buffer could be set up, the host may refuse executable memory
+    */
+    bool ready() const { return buffer != nullptr; }
+
+    /**
+    * @brief Translated code of the block starting at pc
+    * @return host code or nullptr if the block is not translated
+    */
+    const uint8_t* lookup(uint16_t pc) const {
+        const Translation* translation = translations[pc].get();
+        return translation ? translation->code : nullptr;
+    }
+
+    /**
+    * @brief Translate a decoded block and link it with its neighbours
+    * @return host code of the block
+    */
+    const uint8_t* translate(const Z80State& cpu, const Block& block);
+
+    /**
+    * @brief Run translated code until a block exits to the interpreter
+    * @param code host code returned by lookup or translate
+    * @param budget maximum number of instructions to execute
+    * @return number of executed instructions
+    */
+    uint64_t run(Z80State& cpu, const uint8_t* code, uint64_t budget);
+
+    /**
+    * @brief Drop every translation decoded from a page and unlink jumps into them
+    */
+    void invalidatePage(int page);
+
+    /**
+    * @brief Drop every translation and reuse the code buffer
+    */
+    void flush();
+
+private:
+    /**
+    * @brief Patchable jump from a translated block to a successor
+    */
+    struct Exit {
+        uint8_t* jump;      // rel32 field of the jump
+        uint8_t* stub;      // stub returning to the interpreter
+        uint16_t target;    // guest address of the successor
+    };
+
+    /**
+    * @brief Exit of a translation, referenced by the successor address
+    */
+    struct ExitRef {
+        uint16_t from;      // start of the translation owning the exit
+        uint32_t index;     // index into its exits
+    };
+
+    struct Translation {
+        uint16_t start;
+        int firstPage;
+        int lastPage;
+        const uint8_t* code;
+        std::vector<Exit> exits;
+    };
+
+    void link(Exit& exit, const uint8_t* code);
+    void unlink(Exit& exit);
+    void drop(uint16_t start);
+    void writePerfMap(const uint8_t* code, size_t size, uint16_t start);
+
+    /**
+    * @brief Switch the code buffer between writable and executable
+    * @return false if the host refuses the protection
+    */
+    bool setWritable(bool writable);
+
+    BlockCacheStats& counters;
+    uint32_t threshold;
+
+    uint8_t* buffer = nullptr;      // mapped host code, starts with the entry/exit routine, never writable while it runs
+    size_t used = 0;                // bytes used in buffer
+    size_t routineSize = 0;         // bytes of the entry/exit routine
+    const uint8_t* exitRoutine = nullptr;
+
+    std::vector<std::unique_ptr<Translation>> translations;                 // indexed by start address
+    std::vector<std::vector<uint16_t>> pageTranslations;                   // translation starts per page
+    std::unordered_map<uint16_t, std::vector<ExitRef>> exitsTo;            // exits per successor address
+};
+
+#endif
@@ -0,0 +1,246 @@
+#ifndef LOCKSTEP_HPP
+#define LOCKSTEP_HPP
+
+#include "cpu.hpp"
+#include <cstdint>
+#include <memory>
+
+/**
+* @brief 8-bit ALU of the lock-step engine, one operation for every lane at once
+*
+* The flag formulas of flagtables.hpp written as arithmetic instead of table
+* lookups, so the loops over the lanes compile to SIMD code (SSE2 on any
+* x86-64 host, AVX2 with make SIMD=avx2). Every kernel processes all LANES
+* lanes, lanes that are not running compute values nobody reads.
+*/
+namespace LaneAlu {
+    constexpr int LANES = 32;
+
+    // Flags INC and DEC write, Carry and the undocumented bits are kept
+    constexpr uint8_t INC_DEC = Z80State::S_FLAG | Z80State::Z_FLAG | Z80State::H_FLAG | Z80State::PV_FLAG | Z80State::N_FLAG;
+
+    /**
+    * @brief S, Z and even parity (as PV) of a result
+    */
+    inline uint8_t szp(uint8_t value) {
+        uint8_t parity = value ^ (value >> 4);
+        parity ^= parity >> 2;
+        parity ^= parity >> 1;
+        return (value & Z80State::S_FLAG) | (value == 0 ? Z80State::Z_FLAG : 0) | ((~parity & 1) << 2);
+    }
+
+    /**
+    * @brief ADD/ADC: A += value + carry
+    */
+    inline void add(uint8_t* a, uint8_t* f, const uint8_t* value, const uint8_t* carry) {
+        for (int lane = 0; lane < LANES; lane++) {
+            unsigned sum = a[lane] + value[lane] + carry[lane];
+            uint8_t operand = value[lane] + carry[lane];
+            uint8_t result = uint8_t(sum);
+            f[lane] = (result & Z80State::S_FLAG) | (result == 0 ? Z80State::Z_FLAG : 0)
+                | (((a[lane] & 0x0F) + (operand & 0x0F)) & Z80State::H_FLAG)
+                | ((((a[lane] ^ result) & (operand ^ result)) >> 5) & Z80State::PV_FLAG)
+                | uint8_t(sum >> 8);
+            a[lane] = result;
+        }
+    }
+
+    /**
+    * @brief SUB/SBC/CP: A - (value + carry), stored only if store is set
+    */
+    inline void sub(uint8_t* a, uint8_t* f, const uint8_t* value, const uint8_t* carry, bool store) {
+        for (int lane = 0; lane < LANES; lane++) {
+            int difference = a[lane] - value[lane] - carry[lane];
+            uint8_t operand = value[lane] + carry[lane];
+            uint8_t result = uint8_t(difference);
+            f[lane] = Z80State::N_FLAG | (result & Z80State::S_FLAG) | (result == 0 ? Z80State::Z_FLAG : 0)
+                | (((a[lane] & 0x0F) - (operand & 0x0F)) & Z80State::H_FLAG)
+                | ((((a[lane] ^ operand) & (a[lane] ^ result)) >> 5) & Z80State::PV_FLAG)
+                | (difference < 0 ? Z80State::C_FLAG : 0);
+            if (store) a[lane] = result;
+        }
+    }
+
+    inline void andA(uint8_t* a, uint8_t* f, const uint8_t* value) {
+        for (int lane = 0; lane < LANES; lane++) {
+            a[lane] &= value[lane];
+            f[lane] = szp(a[lane]) | Z80State::H_FLAG;
+        }
+    }
+
+    inline void orA(uint8_t* a, uint8_t* f, const uint8_t* value) {
+        for (int lane = 0; lane < LANES; lane++) {
+            a[lane] |= value[lane];
+            f[lane] = szp(a[lane]);
+        }
+    }
+
+    inline void xorA(uint8_t* a, uint8_t* f, const uint8_t* value) {
+        for (int lane = 0; lane < LANES; lane++) {
+            a[lane] ^= value[lane];
+            f[lane] = szp(a[lane]);
+        }
+    }
+
+    /**
+    * @brief INC r, Carry kept
+    */
+    inline void inc(uint8_t* reg, uint8_t* f) {
+        for (int lane = 0; lane < LANES; lane++) {
+            uint8_t old = reg[lane];
+            uint8_t result = old + 1;
+            f[lane] = (f[lane] & ~INC_DEC) | (result & Z80State::S_FLAG) | (result == 0 ? Z80State::Z_FLAG : 0)
+                | ((old & 0x0F) == 0x0F ? Z80State::H_FLAG : 0) | (old == 0x7F ? Z80State::PV_FLAG : 0);
+            reg[lane] = result;
+        }
+    }
+
+    /**
+    * @brief DEC r, Carry kept
+    */
+    inline void dec(uint8_t* reg, uint8_t* f) {
+        for (int lane = 0; lane < LANES; lane++) {
+            uint8_t old = reg[lane];
+            uint8_t result = old - 1;
+            f[lane] = (f[lane] & ~INC_DEC) | Z80State::N_FLAG | (result & Z80State::S_FLAG) | (result == 0 ? Z80State::Z_FLAG : 0)
+                | ((old & 0x0F) == 0x00 ? Z80State::H_FLAG : 0) | (old == 0x80 ? Z80State::PV_FLAG : 0);
+            reg[lane] = result;
+        }
+    }
+}
+
+/**
+* @class LockstepGroup
+* @brief Up to 32 CPUs running the same program side by side, one per lane
+*
+* Every register is an array with one element per lane and memory is
+* interleaved byte by byte (lane l of address x at x * LANES + l), so each
+* instruction runs for all lanes at once: a fetch or an access to the
+* same address in every lane is one contiguous load, and the ALU works
+* through the LaneAlu kernels.
+*
+* Lanes stay together while they fetch the same opcode at the same PC.
+* Before an instruction that would split them (a branch going another way,
+* another jump target, different code), the lanes differing from the
+* majority are peeled off: each gets a scalar Z80 with its registers and
+* memory and finishes the run there. Instructions the lock-step engine
+* does not implement (prefixed opcodes, I/O, ...) peel every lane.
+* Lanes have no interrupt lines, ports or devices.
+*/
+class LockstepGroup {
+public:
+    static constexpr int LANES = LaneAlu::LANES;
+
+    /**
+    * @param lanes number of CPUs, 1 to LANES, all starting from reset state
+    */
+    explicit LockstepGroup(int lanes);
+    ~LockstepGroup();
+
+    int laneCount() const { return count; }
+
+    void writeByte(int lane, uint16_t addr, uint8_t value);
+    uint8_t readByte(int lane, uint16_t addr) const;
+
+    /**
+    * @brief Write the same bytes to every lane
+    */
+    void load(uint16_t addr, const uint8_t* data, size_t size);
+
+    void setRegisters(int lane, const Z80Registers& registers);
+    Z80Registers getRegisters(int lane) const;
+    uint64_t getCycles(int lane) const;
+    bool isHalted(int lane) const;
+
+    /**
+    * @brief Run every lane for a T-state budget, as Z80::runCycles would
+    */
+    void runCycles(uint64_t maxCycles);
+
+    /**
+    * @brief Outcome of the lane's part of the last runCycles call
+    */
+    const RunResult& result(int lane) const { return results[lane]; }
+
+    /**
+    * @brief Whether the lane left lock-step and runs on a scalar Z80
+    */
+    bool peeled(int lane) const { return scalar[lane] != nullptr; }
+
+    /**
+    * @brief Instructions executed in lock-step, counted once for all lanes
+    */
+    uint64_t lockstepInstructions() const { return totalInstructions; }
+
+private:
+    /**
+    * @brief Execute one instruction for all running lanes
+    * @return false if the instruction peeled every lane
+    */
+    bool step();
+
+    /**
+    * @brief Move a lane to a scalar Z80, at the instruction it is about to execute
+    */
+    void peel(int lane);
+
+    /**
+    * @brief Peel every running lane where keep is 0
+    */
+    void keepLanes(const uint8_t* keep);
+
+    /**
+    * @brief Peel the running lanes whose value differs from the leader's
+    */
+    void keepEqual(const uint8_t* values);
+    void keepEqual(const uint16_t* values);
+
+    /**
+    * @brief Peel the running lanes on the minority side of a condition
+    * @return whether the remaining lanes take the branch
+    */
+    bool keepMajority(const uint8_t* condition);
+
+    uint8_t* column(uint16_t addr) { return memory.get() + size_t(addr) * LANES; }
+    const uint8_t* column(uint16_t addr) const { return memory.get() + size_t(addr) * LANES; }
+    uint8_t& at(int lane, uint16_t addr) { return memory[size_t(addr) * LANES + lane]; }
+    uint16_t word(int lane, uint16_t addr) { return uint16_t(at(lane, addr) | (at(lane, uint16_t(addr + 1)) << 8)); }
+
+    uint16_t pair(int code, int lane) const;
+    void setPair(int code, int lane, uint16_t value);
+    void condition(uint8_t code, uint8_t* out) const;
+    void immediate(uint16_t* out) const;
+    void push(const uint16_t* values);
+
+    // Registers, indexed by register code, slot 6 (the (HL) code) holds F
+    alignas(32) uint8_t regs[8][LANES];
+    alignas(32) uint8_t alternate[8][LANES];
+    alignas(32) uint16_t sp[LANES];
+    uint16_t ix[LANES];
+    uint16_t iy[LANES];
+    uint16_t lanePc[LANES];     // PC and HALT state of every lane between runs
+    bool laneHalted[LANES];
+    uint8_t running[LANES];     // 1 while the lane runs in lock-step
+    uint8_t i[LANES];
+    uint8_t r[LANES];
+    uint64_t rFetches[LANES];   // fetches when R was written
+    bool iff1[LANES];
+    bool iff2[LANES];
+    uint8_t im[LANES];
+
+    uint16_t pc;                // shared by all running lanes during a run
+    uint64_t cycles;
+    uint64_t fetches;           // opcode fetches, the same for all running lanes
+    bool halted;
+    int count;
+    int runningCount;
+    int leader;                 // first running lane
+    uint64_t totalInstructions;
+
+    std::unique_ptr<uint8_t[]> memory;     // 64KB per lane, interleaved
+    std::unique_ptr<Z80> scalar[LANES];    // peeled lanes
+    RunResult results[LANES];
+    uint64_t peeledAt[LANES];              // lock-step instructions executed when the lane was peeled
+};
+
+#endif
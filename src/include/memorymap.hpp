@@ -0,0 +1,233 @@
+#ifndef MEMORYMAP_HPP
+#define MEMORYMAP_HPP
+
+#include "bus.hpp"
+#include <array>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/**
+* @brief Device registers mapped into the address space
+* @details Receives the full 16-bit address of every access in its range
+*/
+class MmioDevice {
+public:
+    virtual ~MmioDevice() = default;
+    virtual uint8_t read(uint16_t addr) = 0;
+    virtual void write(uint16_t addr, uint8_t value) = 0;
+};
+
+/**
+* @class MemoryMap
+* @brief Page table translating the 16-bit address space to host memory
+*
+* Every page has a read pointer and a write pointer. RAM pages point both
+* at the same bytes, ROM pages send their writes to a sink page that is
+* never read, so dropping a write costs no extra check.
+* Mapping a page only stores pointers, banked memory is never copied.
+* Unmapped pages use the built-in RAM, 16 reference-counted pages allocated
+* apart from the map so the CPU object itself stays small. Pages are shared
+* copy-on-write: a fresh map shares one page of zeroes, a fork shares the
+* pages of its parent, and the first write to a shared page copies it.
+* Shared pages have no write fast pointer, so only that first write pays.
+* Pages holding a memory-mapped device have null fast pointers, only
+* accesses to them search the device list.
+* Writes mark their 256-byte block dirty, clearRam zeroes only those.
+*/
+class MemoryMap {
+public:
+    static constexpr int PAGE_SHIFT = 12;
+    static constexpr uint32_t PAGE_SIZE = 1 << PAGE_SHIFT;
+    static constexpr int PAGE_COUNT = 0x10000 >> PAGE_SHIFT;
+
+    MemoryMap();
+
+    /**
+    * @brief Copies get their own built-in RAM, pages mapped to host memory stay shared
+    * @details Pages the other map already shares are shared by the copy too
+    */
+    MemoryMap(const MemoryMap& other);
+    MemoryMap& operator=(const MemoryMap& other);
+    MemoryMap(MemoryMap&& other) = default;
+    MemoryMap& operator=(MemoryMap&& other) = default;
+
+    /**
+    * @brief Copy sharing every page of built-in RAM with this map, copy-on-write
+    * @details Costs no RAM, each map copies a page when it first writes to it
+    */
+    MemoryMap fork();
+
+    uint8_t read(uint16_t addr) const {
+        const uint8_t* page = readPages[addr >> PAGE_SHIFT];
+        if (page) return page[addr & (PAGE_SIZE - 1)];
+        return readDevice(addr);
+    }
+
+    void write(uint16_t addr, uint8_t value) {
+        uint8_t* page = writePages[addr >> PAGE_SHIFT];
+        if (page) {
+            page[addr & (PAGE_SIZE - 1)] = value;
+            dirty.mark(addr);
+        }
+        else writeDevice(addr, value);
+    }
+
+    /**
+    * @brief Point a page at host memory
+    * @param page page number (address >> PAGE_SHIFT)
+    * @param read PAGE_SIZE bytes read through the page
+    * @param write PAGE_SIZE bytes written through the page, nullptr drops writes
+    */
+    void map(int page, const uint8_t* read, uint8_t* write);
+
+    /**
+    * @brief Point a page back at the built-in RAM
+    */
+    void unmap(int page);
+
+    /**
+    * @brief Whether writes to the page are dropped
+    */
+    bool readOnly(int page) const { return sink && mappedWrite[page] == sink.get(); }
+
+    /**
+    * @brief Host memory behind addr for bulk reads, valid to the end of its page
+    * @return nullptr if the page holds a device
+    */
+    const uint8_t* readPointer(uint16_t addr) const {
+        const uint8_t* page = readPages[addr >> PAGE_SHIFT];
+        return page ? page + (addr & (PAGE_SIZE - 1)) : nullptr;
+    }
+
+    /**
+    * @brief Host memory behind addr for bulk writes, the sink on read-only pages
+    * @param size bytes the caller writes, up to the end of the page
+    * @return nullptr if the page holds a device
+    */
+    uint8_t* writePointer(uint16_t addr, uint32_t size) {
+        uint8_t* page = writePages[addr >> PAGE_SHIFT];
+        if (!page) page = ownPage(addr >> PAGE_SHIFT);
+        if (!page) return nullptr;
+        dirty.mark(addr, size);
+        return page + (addr & (PAGE_SIZE - 1));
+    }
+
+    /**
+    * @brief Whether accesses to the page may reach a device
+    */
+    bool devicePage(int page) const { return readPages[page] == nullptr; }
+
+    /**
+    * @brief Route accesses to [start, start + size) to a device
+    * @details Addresses outside every device on the same page keep reaching memory
+    */
+    void addDevice(uint16_t start, uint32_t size, MmioDevice* device);
+
+    /**
+    * @brief Remove every range routed to a device
+    */
+    void removeDevice(MmioDevice* device);
+
+    /**
+    * @brief Zero the built-in RAM, the mapping is kept
+    * @details Only the blocks written since the last clear are touched
+    */
+    void clearRam();
+
+    /**
+    * @brief Number of 256-byte blocks the next clearRam zeroes
+    */
+    int dirtyBlocks() const { return dirty.count(); }
+
+    /**
+    * @brief Number of built-in RAM pages shared with other maps
+    */
+    int sharedPages() const;
+
+    /**
+    * @brief Blocks written since the last clear, their pages are the ones holding data
+    */
+    const DirtyBlocks& writtenBlocks() const { return dirty; }
+
+    /**
+    * @brief Bytes of a page of built-in RAM, whatever is mapped at its addresses
+    */
+    const uint8_t* ramPage(int page) const { return ram[page]->data(); }
+
+    /**
+    * @brief Replace the built-in RAM with pages owned elsewhere, shared copy-on-write
+    * @details Nothing is copied, for restoring saved states. The map
+    * writes to a page in place only once it is the last one holding owner
+    * @param owner keeps the pages alive
+    * @param pages PAGE_COUNT pointers to PAGE_SIZE bytes, nullptr for a page of zeroes
+    * @param written blocks that may be nonzero, reset() clears them
+    */
+    void shareRam(const std::shared_ptr<void>& owner, uint8_t* const* pages, const DirtyBlocks& written);
+
+private:
+    using RamPage = std::array<uint8_t, PAGE_SIZE>;
+
+    struct Shared {};
+
+    /**
+    * @brief Map sharing the built-in RAM of parent, see fork
+    */
+    MemoryMap(MemoryMap& parent, Shared);
+
+    /**
+    * @brief Take over the mapping, devices and RAM of other
+    * @param share share every RAM page, otherwise only pages other already shares
+    */
+    void assign(const MemoryMap& other, bool share);
+
+    /**
+    * @brief Whether the built-in page is shared and mapped at its own addresses
+    */
+    bool sharedAndMapped(int page) const;
+
+    /**
+    * @brief Give a page of built-in RAM still shared with other maps its own copy
+    * @return the write fast pointer of the page, nullptr if it holds a device
+    */
+    uint8_t* ownPage(int page);
+
+    /**
+    * @brief Replace the built-in RAM behind a page, mappings to it follow
+    */
+    void setRamPage(int page, std::shared_ptr<RamPage> data);
+
+    /**
+    * @brief Pointer into other's RAM or sink translated to the same place in this map
+    */
+    template<typename T>
+    T* rebase(T* pointer, const MemoryMap& other);
+
+    /**
+    * @brief Slow path of pages holding a device, writes to shared pages also come here
+    */
+    uint8_t readDevice(uint16_t addr) const;
+    void writeDevice(uint16_t addr, uint8_t value);
+
+    /**
+    * @brief Recompute the fast pointers of a page after a mapping or device change
+    */
+    void updatePage(int page);
+
+    struct DeviceRange {
+        uint32_t start;
+        uint32_t end;           // first address after the range
+        MmioDevice* device;
+    };
+
+    const uint8_t* readPages[PAGE_COUNT];   // fast path, nullptr on device pages
+    uint8_t* writePages[PAGE_COUNT];        // also nullptr on shared pages
+    const uint8_t* mappedRead[PAGE_COUNT];  // memory mapped to each page
+    uint8_t* mappedWrite[PAGE_COUNT];
+    std::vector<DeviceRange> devices;
+    std::shared_ptr<RamPage> ram[PAGE_COUNT];   // built-in RAM
+    std::unique_ptr<uint8_t[]> sink;    // receives writes to read-only pages, allocated by the first one
+    DirtyBlocks dirty;          // blocks written by address, mapped pages included
+};
+
+#endif
@@ -16,8 +16,12 @@ constexpr uint8_t INC = 0x34;
 constexpr uint8_t DEC = 0x35;
 constexpr uint8_t LD_IXY = 0x21;
 constexpr uint8_t LD_IXY_d = 0x36;
+constexpr uint8_t LD_IXY_H_N = 0x26; // LD IXH/IYH,n
+constexpr uint8_t LD_IXY_L_N = 0x2E; // LD IXL/IYL,n
 constexpr uint8_t PREFIX_DD = 0xDD;
 constexpr uint8_t PREFIX_FD = 0xFD;
+constexpr uint8_t PREFIX_ED = 0xED;
+constexpr uint8_t PREFIX_CB = 0xCB;
 
 
 // 8-bit Arithmetic Group
@@ -122,6 +126,23 @@ constexpr uint8_t DEC_L = 0x2D;
 constexpr uint8_t DEC_A = 0x3D;
 constexpr uint8_t DEC_HL = 0x35;
 
+// 16-bit Arithmetic Group
+// 00 xx 1001 / 00 xx 0011 / 00 xx 1011 (xx - register pair id)
+constexpr uint8_t ADD_HL_BC = 0x09;
+constexpr uint8_t ADD_HL_DE = 0x19;
+constexpr uint8_t ADD_HL_HL = 0x29;
+constexpr uint8_t ADD_HL_SP = 0x39;
+
+constexpr uint8_t INC_BC = 0x03;
+constexpr uint8_t INC_DE = 0x13;
+constexpr uint8_t INC_HL16 = 0x23;
+constexpr uint8_t INC_SP = 0x33;
+
+constexpr uint8_t DEC_BC = 0x0B;
+constexpr uint8_t DEC_DE = 0x1B;
+constexpr uint8_t DEC_HL16 = 0x2B;
+constexpr uint8_t DEC_SP = 0x3B;
+
 // Load Group
 
 // 00 <-r-> 110, where r(3 bits) is a register identifier
@@ -226,11 +247,22 @@ constexpr uint8_t LD_DE_NN = 0x11; // 0b00010001
 constexpr uint8_t LD_HL_NN = 0x21; // 0b00100001
 constexpr uint8_t LD_SP_NN = 0x31; // 0b00110001
 
+constexpr uint8_t LD_NN_HL = 0x22;  // LD (nn),HL
+constexpr uint8_t LD_HL_INN = 0x2A; // LD HL,(nn)
+constexpr uint8_t LD_NN_A = 0x32;   // LD (nn),A
+constexpr uint8_t LD_A_INN = 0x3A;  // LD A,(nn)
+constexpr uint8_t LD_BC_A = 0x02;   // LD (BC),A
+constexpr uint8_t LD_DE_A = 0x12;   // LD (DE),A
+constexpr uint8_t LD_A_BC = 0x0A;   // LD A,(BC)
+constexpr uint8_t LD_A_DE = 0x1A;   // LD A,(DE)
+constexpr uint8_t LD_SP_HL = 0xF9;
+
 
 // Exchange Group
 constexpr uint8_t EX_DE_HL = 0xEB;
 constexpr uint8_t EX_AF_AF = 0x08;
 constexpr uint8_t EXX = 0xD9;
+constexpr uint8_t EX_SP_HL = 0xE3;
 
 // Jump Group
 constexpr uint8_t JP_NN = 0xC3;
@@ -242,6 +274,7 @@ constexpr uint8_t JP_PO = 0xE2;
 constexpr uint8_t JP_PE = 0xEA;
 constexpr uint8_t JP_P = 0xF2;
 constexpr uint8_t JP_M = 0xFA;
+constexpr uint8_t JP_HL = 0xE9;
 
 constexpr uint8_t JR = 0x18;
 constexpr uint8_t JR_NZ = 0x20;
@@ -270,6 +303,9 @@ constexpr uint8_t RET_PE = 0xE8;
 constexpr uint8_t RET_P = 0xF0;
 constexpr uint8_t RET_M = 0xF8;
 
+// 11ppp111, ppp - restart address / 8. Executed only as the bus byte of an IM 0 interrupt
+constexpr uint8_t RST_00 = 0xC7; //0b11000111
+
 // Stack Group
 // 11qq0101, qq - register id
 constexpr uint8_t PUSH_BC = 0xC5; //0b11000101
@@ -282,10 +318,78 @@ constexpr uint8_t POP_DE = 0xD1; //0b11010001
 constexpr uint8_t POP_HL = 0xE1; //0b11100001
 constexpr uint8_t POP_AF = 0xF1; //0b11110001
 
+// Input and Output Group
+constexpr uint8_t IN_A_N = 0xDB;  // IN A,(n)
+constexpr uint8_t OUT_N_A = 0xD3; // OUT (n),A
+
+// Following 0xED
+// 01 rrr 000 / 01 rrr 001 (rrr - register, 110 - IN (C) only sets flags, OUT (C),0)
+constexpr uint8_t IN_B_C = 0x40;
+constexpr uint8_t IN_C_C = 0x48;
+constexpr uint8_t IN_D_C = 0x50;
+constexpr uint8_t IN_E_C = 0x58;
+constexpr uint8_t IN_H_C = 0x60;
+constexpr uint8_t IN_L_C = 0x68;
+constexpr uint8_t IN_F_C = 0x70;
+constexpr uint8_t IN_A_C = 0x78;
+
+constexpr uint8_t OUT_C_B = 0x41;
+constexpr uint8_t OUT_C_C = 0x49;
+constexpr uint8_t OUT_C_D = 0x51;
+constexpr uint8_t OUT_C_E = 0x59;
+constexpr uint8_t OUT_C_H = 0x61;
+constexpr uint8_t OUT_C_L = 0x69;
+constexpr uint8_t OUT_C_0 = 0x71;
+constexpr uint8_t OUT_C_A = 0x79;
+
+// 101 r d 00x (r - repeat, d - decrement, x - compare)
+constexpr uint8_t LDI = 0xA0;
+constexpr uint8_t CPI = 0xA1;
+constexpr uint8_t LDD = 0xA8;
+constexpr uint8_t CPD = 0xA9;
+constexpr uint8_t LDIR = 0xB0;
+constexpr uint8_t CPIR = 0xB1;
+constexpr uint8_t LDDR = 0xB8;
+constexpr uint8_t CPDR = 0xB9;
+
+// 101 r d 01x (r - repeat, d - decrement HL, x - output)
+constexpr uint8_t INI = 0xA2;
+constexpr uint8_t OUTI = 0xA3;
+constexpr uint8_t IND = 0xAA;
+constexpr uint8_t OUTD = 0xAB;
+constexpr uint8_t INIR = 0xB2;
+constexpr uint8_t OTIR = 0xB3;
+constexpr uint8_t INDR = 0xBA;
+constexpr uint8_t OTDR = 0xBB;
+
 // Control Group
 constexpr uint8_t HALT = 0x76;
 constexpr uint8_t SCF = 0x37;
 constexpr uint8_t DAA = 0x27;
+constexpr uint8_t DI = 0xF3;
+constexpr uint8_t EI = 0xFB;
+
+// Interrupt Group, following 0xED
+constexpr uint8_t IM_0 = 0x46;
+constexpr uint8_t IM_1 = 0x56;
+constexpr uint8_t IM_2 = 0x5E;
+constexpr uint8_t RETN = 0x45;
+constexpr uint8_t RETI = 0x4D;
+constexpr uint8_t LD_I_A = 0x47;
+constexpr uint8_t LD_R_A = 0x4F;
+constexpr uint8_t LD_A_I = 0x57;
+constexpr uint8_t LD_A_R = 0x5F;
+
+// 16-bit arithmetic and loads following 0xED, 01 xx 0010 etc. (xx - register pair id)
+constexpr uint8_t SBC_HL_BC = 0x42;
+constexpr uint8_t ADC_HL_BC = 0x4A;
+constexpr uint8_t LD_NN_BC = 0x43;  // LD (nn),BC
+constexpr uint8_t LD_BC_INN = 0x4B; // LD BC,(nn)
+
+// Accumulator operations following 0xED
+constexpr uint8_t NEG = 0x44;
+constexpr uint8_t RRD = 0x67;
+constexpr uint8_t RLD = 0x6F;
 
 
 namespace Conditions {
@@ -309,5 +413,43 @@ namespace Regs {
     constexpr uint8_t A = 7;
 };
 
+// Register pair encoded in bits 5-4 of 16-bit opcodes
+namespace Pairs {
+    constexpr uint8_t BC = 0;
+    constexpr uint8_t DE = 1;
+    constexpr uint8_t HL = 2;   // IX/IY after a prefix
+    constexpr uint8_t SP = 3;
+}
+
+// ALU operation encoded in bits 5-3 of ALU A,r / ALU A,n opcodes
+namespace AluOps {
+    constexpr uint8_t ADD = 0;
+    constexpr uint8_t ADC = 1;
+    constexpr uint8_t SUB = 2;
+    constexpr uint8_t SBC = 3;
+    constexpr uint8_t AND = 4;
+    constexpr uint8_t XOR = 5;
+    constexpr uint8_t OR = 6;
+    constexpr uint8_t CP = 7;
+}
+
+// Opcodes following 0xCB: bits 7-6 select the group, bits 2-0 the register,
+// bits 5-3 the rotate/shift operation or the bit number
+namespace CbOps {
+    constexpr uint8_t RLC = 0;
+    constexpr uint8_t RRC = 1;
+    constexpr uint8_t RL = 2;
+    constexpr uint8_t RR = 3;
+    constexpr uint8_t SLA = 4;
+    constexpr uint8_t SRA = 5;
+    constexpr uint8_t SLL = 6;  // undocumented, shifts in a 1
+    constexpr uint8_t SRL = 7;
+
+    constexpr uint8_t SHIFT = 0x00;
+    constexpr uint8_t BIT = 0x40;
+    constexpr uint8_t RES = 0x80;
+    constexpr uint8_t SET = 0xC0;
+}
+
 
 #endif
@@ -0,0 +1,109 @@
+#ifndef SCHEDULER_HPP
+#define SCHEDULER_HPP
+
+#include <array>
+#include <cstdint>
+
+/**
+* @brief Receiver of scheduled events
+*/
+class EventHandler {
+public:
+    virtual ~EventHandler() = default;
+
+    /**
+    * @brief Called at the first instruction boundary at or after the deadline
+    * @param cycle deadline the event was scheduled for
+    */
+    virtual void onEvent(uint64_t cycle) = 0;
+};
+
+/**
+* @brief Handle of a scheduled event, slot index in the low byte and
+* the slot's generation above, so handles of fired events go stale
+*/
+using EventId = uint32_t;
+
+/**
+* @class Scheduler
+* @brief One-shot events keyed on the T-state counter
+*
+* Events live in a fixed pool of slots ordered by a binary min-heap of
+* slot indices, every slot knows its heap position. Scheduling, cancelling
+* and rescheduling are O(log n) and never allocate.
+*/
+class Scheduler {
+public:
+    static constexpr int CAPACITY = 64;
+    static constexpr uint64_t NEVER = UINT64_MAX;
+    static constexpr EventId NO_EVENT = UINT32_MAX;
+
+    Scheduler();
+
+    /**
+    * @brief Schedule handler for an absolute cycle
+    * @return the event's handle, NO_EVENT when the pool is full
+    */
+    EventId schedule(uint64_t cycle, EventHandler* handler);
+
+    /**
+    * @brief Remove a pending event
+    * @return false if the event already fired or was cancelled
+    */
+    bool cancel(EventId id);
+
+    /**
+    * @brief Move a pending event to another cycle
+    * @return false if the event already fired or was cancelled
+    */
+    bool reschedule(EventId id, uint64_t cycle);
+
+    /**
+    * @brief Whether an event has neither fired nor been cancelled
+    */
+    bool pending(EventId id) const;
+
+    /**
+    * @brief Deadline of the earliest event, NEVER if none is pending
+    */
+    uint64_t nextDeadline() const { return size ? slots[heap[0]].cycle : NEVER; }
+
+    /**
+    * @brief Fire every event due at cycle now, earliest first
+    * @details Handlers may schedule new events, ones due already fire in the same call
+    */
+    void runDue(uint64_t now);
+
+    /**
+    * @brief Drop every pending event
+    */
+    void clear();
+
+private:
+    struct Slot {
+        uint64_t cycle;
+        EventHandler* handler;
+        uint32_t generation;
+        uint8_t heapIndex;      // position in heap while pending
+        bool used;
+    };
+
+    EventId idOf(uint8_t slot) const { return (slots[slot].generation << 8) | slot; }
+    bool less(uint8_t a, uint8_t b) const { return slots[heap[a]].cycle < slots[heap[b]].cycle; }
+    void swap(uint8_t a, uint8_t b);
+    void siftUp(uint8_t index);
+    void siftDown(uint8_t index);
+
+    /**
+    * @brief Take a slot out of the heap and return it to the free list
+    */
+    void release(uint8_t slot);
+
+    std::array<Slot, CAPACITY> slots;
+    std::array<uint8_t, CAPACITY> heap;     // pending slots, earliest deadline first
+    std::array<uint8_t, CAPACITY> freeSlots;
+    uint8_t size;
+    uint8_t freeCount;
+};
+
+#endif
@@ -0,0 +1,141 @@
+#ifndef SNAPSHOT_HPP
+#define SNAPSHOT_HPP
+
+#include "cpu.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+
+/**
+* @class Snapshot
+* @brief Saved state of a Z80 in a page-aligned binary image
+*
+* The image is laid out so that it can be mapped from a file and used
+* as it is, without parsing or copying:
+*
+*   page 0      Header, then sectionCount Section entries, then the
+*               sections themselves (Cpu, RamTable)
+*   page 1...   one PAGE_SIZE page of built-in RAM per page that holds data
+*
+* All fields are fixed-width integers in the byte order of the host that
+* wrote the image. Readers skip sections of unknown type, so later versions
+* (device state, ...) add sections without breaking older readers, and
+* sections may grow at their end.
+*
+* Restoring hands the RAM pages of the image to the CPU's memory map as
+* shared copy-on-write pages, so it costs a few refcount updates; a page
+* is copied only when the CPU first writes to it. Mapped pages, devices,
+* ports and scheduled events belong to the host and are not saved.
+*/
+class Snapshot {
+public:
+    static constexpr uint32_t VERSION = 1;
+    static constexpr uint32_t PAGE_SIZE = MemoryMap::PAGE_SIZE;
+    static constexpr uint32_t ORDER_MARK = 0x01020304;     // reads back differently on a host of the other byte order
+
+    enum SectionType : uint32_t {
+        CPU = 1,        // Cpu
+        RAM_TABLE = 2   // RamTable
+    };
+
+    struct Header {
+        char magic[8];          // "Z80SNAP" and a 0
+        uint32_t version;       // VERSION of the writer
+        uint32_t byteOrder;     // ORDER_MARK as the writer stored it
+        uint32_t pageSize;      // PAGE_SIZE, RAM pages start at multiples of it
+        uint32_t sectionCount;  // Section entries following the header
+        uint64_t size;          // bytes of the whole image
+    };
+
+    struct Section {
+        uint32_t type;          // SectionType
+        uint32_t reserved;
+        uint64_t offset;        // from the start of the image
+        uint64_t size;
+    };
+
+    /**
+    * @brief Registers, interrupt state and the cycle counter
+    */
+    struct Cpu {
+        uint16_t af, bc, de, hl;
+        uint16_t af_prime, bc_prime, de_prime, hl_prime;
+        uint16_t ix, iy, sp, pc;
+        uint8_t i, r, im;
+        uint8_t iff1, iff2, halted;
+        uint8_t eiShadow;       // EI was the last instruction
+        uint8_t nmiPending;
+        uint8_t intLine;
+        uint8_t intData;
+        uint8_t reserved[6];
+        uint64_t cycles;
+    };
+
+    /**
+    * @brief Where the built-in RAM pages are
+    */
+    struct RamTable {
+        uint64_t pageOffset[MemoryMap::PAGE_COUNT];             // 0 for a page of zeroes
+        uint64_t writtenBlocks[DirtyBlocks::WORD_COUNT];        // DirtyBlocks of the saved map
+    };
+
+    /**
+    * @brief Empty snapshot, valid() is false
+    */
+    Snapshot() = default;
+
+    /**
+    * @brief Save the state of cpu, the RAM pages it has written are copied
+    */
+    explicit Snapshot(const Z80& cpu);
+
+    /**
+    * @brief Map a saved image from a file, read it where mapping is not available
+    * @return false if the file cannot be read or is not a valid image
+    */
+    bool load(const std::string& path);
+
+    /**
+    * @brief Take a copy of an image received from elsewhere
+    * @return false if the bytes are not a valid image
+    */
+    bool read(const uint8_t* bytes, size_t length);
+
+    /**
+    * @brief Write the image to a file
+    */
+    bool save(const std::string& path) const;
+
+    /**
+    * @brief Restore the saved state into cpu
+    * @details Registers, cycles, interrupt state and built-in RAM are
+    * replaced, pending events are dropped and decoded blocks invalidated.
+    * Any number of CPUs may restore the same snapshot, also concurrently
+    */
+    void restore(Z80& cpu) const;
+
+    bool valid() const { return image != nullptr; }
+    const uint8_t* data() const { return image; }
+    size_t size() const { return length; }
+
+    /**
+    * @brief Find a section of the image
+    * @return its bytes, nullptr if the image has no such section
+    */
+    const uint8_t* section(uint32_t type, uint64_t& size) const;
+
+private:
+    /**
+    * @brief Check an image and adopt it, storage keeps bytes alive
+    */
+    bool adopt(std::shared_ptr<void> storage, uint8_t* bytes, size_t size);
+
+    std::shared_ptr<void> storage;  // heap buffer or file mapping behind the image
+    uint8_t* image = nullptr;
+    size_t length = 0;
+    const Cpu* cpu = nullptr;
+    const RamTable* ram = nullptr;
+};
+
+#endif
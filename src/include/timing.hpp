@@ -0,0 +1,134 @@
+#ifndef TIMING_HPP
+#define TIMING_HPP
+
+#include "opcodes.hpp"
+#include <array>
+#include <cstdint>
+
+/**
+* @brief Instruction timings in T-states
+*
+* Conditional instructions are listed with their not-taken timing,
+* the extra T-states of a taken branch are charged by the branch itself.
+*/
+namespace Timing {
+
+    // Extra T-states of a taken conditional branch
+    constexpr uint8_t JR_TAKEN = 5;     // JR cc,e: 7 -> 12
+    constexpr uint8_t CALL_TAKEN = 7;   // CALL cc,nn: 10 -> 17
+    constexpr uint8_t RET_TAKEN = 6;    // RET cc: 5 -> 11
+
+    // Extra T-states of every repeated transfer of INIR/INDR/OTIR/OTDR: 16 -> 21
+    constexpr uint8_t BLOCK_REPEAT = 5;
+
+    // Interrupt acknowledge, including the push of PC
+    constexpr uint8_t NMI = 11;
+    constexpr uint8_t IM0_IM1 = 13;     // RST on the data bus / RST 38h
+    constexpr uint8_t IM2 = 19;
+
+    // Longest instruction (INC (IX+d), EX (SP),IX)
+    constexpr uint8_t MAX_INSTRUCTION = 23;
+
+    /**
+    * @brief Unprefixed opcodes, rows of 16
+    * @details Prefix bytes are 0, the prefixed tables include them
+    */
+    constexpr std::array<uint8_t, 256> unprefixed = { {
+        //  0   1   2   3   4   5   6   7   8   9   A   B   C   D   E   F
+            4, 10,  7,  6,  4,  4,  7,  4,  4, 11,  7,  6,  4,  4,  7,  4,  // 0x00
+            8, 10,  7,  6,  4,  4,  7,  4, 12, 11,  7,  6,  4,  4,  7,  4,  // 0x10
+            7, 10, 16,  6,  4,  4,  7,  4,  7, 11, 16,  6,  4,  4,  7,  4,  // 0x20
+            7, 10, 13,  6, 11, 11, 10,  4,  7, 11, 13,  6,  4,  4,  7,  4,  // 0x30
+            4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 0x40
+            4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 0x50
+            4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 0x60
+            7,  7,  7,  7,  7,  7,  4,  7,  4,  4,  4,  4,  4,  4,  7,  4,  // 0x70
+            4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 0x80
+            4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 0x90
+            4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 0xA0
+            4,  4,  4,  4,  4,  4,  7,  4,  4,  4,  4,  4,  4,  4,  7,  4,  // 0xB0
+            5, 10, 10, 10, 10, 11,  7, 11,  5, 10, 10,  0, 10, 17,  7, 11,  // 0xC0
+            5, 10, 10, 11, 10, 11,  7, 11,  5,  4, 10, 11, 10,  0,  7, 11,  // 0xD0
+            5, 10, 10, 19, 10, 11,  7, 11,  5,  4, 10,  4, 10,  0,  7, 11,  // 0xE0
+            5, 10, 10,  4, 10, 11,  7, 11,  5,  6, 10,  4, 10,  0,  7, 11   // 0xF0
+    } };
+
+    /**
+    * @brief Opcode following 0xDD/0xFD, prefix included
+    * @details (HL) operands become (IX/IY+d), H/L become the index
+    * register halves, other opcodes take the prefix on top
+    */
+    constexpr uint8_t indexed(uint8_t opcode) {
+        uint8_t dest = (opcode >> 3) & 0x07;
+        uint8_t src = opcode & 0x07;
+        // DD CB d op is charged as a whole by indexedCb
+        if (opcode == PREFIX_CB) return 0;
+        if (opcode == INC || opcode == DEC) return 23;
+        if (opcode == LD_IXY_d) return 19;
+        if ((opcode & 0xC0) == 0x40 && opcode != HALT && (src == 6 || dest == 6)) return 19;
+        if ((opcode & 0xC0) == 0x80 && src == 6) return 19;
+        return 4 + unprefixed[opcode];
+    }
+
+    /**
+    * @brief Opcode following 0xED, prefix included
+    * @details Opcodes without an instruction execute as 8 T-state no-ops.
+    * Repeating block instructions are listed with their last transfer
+    */
+    constexpr uint8_t extended(uint8_t opcode) {
+        // IN r,(C), OUT (C),r
+        if ((opcode & 0xC6) == 0x40) return 12;
+        // SBC HL,rr, ADC HL,rr
+        if ((opcode & 0xC7) == SBC_HL_BC) return 15;
+        // LD (nn),rr, LD rr,(nn)
+        if ((opcode & 0xC7) == LD_NN_BC) return 20;
+        // RRD, RLD
+        if (opcode == RRD || opcode == RLD) return 18;
+        // LDI, CPI, INI, OUTI and their decrementing and repeating forms
+        if ((opcode & 0xE4) == 0xA0) return 16;
+        // RETN, RETI
+        if ((opcode & 0xC7) == RETN) return 14;
+        // LD I,A, LD R,A, LD A,I, LD A,R
+        if (opcode == LD_I_A || opcode == LD_R_A || opcode == LD_A_I || opcode == LD_A_R) return 9;
+        return 8;
+    }
+
+    /**
+    * @brief Opcode following 0xCB, prefix included
+    * @details BIT only reads its operand, so BIT b,(HL) is shorter
+    */
+    constexpr uint8_t cb(uint8_t opcode) {
+        if ((opcode & 0x07) != 6) return 8;
+        return (opcode & 0xC0) == CbOps::BIT ? 12 : 15;
+    }
+
+    /**
+    * @brief Opcode of DD CB d op / FD CB d op, both prefixes included
+    */
+    constexpr uint8_t indexedCb(uint8_t opcode) {
+        return (opcode & 0xC0) == CbOps::BIT ? 20 : 23;
+    }
+
+    constexpr std::array<uint8_t, 256> buildTable(uint8_t (*timing)(uint8_t)) {
+        std::array<uint8_t, 256> table{};
+        for (int opcode = 0; opcode < 256; opcode++) table[opcode] = timing(opcode);
+        return table;
+    }
+
+    inline constexpr std::array<uint8_t, 256> indexedTable = buildTable(indexed);
+    inline constexpr std::array<uint8_t, 256> extendedTable = buildTable(extended);
+    inline constexpr std::array<uint8_t, 256> cbTable = buildTable(cb);
+    inline constexpr std::array<uint8_t, 256> indexedCbTable = buildTable(indexedCb);
+
+    static_assert(indexedTable[LD_IXY] == 14 && indexedTable[ADD] == 19 && indexedTable[INC] == 23, "indexed timings");
+    static_assert(extendedTable[IN_A_C] == 12 && extendedTable[OUT_C_0] == 12 && extendedTable[OTDR] == 16
+        && extendedTable[RETI] == 14 && extendedTable[LD_A_R] == 9 && extendedTable[IM_2] == 8
+        && extendedTable[SBC_HL_BC] == 15 && extendedTable[0x7B] == 20 && extendedTable[RLD] == 18
+        && extendedTable[LDIR] == 16 && extendedTable[CPDR] == 16 && extendedTable[NEG] == 8, "extended timings");
+    static_assert(cbTable[0x00] == 8 && cbTable[0x06] == 15 && cbTable[0x46] == 12 && cbTable[0xFE] == 15
+        && indexedCbTable[0x46] == 20 && indexedCbTable[0x06] == 23, "cb timings");
+    static_assert(unprefixed[CALL_NZ] + CALL_TAKEN == unprefixed[CALL_NN], "call timings");
+    static_assert(unprefixed[JR_NZ] + JR_TAKEN == unprefixed[JR], "jr timings");
+}
+
+#endif
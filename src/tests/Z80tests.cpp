@@ -20,9 +20,32 @@ void Z80Tests::returnFinalState() {
 
 }
 
+bool Z80Tests::sameState(const Z80& lhs, const Z80& rhs) {
+    if (lhs.getAF() != rhs.getAF() || lhs.getBC() != rhs.getBC() ||
+        lhs.getDE() != rhs.getDE() || lhs.getHL() != rhs.getHL())
+        return false;
+    if (lhs.getAF_P() != rhs.getAF_P() || lhs.getBC_P() != rhs.getBC_P() ||
+        lhs.getDE_P() != rhs.getDE_P() || lhs.getHL_P() != rhs.getHL_P())
+        return false;
+    if (lhs.getIX() != rhs.getIX() || lhs.getIY() != rhs.getIY() ||
+        lhs.getSP() != rhs.getSP() || lhs.getPC() != rhs.getPC())
+        return false;
+    if (lhs.getCycles() != rhs.getCycles())
+        return false;
+    if (lhs.getI() != rhs.getI() || lhs.getR() != rhs.getR() || lhs.getIFF1() != rhs.getIFF1() ||
+        lhs.getIFF2() != rhs.getIFF2() || lhs.getIM() != rhs.getIM() || lhs.isHalted() != rhs.isHalted())
+        return false;
+    for (uint32_t addr = 0; addr < 0x10000; addr++) {
+        if (lhs.readByte(addr) != rhs.readByte(addr))
+            return false;
+    }
+    return true;
+}
+
 void Z80Tests::runAllTests() {
     test8BitLoads();
     test16BitLoads();
+    testRegisterFile();
     testExchangeOps();
     test8BitArithmetic();
     testLogicalOps();
@@ -32,47 +55,68 @@ void Z80Tests::runAllTests() {
     testCallReturn();
     testStackOps();
     testIndexedOps();
+    testIndexRegisters();
+    testBitOps();
     testFlagOps();
     testConditionalOps();
     testConditionalJump();
+    testBatchedStep();
+    testFlagTables();
+    testFlagReaders();
+    testBlockCache();
+    testMemoryMap();
+    testMemoryImages();
+    testFork();
+    testSnapshot();
+    testMmio();
+    testPortIo();
+    testInterrupts();
+    testScheduler();
+    testFastForward();
+    testBlockTransfers();
+    testBusPolicies();
+    testBatchRunner();
+    testLockstep();
+    testJit();
+    testRunApi();
+    testCycles();
     std::cout << "\nAll tests passed\n\n";
 }
 
 void Z80Tests::loadProgram(const std::vector<uint8_t>& program) {
     cpu.reset();
+    cpu.loadImage(0, program);
     std::cout << "Program:\n\n";
     for (uint16_t i = 0; i < (uint16_t)program.size(); i++) {
-        cpu.writeByte(i, program[i]);
         std::cout << "[0x" << std::hex << i << "] = 0x" << static_cast<int>(program[i]) << "\n";
     }
     std::cout << "\n\n";
 }
 
 void Z80Tests::executeUntilHalt() {
-    while (cpu.readByte(cpu.getPC()) != HALT) {
-        uint16_t prev_pc = cpu.getPC();
-        uint8_t opcode = cpu.readByte(cpu.getPC());
+    // Differential run: the same program translated by the JIT from its first execution
+    Z80 translated(cpu);
+    translated.enableJit(true, 1);
+    translated.runUntilHalt();
 
-        cpu.step();
+    RunResult result = cpu.runUntilHalt();
+    assert(result.status == RunStatus::Halted);
 
-        std::cout << "Executed opcode 0x" << std::hex 
-            << static_cast<int>(opcode) 
-            << " at 0x" << prev_pc << "\n";
-        std::cout << "Registers: AF=0x" << std::hex << cpu.getAF()
-            << std::hex << " BC=0x" << cpu.getBC()
-            <<std::hex << " DE=0x" << cpu.getDE()
-            << std::hex << " HL=0x" << cpu.getHL()
-            << std::hex << "\n";
-        std::cout << "Flags: " 
-            << (cpu.getF() & Z80::S_FLAG ? "S" : "-")
-            << (cpu.getF() & Z80::Z_FLAG ? "Z" : "-")
-            << (cpu.getF() & Z80::H_FLAG ? "H" : "-")
-            << (cpu.getF() & Z80::PV_FLAG ? "PV" : "-")
-            << (cpu.getF() & Z80::N_FLAG ? "N" : "-")
-            << (cpu.getF() & Z80::C_FLAG ? "C" : "-")
-            << "\n\n";
-    }
-    cpu.step();
+    std::cout << "Executed " << std::dec << result.instructions << " instructions\n";
+    std::cout << "Registers: AF=0x" << std::hex << cpu.getAF()
+        << std::hex << " BC=0x" << cpu.getBC()
+        << std::hex << " DE=0x" << cpu.getDE()
+        << std::hex << " HL=0x" << cpu.getHL()
+        << std::hex << "\n";
+    std::cout << "Flags: "
+        << (cpu.getF() & Z80::S_FLAG ? "S" : "-")
+        << (cpu.getF() & Z80::Z_FLAG ? "Z" : "-")
+        << (cpu.getF() & Z80::H_FLAG ? "H" : "-")
+        << (cpu.getF() & Z80::PV_FLAG ? "PV" : "-")
+        << (cpu.getF() & Z80::N_FLAG ? "N" : "-")
+        << (cpu.getF() & Z80::C_FLAG ? "C" : "-")
+        << "\n\n";
+    assert(sameState(cpu, translated));
 }
 
 void Z80Tests::test8BitLoads() {
@@ -135,6 +179,51 @@ void Z80Tests::test16BitLoads() {
 
 }
 
+void Z80Tests::testRegisterFile() {
+    std::cout << "Register file:\n";
+    const uint8_t codes[] = { Regs::B, Regs::C, Regs::D, Regs::E, Regs::H, Regs::L, Regs::A };
+    auto value = [this](uint8_t code) {
+        switch (code) {
+        case Regs::B: return cpu.getB();
+        case Regs::C: return cpu.getC();
+        case Regs::D: return cpu.getD();
+        case Regs::E: return cpu.getE();
+        case Regs::H: return cpu.getH();
+        case Regs::L: return cpu.getL();
+        default: return cpu.getA();
+        }
+    };
+
+    // LD r,r' for every pair of registers, the byte has to land in the right half of its pair
+    for (uint8_t dest : codes) {
+        for (uint8_t src : codes) {
+            cpu.reset();
+            const uint8_t program[] = {
+                LD_BC_NN, 0x01, 0x02,                       // LD BC, 0x0201
+                LD_DE_NN, 0x03, 0x04,                       // LD DE, 0x0403
+                LD_HL_NN, 0x05, 0x06,                       // LD HL, 0x0605
+                LD_A_N, 0x07,                               // LD A, 0x07
+                uint8_t(LD_B_N | (src << 3)), 0xEE,         // LD src, 0xEE
+                uint8_t(0x40 | (dest << 3) | src),          // LD dest, src
+                HALT
+            };
+            for (uint16_t i = 0; i < sizeof(program); i++) cpu.writeByte(i, program[i]);
+            cpu.runUntilHalt();
+
+            assert(value(dest) == 0xEE);
+            assert(cpu.getBC() == ((value(Regs::B) << 8) | value(Regs::C)));
+            assert(cpu.getDE() == ((value(Regs::D) << 8) | value(Regs::E)));
+            assert(cpu.getHL() == ((value(Regs::H) << 8) | value(Regs::L)));
+            assert((cpu.getAF() >> 8) == cpu.getA());
+            for (uint8_t other : codes) {
+                if (other != dest && other != src) assert(value(other) != 0xEE);
+            }
+        }
+    }
+
+    std::cout << "Test passed\n";
+}
+
 void Z80Tests::testExchangeOps() {
     cpu.reset();
     std::cout << "Exchange operations:\n";
@@ -398,6 +487,121 @@ void Z80Tests::testIndexedOps() {
     std::cout << "Test passed\n";
 }
 
+void Z80Tests::testIndexRegisters() {
+    cpu.reset();
+    std::cout << "Index register operations:\n";
+    loadProgram({
+        PREFIX_DD, LD_IXY, 0x34, 0x12,          // LD IX, 0x1234
+        PREFIX_FD, LD_IXY, 0x00, 0x20,          // LD IY, 0x2000
+        PREFIX_DD, LD_A_H,                      // LD A, IXH
+        PREFIX_DD, LD_B_L,                      // LD B, IXL
+        PREFIX_DD, INC_L,                       // INC IXL
+        PREFIX_FD, LD_IXY_H_N, 0x55,            // LD IYH, 0x55
+        PREFIX_DD, ADD_A_L,                     // ADD A, IXL
+        LD_BC_NN, 0x00, 0x01,                   // LD BC, 0x0100
+        PREFIX_DD, ADD_HL_BC,                   // ADD IX, BC
+        LD_SP_NN, 0x00, 0xF0,                   // LD SP, 0xF000
+        PREFIX_DD, PUSH_HL,                     // PUSH IX
+        PREFIX_FD, POP_HL,                      // POP IY
+        PREFIX_FD, INC_HL16,                    // INC IY
+        PREFIX_DD, LD_NN_HL, 0x00, 0x30,        // LD (0x3000), IX
+        PREFIX_FD, LD_HL_INN, 0x00, 0x30,       // LD IY, (0x3000)
+        LD_DE_NN, 0xCD, 0xAB,                   // LD DE, 0xABCD
+        PUSH_DE,                                // PUSH DE
+        PREFIX_DD, EX_SP_HL,                    // EX (SP), IX
+        POP_HL,                                 // POP HL
+        ADD_HL_HL,                              // ADD HL, HL
+        DEC_HL16,                               // DEC HL
+        LD_NN_HL, 0x02, 0x30,                   // LD (0x3002), HL
+        PREFIX_DD, LD_C_A,                      // LD C, A (prefix ignored)
+        PREFIX_FD, LD_SP_HL,                    // LD SP, IY
+        LD_DE_NN, 0x01, 0xF0,                   // LD DE, 0xF001
+        PREFIX_FD, ADD_HL_DE,                   // ADD IY, DE
+        PREFIX_DD, LD_IXY, 0x45, 0x00,          // LD IX, 0x0045
+        PREFIX_DD, JP_HL,                       // JP (IX)
+        HALT,                                   // skipped
+        HALT                                    // HALT
+        });
+    std::cout << "Executing test:\n";
+    executeUntilHalt();
+    returnFinalState();
+
+    assert(cpu.getA() == 0x47);             // 0x12 + 0x35
+    assert(cpu.getBC() == 0x0147);
+    assert(cpu.readByte(0x3000) == 0x35 && cpu.readByte(0x3001) == 0x13);
+    assert(cpu.getHL() == 0x2669);          // 0x1335 * 2 - 1
+    assert(cpu.readByte(0x3002) == 0x69 && cpu.readByte(0x3003) == 0x26);
+    assert(cpu.getSP() == 0x1335);
+    assert(cpu.getIY() == 0x0336);          // 0x1335 + 0xF001
+    assert((cpu.getF() & (Z80::C_FLAG | Z80::H_FLAG | Z80::N_FLAG)) == Z80::C_FLAG);
+    assert(cpu.getIX() == 0x0045);
+    assert(cpu.getPC() == 0x0045);
+
+    std::cout << "Test passed\n";
+}
+
+void Z80Tests::testBitOps() {
+    cpu.reset();
+    std::cout << "Bit operations test:\n";
+    loadProgram({
+        LD_HL_NN, 0x00, 0x30,               // LD HL, 0x3000
+        LD_HL_N, 0x0F,                      // LD (HL), 0x0F
+        LD_A_N, 0x81,                       // LD A, 0x81
+        PREFIX_CB, 0x07,                    // RLC A
+        PREFIX_CB, 0x1F,                    // RR A
+        PREFIX_CB, 0x3F,                    // SRL A
+        PREFIX_CB, 0x36,                    // SLL (HL)
+        PREFIX_CB, 0x7E,                    // BIT 7, (HL)
+        PREFIX_CB, 0x46,                    // BIT 0, (HL)
+        PREFIX_CB, 0xFE,                    // SET 7, (HL)
+        PREFIX_CB, 0x86,                    // RES 0, (HL)
+        PREFIX_DD, LD_IXY, 0xF0, 0x2F,      // LD IX, 0x2FF0
+        PREFIX_DD, PREFIX_CB, 0x10, 0x06,   // RLC (IX+0x10)
+        PREFIX_DD, PREFIX_CB, 0x10, 0xF8,   // SET 7, (IX+0x10) -> B
+        PREFIX_DD, PREFIX_CB, 0x10, 0x4E,   // BIT 1, (IX+0x10)
+        HALT                                // HALT
+        });
+    Z80 blocks(cpu);
+    blocks.enableBlockCache(true);
+    Z80 translated(cpu);
+    translated.enableJit(true, 1);
+
+    auto next = [this](uint32_t cycles) { assert(cpu.step() == cycles); };
+    cpu.step(3);
+    next(8);
+    assert(cpu.getA() == 0x03 && cpu.getF() == (Z80::PV_FLAG | Z80::C_FLAG));
+    next(8);
+    assert(cpu.getA() == 0x81 && cpu.getF() == (Z80::S_FLAG | Z80::PV_FLAG | Z80::C_FLAG));
+    next(8);
+    assert(cpu.getA() == 0x40 && cpu.getF() == Z80::C_FLAG);
+    next(15);
+    assert(cpu.readByte(0x3000) == 0x1F && cpu.getF() == 0);
+    next(12);
+    assert(cpu.getF() == (Z80::Z_FLAG | Z80::H_FLAG | Z80::PV_FLAG));
+    next(12);
+    assert(cpu.getF() == Z80::H_FLAG);
+    next(15);
+    next(15);
+    assert(cpu.readByte(0x3000) == 0x9E && cpu.getF() == Z80::H_FLAG);
+    cpu.step();
+    next(23);
+    assert(cpu.readByte(0x3000) == 0x3D && cpu.getF() == Z80::C_FLAG);
+    next(23);
+    assert(cpu.readByte(0x3000) == 0xBD && cpu.getB() == 0xBD);
+    next(20);
+    assert(cpu.getF() == (Z80::Z_FLAG | Z80::H_FLAG | Z80::PV_FLAG | Z80::C_FLAG));
+    assert(cpu.getPC() == 0x27 && cpu.getCycles() == 10 + 10 + 7 + 3 * 8 + 15 + 2 * 12 + 2 * 15 + 14 + 2 * 23 + 20);
+
+    // Every engine decodes the prefix the same way
+    cpu.step();
+    blocks.runUntilHalt();
+    translated.runUntilHalt();
+    assert(sameState(cpu, blocks));
+    assert(sameState(cpu, translated));
+
+    std::cout << "Test passed\n";
+}
+
 void Z80Tests::testFlagOps() {
     cpu.reset();
     std::cout << "Flag operations:\n";
@@ -461,4 +665,1810 @@ void Z80Tests::testConditionalJump() {
     std::cout << "Test passed\n";
 }
 
+void Z80Tests::testBatchedStep() {
+    cpu.reset();
+    std::cout << "Batched execution test:\n";
+
+    loadProgram({
+        LD_SP_NN, 0x00, 0x20,                   // LD SP, 0x2000
+        PREFIX_DD, LD_IXY, 0x00, 0x10,          // LD IX, 0x1000
+        LD_B_N, 0x05,                           // LD B, 0x05
+        LD_A_B,                                 // loop: LD A, B
+        PREFIX_DD, ADD, 0x00,                   // ADD A, (IX+0)
+        PREFIX_DD, 0x77, 0x00,                  // LD (IX+0), A
+        PUSH_AF,                                // PUSH AF
+        DEC_B,                                  // DEC B
+        JR_NZ, 0xF5,                            // JR NZ, loop
+        HALT                                    // HALT
+        });
+
+    // Same program executed one step at a time
+    Z80 reference;
+    for (uint16_t addr = 0; addr < 0x20; addr++) {
+        reference.writeByte(addr, cpu.readByte(addr));
+    }
+    uint64_t steps = 0;
+    while (reference.readByte(reference.getPC()) != HALT) {
+        reference.step();
+        steps++;
+    }
+    reference.step();
+
+    std::cout << "Executing test:\n";
+    uint64_t executed = cpu.step(1000);
+    returnFinalState();
+
+    assert(executed == steps + 1);
+    assert(cpu.step(1000) == 0);
+    assert(cpu.readByte(0x1000) == 0x0F);
+    assert(sameState(cpu, reference));
+
+    std::cout << "Test passed\n";
+}
+
+/**
+* Execute a single ALU instruction with the given A and F
+* Program: LD SP,0x0100; POP AF; <opcode> <operand>; JP 0x0000
+* @return AF after the instruction
+*/
+uint16_t Z80Tests::runAluCase(uint8_t opcode, uint8_t operand, uint8_t a, uint8_t f) {
+    cpu.writeByte(0x0004, opcode);
+    cpu.writeByte(0x0005, operand);
+    cpu.writeByte(0x0100, f);
+    cpu.writeByte(0x0101, a);
+    cpu.step(3);
+    uint16_t af = cpu.getAF();
+    // skip the operand byte of single-byte opcodes (executed as NOP) and JP
+    while (cpu.getPC() != 0x0000) {
+        cpu.step();
+    }
+    return af;
+}
+
+void Z80Tests::testFlagTables() {
+    cpu.reset();
+    std::cout << "Flag table test:\n";
+    loadProgram({
+        LD_SP_NN, 0x00, 0x01,   // LD SP, 0x0100
+        POP_AF,                 // POP AF
+        0x00, 0x00,             // <opcode> <operand>
+        JP_NN, 0x00, 0x00       // JP 0x0000
+        });
+
+    std::cout << "Executing test:\n";
+    for (int carry = 0; carry < 2; carry++) {
+        for (int a = 0; a < 256; a++) {
+            for (int v = 0; v < 256; v++) {
+                uint8_t operand = v + carry;
+                uint16_t sum = a + v + carry;
+                uint16_t diff = a - (v + carry);
+                uint8_t f = carry ? Z80::C_FLAG : 0;
+
+                assert(runAluCase(ADD_A_N, v, a, f) == (((a + v) & 0xFF) << 8 | FlagTables::add(a, v, a + v)));
+                assert(runAluCase(ADC_A_N, v, a, f) == ((sum & 0xFF) << 8 | FlagTables::add(a, operand, sum)));
+                assert(runAluCase(SUB_N, v, a, f) == (((a - v) & 0xFF) << 8 | FlagTables::sub(a, v, uint16_t(a - v))));
+                assert(runAluCase(SBC_A_N, v, a, f) == ((diff & 0xFF) << 8 | FlagTables::sub(a, operand, diff)));
+                assert(runAluCase(CP_N, v, a, f) == (a << 8 | FlagTables::sub(a, v, uint16_t(a - v))));
+            }
+        }
+    }
+
+    for (int a = 0; a < 256; a++) {
+        for (int v = 0; v < 256; v++) {
+            uint8_t and_res = a & v, or_res = a | v, xor_res = a ^ v;
+            auto logic = [](uint8_t res) {
+                return FlagTables::signZero(res) | (FlagTables::parityEven(res) ? Z80::PV_FLAG : 0);
+            };
+            assert(runAluCase(AND_N, v, a, 0) == (and_res << 8 | logic(and_res) | Z80::H_FLAG));
+            assert(runAluCase(OR_N, v, a, 0) == (or_res << 8 | logic(or_res)));
+            assert(runAluCase(XOR_N, v, a, 0) == (xor_res << 8 | logic(xor_res)));
+        }
+    }
+
+    const uint8_t inc_dec_flags = Z80::N_FLAG | Z80::Z_FLAG | Z80::S_FLAG | Z80::H_FLAG | Z80::PV_FLAG;
+    for (int a = 0; a < 256; a++) {
+        for (int f = 0; f < 256; f++) {
+            uint8_t inc_res = a + 1, dec_res = a - 1;
+            uint8_t kept = f & ~inc_dec_flags;
+            assert(runAluCase(INC_A, 0x00, a, f) == (inc_res << 8 | kept | FlagTables::incDec(inc_res, a, true)));
+            assert(runAluCase(DEC_A, 0x00, a, f) == (dec_res << 8 | kept | FlagTables::incDec(dec_res, a, false)));
+            assert(runAluCase(DAA, 0x00, a, f) == FlagTables::daa(a, f));
+        }
+    }
+
+    // Known answers, independent of the functions the tables are built from
+    assert(runAluCase(INC_A, 0x00, 0x0F, 0) == 0x1010);                 // H
+    assert(runAluCase(INC_A, 0x00, 0x7F, Z80::C_FLAG) == 0x8095);       // S, H, PV, carry kept
+    assert(runAluCase(INC_A, 0x00, 0xFF, 0) == 0x0050);                 // Z, H
+    assert(runAluCase(DEC_A, 0x00, 0x10, 0) == 0x0F12);                 // H, N
+    assert(runAluCase(DEC_A, 0x00, 0x80, 0) == 0x7F16);                 // H, PV, N
+    assert(runAluCase(DEC_A, 0x00, 0x01, Z80::C_FLAG) == 0x0043);       // Z, N, carry kept
+    assert(runAluCase(ADD_A_N, 0x01, 0x7F, 0) == 0x8094);               // S, H, PV
+    assert(runAluCase(ADD_A_N, 0x01, 0xFF, 0) == 0x0051);               // Z, H, C
+    assert(runAluCase(SUB_N, 0x01, 0x00, 0) == 0xFF93);                 // S, H, N, C
+    assert(runAluCase(SUB_N, 0x01, 0x80, 0) == 0x7F16);                 // H, PV, N
+    assert(runAluCase(CP_N, 0x42, 0x42, 0) == 0x4242);                  // Z, N
+    assert(runAluCase(DAA, 0x00, 0x12, Z80::H_FLAG) == 0x1804);         // 0x09 + 0x09, PV
+    assert(runAluCase(DAA, 0x00, 0x9A, 0) == 0x0055);                   // Z, H, PV, C
+
+    std::cout << "Test passed\n";
+}
+
+void Z80Tests::testFlagReaders() {
+    cpu.reset();
+    std::cout << "Flag readers test:\n";
+    loadProgram({
+        LD_SP_NN, 0x00, 0x20,   // LD SP, 0x2000
+        LD_A_N, 0xF0,           // LD A, 0xF0
+        ADD_A_N, 0x20,          // ADD A, 0x20 -> carry
+        INC_B,                  // INC B, carry kept
+        ADC_A_N, 0x00,          // ADC A, 0x00 -> A = 0x11
+        PUSH_AF,                // PUSH AF
+        LD_A_N, 0x10,           // LD A, 0x10
+        SUB_N, 0x20,            // SUB 0x20 -> S, N, C
+        EX_AF_AF,               // EX AF, AF'
+        XOR_A,                  // XOR A -> Z, PV
+        SCF,                    // SCF
+        JP_PE, 0x17, 0x00,      // JP PE, 0x0017
+        LD_A_N, 0xFF,           // LD A, 0xFF (skipped)
+        HALT                    // address 0x0017: HALT
+        });
+
+    std::cout << "Executing test:\n";
+    executeUntilHalt();
+    returnFinalState();
+
+    // flags of every pending operation must be visible to the instructions reading them
+    assert(cpu.readByte(0x1FFF) == 0x11);
+    assert(cpu.readByte(0x1FFE) == 0x00);
+    assert(cpu.getB() == 0x01);
+    assert(cpu.getAF_P() == (0xF000 | Z80::S_FLAG | Z80::N_FLAG | Z80::C_FLAG));
+    assert(cpu.getAF() == (Z80::Z_FLAG | Z80::PV_FLAG | Z80::C_FLAG));
+
+    std::cout << "Test passed\n";
+}
+
+void Z80Tests::testBlockCache() {
+    cpu.reset();
+    std::cout << "Block cache test:\n";
+
+    // Loop modifying the immediate operand of its own LD A,n
+    loadProgram({
+        LD_HL_NN, 0x06, 0x00,   // LD HL, 0x0006
+        LD_B_N, 0x03,           // LD B, 0x03
+        LD_A_N, 0x10,           // loop: LD A, 0x10 (operand at 0x0006)
+        ADD_A_C,                // ADD A, C
+        LD_C_A,                 // LD C, A
+        INC_HL,                 // INC (HL)
+        DEC_B,                  // DEC B
+        JR_NZ, 0xF8,            // JR NZ, loop
+        HALT                    // HALT
+        });
+
+    std::cout << "Executing test:\n";
+    cpu.enableBlockCache(true);
+    cpu.step(1000);
+    returnFinalState();
+
+    assert(cpu.getC() == 0x33);
+    assert(cpu.readByte(0x0006) == 0x13);
+    assert(cpu.blockCacheStats().invalidations == 3);
+
+    // Loop without stores into its code runs from the cache
+    loadProgram({
+        LD_SP_NN, 0x00, 0x20,                   // LD SP, 0x2000
+        PREFIX_FD, LD_IXY, 0x00, 0x10,          // LD IY, 0x1000
+        LD_B_N, 0x40,                           // LD B, 0x40
+        LD_A_B,                                 // loop: LD A, B
+        PREFIX_FD, ADD, 0x01,                   // ADD A, (IY+1)
+        PREFIX_FD, 0x77, 0x01,                  // LD (IY+1), A
+        CALL_NN, 0x17, 0x00,                    // CALL sub
+        DEC_B,                                  // DEC B
+        JR_NZ, 0xF3,                            // JR NZ, loop
+        HALT,                                   // HALT
+        PUSH_AF,                                // sub: PUSH AF
+        INC_C,                                  // INC C
+        POP_AF,                                 // POP AF
+        RET                                     // RET
+        });
+
+    Z80 reference;
+    for (uint16_t addr = 0; addr < 0x20; addr++) {
+        reference.writeByte(addr, cpu.readByte(addr));
+    }
+    reference.step(10000);
+
+    cpu.enableBlockCache(false);
+    cpu.enableBlockCache(true);
+    cpu.step(10000);
+    returnFinalState();
+
+    const BlockCacheStats& stats = cpu.blockCacheStats();
+    std::cout << "hits: " << std::dec << stats.hits << " misses: " << stats.misses
+        << " invalidations: " << stats.invalidations << "\n";
+    assert(cpu.getC() == 0x40);
+    assert(sameState(cpu, reference));
+    assert(stats.invalidations == 0);
+    assert(stats.misses == 5);
+    assert(stats.hits == 3 * 0x40 - 4);
+
+    cpu.enableBlockCache(false);
+    std::cout << "Test passed\n";
+}
+
+void Z80Tests::testMemoryMap() {
+    std::cout << "Memory map test:\n";
+    Z80 machine;
+    std::vector<uint8_t> rom(MemoryMap::PAGE_SIZE, 0x5A);
+    std::vector<uint8_t> bankA(MemoryMap::PAGE_SIZE), bankB(MemoryMap::PAGE_SIZE);
+
+    // ROM pages drop writes, the host bytes stay untouched
+    machine.mapRom(3, rom.data());
+    machine.writeByte(0x3010, 0x77);
+    assert(machine.readByte(0x3010) == 0x5A);
+    assert(rom[0x10] == 0x5A);
+
+    // Mapped pages are not copied, host writes show up at once
+    machine.mapRam(2, bankA.data());
+    machine.writeByte(0x2001, 0x11);
+    assert(bankA[1] == 0x11);
+    bankA[2] = 0x22;
+    assert(machine.readByte(0x2002) == 0x22);
+
+    // Copies get their own built-in RAM and share mapped pages
+    machine.writeByte(0x0100, 0x01);
+    Z80 copy(machine);
+    copy.writeByte(0x0100, 0x02);
+    copy.writeByte(0x2003, 0x33);
+    assert(machine.readByte(0x0100) == 0x01);
+    assert(machine.readByte(0x2003) == 0x33);
+    copy.writeByte(0x3010, 0x66);
+    assert(copy.readByte(0x3010) == 0x5A && rom[0x10] == 0x5A);
+    copy = machine;
+    assert(copy.readByte(0x0100) == 0x01);
+    copy.writeByte(0x0100, 0x03);
+    assert(machine.readByte(0x0100) == 0x01);
+
+    // Loop calling a subroutine in a banked page, switching the bank
+    // replaces the subroutine even after it has been translated
+    const uint8_t loop[] = {
+        CALL_NN, 0x00, 0x20,    // loop: CALL 0x2000
+        JR, 0xFB                // JR loop
+    };
+    const uint8_t subA[] = { LD_B_N, 0x11, RET };  // LD B, 0x11; RET
+    const uint8_t subB[] = { LD_B_N, 0x22, RET };  // LD B, 0x22; RET
+    std::copy(std::begin(subA), std::end(subA), bankA.begin());
+    std::copy(std::begin(subB), std::end(subB), bankB.begin());
+
+    machine.reset();
+    for (uint16_t i = 0; i < sizeof(loop); i++) machine.writeByte(i, loop[i]);
+    machine.enableJit(true, 1);
+    machine.run(40);
+    assert(machine.getB() == 0x11);
+
+    uint64_t invalidations = machine.blockCacheStats().invalidations;
+    machine.mapRam(2, bankB.data());
+    machine.run(40);
+    assert(machine.getB() == 0x22);
+    assert(machine.blockCacheStats().invalidations > invalidations);
+
+    machine.unmapPage(2);
+    assert(machine.readByte(0x2000) == 0x00);
+
+    std::cout << "Test passed\n";
+}
+
+/**
+* @brief Device with four registers counting its accesses
+*/
+struct TestDevice : MmioDevice {
+    uint8_t registers[4] = { 0x10, 0x20, 0x30, 0x40 };
+    int reads = 0;
+    int writes = 0;
+
+    uint8_t read(uint16_t addr) override {
+        reads++;
+        return registers[addr & 0x03];
+    }
+
+    void write(uint16_t addr, uint8_t value) override {
+        writes++;
+        registers[addr & 0x03] = value;
+    }
+};
+
+void Z80Tests::testMemoryImages() {
+    std::cout << "Memory images and reset test:\n";
+    Z80 machine;
+    assert(machine.bus().dirtyBlocks() == 0);
+
+    // Bulk load wrapping around the end of the address space, read back in one piece
+    std::vector<uint8_t> image(0x300), dump(0x300);
+    for (size_t i = 0; i < image.size(); i++) image[i] = uint8_t(i * 7 + 1);
+    machine.loadImage(0xFF80, image);
+    assert(machine.readByte(0xFF80) == image[0] && machine.readByte(0x0000) == image[0x80]);
+    machine.dumpImage(0xFF80, dump.data(), dump.size());
+    assert(dump == image);
+
+    // Stores, pushes and an LDIR mark their blocks, reset zeroes exactly those
+    machine.reset();
+    assert(machine.bus().dirtyBlocks() == 0 && machine.readByte(0x0000) == 0);
+    machine.loadImage(0, {
+        LD_SP_NN, 0x00, 0xC0,           // LD SP, 0xC000
+        LD_A_N, 0x5A,                   // LD A, 0x5A
+        LD_NN_A, 0x23, 0x71,            // LD (0x7123), A
+        PUSH_AF,                        // PUSH AF
+        LD_HL_NN, 0x00, 0x00,           // LD HL, 0x0000
+        LD_DE_NN, 0x00, 0x40,           // LD DE, 0x4000
+        LD_BC_NN, 0x00, 0x03,           // LD BC, 0x0300
+        PREFIX_ED, LDIR,                // LDIR
+        HALT                            // HALT
+        });
+    machine.runUntilHalt();
+    assert(machine.readByte(0x7123) == 0x5A && machine.readByte(0x4000) == LD_SP_NN);
+    assert(machine.bus().dirtyBlocks() == 6);   // 0x00, 0x40-0x42, 0x71, 0xBF
+    Z80 copy(machine);
+    machine.reset();
+    std::vector<uint8_t> memory(0x10000, 0xFF);
+    machine.dumpImage(0, memory.data(), memory.size());
+    assert(std::all_of(memory.begin(), memory.end(), [](uint8_t value) { return value == 0; }));
+    assert(machine.bus().dirtyBlocks() == 0);
+
+    // Copies take the dirty blocks along with the RAM
+    assert(copy.readByte(0xBFFF) == 0x5A);
+    copy.reset();
+    copy.dumpImage(0, memory.data(), memory.size());
+    assert(std::all_of(memory.begin(), memory.end(), [](uint8_t value) { return value == 0; }));
+
+    // ROM pages drop loaded bytes, device pages get them one by one
+    std::vector<uint8_t> rom(MemoryMap::PAGE_SIZE, 0xC3);
+    TestDevice device;
+    machine.mapRom(5, rom.data());
+    machine.addMmioDevice(0x6000, 4, &device);
+    machine.loadImage(0x5FFE, { 0x01, 0x02, 0x03, 0x04 });
+    assert(machine.readByte(0x5FFF) == 0xC3 && rom[0xFFF] == 0xC3);
+    assert(device.writes == 2 && device.registers[0] == 0x03 && device.registers[1] == 0x04);
+    uint8_t registers[4];
+    machine.dumpImage(0x6000, registers, 4);
+    assert(device.reads == 4 && registers[3] == 0x40);
+    machine.removeMmioDevice(&device);
+    machine.unmapPage(5);
+
+    // The flat bus tracks the same way
+    Z80Flat flat;
+    flat.loadImage(0x1234, { 0x11, 0x22 });
+    flat.writeByte(0xE000, 0x33);
+    assert(flat.bus().dirtyBlocks() == 2 && flat.readByte(0x1235) == 0x22);
+    flat.reset();
+    assert(flat.bus().dirtyBlocks() == 0 && flat.readByte(0x1235) == 0 && flat.readByte(0xE000) == 0);
+
+    std::cout << "Test passed\n";
+}
+
+void Z80Tests::testFork() {
+    std::cout << "Copy-on-write fork test:\n";
+    Z80 parent;
+    assert(parent.bus().sharedPages() == MemoryMap::PAGE_COUNT);   // fresh RAM is the shared page of zeroes
+    std::vector<uint8_t> program = {
+        LD_SP_NN, 0x00, 0xC0,           // LD SP, 0xC000
+        LD_HL_NN, 0x00, 0x80,           // LD HL, 0x8000
+        LD_B_N, 0x40,                   // LD B, 0x40
+        INC_HL,                         // loop: INC (HL)
+        PUSH_BC,                        // PUSH BC
+        POP_DE,                         // POP DE
+        INC_HL16,                       // INC HL
+        DEC_B,                          // DEC B
+        JR_NZ, 0xF9,                    // JR NZ, loop
+        HALT                            // HALT
+    };
+    parent.loadImage(0, program);
+    parent.runCycles(500);
+    assert(parent.bus().sharedPages() == MemoryMap::PAGE_COUNT - 3);
+
+    // Both continue from the same point and end the same way
+    Z80 child = parent.fork();
+    assert(parent.bus().sharedPages() == MemoryMap::PAGE_COUNT && child.bus().sharedPages() == MemoryMap::PAGE_COUNT);
+    assert(child.getRegisters().pc == parent.getRegisters().pc && child.getCycles() == parent.getCycles());
+    child.runUntilHalt();
+    assert(child.bus().sharedPages() == MemoryMap::PAGE_COUNT - 2);    // the counters and the stack
+    assert(parent.bus().sharedPages() == MemoryMap::PAGE_COUNT - 2);    // left alone with the old ones
+    parent.runUntilHalt();
+    std::vector<uint8_t> parentMemory(0x10000), childMemory(0x10000);
+    parent.dumpImage(0, parentMemory.data(), parentMemory.size());
+    child.dumpImage(0, childMemory.data(), childMemory.size());
+    assert(parentMemory == childMemory && parent.readByte(0x803F) == 1 && parent.readByte(0x8040) == 0);
+    assert(parent.getRegisters().de == child.getRegisters().de && parent.getCycles() == child.getCycles());
+
+    // Branches see only their own writes, bulk writes included
+    Z80 left = parent.fork();
+    Z80 right = parent.fork();
+    left.writeByte(0x8000, 0xAA);
+    right.loadImage(0x7FFF, { 0xBB, 0xBB });
+    assert(parent.readByte(0x8000) == 1 && left.readByte(0x8000) == 0xAA && right.readByte(0x8000) == 0xBB);
+    assert(left.readByte(0x7FFF) == 0 && right.readByte(0x7FFF) == 0xBB && parent.readByte(0x0000) == LD_SP_NN);
+    parent.writeByte(0x8001, 0xCC);
+    assert(left.readByte(0x8001) == 1 && right.readByte(0x8001) == 1);
+
+    // Resetting a branch leaves the pages it shares alone
+    left.reset();
+    assert(left.readByte(0x0000) == 0 && left.readByte(0x8000) == 0 && left.bus().dirtyBlocks() == 0);
+    assert(parent.readByte(0x0000) == LD_SP_NN && right.readByte(0x0000) == LD_SP_NN);
+
+    // ROM pages still drop writes, mapped host memory stays shared, pages outlive the parent
+    std::vector<uint8_t> rom(MemoryMap::PAGE_SIZE, 0xC3), bank(MemoryMap::PAGE_SIZE);
+    auto machine = std::make_unique<Z80>();
+    machine->writeByte(0x0010, 0x10);
+    machine->mapRom(3, rom.data());
+    machine->mapRam(4, bank.data());
+    Z80 branch = machine->fork();
+    branch.writeByte(0x3000, 0x01);
+    branch.writeByte(0x4000, 0x02);
+    assert(branch.readByte(0x3000) == 0xC3 && bank[0] == 0x02 && machine->readByte(0x4000) == 0x02);
+    machine.reset();
+    assert(branch.readByte(0x0010) == 0x10);
+    branch.writeByte(0x0011, 0x11);
+    assert(branch.readByte(0x0010) == 0x10 && branch.readByte(0x0011) == 0x11);
+
+    // Block copies within shared pages end as on a machine that never forked
+    auto copier = [](Z80& target) {
+        target.loadImage(0, {
+            LD_HL_NN, 0x00, 0x80,       // LD HL, 0x8000
+            LD_DE_NN, 0x01, 0x80,       // LD DE, 0x8001
+            LD_BC_NN, 0xFF, 0x00,       // LD BC, 0x00FF
+            PREFIX_ED, LDIR,            // LDIR - fill
+            LD_HL_NN, 0x00, 0x90,       // LD HL, 0x9000
+            LD_DE_NN, 0x02, 0x90,       // LD DE, 0x9002
+            LD_BC_NN, 0xFE, 0x00,       // LD BC, 0x00FE
+            PREFIX_ED, LDIR,            // LDIR - repeat a 2-byte pattern
+            HALT                        // HALT
+        });
+        target.loadImage(0x8000, { 0x5A });
+        target.loadImage(0x9000, { 0x12, 0x34 });
+    };
+    Z80 plain, source;
+    copier(plain);
+    copier(source);
+    Z80 copy = source.fork();
+    plain.runUntilHalt();
+    copy.runUntilHalt();
+    std::vector<uint8_t> plainMemory(0x10000), copyMemory(0x10000);
+    plain.dumpImage(0, plainMemory.data(), plainMemory.size());
+    copy.dumpImage(0, copyMemory.data(), copyMemory.size());
+    assert(plainMemory == copyMemory && copy.readByte(0x80FF) == 0x5A && copy.readByte(0x90FE) == 0x12 && copy.readByte(0x90FF) == 0x34);
+    assert(source.readByte(0x8001) == 0 && source.readByte(0x9002) == 0);
+
+    std::cout << "Test passed\n";
+}
+
+void Z80Tests::testSnapshot() {
+    std::cout << "Snapshot test:\n";
+    Z80 machine;
+    machine.loadImage(0, {
+        LD_SP_NN, 0x00, 0xC0,           // LD SP, 0xC000
+        PREFIX_ED, IM_1,                // IM 1
+        EI,                             // EI
+        INC_A,                          // loop: INC A
+        LD_NN_A, 0x00, 0x90,            // LD (0x9000), A
+        JR, 0xFA                        // JR loop
+    });
+    machine.loadImage(0x0038, {
+        INC_B,                          // INC B
+        EI,                             // EI
+        RET                             // RET
+    });
+    machine.runCycles(1000);
+    uint8_t saved = machine.readByte(0x9000);
+
+    // The header page, the code page and the page of the counter
+    Snapshot snapshot(machine);
+    assert(snapshot.valid() && snapshot.size() == 3 * Snapshot::PAGE_SIZE);
+    uint64_t size = 0;
+    assert(snapshot.section(Snapshot::CPU, size) && size == sizeof(Snapshot::Cpu));
+    assert(!snapshot.section(0x99, size));
+
+    // Restoring copies nothing, the restored CPU runs on exactly as the original
+    auto resume = [](Z80& cpu) {
+        cpu.setIntLine(true);
+        cpu.runCycles(100);
+        cpu.setIntLine(false);
+        cpu.runCycles(1000);
+    };
+    auto sameMachine = [](const Z80& a, const Z80& b) {
+        Z80Registers first = a.getRegisters(), second = b.getRegisters();
+        std::vector<uint8_t> firstMemory(0x10000), secondMemory(0x10000);
+        a.dumpImage(0, firstMemory.data(), firstMemory.size());
+        b.dumpImage(0, secondMemory.data(), secondMemory.size());
+        return std::memcmp(&first, &second, sizeof(first)) == 0 && a.getCycles() == b.getCycles() && firstMemory == secondMemory;
+    };
+    Z80 restored;
+    restored.writeByte(0x5000, 0x77);
+    snapshot.restore(restored);
+    assert(restored.readByte(0x5000) == 0 && restored.bus().sharedPages() == MemoryMap::PAGE_COUNT);
+    assert(sameMachine(machine, restored));
+    resume(machine);
+    resume(restored);
+    assert(sameMachine(machine, restored) && machine.getB() > 0 && machine.readByte(0xBFFE) != 0);
+
+    // The image is left as it was, reset drops the pages shared with it
+    Z80 again;
+    snapshot.restore(again);
+    assert(again.readByte(0x9000) == saved);
+    again.reset();
+    assert(again.readByte(0x0000) == 0 && again.readByte(0x9000) == 0 && again.bus().dirtyBlocks() == 0);
+    snapshot.restore(again);
+    assert(again.readByte(0x0000) == LD_SP_NN);
+
+    // Round trip through a file
+    const std::string path = "z80_snapshot_test.snap";
+    assert(snapshot.save(path));
+    Snapshot loaded;
+    assert(loaded.load(path));
+    std::remove(path.c_str());
+    assert(loaded.size() == snapshot.size() && std::memcmp(loaded.data(), snapshot.data(), snapshot.size()) == 0);
+    Z80 fromFile;
+    loaded.restore(fromFile);
+    resume(fromFile);
+    assert(sameMachine(machine, fromFile));
+
+    // Damaged and foreign images are refused
+    std::vector<uint8_t> bytes(snapshot.data(), snapshot.data() + snapshot.size());
+    Snapshot checked;
+    assert(!checked.read(bytes.data(), bytes.size() - 1) && !checked.valid());
+    bytes[0] = 'X';
+    assert(!checked.read(bytes.data(), bytes.size()));
+    bytes[0] = 'Z';
+    bytes[offsetof(Snapshot::Header, version)] = Snapshot::VERSION + 1;
+    assert(!checked.read(bytes.data(), bytes.size()));
+    bytes[offsetof(Snapshot::Header, version)] = Snapshot::VERSION;
+    assert(checked.read(bytes.data(), bytes.size()));
+    assert(!checked.load(path));
+
+    // Batch jobs resume from a snapshot on any worker
+    BatchJob job;
+    job.snapshot = std::make_shared<const Snapshot>(snapshot);
+    job.cycleBudget = 500;
+    Z80 reference;
+    snapshot.restore(reference);
+    RunResult expected = reference.runCycles(job.cycleBudget);
+    BatchRunner runner(2);
+    runner.run(std::vector<BatchJob>(8, job), [&](const BatchResult& result) {
+        Z80Registers registers = reference.getRegisters();
+        assert(result.run.cycles == expected.cycles && result.run.instructions == expected.instructions);
+        assert(std::memcmp(&result.registers, &registers, sizeof(registers)) == 0);
+    });
+
+    std::cout << "Test passed\n";
+}
+
+void Z80Tests::testMmio() {
+    cpu.reset();
+    std::cout << "Memory-mapped I/O test:\n";
+    TestDevice device;
+    cpu.addMmioDevice(0x5000, 4, &device);
+
+    loadProgram({
+        LD_HL_NN, 0x01, 0x50,   // LD HL, 0x5001
+        LD_A_HL,                // LD A, (HL)
+        INC_A,                  // INC A
+        LD_HL_A,                // LD (HL), A
+        INC_HL,                 // INC (HL) - read and write
+        LD_HL_NN, 0x10, 0x50,   // LD HL, 0x5010
+        LD_HL_N, 0x99,          // LD (HL), 0x99 - RAM on the device page
+        HALT                    // HALT
+        });
+    cpu.runUntilHalt();
+    returnFinalState();
+
+    assert(cpu.getA() == 0x21);
+    assert(device.registers[1] == 0x22);
+    assert(device.registers[2] == 0x30);
+    assert(device.reads == 2 && device.writes == 2);
+    assert(cpu.readByte(0x5010) == 0x99);
+
+    // Removed devices leave the memory behind them
+    cpu.removeMmioDevice(&device);
+    assert(cpu.readByte(0x5001) == 0x00);
+    cpu.writeByte(0x5001, 0x55);
+    assert(cpu.readByte(0x5001) == 0x55);
+    assert(device.registers[1] == 0x22 && device.reads == 2);
+
+    std::cout << "Test passed\n";
+}
+
+/**
+* @brief Port counting single and batched accesses
+*/
+struct TestPort : IoDevice {
+    uint8_t next = 0x80;
+    uint16_t lastPort = 0;
+    int singles = 0;
+    int blocks = 0;
+    std::vector<uint8_t> written;
+
+    uint8_t in(uint16_t port) override {
+        singles++;
+        lastPort = port;
+        return next++;
+    }
+
+    void out(uint16_t port, uint8_t value) override {
+        singles++;
+        lastPort = port;
+        written.push_back(value);
+    }
+
+    void inBlock(uint16_t port, uint8_t* data, size_t size) override {
+        blocks++;
+        lastPort = port;
+        for (size_t i = 0; i < size; i++) data[i] = next++;
+    }
+
+    void outBlock(uint16_t port, const uint8_t* data, size_t size) override {
+        blocks++;
+        lastPort = port;
+        written.insert(written.end(), data, data + size);
+    }
+};
+
+void Z80Tests::testPortIo() {
+    cpu.reset();
+    std::cout << "Port I/O test:\n";
+    TestPort port;
+    cpu.attachIoDevice(0x10, &port);
+
+    loadProgram({
+        LD_A_N, 0x12,                   // LD A, 0x12               7
+        OUT_N_A, 0x10,                  // OUT (0x10), A            11
+        LD_A_N, 0x00,                   // LD A, 0x00               7
+        IN_A_N, 0x10,                   // IN A, (0x10)             11
+        LD_BC_NN, 0x10, 0x04,           // LD BC, 0x0410            10
+        LD_HL_NN, 0x00, 0x40,           // LD HL, 0x4000            10
+        PREFIX_ED, INIR,                // INIR                     3 * 21 + 16
+        LD_BC_NN, 0x10, 0x03,           // LD BC, 0x0310            10
+        LD_HL_NN, 0x00, 0x40,           // LD HL, 0x4000            10
+        PREFIX_ED, OTIR,                // OTIR                     2 * 21 + 16
+        LD_C_N, 0x20,                   // LD C, 0x20               7
+        PREFIX_ED, IN_D_C,              // IN D, (C) - no device    12
+        PREFIX_ED, OUT_C_D,             // OUT (C), D - dropped     12
+        HALT                            // HALT                     4
+        });
+    cpu.runUntilHalt();
+    returnFinalState();
+
+    assert(cpu.getA() == 0x80);
+    assert(cpu.readByte(0x4000) == 0x81 && cpu.readByte(0x4003) == 0x84);
+    assert(cpu.getB() == 0x00 && cpu.getHL() == 0x4003);
+    assert(port.written == std::vector<uint8_t>({ 0x12, 0x81, 0x82, 0x83 }));
+    // Each repeated transfer reached the device as one call, OTIR starts at B - 1
+    assert(port.singles == 2 && port.blocks == 2 && port.lastPort == 0x0210);
+    assert(cpu.getD() == IoBus::FLOATING);
+    assert((cpu.getF() & (Z80::S_FLAG | Z80::PV_FLAG)) == (Z80::S_FLAG | Z80::PV_FLAG));
+    assert(cpu.getCycles() == 7 + 11 + 7 + 11 + 10 + 10 + 79 + 10 + 10 + 58 + 7 + 12 + 12 + 4);
+
+    // A fully decoded port takes its address from the low byte device,
+    // so transfers crossing it go byte by byte
+    TestPort full;
+    cpu.attachIoDevice(0x0110, &full, true);
+    loadProgram({
+        LD_BC_NN, 0x10, 0x02,           // LD BC, 0x0210
+        LD_HL_NN, 0x00, 0x41,           // LD HL, 0x4100
+        PREFIX_ED, INIR,                // INIR
+        LD_A_N, 0x01,                   // LD A, 0x01
+        IN_A_N, 0x10,                   // IN A, (0x10)
+        HALT                            // HALT
+        });
+    port.next = 0x40;
+    cpu.runUntilHalt();
+    assert(cpu.readByte(0x4100) == 0x40 && cpu.readByte(0x4101) == 0x80);
+    assert(cpu.getA() == 0x81);
+    assert((cpu.getF() & Z80::Z_FLAG) && (cpu.getF() & Z80::N_FLAG));
+    assert(port.blocks == 2 && full.singles == 2);
+
+    // Detached ports float, the JIT copy runs the same instructions
+    cpu.detachIoDevice(&port);
+    cpu.detachIoDevice(&full);
+    loadProgram({
+        LD_BC_NN, 0x10, 0x02,           // LD BC, 0x0210
+        LD_HL_NN, 0x00, 0x42,           // LD HL, 0x4200
+        IN_A_N, 0x10,                   // IN A, (0x10)
+        PREFIX_ED, IN_E_C,              // IN E, (C)
+        PREFIX_DD, PREFIX_ED, IN_D_C,   // IN D, (C) - DD is a no-op
+        PREFIX_ED, INIR,                // INIR
+        HALT                            // HALT
+        });
+    executeUntilHalt();
+    assert(cpu.getA() == IoBus::FLOATING && cpu.getE() == IoBus::FLOATING && cpu.getD() == IoBus::FLOATING);
+    assert(cpu.getHL() == 0x4202 && cpu.readByte(0x4201) == IoBus::FLOATING);
+
+    std::cout << "Test passed\n";
+}
+
+/**
+* @brief Port whose writes acknowledge the interrupt by releasing INT
+*/
+struct InterruptAck : IoDevice {
+    Z80& cpu;
+    explicit InterruptAck(Z80& cpu) : cpu(cpu) {}
+    uint8_t in(uint16_t) override { return 0; }
+    void out(uint16_t, uint8_t) override { cpu.setIntLine(false); }
+};
+
+void Z80Tests::testInterrupts() {
+    cpu.reset();
+    std::cout << "Interrupt test:\n";
 
+    std::vector<uint8_t> program = {
+        LD_SP_NN, 0x00, 0x20,               // 0x00: LD SP, 0x2000
+        LD_A_N, 0x30,                       // 0x03: LD A, 0x30
+        PREFIX_ED, LD_I_A,                  // 0x05: LD I, A
+        PREFIX_ED, IM_2,                    // 0x07: IM 2
+        EI,                                 // 0x09: EI
+        HALT,                               // 0x0A: HALT - woken by INT in IM 2
+        PREFIX_ED, IM_1,                    // 0x0B: IM 1
+        HALT,                               // 0x0D: HALT - woken by INT in IM 1
+        HALT,                               // 0x0E: HALT - woken by NMI
+        DI,                                 // 0x0F: DI
+        HALT                                // 0x10: HALT
+    };
+    program.resize(0x38);
+    program.insert(program.end(), {
+        INC_B,                              // 0x38: INC B
+        OUT_N_A, 0x10,                      // OUT (0x10), A - releases INT
+        EI,                                 // EI
+        PREFIX_ED, RETI                     // RETI
+        });
+    program.resize(0x50);
+    program.insert(program.end(), {
+        INC_C,                              // 0x50: INC C
+        OUT_N_A, 0x10,                      // OUT (0x10), A - releases INT
+        EI,                                 // EI
+        PREFIX_ED, RETI                     // RETI
+        });
+    program.resize(0x66);
+    program.insert(program.end(), {
+        PREFIX_ED, LD_A_I,                  // 0x66: LD A, I - P/V is IFF2
+        PUSH_AF,                            // PUSH AF
+        POP_HL,                             // POP HL
+        INC_D,                              // INC D
+        PREFIX_ED, RETN                     // RETN
+        });
+    loadProgram(program);
+    cpu.writeByte(0x3040, 0x50);            // IM 2 vector
+    cpu.writeByte(0x3041, 0x00);
+
+    // Every engine wakes up at the same instruction boundaries
+    auto drive = [](Z80& z80) {
+        InterruptAck ack(z80);
+        z80.attachIoDevice(0x10, &ack);
+        RunResult result = z80.runUntilHalt();
+        assert(result.status == RunStatus::Halted && z80.getPC() == 0x0A);
+        assert(z80.getIFF1() && z80.getIM() == 2);
+
+        // A halted CPU costs nothing until its interrupt
+        uint64_t cycles = z80.getCycles();
+        result = z80.runUntilHalt();
+        assert(result.status == RunStatus::Halted && result.instructions == 0 && z80.getCycles() == cycles);
+        assert(z80.step() == 0);
+
+        z80.setIntLine(true, 0x40);
+        result = z80.runUntilHalt();
+        assert(z80.getPC() == 0x0D && z80.getC() == 0x01 && z80.getIM() == 1);
+
+        z80.setIntLine(true);
+        result = z80.runUntilHalt();
+        assert(z80.getPC() == 0x0E && z80.getB() == 0x01);
+
+        z80.triggerNmi();
+        result = z80.runUntilHalt();
+        assert(z80.getPC() == 0x10 && z80.getD() == 0x01 && !z80.getIFF1());
+        z80.detachIoDevice(&ack);
+    };
+    Z80 blocks(cpu);
+    blocks.enableBlockCache(true);
+    Z80 translated(cpu);
+    translated.enableJit(true, 1);
+    drive(cpu);
+    drive(blocks);
+    drive(translated);
+    returnFinalState();
+
+    assert(cpu.getA() == 0x30 && (cpu.getL() & Z80::PV_FLAG));
+    assert(cpu.getSP() == 0x2000);
+    assert(cpu.getCycles() == 10 + 7 + 9 + 8 + 4 + 4                 // to the first HALT
+        + 19 + 4 + 11 + 4 + 14 + 8 + 4                                 // IM 2
+        + 13 + 4 + 11 + 4 + 14 + 4                                     // IM 1
+        + 11 + 9 + 11 + 10 + 4 + 14 + 4 + 4);                          // NMI
+    assert(sameState(cpu, blocks));
+    assert(sameState(cpu, translated));
+
+    // INT asserted before EI is accepted after the instruction following it,
+    // IM 0 executes the RST on the data bus and ignores any other byte
+    InterruptAck ack(cpu);
+    loadProgram({
+        LD_SP_NN, 0x00, 0x20,               // 0x00: LD SP, 0x2000
+        PREFIX_ED, IM_0,                    // 0x03: IM 0
+        EI,                                 // 0x05: EI
+        HALT,                               // 0x06: HALT - still executed
+        HALT,                               // 0x07: HALT
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        OUT_N_A, 0x10,                      // 0x10: OUT (0x10), A - releases INT
+        EI,                                 // EI
+        PREFIX_ED, RETI                     // RETI
+        });
+    cpu.attachIoDevice(0x10, &ack);
+    cpu.setIntLine(true, 0x00);             // NOP, not accepted
+    RunResult result = cpu.runUntilHalt();
+    assert(result.status == RunStatus::Halted && cpu.getPC() == 0x06);
+    assert(cpu.getIFF1() && cpu.getSP() == 0x2000);
+    cpu.setIntLine(true, 0xD7);             // RST 10h
+    result = cpu.runUntilHalt();
+    assert(result.status == RunStatus::Halted && cpu.getPC() == 0x07);
+    assert(cpu.readByte(0x1FFE) == 0x07 && cpu.readByte(0x1FFF) == 0x00);
+
+    cpu.detachIoDevice(&ack);
+
+    // R advances once per opcode fetch, twice for prefixed opcodes and
+    // for every repetition of LDIR. Bit 7 stays as LD R,A wrote it
+    loadProgram({
+        LD_A_N, 0xFE,                       // LD A, 0xFE
+        PREFIX_ED, LD_R_A,                  // LD R, A
+        LD_A_INN, 0x00, 0x01,               // LD A, (0x0100)             +1
+        PREFIX_DD, LD_IXY, 0x00, 0x02,      // LD IX, 0x0200              +2
+        PREFIX_DD, 0x46, 0x01,              // LD B, (IX+1)               +2
+        PREFIX_DD, PREFIX_CB, 0x02, 0x46,   // BIT 0, (IX+2)              +2
+        PREFIX_CB, 0x00,                    // RLC B                      +2
+        PREFIX_DD, PREFIX_FD, INC_HL16,     // INC IY, DD is a no-op      +3
+        LD_HL_NN, 0x00, 0x03,               // LD HL, 0x0300              +1
+        LD_DE_NN, 0x00, 0x04,               // LD DE, 0x0400              +1
+        LD_BC_NN, 0x03, 0x00,               // LD BC, 3                   +1
+        PREFIX_ED, LDIR,                    // LDIR, 3 times              +6
+        PREFIX_ED, LD_A_R,                  // LD A, R                    +2
+        HALT                                // HALT                       +1
+        });
+    auto refresh = [](Z80& z80) {
+        z80.runUntilHalt();
+        assert(z80.getA() == 0x95 && z80.getR() == 0x96);
+    };
+    Z80 refreshBlocks(cpu);
+    refreshBlocks.enableBlockCache(true);
+    Z80 refreshTranslated(cpu);
+    refreshTranslated.enableJit(true, 1);
+    refresh(cpu);
+    refresh(refreshBlocks);
+    refresh(refreshTranslated);
+
+    std::cout << "Test passed\n";
+}
+
+/**
+* @brief Handler recording the deadlines it fired at
+*/
+struct EventLog : EventHandler {
+    std::vector<uint64_t> fired;
+    void onEvent(uint64_t cycle) override { fired.push_back(cycle); }
+};
+
+/**
+* @brief Timer asserting INT every period T-states
+*/
+struct TestTimer : EventHandler {
+    Z80& cpu;
+    uint64_t period;
+    uint64_t lateness = 0;
+    EventId id = Scheduler::NO_EVENT;
+    explicit TestTimer(Z80& cpu, uint64_t period) : cpu(cpu), period(period) {}
+    void onEvent(uint64_t cycle) override {
+        lateness = std::max(lateness, cpu.getCycles() - cycle);
+        cpu.setIntLine(true);
+        id = cpu.scheduleEvent(cycle + period, this);
+    }
+};
+
+/**
+* @brief Event recording when it ran and how many transfers were left in B
+*/
+struct TransferProbe : EventHandler {
+    Z80& cpu;
+    uint64_t ranAt = 0;
+    uint8_t left = 0;
+    explicit TransferProbe(Z80& cpu) : cpu(cpu) {}
+    void onEvent(uint64_t) override {
+        ranAt = cpu.getCycles();
+        left = cpu.getB();
+    }
+};
+
+void Z80Tests::testScheduler() {
+    std::cout << "Scheduler test:\n";
+
+    // Earliest deadline first, whatever the scheduling order
+    Scheduler scheduler;
+    EventLog log;
+    EventId late = scheduler.schedule(300, &log);
+    scheduler.schedule(100, &log);
+    EventId moved = scheduler.schedule(200, &log);
+    EventId cancelled = scheduler.schedule(150, &log);
+    assert(scheduler.nextDeadline() == 100);
+    assert(scheduler.cancel(cancelled) && !scheduler.cancel(cancelled));
+    assert(scheduler.reschedule(moved, 400));
+    scheduler.runDue(300);
+    assert((log.fired == std::vector<uint64_t>{ 100, 300 }));
+    assert(!scheduler.pending(late) && !scheduler.reschedule(late, 500));
+    assert(scheduler.pending(moved) && scheduler.nextDeadline() == 400);
+    scheduler.clear();
+    assert(!scheduler.pending(moved) && scheduler.nextDeadline() == Scheduler::NEVER);
+
+    // The pool is fixed, slots are reused under new handles
+    std::vector<EventId> ids;
+    for (int i = 0; i < Scheduler::CAPACITY; i++) ids.push_back(scheduler.schedule(1000 - i, &log));
+    assert(scheduler.schedule(0, &log) == Scheduler::NO_EVENT);
+    assert(scheduler.nextDeadline() == 1000 - Scheduler::CAPACITY + 1);
+    for (int round = 0; round < 1000; round++) {
+        EventId id = ids[round % Scheduler::CAPACITY];
+        assert(scheduler.cancel(id));
+        ids[round % Scheduler::CAPACITY] = scheduler.schedule(2000 + round, &log);
+        assert(ids[round % Scheduler::CAPACITY] != id && !scheduler.pending(id));
+    }
+    log.fired.clear();
+    scheduler.runDue(Scheduler::NEVER);
+    assert(log.fired.size() == Scheduler::CAPACITY && std::is_sorted(log.fired.begin(), log.fired.end()));
+
+    // A periodic timer interrupts a busy loop, the engines run in slices
+    // ending at its deadlines instead of checking it per instruction
+    cpu.reset();
+    std::vector<uint8_t> program = {
+        LD_SP_NN, 0x00, 0x20,               // 0x00: LD SP, 0x2000
+        PREFIX_ED, IM_1,                    // 0x03: IM 1
+        EI,                                 // 0x05: EI
+        INC_A,                              // 0x06: INC A
+        JR, 0xFD                            // 0x07: JR 0x06
+    };
+    program.resize(0x38);
+    program.insert(program.end(), {
+        INC_B,                              // 0x38: INC B
+        OUT_N_A, 0x10,                      // OUT (0x10), A - releases INT
+        EI,                                 // EI
+        PREFIX_ED, RETI                     // RETI
+        });
+    loadProgram(program);
+
+    auto drive = [](Z80& z80) {
+        InterruptAck ack(z80);
+        TestTimer timer(z80, 1000);
+        z80.attachIoDevice(0x10, &ack);
+        timer.id = z80.scheduleEvent(1000, &timer);
+        RunResult result = z80.runCycles(10500);
+        assert(result.status == RunStatus::Limit && result.cycles < 10500 + Timing::MAX_INSTRUCTION);
+        assert(z80.getB() == 10 && timer.lateness < Timing::MAX_INSTRUCTION);
+        assert(z80.cancelEvent(timer.id));
+        z80.detachIoDevice(&ack);
+    };
+    Z80 blocks(cpu);
+    blocks.enableBlockCache(true);
+    Z80 translated(cpu);
+    translated.enableJit(true, 1);
+    drive(cpu);
+    drive(blocks);
+    drive(translated);
+    assert(sameState(cpu, blocks));
+    assert(sameState(cpu, translated));
+
+    // Repeated port transfers pause at a due event and resume after it
+    cpu.reset();
+    TestPort port;
+    cpu.attachIoDevice(0x10, &port);
+    loadProgram({
+        LD_BC_NN, 0x10, 0xC8,               // LD BC, 0xC810            10
+        LD_HL_NN, 0x00, 0x40,               // LD HL, 0x4000            10
+        PREFIX_ED, INIR,                    // INIR                     199 * 21 + 16
+        LD_BC_NN, 0x10, 0xC8,               // LD BC, 0xC810            10
+        LD_HL_NN, 0x00, 0x40,               // LD HL, 0x4000            10
+        PREFIX_ED, OTIR,                    // OTIR                     199 * 21 + 16
+        HALT                                // HALT                     4
+        });
+    TransferProbe input(cpu), output(cpu);
+    cpu.scheduleEvent(1000, &input);
+    cpu.scheduleEvent(6000, &output);
+    cpu.runUntilHalt();
+    assert(input.ranAt >= 1000 && input.ranAt < 1000 + 21 && input.left > 0 && input.left < 0xC8);
+    assert(output.ranAt >= 6000 && output.ranAt < 6000 + 21 && output.left > 0 && output.left < 0xC8);
+    assert(port.blocks == 4 && cpu.getB() == 0 && port.written.size() == 0xC8);
+    for (uint16_t i = 0; i < 0xC8; i++) assert(cpu.readByte(0x4000 + i) == uint8_t(0x80 + i) && port.written[i] == uint8_t(0x80 + i));
+    assert(cpu.getCycles() == 2 * (10 + 10 + 199 * 21 + 16) + 4);
+    cpu.detachIoDevice(&port);
+
+    std::cout << "Test passed\n";
+}
+
+/**
+* @brief Event setting a flag byte in memory
+*/
+struct FlagWriter : EventHandler {
+    Z80& cpu;
+    explicit FlagWriter(Z80& cpu) : cpu(cpu) {}
+    void onEvent(uint64_t) override { cpu.writeByte(0x4000, 0x01); }
+};
+
+void Z80Tests::testFastForward() {
+    std::cout << "Fast-forward test:\n";
+
+    // A halted CPU jumps to the next timer interrupt
+    std::vector<uint8_t> program = {
+        LD_SP_NN, 0x00, 0x20,               // 0x00: LD SP, 0x2000
+        PREFIX_ED, IM_1,                    // 0x03: IM 1
+        EI,                                 // 0x05: EI
+        HALT,                               // 0x06: HALT
+        JR, 0xFD                            // 0x07: JR 0x06
+    };
+    program.resize(0x38);
+    program.insert(program.end(), {
+        INC_B,                              // 0x38: INC B
+        OUT_N_A, 0x10,                      // OUT (0x10), A - releases INT
+        EI,                                 // EI
+        PREFIX_ED, RETI                     // RETI
+        });
+    loadProgram(program);
+    Z80 stepped(cpu);
+    stepped.addBreakpoint(0xFFFF);          // single steps, never skips a loop
+    auto wait = [](Z80& z80, uint64_t& executed) {
+        InterruptAck ack(z80);
+        TestTimer timer(z80, 1000);
+        z80.attachIoDevice(0x10, &ack);
+        timer.id = z80.scheduleEvent(1000, &timer);
+        RunResult result = z80.runCycles(10500);
+        assert(result.status == RunStatus::Limit && result.cycles >= 10500 && result.cycles < 10504);
+        assert(z80.getB() == 10 && timer.lateness < 4 && z80.isHalted());
+        assert(z80.cancelEvent(timer.id));
+        z80.detachIoDevice(&ack);
+        executed = result.instructions;
+    };
+    uint64_t waited = 0, stepWaited = 0;
+    wait(cpu, waited);
+    wait(stepped, stepWaited);
+    assert(waited == stepWaited && sameState(cpu, stepped));
+
+    // Without a cycle bound the NOPs count against the instruction budget,
+    // and every entry point gets to the interrupt instead of returning at once
+    InterruptAck ack(cpu);
+    TestTimer timer(cpu, 1000);
+    cpu.attachIoDevice(0x10, &ack);
+    timer.id = cpu.scheduleEvent(cpu.getCycles() + 400, &timer);
+    uint8_t refresh = cpu.getR();
+    RunResult result = cpu.run(50);
+    assert(result.status == RunStatus::Limit && result.instructions == 50 && result.cycles == 200);
+    assert(cpu.isHalted() && cpu.getB() == 10 && ((cpu.getR() - refresh) & 0x7F) == 50);
+    assert(cpu.step() == 4 && cpu.step(9) == 9);
+    result = cpu.run(100);                  // 40 NOPs, the interrupt handler, HALT and NOPs
+    assert(result.status == RunStatus::Limit && result.instructions == 100 && cpu.getB() == 11 && cpu.isHalted());
+    result = cpu.runUntilHalt();            // wakes up at the next interrupt
+    assert(result.status == RunStatus::Halted && cpu.getB() == 12);
+    assert(cpu.cancelEvent(timer.id));
+    result = cpu.run(100);
+    assert(result.status == RunStatus::Halted && result.instructions == 0);
+    cpu.detachIoDevice(&ack);
+
+    // A polling loop is skipped up to the event that ends it,
+    // leaving it at the same instruction boundary as executing it
+    loadProgram({
+        LD_A_INN, 0x00, 0x40,               // 0x00: LD A, (0x4000)
+        AND_N, 0x01,                        // 0x03: AND 0x01
+        JR_Z, 0xF9,                         // 0x05: JR Z, 0x00
+        HALT                                // 0x07: HALT
+        });
+    Z80 blocks(cpu);
+    blocks.enableBlockCache(true);
+    Z80 translated(cpu);
+    translated.enableJit(true, 1);
+    Z80 checked(cpu);
+    checked.addBreakpoint(0xFFFF);
+    auto poll = [](Z80& z80, uint64_t& executed) {
+        FlagWriter writer(z80);
+        z80.scheduleEvent(50000, &writer);
+        RunResult result = z80.runCycles(100000);
+        assert(result.status == RunStatus::Halted && z80.getPC() == 0x07);
+        assert(result.cycles > 50000 && result.cycles < 50000 + 2 * 32 + 4);
+        executed = result.instructions;
+    };
+    uint64_t skipped = 0, executed = 0;
+    poll(cpu, skipped);
+    poll(checked, executed);
+    assert(skipped == executed && sameState(cpu, checked));
+    poll(blocks, executed);
+    assert(skipped == executed && sameState(cpu, blocks));
+    poll(translated, executed);
+    assert(skipped == executed && sameState(cpu, translated));
+
+    std::cout << "Test passed\n";
+}
+
+/**
+* @brief Event recording the cycle and BC it fired at
+*/
+struct CopyProbe : EventHandler {
+    Z80& cpu;
+    uint64_t at = 0;
+    uint16_t bc = 0;
+    explicit CopyProbe(Z80& cpu) : cpu(cpu) {}
+    void onEvent(uint64_t) override {
+        at = cpu.getCycles();
+        bc = cpu.getBC();
+    }
+};
+
+void Z80Tests::testBlockTransfers() {
+    cpu.reset();
+    std::cout << "Block transfer test:\n";
+
+    // 16-bit arithmetic, NEG, LD (nn),rr and the digit rotations
+    loadProgram({
+        LD_HL_NN, 0xFF, 0x7F,               // LD HL, 0x7FFF
+        LD_BC_NN, 0x01, 0x00,               // LD BC, 0x0001
+        PREFIX_ED, ADC_HL_BC,               // ADC HL, BC
+        PREFIX_ED, SBC_HL_BC,               // SBC HL, BC
+        LD_A_N, 0x01,                       // LD A, 0x01
+        PREFIX_ED, NEG,                     // NEG
+        PREFIX_ED, LD_NN_BC, 0x00, 0x30,    // LD (0x3000), BC
+        PREFIX_ED, 0x5B, 0x00, 0x30,        // LD DE, (0x3000)
+        LD_HL_NN, 0x00, 0x30,               // LD HL, 0x3000
+        LD_HL_N, 0x34,                      // LD (HL), 0x34
+        LD_A_N, 0x12,                       // LD A, 0x12
+        PREFIX_ED, RLD,                     // RLD
+        PREFIX_ED, RRD,                     // RRD
+        HALT                                // HALT
+        });
+    Z80 blocks(cpu);
+    blocks.enableBlockCache(true);
+    Z80 translated(cpu);
+    translated.enableJit(true, 1);
+
+    auto next = [this](uint32_t cycles) { assert(cpu.step() == cycles); };
+    cpu.step(2);
+    next(15);
+    assert(cpu.getHL() == 0x8000 && cpu.getF() == (Z80::S_FLAG | Z80::H_FLAG | Z80::PV_FLAG));
+    next(15);
+    assert(cpu.getHL() == 0x7FFF && cpu.getF() == (Z80::H_FLAG | Z80::PV_FLAG | Z80::N_FLAG));
+    cpu.step();
+    next(8);
+    assert(cpu.getA() == 0xFF && (cpu.getF() & (Z80::N_FLAG | Z80::C_FLAG)) == (Z80::N_FLAG | Z80::C_FLAG));
+    next(20);
+    assert(cpu.readByte(0x3000) == 0x01 && cpu.readByte(0x3001) == 0x00);
+    next(20);
+    assert(cpu.getDE() == 0x0001);
+    cpu.step(3);
+    next(18);
+    assert(cpu.getA() == 0x13 && cpu.readByte(0x3000) == 0x42);
+    next(18);
+    assert(cpu.getA() == 0x12 && cpu.readByte(0x3000) == 0x34 && (cpu.getF() & Z80::C_FLAG));
+    cpu.step();
+    blocks.runUntilHalt();
+    translated.runUntilHalt();
+    assert(sameState(cpu, blocks));
+    assert(sameState(cpu, translated));
+
+    // LDIR across page boundaries runs at once with exact registers and timing
+    loadProgram({
+        LD_HL_NN, 0x80, 0x4F,               // LD HL, 0x4F80
+        LD_DE_NN, 0x00, 0x6F,               // LD DE, 0x6F00
+        LD_BC_NN, 0x00, 0x02,               // LD BC, 0x0200
+        PREFIX_ED, LDIR,                    // LDIR
+        LD_HL_NN, 0x00, 0x20,               // LD HL, 0x2000
+        LD_HL_N, 0xAA,                      // LD (HL), 0xAA
+        LD_DE_NN, 0x01, 0x20,               // LD DE, 0x2001
+        LD_BC_NN, 0xFF, 0x1F,               // LD BC, 0x1FFF
+        PREFIX_ED, LDIR,                    // LDIR - fill
+        HALT                                // HALT
+        });
+    for (uint16_t i = 0; i < 0x200; i++) cpu.writeByte(0x4F80 + i, uint8_t(i * 7));
+    cpu.step(3);
+    next(0x1FF * 21 + 16);
+    assert(cpu.getHL() == 0x5180 && cpu.getDE() == 0x7100 && cpu.getBC() == 0 && !(cpu.getF() & Z80::PV_FLAG));
+    for (uint16_t i = 0; i < 0x200; i++) assert(cpu.readByte(0x6F00 + i) == uint8_t(i * 7));
+    cpu.step(4);
+    next(0x1FFE * 21 + 16);
+    for (uint32_t addr = 0x2000; addr < 0x4000; addr++) assert(cpu.readByte(addr) == 0xAA);
+    assert(cpu.getPC() == 0x18 && cpu.getDE() == 0x4000);
+
+    // Overlapping copies end as if done byte by byte
+    struct Copy { uint16_t from, to, count; uint8_t op; };
+    for (const Copy& copy : { Copy{ 0x8000, 0x8003, 0x1800, LDIR }, Copy{ 0x8800, 0x87FB, 0x1800, LDIR },
+        Copy{ 0x97FF, 0x97FC, 0x1800, LDDR }, Copy{ 0x97FF, 0x97FE, 0x1800, LDDR }, Copy{ 0x87FF, 0x8804, 0x0900, LDDR } }) {
+        cpu.reset();
+        const uint8_t program[] = {
+            LD_HL_NN, uint8_t(copy.from), uint8_t(copy.from >> 8),
+            LD_DE_NN, uint8_t(copy.to), uint8_t(copy.to >> 8),
+            LD_BC_NN, uint8_t(copy.count), uint8_t(copy.count >> 8),
+            PREFIX_ED, copy.op, HALT };
+        for (uint16_t i = 0; i < sizeof(program); i++) cpu.writeByte(i, program[i]);
+        std::vector<uint8_t> expected(0x10000);
+        for (uint32_t addr = 0x7000; addr < 0xA000; addr++) cpu.writeByte(addr, uint8_t(addr ^ (addr >> 8)));
+        for (uint32_t addr = 0; addr < 0x10000; addr++) expected[addr] = cpu.readByte(addr);
+        int step = copy.op == LDIR ? 1 : -1;
+        for (int i = 0; i < copy.count; i++) expected[uint16_t(copy.to + step * i)] = expected[uint16_t(copy.from + step * i)];
+        cpu.runUntilHalt();
+        for (uint32_t addr = 0; addr < 0x10000; addr++) assert(cpu.readByte(addr) == expected[addr]);
+    }
+
+    // Same for short strides on pages the transfer has to copy on write
+    for (const Copy& copy : { Copy{ 0x8000, 0x8001, 0x0800, LDIR }, Copy{ 0x8000, 0x8002, 0x0800, LDIR },
+        Copy{ 0x87FF, 0x8800, 0x0800, LDDR }, Copy{ 0x87FF, 0x8801, 0x0800, LDDR },
+        Copy{ 0x87FF, 0x87FE, 0x0800, LDDR }, Copy{ 0x87FF, 0x87FD, 0x0800, LDDR } }) {
+        cpu.reset();
+        cpu.loadImage(0, {
+            LD_HL_NN, uint8_t(copy.from), uint8_t(copy.from >> 8),
+            LD_DE_NN, uint8_t(copy.to), uint8_t(copy.to >> 8),
+            LD_BC_NN, uint8_t(copy.count), uint8_t(copy.count >> 8),
+            PREFIX_ED, copy.op, HALT });
+        for (uint32_t addr = 0x7000; addr < 0xA000; addr++) cpu.writeByte(addr, uint8_t(addr ^ (addr >> 8)));
+        std::vector<uint8_t> expected(0x10000);
+        cpu.dumpImage(0, expected.data(), expected.size());
+        int step = copy.op == LDIR ? 1 : -1;
+        for (int i = 0; i < copy.count; i++) expected[uint16_t(copy.to + step * i)] = expected[uint16_t(copy.from + step * i)];
+        Z80 shared = cpu.fork();
+        assert(shared.bus().sharedPages() == MemoryMap::PAGE_COUNT);
+        shared.runUntilHalt();
+        std::vector<uint8_t> memory(0x10000);
+        shared.dumpImage(0, memory.data(), memory.size());
+        assert(memory == expected);
+    }
+
+    // Transfers through a device reach it one access at a time
+    cpu.reset();
+    TestDevice device;
+    cpu.addMmioDevice(0x5000, 4, &device);
+    loadProgram({
+        LD_HL_NN, 0xFE, 0x4F,               // LD HL, 0x4FFE
+        LD_DE_NN, 0x00, 0x30,               // LD DE, 0x3000
+        LD_BC_NN, 0x08, 0x00,               // LD BC, 0x0008
+        PREFIX_ED, LDIR,                    // LDIR
+        LD_HL_NN, 0x10, 0x30,               // LD HL, 0x3010
+        LD_DE_NN, 0x00, 0x50,               // LD DE, 0x5000
+        LD_BC_NN, 0x04, 0x00,               // LD BC, 0x0004
+        PREFIX_ED, LDIR,                    // LDIR
+        HALT                                // HALT
+        });
+    for (uint16_t i = 0; i < 4; i++) cpu.writeByte(0x3010 + i, uint8_t(0xA0 + i));
+    cpu.runUntilHalt();
+    assert(device.reads == 4 && device.writes == 4);
+    assert(cpu.readByte(0x3002) == 0x10 && cpu.readByte(0x3005) == 0x40);
+    assert(device.registers[0] == 0xA0 && device.registers[3] == 0xA3);
+    cpu.removeMmioDevice(&device);
+
+    // CPIR stops at the first match, CPDR searches down
+    loadProgram({
+        LD_HL_NN, 0x00, 0x40,               // LD HL, 0x4000
+        LD_BC_NN, 0x00, 0x02,               // LD BC, 0x0200
+        LD_A_N, 0x80,                       // LD A, 0x80
+        PREFIX_ED, CPIR,                    // CPIR
+        LD_HL_NN, 0x00, 0x40,               // LD HL, 0x4000
+        LD_BC_NN, 0x40, 0x00,               // LD BC, 0x0040
+        PREFIX_ED, CPIR,                    // CPIR - no match
+        LD_HL_NN, 0xFF, 0x40,               // LD HL, 0x40FF
+        LD_BC_NN, 0x00, 0x01,               // LD BC, 0x0100
+        LD_A_N, 0x10,                       // LD A, 0x10
+        PREFIX_ED, CPDR,                    // CPDR
+        HALT                                // HALT
+        });
+    for (uint16_t i = 0; i < 0x100; i++) cpu.writeByte(0x4000 + i, uint8_t(i));
+    cpu.step(3);
+    next(0x80 * 21 + 16);
+    assert(cpu.getHL() == 0x4081 && cpu.getBC() == 0x17F);
+    assert((cpu.getF() & (Z80::Z_FLAG | Z80::PV_FLAG | Z80::N_FLAG)) == (Z80::Z_FLAG | Z80::PV_FLAG | Z80::N_FLAG));
+    cpu.step(2);
+    next(0x3F * 21 + 16);
+    assert(cpu.getHL() == 0x4040 && cpu.getBC() == 0 && !(cpu.getF() & (Z80::Z_FLAG | Z80::PV_FLAG)));
+    cpu.step(3);
+    next(0xEF * 21 + 16);
+    assert(cpu.getHL() == 0x400F && cpu.getBC() == 0x10 && (cpu.getF() & Z80::Z_FLAG));
+
+    // An event due during a long LDIR fires between two transfers,
+    // the copy resumes and ends exactly as an uninterrupted one
+    loadProgram({
+        LD_HL_NN, 0x00, 0x40,               // LD HL, 0x4000
+        LD_DE_NN, 0x00, 0x80,               // LD DE, 0x8000
+        LD_BC_NN, 0x00, 0x10,               // LD BC, 0x1000
+        PREFIX_ED, LDIR,                    // LDIR
+        HALT                                // HALT
+        });
+    Z80 reference(cpu);
+    reference.runUntilHalt();
+    auto interrupted = [this, &reference](Z80& z80) {
+        CopyProbe probe(z80);
+        z80.scheduleEvent(30 + 100 * 21 + 10, &probe);
+        RunResult result = z80.runUntilHalt();
+        assert(result.status == RunStatus::Halted && result.instructions == 6);
+        assert(probe.at == 30 + 101 * 21 && probe.bc == 0x1000 - 101);
+        assert(sameState(z80, reference));
+    };
+    Z80 resumedBlocks(cpu);
+    resumedBlocks.enableBlockCache(true);
+    Z80 resumedTranslated(cpu);
+    resumedTranslated.enableJit(true, 1);
+    interrupted(cpu);
+    interrupted(resumedBlocks);
+    interrupted(resumedTranslated);
+
+    std::cout << "Test passed\n";
+}
+
+/**
+ * Counts the accesses a TracingBus reports
+ */
+struct CountingTracer {
+    uint32_t reads = 0;
+    uint32_t writes = 0;
+    uint16_t lastWrite = 0;
+
+    void onRead(uint16_t, uint8_t) { reads++; }
+    void onWrite(uint16_t addr, uint8_t) { writes++; lastWrite = addr; }
+};
+
+void Z80Tests::testBusPolicies() {
+    cpu.reset();
+    std::cout << "Bus policy test:\n";
+
+    loadProgram({
+        LD_HL_NN, 0x00, 0x40,               // LD HL, 0x4000
+        LD_DE_NN, 0x00, 0x50,               // LD DE, 0x5000
+        LD_BC_NN, 0x00, 0x01,               // LD BC, 0x0100
+        PREFIX_ED, LDIR,                    // LDIR
+        LD_SP_NN, 0x00, 0x80,               // LD SP, 0x8000
+        LD_B_N, 0x10,                       // LD B, 0x10
+        CALL_NN, 0x20, 0x00,                // CALL 0x0020
+        DEC_B,                              // DEC B
+        JR_NZ, 0xFA,                        // JR NZ, -6
+        HALT,                               // HALT
+        0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+        LD_A_INN, 0x10, 0x50,               // 0x0020: LD A, (0x5010)
+        ADD_A_B,                            // ADD A, B
+        LD_NN_A, 0x00, 0x60,                // LD (0x6000), A
+        RET                                 // RET
+        });
+    for (uint16_t i = 0; i < 0x100; i++) cpu.writeByte(0x4000 + i, uint8_t(i * 3));
+
+    // The same program on the flat bus, interpreted and translated,
+    // and on a flat bus reporting every access
+    Z80Flat flat;
+    Z80Core<TracingBus<FlatBus, CountingTracer>> traced;
+    for (uint32_t addr = 0; addr < 0x10000; addr++) {
+        flat.writeByte(addr, cpu.readByte(addr));
+        traced.writeByte(addr, cpu.readByte(addr));
+    }
+    traced.bus().tracer = CountingTracer();
+    Z80Flat translated(flat);
+    translated.enableJit(true, 1);
+
+    auto matches = [this](const auto& other) {
+        for (uint32_t addr = 0; addr < 0x10000; addr++)
+            if (cpu.readByte(addr) != other.readByte(addr)) return false;
+        return cpu.getAF() == other.getAF() && cpu.getBC() == other.getBC() && cpu.getDE() == other.getDE() &&
+            cpu.getHL() == other.getHL() && cpu.getSP() == other.getSP() && cpu.getPC() == other.getPC() &&
+            cpu.getCycles() == other.getCycles() && other.isHalted();
+    };
+    cpu.runUntilHalt();
+    flat.runUntilHalt();
+    translated.runUntilHalt();
+    assert(cpu.readByte(0x6000) == uint8_t(0x30 + 1) && cpu.getB() == 0);
+    assert(matches(flat));
+    assert(matches(translated));
+
+    // The copy stays byte by byte: 0x100 transfers, 16 calls and 16 stores
+    RunResult result = traced.runUntilHalt();
+    assert(matches(traced));
+    assert(result.status == RunStatus::Halted && result.instructions == 7 + 16 * 7);
+    const CountingTracer& tracer = traced.bus().tracer;
+    assert(tracer.writes == 0x100 + 16 * 3 && tracer.lastWrite == 0x6000);
+    assert(tracer.reads > 0x100 + 16 * 3);
+
+    std::cout << "Test passed\n";
+}
+
+void Z80Tests::testBatchRunner() {
+    cpu.reset();
+    std::cout << "Batch runner test:\n";
+
+    // Registers round-trip, R and F included
+    Z80Registers state{ 0x12D7, 0x3456, 0x789A, 0xBCDE, 0x1111, 0x2222, 0x3333, 0x4444,
+        0x5555, 0x6666, 0xFFF0, 0x0100, 0x3F, 0x85, true, true, 2, false };
+    cpu.setRegisters(state);
+    Z80Registers read = cpu.getRegisters();
+    assert(std::memcmp(&read, &state, sizeof(state)) == 0);
+    assert(cpu.getAF() == 0x12D7 && cpu.getR() == 0x85 && cpu.getIM() == 2);
+
+    // Sum C into A, B times, in jobs of very different lengths
+    auto image = std::make_shared<const std::vector<uint8_t>>(std::vector<uint8_t>{
+        ADD_A_C,                            // loop: ADD A, C
+        DEC_B,                              // DEC B
+        JR_NZ, 0xFC,                        // JR NZ, loop
+        HALT                                // HALT
+        });
+    std::vector<BatchJob> jobs;
+    for (uint16_t i = 0; i < 300; i++) {
+        BatchJob job;
+        job.image = image;
+        job.origin = 0x8000;
+        job.registers = Z80Registers{};
+        job.registers.pc = 0x8000;
+        job.registers.bc = uint16_t((i % 10 == 0 ? 0 : i % 13 + 1) << 8 | (i & 0xFF));
+        if (i % 50 == 7) job.cycleBudget = 100;     // the rest run until HALT
+        jobs.push_back(job);
+    }
+
+    // Every job reported once, as a fresh CPU would run it
+    auto expected = [&jobs](size_t index) {
+        Z80 reference;
+        for (size_t i = 0; i < jobs[index].image->size(); i++) reference.writeByte(uint16_t(0x8000 + i), (*jobs[index].image)[i]);
+        reference.setRegisters(jobs[index].registers);
+        RunResult run = reference.runCycles(jobs[index].cycleBudget);
+        return BatchResult{ index, run, reference.getRegisters() };
+    };
+    BatchRunner runner(3);
+    assert(runner.threadCount() == 3);
+    for (int batch = 0; batch < 2; batch++) {
+        std::vector<int> seen(jobs.size());
+        runner.run(jobs, [&](const BatchResult& result) {
+            BatchResult reference = expected(result.job);
+            assert(seen[result.job]++ == 0);
+            assert(result.run.status == reference.run.status && result.run.cycles == reference.run.cycles
+                && result.run.instructions == reference.run.instructions);
+            assert(std::memcmp(&result.registers, &reference.registers, sizeof(Z80Registers)) == 0);
+            if (result.run.status == RunStatus::Halted) {
+                uint8_t times = uint8_t(jobs[result.job].registers.bc >> 8);
+                assert((result.registers.af >> 8) == uint8_t((times ? times : 256) * (result.job & 0xFF)));
+            }
+        });
+        assert(std::count(seen.begin(), seen.end(), 1) == int(jobs.size()));
+    }
+    assert(expected(7).run.status == RunStatus::Limit && expected(7).run.cycles >= 100);
+
+    std::cout << "Test passed\n";
+}
+
+void Z80Tests::testLockstep() {
+    cpu.reset();
+    std::cout << "Lock-step lanes test:\n";
+
+    // Lane kernels against the flag tables, for every input
+    constexpr int LANES = LockstepGroup::LANES;
+    uint8_t a[LANES], f[LANES], value[LANES], carry[LANES];
+    for (int c = 0; c < 2; c++) {
+        for (int x = 0; x < 256; x++) {
+            for (int base = 0; base < 256; base += LANES) {
+                auto fill = [&] {
+                    for (int lane = 0; lane < LANES; lane++) {
+                        a[lane] = uint8_t(x);
+                        value[lane] = uint8_t(base + lane);
+                        carry[lane] = uint8_t(c);
+                        f[lane] = uint8_t(x ^ lane ^ 0xA5);
+                    }
+                };
+                fill();
+                LaneAlu::add(a, f, value, carry);
+                for (int lane = 0; lane < LANES; lane++) {
+                    assert(a[lane] == uint8_t(x + value[lane] + c) && f[lane] == FlagTables::tables.add[c][x][value[lane]]);
+                }
+                fill();
+                LaneAlu::sub(a, f, value, carry, c == 0);
+                for (int lane = 0; lane < LANES; lane++) {
+                    assert(a[lane] == uint8_t(c ? x : x - value[lane]) && f[lane] == FlagTables::tables.sub[c][x][value[lane]]);
+                }
+                fill();
+                if (c) LaneAlu::andA(a, f, value);
+                else LaneAlu::xorA(a, f, value);
+                for (int lane = 0; lane < LANES; lane++) {
+                    uint8_t result = uint8_t(c ? x & value[lane] : x ^ value[lane]);
+                    assert(a[lane] == result && f[lane] == (FlagTables::tables.szp[result] | (c ? Z80::H_FLAG : 0)));
+                }
+                fill();
+                LaneAlu::orA(a, f, value);
+                for (int lane = 0; lane < LANES; lane++) {
+                    assert(a[lane] == uint8_t(x | value[lane]) && f[lane] == FlagTables::tables.szp[a[lane]]);
+                }
+                fill();
+                if (c) LaneAlu::dec(value, f);
+                else LaneAlu::inc(value, f);
+                for (int lane = 0; lane < LANES; lane++) {
+                    uint8_t old = uint8_t(base + lane);
+                    uint8_t kept = uint8_t(x ^ lane ^ 0xA5) & ~INC_DEC_FLAGS;
+                    assert(value[lane] == uint8_t(c ? old - 1 : old + 1)
+                        && f[lane] == (kept | (c ? FlagTables::tables.dec[old] : FlagTables::tables.inc[old])));
+                }
+            }
+        }
+    }
+
+    // Data-dependent loop and subroutine: lanes peel off at the branches,
+    // the prefixed NEG after the loop peels whatever is left
+    std::vector<uint8_t> program = {
+        LD_SP_NN, 0x00, 0xF0,                   // LD SP, 0xF000
+        LD_HL_NN, 0x00, 0x90,                   // LD HL, 0x9000
+        LD_A_C,                                 // loop: LD A, C
+        ADD_A_B,                                // ADD A, B
+        XOR_N, 0x5A,                            // XOR 0x5A
+        LD_HL_A,                                // LD (HL), A
+        INC_HL16,                               // INC HL
+        ADC_A_HL,                               // ADC A, (HL)
+        DAA,                                    // DAA
+        PUSH_AF,                                // PUSH AF
+        CALL_NN, 0x30, 0x80,                    // CALL sub
+        POP_DE,                                 // POP DE
+        CP_N, 0x80,                             // CP 0x80
+        JR_C, 0x02,                             // JR C, skip
+        INC_C,                                  // INC C
+        INC_C,                                  // INC C
+        DEC_B,                                  // skip: DEC B
+        JP_NZ, 0x06, 0x80,                      // JP NZ, loop
+        LD_NN_HL, 0x00, 0xA0,                   // LD (0xA000), HL
+        PREFIX_ED, NEG,                         // NEG
+        HALT                                    // HALT
+    };
+    program.resize(0x30);
+    program.insert(program.end(), {
+        EX_AF_AF,                               // sub: EX AF, AF'
+        EXX,                                    // EXX
+        ADD_HL_BC,                              // ADD HL, BC
+        LD_A_INN, 0x00, 0x90,                   // LD A, (0x9000)
+        LD_DE_A,                                // LD (DE), A
+        EXX,                                    // EXX
+        EX_AF_AF,                               // EX AF, AF'
+        INC_A,                                  // INC A
+        AND_N, 0xF0,                            // AND 0xF0
+        OR_D,                                   // OR D
+        SUB_HL,                                 // SUB (HL)
+        SBC_A_E,                                // SBC A, E
+        DEC_HL,                                 // DEC (HL)
+        INC_HL, INC_HL,                         // INC (HL), INC (HL)
+        EX_DE_HL, EX_DE_HL,                     // EX DE, HL, EX DE, HL
+        CP_N, 0x40,                             // CP 0x40
+        RET_NC,                                 // RET NC
+        SCF,                                    // SCF
+        RET_C                                   // RET C
+        });
+
+    auto registers = [](int lane) {
+        Z80Registers state{};
+        state.af = uint16_t(lane << 8 | 0x28);
+        state.bc = uint16_t((8 + lane % 3) << 8 | (lane * 7));
+        state.de = uint16_t(lane * 0x101);
+        state.bc_prime = uint16_t(lane * 0x33);
+        state.de_prime = uint16_t(0xB000 + lane);
+        state.hl_prime = uint16_t(lane << 8);
+        state.ix = uint16_t(lane);
+        state.r = uint8_t(lane);
+        // The last lane starts past LD SP and is peeled before the first instruction
+        state.pc = lane == LANES - 1 ? 0x8003 : 0x8000;
+        return state;
+    };
+    LockstepGroup group(LANES);
+    std::vector<std::unique_ptr<Z80>> reference;
+    group.load(0x8000, program.data(), program.size());
+    for (int lane = 0; lane < LANES; lane++) {
+        group.writeByte(lane, 0x9001, uint8_t(lane * 5));
+        group.setRegisters(lane, registers(lane));
+        reference.push_back(std::make_unique<Z80>());
+        for (size_t i = 0; i < program.size(); i++) reference[lane]->writeByte(uint16_t(0x8000 + i), program[i]);
+        reference[lane]->writeByte(0x9001, uint8_t(lane * 5));
+        reference[lane]->setRegisters(registers(lane));
+    }
+    Z80Registers read = group.getRegisters(5);
+    Z80Registers written = registers(5);
+    assert(std::memcmp(&read, &written, sizeof(read)) == 0);
+
+    // Every lane ends as its own CPU would, within a slice and across slices
+    for (uint64_t budget : { 150, 700, 100000 }) {
+        group.runCycles(budget);
+        for (int lane = 0; lane < LANES; lane++) {
+            RunResult expected = reference[lane]->runCycles(budget);
+            const RunResult& result = group.result(lane);
+            assert(result.status == expected.status && result.instructions == expected.instructions && result.cycles == expected.cycles);
+            Z80Registers state = group.getRegisters(lane);
+            Z80Registers expectedState = reference[lane]->getRegisters();
+            assert(std::memcmp(&state, &expectedState, sizeof(state)) == 0);
+            assert(group.getCycles(lane) == reference[lane]->getCycles() && group.isHalted(lane) == reference[lane]->isHalted());
+        }
+        if (budget == 150) assert(!group.peeled(0) && group.peeled(LANES - 1));
+    }
+    for (int lane = 0; lane < LANES; lane++) {
+        assert(group.result(lane).status == RunStatus::Halted && group.peeled(lane));
+        for (uint32_t addr = 0; addr < 0x10000; addr++) {
+            assert(group.readByte(lane, uint16_t(addr)) == reference[lane]->readByte(uint16_t(addr)));
+        }
+    }
+    assert(group.lockstepInstructions() > 100);
+
+    std::cout << "Test passed\n";
+}
+
+void Z80Tests::testJit() {
+    cpu.reset();
+    std::cout << "JIT test:\n";
+
+    // Loop with calls, indexed operands and conditional branches
+    loadProgram({
+        LD_SP_NN, 0x00, 0x20,                   // LD SP, 0x2000
+        PREFIX_FD, LD_IXY, 0x00, 0x10,          // LD IY, 0x1000
+        LD_B_N, 0x40,                           // LD B, 0x40
+        LD_A_B,                                 // loop: LD A, B
+        PREFIX_FD, ADD, 0x01,                   // ADD A, (IY+1)
+        PREFIX_FD, 0x77, 0x01,                  // LD (IY+1), A
+        CALL_NN, 0x17, 0x00,                    // CALL sub
+        DEC_B,                                  // DEC B
+        JR_NZ, 0xF3,                            // JR NZ, loop
+        HALT,                                   // HALT
+        PUSH_AF,                                // sub: PUSH AF
+        INC_C,                                  // INC C
+        ADC_A_C,                                // ADC A, C
+        XOR_N, 0x5A,                            // XOR 0x5A
+        LD_D_A,                                 // LD D, A
+        SBC_A_D,                                // SBC A, D
+        OR_D,                                   // OR D
+        JP_PE, 0x23, 0x00,                      // JP PE, skip
+        INC_E,                                  // INC E
+        POP_AF,                                 // skip: POP AF
+        RET                                     // RET
+        });
+
+    if (!Z80::lazyFlags) {
+        // Stops after every possible instruction count must match the interpreter
+        for (uint64_t count = 1; count < 400; count += 7) {
+            Z80 reference(cpu);
+            Z80 translated(cpu);
+            translated.enableJit(true, 2);
+            uint64_t executed = reference.step(count);
+            assert(translated.step(count) == executed);
+            assert(sameState(reference, translated));
+        }
+    }
+
+    Z80 reference(cpu);
+    reference.step(100000);
+
+    cpu.enableJit(true);
+    cpu.step(100000);
+    returnFinalState();
+
+    const BlockCacheStats& stats = cpu.blockCacheStats();
+    std::cout << "translations: " << std::dec << stats.translations << "\n";
+    assert(sameState(cpu, reference));
+    assert(cpu.getC() == 0x40);
+    assert(stats.translations == (Jit::supported() ? 5 : 0));
+
+    // Self-modifying loop: the translated block rewrites its own operand
+    loadProgram({
+        LD_HL_NN, 0x06, 0x00,   // LD HL, 0x0006
+        LD_B_N, 0x30,           // LD B, 0x30
+        LD_A_N, 0x10,           // loop: LD A, 0x10 (operand at 0x06)
+        ADD_A_C,                // ADD A, C
+        LD_C_A,                 // LD C, A
+        INC_HL,                 // INC (HL)
+        DEC_B,                  // DEC B
+        JR_NZ, 0xF8,            // JR NZ, loop
+        HALT                    // HALT
+        });
+
+    reference = cpu;
+    reference.enableJit(false);
+    reference.enableBlockCache(false);
+    reference.step(100000);
+
+    cpu.enableJit(true, 2);
+    cpu.step(100000);
+    returnFinalState();
+
+    assert(cpu.readByte(0x0006) == 0x40);
+    assert(sameState(cpu, reference));
+
+    cpu.enableJit(false);
+    cpu.enableBlockCache(false);
+    std::cout << "Test passed\n";
+}
+
+void Z80Tests::testRunApi() {
+    cpu.reset();
+    std::cout << "Run API test:\n";
+
+    loadProgram({
+        LD_B_N, 0x10,           // LD B, 0x10
+        LD_A_N, 0x00,           // LD A, 0x00
+        ADD_A_B,                // loop: ADD A, B
+        DEC_B,                  // DEC B
+        JR_NZ, 0xFC,            // JR NZ, loop
+        HALT                    // HALT
+        });
+
+    std::cout << "Executing test:\n";
+
+    // Instruction limit
+    RunResult result = cpu.run(5);
+    assert(result.status == RunStatus::Limit);
+    assert(result.instructions == 5);
+    assert(cpu.getPC() == 0x0004);
+
+    // Breakpoint stops before the instruction, resuming executes it
+    cpu.addBreakpoint(0x0004);
+    result = cpu.run(1000);
+    assert(result.status == RunStatus::Breakpoint);
+    assert(result.instructions == 3);
+    assert(cpu.getPC() == 0x0004);
+    result = cpu.run(1000);
+    assert(result.status == RunStatus::Breakpoint);
+    assert(result.instructions == 3);
+    assert(cpu.getB() == 0x0D);
+
+    // Stop request ends the next run before its first instruction
+    cpu.requestStop();
+    result = cpu.run(1000);
+    assert(result.status == RunStatus::Stopped);
+    assert(result.instructions == 0);
+
+    cpu.removeBreakpoint(0x0004);
+    result = cpu.runUntilHalt();
+    returnFinalState();
+
+    assert(result.status == RunStatus::Halted);
+    assert(result.instructions == 3 * 0x0D + 1);
+    assert(cpu.getA() == 0x88);
+    assert(cpu.getPC() == 0x0008);
+
+    result = cpu.run(1000);
+    assert(result.status == RunStatus::Halted);
+    assert(result.instructions == 0);
+
+    std::cout << "Test passed\n";
+}
+
+void Z80Tests::testCycles() {
+    cpu.reset();
+    std::cout << "Cycle counting test:\n";
+
+    loadProgram({
+        LD_SP_NN, 0x00, 0x20,   // LD SP, 0x2000            10
+        LD_B_N, 0x03,           // LD B, 0x03               7
+        ADD_A_B,                // loop: ADD A, B           4
+        DEC_B,                  // DEC B                    4
+        JR_NZ, 0xFC,            // JR NZ, loop              12 taken / 7
+        CALL_Z, 0x13, 0x00,     // CALL Z, sub              17 taken
+        CALL_NZ, 0x13, 0x00,    // CALL NZ, sub             10 not taken
+        PREFIX_DD, INC, 0x00,   // INC (IX+0)               23
+        HALT,                   // HALT                     4
+        RET_NZ,                 // sub: RET NZ              5 not taken
+        RET_Z                   // RET Z                    11 taken
+        });
+
+    std::cout << "Executing test:\n";
+    executeUntilHalt();
+    returnFinalState();
+
+    const uint64_t expected = 10 + 7 + 3 * 8 + 2 * 12 + 7 + 17 + 10 + 23 + 4 + 5 + 11;
+    assert(cpu.getCycles() == expected);
+    assert(cpu.getSP() == 0x2000);
+
+    // The cycle budget is met at the first instruction boundary after it
+    cpu.reset();
+    loadProgram({
+        LD_A_N, 0x00,           // LD A, 0x00
+        INC_A,                  // loop: INC A
+        PREFIX_FD, INC, 0x00,   // INC (IY+0)
+        JP_NN, 0x02, 0x00       // JP loop
+        });
+    for (uint64_t budget : { 1, 100, 1000, 12345 }) {
+        uint64_t before = cpu.getCycles();
+        RunResult result = cpu.runCycles(budget);
+        assert(result.status == RunStatus::Limit);
+        assert(result.cycles == cpu.getCycles() - before);
+        assert(result.cycles >= budget && result.cycles < budget + Timing::MAX_INSTRUCTION);
+    }
+
+    // Every engine charges the same T-states
+    Z80 reference(cpu);
+    reference.run(5000);
+    Z80 blocks(cpu);
+    blocks.enableBlockCache(true);
+    blocks.run(5000);
+    Z80 translated(cpu);
+    translated.enableJit(true, 1);
+    translated.run(5000);
+    assert(sameState(reference, blocks));
+    assert(sameState(reference, translated));
+
+    std::cout << "Test passed\n";
+}
@@ -1,8 +1,16 @@
 #ifndef Z80_TESTS_HPP
 #define Z80_TESTS_HPP
 
-#include "../include/cpu.hpp"
+#include "../include/batch.hpp"
+#include "../include/cpucore.hpp"
+#include "../include/flagtables.hpp"
+#include "../include/lockstep.hpp"
+#include "../include/timing.hpp"
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
 
 
@@ -16,8 +24,10 @@ public:
 private:
 
     void returnFinalState();
+    bool sameState(const Z80& lhs, const Z80& rhs);
     void test8BitLoads();
     void test16BitLoads();
+    void testRegisterFile();
     void testExchangeOps();
     void test8BitArithmetic();
     void testLogicalOps();
@@ -27,9 +37,32 @@ private:
     void testCallReturn();
     void testStackOps();
     void testIndexedOps();
+    void testIndexRegisters();
+    void testBitOps();
     void testFlagOps();
     void testConditionalOps();
     void testConditionalJump();
+    void testBatchedStep();
+    void testFlagTables();
+    void testFlagReaders();
+    void testBlockCache();
+    void testMemoryMap();
+    void testMemoryImages();
+    void testFork();
+    void testSnapshot();
+    void testMmio();
+    void testPortIo();
+    void testInterrupts();
+    void testScheduler();
+    void testFastForward();
+    void testBlockTransfers();
+    void testBusPolicies();
+    void testBatchRunner();
+    void testLockstep();
+    void testJit();
+    void testRunApi();
+    void testCycles();
+    uint16_t runAluCase(uint8_t opcode, uint8_t operand, uint8_t a, uint8_t f);
 
 };
 